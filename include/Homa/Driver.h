@@ -18,6 +18,8 @@
 
 #include "Homa/Exception.h"
 
+#include <cstddef>
+#include <cstring>
 #include <string>
 #include <vector>
 
@@ -49,6 +51,36 @@ class Driver {
             uint8_t type;  ///< Can be used to distinguish between different raw
                            ///< address formats.
             uint8_t bytes[19];  ///< Holds an Address's serialized byte-format.
+
+            /// Two Raw addresses are equal if all their bytes are equal.
+            bool operator==(const Raw& other) const
+            {
+                return std::memcmp(this, &other, sizeof(Raw)) == 0;
+            }
+
+            /// Two Raw addresses are equal if all their bytes are equal.
+            bool operator!=(const Raw& other) const
+            {
+                return !(*this == other);
+            }
+
+            /**
+             * Hash function for Raw addresses (FNV-1a over all bytes), so that
+             * Raw can be used as a key in hash tables.
+             */
+            struct Hasher {
+                std::size_t operator()(const Raw& raw) const
+                {
+                    const uint8_t* data =
+                        reinterpret_cast<const uint8_t*>(&raw);
+                    uint64_t hash = 14695981039346656037ULL;
+                    for (std::size_t i = 0; i < sizeof(Raw); ++i) {
+                        hash ^= data[i];
+                        hash *= 1099511628211ULL;
+                    }
+                    return hash;
+                }
+            };
         } __attribute__((packed));
 
       protected:
@@ -66,7 +98,9 @@ class Driver {
         virtual std::string toString() const = 0;
 
         /**
-         * Get the serialized byte-format for this network address.
+         * Get the serialized byte-format for this network address.  Bytes
+         * not used by the format must be zeroed so that Raw addresses can be
+         * compared and hashed byte-wise.
          */
         virtual void toRaw(Raw* raw) const = 0;
     };
@@ -173,6 +207,23 @@ class Driver {
      */
     virtual Packet* allocPacket() = 0;
 
+    /**
+     * Allocate a batch of new Packet objects from the Driver's pool of
+     * resources.  Behaves like numPackets calls to allocPacket() but lets the
+     * Driver amortize the cost of the allocation (e.g. locking) over the whole
+     * batch.  The caller must ensure that each Packet is eventually released
+     * back to the Driver; see Driver::releasePackets().
+     *
+     * @param[out] packets
+     *      Array of at least numPackets entries into which pointers to the
+     *      allocated Packet objects will be written.
+     * @param numPackets
+     *      Number of Packet objects to allocate.
+     *
+     * @sa Driver::allocPacket(), Driver::releasePackets()
+     */
+    virtual void allocPackets(Packet* packets[], uint16_t numPackets) = 0;
+
     /**
      * Send a burst of packets over the network.
      *
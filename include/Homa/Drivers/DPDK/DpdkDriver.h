@@ -44,10 +44,15 @@ class DpdkDriver : public Driver {
      *
      * @param port
      *      Selects which physical port to use for communication.
+     * @param numQueues
+     *      Number of receive/transmit queue pairs to open on the NIC.  Each
+     *      thread that uses the driver is assigned one of the queues so that
+     *      threads on different queues don't contend; fewer queues are opened
+     *      if the NIC doesn't support this many.
      * @throw DriverInitFailure
      *      Thrown if DpdkDriver fails to initialize for any reason.
      */
-    static DpdkDriver* newDpdkDriver(int port);
+    static DpdkDriver* newDpdkDriver(int port, uint16_t numQueues = 1);
 
     /**
      * Create and return a pointer to a DpdkDriver and initialize the DPDK EAL
@@ -70,10 +75,16 @@ class DpdkDriver : public Driver {
      *      Parameter passed to rte_eal_init().
      * @param argv
      *      Parameter passed to rte_eal_init().
+     * @param numQueues
+     *      Number of receive/transmit queue pairs to open on the NIC.  Each
+     *      thread that uses the driver is assigned one of the queues so that
+     *      threads on different queues don't contend; fewer queues are opened
+     *      if the NIC doesn't support this many.
      * @throw DriverInitFailure
      *      Thrown if DpdkDriver fails to initialize for any reason.
      */
-    static DpdkDriver* newDpdkDriver(int port, int argc, char* argv[]);
+    static DpdkDriver* newDpdkDriver(int port, int argc, char* argv[],
+                                     uint16_t numQueues = 1);
 
     /// Used to signal to the DpdkDriver constructor that the DPDK EAL should
     /// not be initialized.
@@ -95,10 +106,16 @@ class DpdkDriver : public Driver {
      * @param _
      *      Parameter is used only to define this constructors alternate
      *      signature.
+     * @param numQueues
+     *      Number of receive/transmit queue pairs to open on the NIC.  Each
+     *      thread that uses the driver is assigned one of the queues so that
+     *      threads on different queues don't contend; fewer queues are opened
+     *      if the NIC doesn't support this many.
      * @throw DriverInitFailure
      *      Thrown if DpdkDriver fails to initialize for any reason.
      */
-    static DpdkDriver* newDpdkDriver(int port, NoEalInit _);
+    static DpdkDriver* newDpdkDriver(int port, NoEalInit _,
+                                     uint16_t numQueues = 1);
 
     /// See Driver::getAddress()
     virtual Driver::Address* getAddress(
@@ -107,6 +124,9 @@ class DpdkDriver : public Driver {
     /// See Driver::allocPacket()
     virtual Packet* allocPacket() = 0;
 
+    /// See Driver::allocPackets()
+    virtual void allocPackets(Packet* packets[], uint16_t numPackets) = 0;
+
     /// See Driver::sendPackets()
     virtual void sendPackets(Packet* packets[], uint16_t numPackets) = 0;
 
@@ -20,12 +20,17 @@
 
 #include <bitset>
 #include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
 
 namespace Homa {
 
 // forward declarations
+class RemoteOp;
 class Transport;
 namespace Core {
+class CompletionQueue;
 class Transport;
 class OpContext;
 }  // namespace Core
@@ -39,6 +44,27 @@ class OpContext;
  */
 class Message {
   public:
+    /**
+     * Describes a contiguous range of bytes stored within a Message.
+     */
+    struct Span {
+        /// Address of the first byte in the range.
+        const void* data;
+        /// Number of bytes in the range.
+        uint32_t length;
+    };
+
+    /**
+     * Describes a contiguous range of writable bytes reserved at the end of
+     * a Message.
+     */
+    struct WritableSpan {
+        /// Address of the first byte in the range.
+        void* data;
+        /// Number of bytes in the range.
+        uint32_t length;
+    };
+
     /**
      * Copy an array of bytes to the end of the Message.
      *
@@ -50,6 +76,40 @@ class Message {
      */
     virtual void append(const void* source, uint32_t num) = 0;
 
+    /**
+     * Reserve space at the end of the Message so that the caller can write
+     * data directly into the Message's internal storage instead of copying
+     * it in with append().  The reserved bytes become part of the Message
+     * only once they are committed; see commit().
+     *
+     * @param num
+     *      The number of bytes to reserve.
+     * @param spans
+     *      Array into which the WritableSpan objects describing the reserved
+     *      space will be written, in order.  The first span starts at the
+     *      current end of the Message.
+     * @param maxSpans
+     *      Number of entries in the _spans_ array.
+     *
+     * @return
+     *      The number of WritableSpan objects written.  The spans may cover
+     *      fewer than "num" bytes if the Message would exceed its maximum
+     *      size or if more than "maxSpans" spans would be needed.
+     */
+    virtual uint32_t reserve(uint32_t num, WritableSpan* spans,
+                             uint32_t maxSpans) = 0;
+
+    /**
+     * Add the first "num" bytes of the space returned by the last call to
+     * reserve() to the end of the Message and end the reservation; any
+     * reserved space beyond those bytes is discarded.
+     *
+     * @param num
+     *      The number of bytes written into the reserved space; must not be
+     *      more than the number of bytes reserved.
+     */
+    virtual void commit(uint32_t num) = 0;
+
     /**
      * Get the contents of a specified range of bytes in the Message by
      * copying them into the provided destination memory region.
@@ -72,12 +132,144 @@ class Message {
     virtual uint32_t get(uint32_t offset, void* destination,
                          uint32_t num) const = 0;
 
+    /**
+     * Get a specified range of bytes in the Message without copying them;
+     * the range is described as a list of Span objects that point directly
+     * into the Message's internal storage.  The Span objects remain valid
+     * for the lifetime of the Message.
+     *
+     * @param offset
+     *      The number of bytes in the Message preceding the range of bytes
+     *      being requested.
+     * @param num
+     *      The number of bytes being requested.
+     * @param spans
+     *      Array into which the Span objects describing the requested range
+     *      will be written, in order.
+     * @param maxSpans
+     *      Number of entries in the _spans_ array.
+     *
+     * @return
+     *      The number of Span objects written.  The spans may cover fewer
+     *      than "num" bytes if the requested byte range exceeds the range of
+     *      bytes in the Message or if more than "maxSpans" spans would be
+     *      needed; call again with a larger offset to get the rest.
+     */
+    virtual uint32_t getSpans(uint32_t offset, uint32_t num, Span* spans,
+                              uint32_t maxSpans) const = 0;
+
+    /**
+     * Return a pointer to a specified range of bytes in the Message if the
+     * range is stored contiguously.  The pointer remains valid for the
+     * lifetime of the Message.
+     *
+     * @param offset
+     *      The number of bytes in the Message preceding the range of bytes
+     *      being requested.
+     * @param num
+     *      The number of bytes being requested.
+     *
+     * @return
+     *      Pointer to the first byte of the range; nullptr if the range
+     *      exceeds the range of bytes in the Message or is not contiguous.
+     */
+    virtual const void* peek(uint32_t offset, uint32_t num) const = 0;
+
+    /**
+     * Return a pointer to an object of type T stored contiguously in the
+     * Message, typically an application header at the start of the Message.
+     * No alignment is guaranteed, so T should be a packed structure.
+     *
+     * @param offset
+     *      The number of bytes in the Message preceding the object.
+     *
+     * @return
+     *      Pointer to the object; nullptr if the object is not stored
+     *      contiguously (see peek(uint32_t, uint32_t)).
+     */
+    template <typename T>
+    const T* peek(uint32_t offset = 0) const
+    {
+        return static_cast<const T*>(peek(offset, sizeof(T)));
+    }
+
     /**
      * Return the number of bytes this Message contains.
      */
     virtual uint32_t length() const = 0;
 };
 
+/**
+ * A CompletionQueue collects RemoteOp objects as they finish so that an
+ * application with many outstanding RemoteOp objects can learn which ones are
+ * ready in batches rather than calling RemoteOp::isReady() on each of them.
+ *
+ * A RemoteOp is delivered to the CompletionQueue, at most once per send, by
+ * Transport::poll() once the RemoteOp has either completed or failed; a
+ * delivered RemoteOp will return true from RemoteOp::isReady().  A RemoteOp
+ * must not be destroyed while it may still be delivered (i.e. between being
+ * sent and being popped from the CompletionQueue), and the CompletionQueue
+ * must outlive all RemoteOp objects sent with it.  (A RemoteOpGroup manages
+ * its own CompletionQueue and detaches unfinished members when it is
+ * destroyed, so its members are not bound by this rule.)
+ *
+ * This class is thread-safe.
+ */
+class CompletionQueue {
+  public:
+    /// Function invoked with each RemoteOp as it finishes.
+    typedef std::function<void(RemoteOp*)> Callback;
+
+    /**
+     * Construct a CompletionQueue from which finished RemoteOp objects can be
+     * popped using CompletionQueue::poll().
+     */
+    CompletionQueue();
+
+    /**
+     * Construct a CompletionQueue that hands each finished RemoteOp directly
+     * to a callback instead of queueing it.
+     *
+     * @param callback
+     *      Function to invoke with each finished RemoteOp.  The callback is
+     *      invoked from within Transport::poll() by the polling thread and
+     *      should be short; it may access the RemoteOp but must not call
+     *      Transport::poll() itself.
+     */
+    explicit CompletionQueue(Callback callback);
+
+    /**
+     * CompletionQueue destructor.
+     */
+    ~CompletionQueue();
+
+    /**
+     * Remove up to _maxOps_ finished RemoteOp objects from the queue in the
+     * order in which they finished.  Does not block and does not drive the
+     * Transport; the application should continue to call Transport::poll().
+     *
+     * @param[out] ops
+     *      Array into which the finished RemoteOp objects are written.
+     * @param maxOps
+     *      Number of entries available in _ops_.
+     * @return
+     *      Number of RemoteOp objects written to _ops_; 0 if none have
+     *      finished.
+     */
+    size_t poll(RemoteOp* ops[], size_t maxOps);
+
+  private:
+    /// Contains the internal implementation of Homa::CompletionQueue.
+    std::unique_ptr<Core::CompletionQueue> internal;
+
+    // Disable Copy and Assign
+    CompletionQueue(const CompletionQueue&) = delete;
+    CompletionQueue& operator=(const CompletionQueue&) = delete;
+
+    friend class RemoteOp;
+    friend class RemoteOpGroup;
+};
+
 /**
  * A RemoteOp is a Message pair consisting of a request Message to be sent to
  * and processed by a "remote server" and a response Message that returns the
@@ -112,8 +304,12 @@ class RemoteOp {
      *
      * @param destination
      *      The network address to which the request will be sent.
+     * @param completionQueue
+     *      If provided, this RemoteOp will be delivered to the CompletionQueue
+     *      once it completes or fails.
      */
-    void send(Driver::Address* destination);
+    void send(Driver::Address* destination,
+              CompletionQueue* completionQueue = nullptr);
 
     /**
      * Indicates whether this RemoteOp is done being processed.  Used to
@@ -128,10 +324,25 @@ class RemoteOp {
     bool isReady();
 
     /**
-     * Wait for a response to be received for this RemoteOp.
+     * Wait for a response to be received for this RemoteOp.  Spins calling
+     * Transport::poll() until the RemoteOp is ready.
      */
     void wait();
 
+    /**
+     * Wait for a response to be received for this RemoteOp, spinning for at
+     * most _spinTimeUs_ and then blocking on the Transport's event file
+     * descriptor (see Transport::getEventFd()).
+     *
+     * While blocked, this thread relies on other threads calling
+     * Transport::poll() to make progress; if none do, it wakes up
+     * periodically to poll the Transport itself.
+     *
+     * @param spinTimeUs
+     *      Number of microseconds to spin before blocking.
+     */
+    void wait(uint64_t spinTimeUs);
+
     /// Message to be sent to and processed by the target "remote server".
     Message* request;
 
@@ -146,9 +357,131 @@ class RemoteOp {
     RemoteOp(const RemoteOp&) = delete;
     RemoteOp& operator=(const RemoteOp&) = delete;
 
+    friend class RemoteOpGroup;
     friend class Transport;
 };
 
+/**
+ * A RemoteOpGroup tracks a set of RemoteOp objects that are sent together
+ * (e.g. a request fanned out to many servers) so that the application can
+ * wait for the first, the first K, or all of them to finish.  Finished members
+ * are collected through a CompletionQueue so each completion costs O(1) work
+ * regardless of the size of the group.
+ *
+ * The group does not own its members.  A member may be destroyed once it has
+ * been returned by waitAny() or listed by getFinished(); any other member must
+ * not be destroyed before the group.  Members that have not finished when the
+ * group is destroyed are detached from it and can still be waited on
+ * individually with RemoteOp::isReady() or RemoteOp::wait().
+ *
+ * This class is NOT thread-safe.
+ */
+class RemoteOpGroup {
+  public:
+    /**
+     * Construct an empty RemoteOpGroup.
+     *
+     * @param transport
+     *      Homa::Transport which will send/receive the member RemoteOps.
+     */
+    explicit RemoteOpGroup(Transport* transport);
+
+    /**
+     * RemoteOpGroup destructor.
+     */
+    ~RemoteOpGroup();
+
+    /**
+     * Add a RemoteOp to this group.  The RemoteOp will be sent by the next
+     * call to send().
+     *
+     * WARNING: Do not modify the request after calling this method.
+     *
+     * @param op
+     *      RemoteOp, that has not yet been sent, to add to the group.
+     * @param destination
+     *      The network address to which the RemoteOp's request will be sent.
+     */
+    void add(RemoteOp* op, Driver::Address* destination);
+
+    /**
+     * Send all RemoteOp members that have been added since the last call to
+     * send() in a single batch.
+     */
+    void send();
+
+    /**
+     * Wait for a member RemoteOp to finish.  Each finished member is returned
+     * exactly once, in the order in which the members finished.
+     *
+     * @return
+     *      A member RemoteOp which has completed or failed (i.e. isReady() is
+     *      true); nullptr if every sent member has already been returned.
+     */
+    RemoteOp* waitAny();
+
+    /**
+     * Wait until at least _numOps_ sent members have finished, or until all
+     * sent members have finished if fewer than _numOps_ were sent.
+     *
+     * @param numOps
+     *      Number of finished members to wait for.
+     * @return
+     *      Number of members that have finished.
+     */
+    size_t waitFor(size_t numOps);
+
+    /**
+     * Wait until all sent members have finished.
+     */
+    void waitAll();
+
+    /**
+     * Return the members that have finished so far, in the order in which
+     * they finished.
+     */
+    const std::vector<RemoteOp*>& getFinished() const
+    {
+        return finished;
+    }
+
+    /**
+     * Return the number of RemoteOp members that have been sent.
+     */
+    size_t size() const
+    {
+        return sent.size();
+    }
+
+  private:
+    void collect();
+
+    /// Transport used to send the members and drive their progress.
+    Transport* const transport;
+
+    /// Receives the members as they finish.
+    CompletionQueue completionQueue;
+
+    /// Members added but not yet sent.
+    std::vector<RemoteOp*> unsent;
+
+    /// Destination of each member in _unsent_.
+    std::vector<Driver::Address*> unsentDestinations;
+
+    /// Members that have been sent, in the order in which they were sent.
+    std::vector<RemoteOp*> sent;
+
+    /// Members that have finished, in the order in which they finished.
+    std::vector<RemoteOp*> finished;
+
+    /// Index into _finished_ of the next member to be returned by waitAny().
+    size_t nextFinished;
+
+    // Disable Copy and Assign
+    RemoteOpGroup(const RemoteOpGroup&) = delete;
+    RemoteOpGroup& operator=(const RemoteOpGroup&) = delete;
+};
+
 /**
  * A ServerOp is a Message pair consisting of an incomming request Message to
  * be processed and an outgoing response Message containing the result of
@@ -183,7 +516,7 @@ class ServerOp {
     ~ServerOp();
 
     /**
-     * Move assignment.
+     * Move assignment.  Any request already held by this ServerOp is released.
      */
     ServerOp& operator=(ServerOp&& other);
 
@@ -238,6 +571,10 @@ class ServerOp {
  */
 class Transport {
   public:
+    /// Default number of incoming messages to which a transport will grant
+    /// at the same time.
+    static const uint32_t DEFAULT_OVERCOMMITMENT_DEGREE = 4;
+
     /**
      * Constuct a new instance of a Homa-based transport.
      *
@@ -246,8 +583,13 @@ class Transport {
      * @param transportId
      *      This transport's unique identifier in the group of transports among
      *      which this transport will communicate.
+     * @param overcommitmentDegree
+     *      Maximum number of incoming messages to which this transport will
+     *      grant at the same time.  Granting to more than one message keeps
+     *      the downlink busy when some senders don't respond right away.
      */
-    Transport(Driver* driver, uint64_t transportId);
+    Transport(Driver* driver, uint64_t transportId,
+              uint32_t overcommitmentDegree = DEFAULT_OVERCOMMITMENT_DEGREE);
 
     /**
      * Homa::Transport destructor.
@@ -261,6 +603,33 @@ class Transport {
      */
     ServerOp receiveServerOp();
 
+    /**
+     * Receive up to _maxOps_ incomming requests that have been received by
+     * this Homa::Transport in a single batch.  Cheaper than calling
+     * receiveServerOp() repeatedly.
+     *
+     * @param[out] ops
+     *      Array of ServerOps into which the received requests are moved.
+     *      Any request already held by an overwritten ServerOp is released.
+     * @param maxOps
+     *      Number of entries available in _ops_.
+     * @return
+     *      Number of ServerOps filled in; ops[0] through ops[n-1].
+     */
+    size_t receiveServerOps(ServerOp ops[], size_t maxOps);
+
+    /**
+     * Send the response of each ServerOp back to its initial requestor as a
+     * single batch.  Equivalent to calling ServerOp::reply() on each.
+     *
+     * @param ops
+     *      ServerOps whose responses should be sent.  Empty ServerOps are
+     *      skipped.
+     * @param numOps
+     *      Number of entries in _ops_.
+     */
+    void reply(ServerOp ops[], size_t numOps);
+
     /**
      * Return a network address handle for the given string representation of
      * the address. Addresses and address strings are Driver specific.
@@ -282,6 +651,64 @@ class Transport {
      */
     void poll();
 
+    /**
+     * Start background threads that drive the Transport by calling poll()
+     * continuously, so that the Transport makes progress even when
+     * application threads are busy.  Application threads then only need to
+     * send operations and consume their results (e.g. with a CompletionQueue
+     * or RemoteOp::wait(uint64_t)); they may still call poll() as well.  Any
+     * previously started polling threads are stopped first.
+     *
+     * @param cpus
+     *      One entry per polling thread to start: the CPU core to which the
+     *      thread should be pinned, or a negative value to leave the thread
+     *      unpinned.
+     * @throw FatalError
+     *      A polling thread could not be pinned to its CPU core.
+     */
+    void startPollingThreads(const std::vector<int>& cpus);
+
+    /**
+     * Stop any background threads started by startPollingThreads().  Called
+     * automatically when the Transport is destroyed.
+     */
+    void stopPollingThreads();
+
+    /**
+     * Return a file descriptor that becomes readable when the state of some
+     * RemoteOp or ServerOp may have changed (e.g. a RemoteOp finished or a
+     * new request can be received).  Allows the Transport to be included in
+     * an application's epoll/select loop.  The descriptor is signaled by
+     * whichever thread calls poll().
+     *
+     * The application must not read from the file descriptor directly; once
+     * it is readable, call clearEvent() and then check for the awaited state
+     * changes.
+     */
+    int getEventFd();
+
+    /**
+     * Reset the file descriptor returned by getEventFd() so that it only
+     * becomes readable once more state changes.  Check for the awaited state
+     * changes after calling this method and before blocking on the file
+     * descriptor so that no change is missed.
+     */
+    void clearEvent();
+
+    /**
+     * Return the estimated number of bytes that have been handed to the
+     * Driver but are still waiting in the NIC's transmit queue.  The
+     * Transport keeps this to about two packets' worth so that packets are
+     * sent in SRPT order by software rather than in FIFO order by the NIC.
+     */
+    uint32_t getNicQueuedBytes();
+
+    /**
+     * Return the number of granted packets that the Transport is holding
+     * back until there is room for them in the NIC's transmit queue.
+     */
+    uint32_t getNumReadyPackets();
+
   private:
     /// Contains the internal implementation of Homa::Transport which does most
     /// of the actual work.  Hides unnecessary details from users of libHoma.
@@ -292,6 +719,7 @@ class Transport {
     Transport& operator=(const Transport&) = delete;
 
     friend class RemoteOp;
+    friend class RemoteOpGroup;
 };
 
 }  // namespace Homa
@@ -0,0 +1,107 @@
+/* Copyright (c) 2018-2019, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_CORE_COMPLETIONQUEUE_H
+#define HOMA_CORE_COMPLETIONQUEUE_H
+
+#include <Homa/Homa.h>
+
+#include <algorithm>
+#include <deque>
+#include <utility>
+
+#include "SpinLock.h"
+
+namespace Homa {
+namespace Core {
+
+/**
+ * Internal implementation of Homa::CompletionQueue.
+ *
+ * Collects the RemoteOp objects that have finished so that the application
+ * can learn about them in batches instead of checking each RemoteOp.
+ *
+ * This class is thread-safe.
+ */
+class CompletionQueue {
+  public:
+    /**
+     * Constructor.
+     *
+     * @param callback
+     *      Function to invoke for each finished RemoteOp instead of queueing
+     *      it; queue finished RemoteOp objects if the callback is empty.
+     */
+    explicit CompletionQueue(Homa::CompletionQueue::Callback callback)
+        : mutex()
+        , queue()
+        , callback(std::move(callback))
+    {}
+
+    /**
+     * Deliver a finished RemoteOp to the application, either by invoking the
+     * callback or by queueing the RemoteOp until it is popped.
+     *
+     * Should not be called while holding the RemoteOp's internal Op mutex;
+     * the callback is allowed to access the RemoteOp.
+     *
+     * @param op
+     *      RemoteOp that has either completed or failed.
+     */
+    void push(RemoteOp* op)
+    {
+        if (callback) {
+            callback(op);
+        } else {
+            SpinLock::Lock lock(mutex);
+            queue.push_back(op);
+        }
+    }
+
+    /**
+     * Remove up to _maxOps_ finished RemoteOp objects from the queue in the
+     * order in which they finished.
+     *
+     * @param[out] ops
+     *      Array into which the finished RemoteOp objects are written.
+     * @param maxOps
+     *      Number of entries available in _ops_.
+     * @return
+     *      Number of RemoteOp objects written to _ops_.
+     */
+    size_t pop(RemoteOp* ops[], size_t maxOps)
+    {
+        SpinLock::Lock lock(mutex);
+        size_t numOps = std::min(maxOps, queue.size());
+        std::copy(queue.begin(), queue.begin() + numOps, ops);
+        queue.erase(queue.begin(), queue.begin() + numOps);
+        return numOps;
+    }
+
+  private:
+    /// Protects the queue.
+    SpinLock mutex;
+
+    /// RemoteOp objects that have finished but have not yet been popped.
+    std::deque<RemoteOp*> queue;
+
+    /// Invoked for each finished RemoteOp in place of queueing, if set.
+    const Homa::CompletionQueue::Callback callback;
+};
+
+}  // namespace Core
+}  // namespace Homa
+
+#endif  // HOMA_CORE_COMPLETIONQUEUE_H
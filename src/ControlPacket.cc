@@ -0,0 +1,117 @@
+/* Copyright (c) 2019, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "ControlPacket.h"
+
+#include <Homa/Util.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace Homa {
+namespace Core {
+namespace ControlPacket {
+
+namespace {
+/// Maximum number of packets handed to the Driver in a single call to
+/// Driver::sendPackets().
+const uint16_t MAX_BURST = 32;
+}  // namespace
+
+/**
+ * Queue constructor.
+ *
+ * @param driver
+ *      Driver with which queued packets will be sent.
+ */
+Queue::Queue(Driver* driver)
+    : mutex()
+    , driver(driver)
+    , packets()
+    , grants()
+{}
+
+/**
+ * Queue destructor; sends any packets that are still queued.
+ */
+Queue::~Queue()
+{
+    flush();
+}
+
+/**
+ * Send all queued packets in bursts of up to MAX_BURST packets and return them
+ * to the Driver.
+ */
+void
+Queue::flush()
+{
+    SpinLock::Lock lock(mutex);
+    if (packets.empty()) {
+        return;
+    }
+    for (size_t i = 0; i < packets.size(); i += MAX_BURST) {
+        Driver::Packet** burst = packets.data() + i;
+        uint16_t numPackets = Util::downCast<uint16_t>(
+            std::min(packets.size() - i, size_t(MAX_BURST)));
+        driver->sendPackets(burst, numPackets);
+        driver->releasePackets(burst, numPackets);
+    }
+    packets.clear();
+    grants.clear();
+}
+
+/**
+ * Copy a control packet header into a packet to be sent on the next flush().
+ *
+ * @param address
+ *      Destination address for the packet.
+ * @param header
+ *      Header of the packet to be sent.
+ * @param length
+ *      Number of bytes in the header.
+ */
+void
+Queue::enqueue(Driver::Address* address,
+               const Protocol::Packet::CommonHeader* header, uint16_t length)
+{
+    SpinLock::Lock lock(mutex);
+    Driver::Packet* packet = nullptr;
+    if (header->opcode == Protocol::Packet::GRANT) {
+        Protocol::MessageId id = header->messageId;
+        auto it = grants.find(id);
+        if (it != grants.end()) {
+            // Replace the superseded GRANT.
+            packet = it->second;
+        } else {
+            packet = driver->allocPacket();
+            packets.push_back(packet);
+            grants.insert({id, packet});
+        }
+    } else {
+        packet = driver->allocPacket();
+        packets.push_back(packet);
+    }
+    std::memcpy(packet->payload, header, length);
+    packet->length = length;
+    packet->address = address;
+    // Control packets go ahead of all DATA so that, e.g., GRANTs are not
+    // queued behind the traffic they schedule.
+    packet->priority = driver->getHighestPacketPriority();
+}
+
+}  // namespace ControlPacket
+}  // namespace Core
+}  // namespace Homa
@@ -18,32 +18,68 @@
 
 #include <Homa/Driver.h>
 
+#include <unordered_map>
+#include <vector>
+
+#include "Protocol.h"
+#include "SpinLock.h"
+
 namespace Homa {
 namespace Core {
 namespace ControlPacket {
 
 /**
- * Send a packet of the given type.  Helper function used to other modules to
- * send various control packets.
+ * Collects the control packets (e.g. GRANT, DONE, RESEND) generated while
+ * processing a batch of work so that they can be handed to the Driver in a
+ * few large bursts by flush().
+ *
+ * Only the most recent GRANT for any given message is sent; queuing a GRANT
+ * overwrites any GRANT for the same message that has not yet been flushed.
  *
- * @param driver
- *      Driver with which to send the packet.
- * @param address
- *      Destination address for the packet to be sent.
- * @param args
- *      Arguments to PacketHeaderType's constructor.
+ * This class is thread-safe.
  */
-template <typename PacketHeaderType, typename... Args>
-void
-send(Driver* driver, Driver::Address* address, Args&&... args)
-{
-    Driver::Packet* packet = driver->allocPacket();
-    new (packet->payload) PacketHeaderType(static_cast<Args&&>(args)...);
-    packet->length = sizeof(PacketHeaderType);
-    packet->address = address;
-    driver->sendPackets(&packet, 1);
-    driver->releasePackets(&packet, 1);
-}
+class Queue {
+  public:
+    explicit Queue(Driver* driver);
+    ~Queue();
+
+    /**
+     * Queue a packet of the given type to be sent on the next flush().
+     *
+     * @param address
+     *      Destination address for the packet to be sent.
+     * @param args
+     *      Arguments to PacketHeaderType's constructor.
+     */
+    template <typename PacketHeaderType, typename... Args>
+    void send(Driver::Address* address, Args&&... args)
+    {
+        PacketHeaderType header(static_cast<Args&&>(args)...);
+        enqueue(address, &header.common, sizeof(PacketHeaderType));
+    }
+
+    void flush();
+
+  private:
+    void enqueue(Driver::Address* address,
+                 const Protocol::Packet::CommonHeader* header,
+                 uint16_t length);
+
+    /// Monitor-style lock.
+    SpinLock mutex;
+
+    /// Driver with which the queued packets will be sent.
+    Driver* const driver;
+
+    /// Packets waiting to be sent, in the order they were queued.
+    std::vector<Driver::Packet*> packets;
+
+    /// Queued GRANT packets by the MessageId they grant to; used to collapse
+    /// superseded GRANTs.
+    std::unordered_map<Protocol::MessageId, Driver::Packet*,
+                       Protocol::MessageId::Hasher>
+        grants;
+};
 
 }  // namespace ControlPacket
 }  // namespace Core
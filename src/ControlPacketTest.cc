@@ -0,0 +1,183 @@
+/* Copyright (c) 2019, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include "ControlPacket.h"
+
+#include <deque>
+
+#include "Mock/MockDriver.h"
+
+namespace Homa {
+namespace Core {
+namespace {
+
+using ::testing::_;
+using ::testing::Args;
+using ::testing::ElementsAre;
+using ::testing::Eq;
+using ::testing::Mock;
+using ::testing::NiceMock;
+using ::testing::Return;
+
+class ControlPacketTest : public ::testing::Test {
+  public:
+    ControlPacketTest()
+        : mockDriver()
+        , payload()
+        , packet0(payload[0])
+        , packet1(payload[1])
+        , queue(&mockDriver)
+    {
+        ON_CALL(mockDriver, getHighestPacketPriority).WillByDefault(Return(7));
+    }
+
+    NiceMock<Homa::Mock::MockDriver> mockDriver;
+    char payload[2][1024];
+    Homa::Mock::MockDriver::MockPacket packet0;
+    Homa::Mock::MockDriver::MockPacket packet1;
+    ControlPacket::Queue queue;
+};
+
+TEST_F(ControlPacketTest, destructor)
+{
+    ControlPacket::Queue* queue = new ControlPacket::Queue(&mockDriver);
+    EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&packet0));
+    queue->send<Protocol::Packet::DoneHeader>((Driver::Address*)22,
+                                              Protocol::MessageId(42, 1, 1));
+
+    EXPECT_CALL(mockDriver, sendPackets(_, Eq(1)))
+        .With(Args<0, 1>(ElementsAre(&packet0)));
+    EXPECT_CALL(mockDriver, releasePackets(_, Eq(1)))
+        .With(Args<0, 1>(ElementsAre(&packet0)));
+
+    delete queue;
+}
+
+TEST_F(ControlPacketTest, send)
+{
+    Protocol::MessageId id(42, 1, 1);
+    EXPECT_CALL(mockDriver, allocPacket)
+        .WillOnce(Return(&packet0))
+        .WillOnce(Return(&packet1));
+
+    queue.send<Protocol::Packet::ResendHeader>((Driver::Address*)22, id, 2, 3);
+    queue.send<Protocol::Packet::PingHeader>((Driver::Address*)33, id);
+
+    EXPECT_EQ(2U, queue.packets.size());
+    EXPECT_TRUE(queue.grants.empty());
+    Protocol::Packet::ResendHeader* header =
+        static_cast<Protocol::Packet::ResendHeader*>(packet0.payload);
+    EXPECT_EQ(Protocol::Packet::RESEND, header->common.opcode);
+    EXPECT_EQ(id, header->common.messageId);
+    EXPECT_EQ(2U, header->index);
+    EXPECT_EQ(3U, header->num);
+    EXPECT_EQ(sizeof(Protocol::Packet::ResendHeader), packet0.length);
+    EXPECT_EQ((Driver::Address*)22, packet0.address);
+    EXPECT_EQ(7, packet0.priority);
+    EXPECT_EQ(Protocol::Packet::PING,
+              static_cast<Protocol::Packet::CommonHeader*>(packet1.payload)
+                  ->opcode);
+    EXPECT_EQ(sizeof(Protocol::Packet::PingHeader), packet1.length);
+    EXPECT_EQ((Driver::Address*)33, packet1.address);
+    EXPECT_EQ(7, packet1.priority);
+}
+
+TEST_F(ControlPacketTest, send_collapseGrants)
+{
+    Protocol::MessageId id0(42, 1, 1);
+    Protocol::MessageId id1(42, 2, 1);
+    Protocol::Packet::UnscheduledCutoffs cutoffs;
+    EXPECT_CALL(mockDriver, allocPacket)
+        .WillOnce(Return(&packet0))
+        .WillOnce(Return(&packet1));
+
+    queue.send<Protocol::Packet::GrantHeader>((Driver::Address*)22, id0, 5, 1,
+                                              cutoffs, 0);
+    queue.send<Protocol::Packet::GrantHeader>((Driver::Address*)33, id1, 3, 0,
+                                              cutoffs, 0);
+    queue.send<Protocol::Packet::GrantHeader>((Driver::Address*)22, id0, 7, 2,
+                                              cutoffs, 0);
+
+    EXPECT_EQ(2U, queue.packets.size());
+    EXPECT_EQ(2U, queue.grants.size());
+    Protocol::Packet::GrantHeader* header =
+        static_cast<Protocol::Packet::GrantHeader*>(packet0.payload);
+    EXPECT_EQ(id0, header->common.messageId);
+    EXPECT_EQ(7U, header->indexLimit);
+    EXPECT_EQ(2U, header->priority);
+    EXPECT_EQ(7, packet0.priority);
+    header = static_cast<Protocol::Packet::GrantHeader*>(packet1.payload);
+    EXPECT_EQ(id1, header->common.messageId);
+    EXPECT_EQ(3U, header->indexLimit);
+}
+
+TEST_F(ControlPacketTest, flush)
+{
+    Protocol::Packet::UnscheduledCutoffs cutoffs;
+    EXPECT_CALL(mockDriver, allocPacket)
+        .WillOnce(Return(&packet0))
+        .WillOnce(Return(&packet1));
+    queue.send<Protocol::Packet::GrantHeader>(
+        (Driver::Address*)22, Protocol::MessageId(42, 1, 1), 5, 1, cutoffs, 0);
+    queue.send<Protocol::Packet::BusyHeader>((Driver::Address*)22,
+                                             Protocol::MessageId(42, 2, 1));
+
+    EXPECT_CALL(mockDriver, sendPackets(_, Eq(2)))
+        .With(Args<0, 1>(ElementsAre(&packet0, &packet1)));
+    EXPECT_CALL(mockDriver, releasePackets(_, Eq(2)))
+        .With(Args<0, 1>(ElementsAre(&packet0, &packet1)));
+
+    queue.flush();
+
+    EXPECT_TRUE(queue.packets.empty());
+    EXPECT_TRUE(queue.grants.empty());
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // Nothing queued.
+    EXPECT_CALL(mockDriver, sendPackets).Times(0);
+    queue.flush();
+}
+
+TEST_F(ControlPacketTest, flush_manyPackets)
+{
+    std::deque<Homa::Mock::MockDriver::MockPacket> packets;
+    for (uint16_t i = 0; i < 40; ++i) {
+        packets.emplace_back(payload[0]);
+    }
+    auto next = packets.begin();
+    EXPECT_CALL(mockDriver, allocPacket).WillRepeatedly([&next]() {
+        return &*next++;
+    });
+    for (uint16_t i = 0; i < 40; ++i) {
+        queue.send<Protocol::Packet::PingHeader>((Driver::Address*)22,
+                                                 Protocol::MessageId(42, i, 1));
+    }
+
+    // Sent and released in bursts of at most 32 packets.
+    EXPECT_CALL(mockDriver, sendPackets(Eq(&queue.packets[0]), Eq(32)));
+    EXPECT_CALL(mockDriver, releasePackets(Eq(&queue.packets[0]), Eq(32)));
+    EXPECT_CALL(mockDriver, sendPackets(Eq(&queue.packets[32]), Eq(8)));
+    EXPECT_CALL(mockDriver, releasePackets(Eq(&queue.packets[32]), Eq(8)));
+
+    queue.flush();
+
+    EXPECT_TRUE(queue.packets.empty());
+}
+
+}  // namespace
+}  // namespace Core
+}  // namespace Homa
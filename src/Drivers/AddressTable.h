@@ -0,0 +1,163 @@
+/* Copyright (c) 2019, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_DRIVERS_ADDRESSTABLE_H
+#define HOMA_DRIVERS_ADDRESSTABLE_H
+
+#include <Homa/Driver.h>
+
+#include <atomic>
+
+namespace Homa {
+namespace Drivers {
+
+/**
+ * Interns a Driver's Address objects by their raw byte-format so that each
+ * distinct address is represented by exactly one AddressType object for the
+ * lifetime of the table.  Drivers use this to implement Driver::getAddress()
+ * without formatting or locking; the returned pointers can be compared
+ * directly.
+ *
+ * The table is a fixed array of buckets, each holding a singly linked list of
+ * entries.  Entries are only ever pushed onto the head of a list (with a
+ * compare-and-swap) and are never removed until the table is destroyed, so
+ * lookups and insertions are lock-free.
+ *
+ * This class is thread-safe.
+ *
+ * @tparam AddressType
+ *      Driver::Address subclass stored in the table; must be constructible
+ *      from a `const Driver::Address::Raw*`.
+ */
+template <typename AddressType>
+class AddressTable {
+  public:
+    /**
+     * Construct an empty AddressTable.
+     */
+    AddressTable()
+        : buckets()
+    {
+        for (std::atomic<Entry*>& bucket : buckets) {
+            bucket.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Destruct the table along with all the AddressType objects it holds.
+     */
+    ~AddressTable()
+    {
+        for (std::atomic<Entry*>& bucket : buckets) {
+            Entry* entry = bucket.load(std::memory_order_acquire);
+            while (entry != nullptr) {
+                Entry* next = entry->next;
+                delete entry;
+                entry = next;
+            }
+        }
+    }
+
+    /**
+     * Return the AddressType object for the given raw address, constructing
+     * it if this is the first time the address has been seen.
+     *
+     * @param raw
+     *      Raw byte-format of the address; unused bytes must be zero.
+     * @return
+     *      Pointer to the AddressType object for _raw_; the same pointer is
+     *      returned for equal raw addresses and is valid for the lifetime of
+     *      the table.
+     * @throw BadAddress
+     *      Thrown by the AddressType constructor if _raw_ is malformed.
+     */
+    AddressType* get(const Driver::Address::Raw& raw)
+    {
+        std::atomic<Entry*>& bucket =
+            buckets[Driver::Address::Raw::Hasher()(raw) % NUM_BUCKETS];
+        Entry* head = bucket.load(std::memory_order_acquire);
+        Entry* found = find(head, nullptr, raw);
+        if (found != nullptr) {
+            return &found->address;
+        }
+
+        Entry* entry = new Entry(raw);
+        entry->next = head;
+        while (!bucket.compare_exchange_weak(entry->next, entry,
+                                             std::memory_order_release,
+                                             std::memory_order_acquire)) {
+            // Entries were added concurrently; only those need to be checked.
+            found = find(entry->next, head, raw);
+            if (found != nullptr) {
+                delete entry;
+                return &found->address;
+            }
+            head = entry->next;
+        }
+        return &entry->address;
+    }
+
+  private:
+    /// Number of buckets in the table.
+    static const uint32_t NUM_BUCKETS = 1024;
+
+    /**
+     * Holds one interned address.
+     */
+    struct Entry {
+        /// Construct an Entry for the given raw address.
+        explicit Entry(const Driver::Address::Raw& raw)
+            : raw(raw)
+            , address(&raw)
+            , next(nullptr)
+        {}
+
+        /// Raw byte-format of the address; used as the key.
+        const Driver::Address::Raw raw;
+
+        /// The interned Address object.
+        AddressType address;
+
+        /// Next entry in the same bucket; immutable once the entry is
+        /// published.
+        Entry* next;
+    };
+
+    /**
+     * Return the first entry matching _raw_ in the list starting at _begin_
+     * and ending before _end_; nullptr if there is none.
+     */
+    static Entry* find(Entry* begin, Entry* end,
+                       const Driver::Address::Raw& raw)
+    {
+        for (Entry* entry = begin; entry != end; entry = entry->next) {
+            if (entry->raw == raw) {
+                return entry;
+            }
+        }
+        return nullptr;
+    }
+
+    /// Heads of the per-bucket lists of entries.
+    std::atomic<Entry*> buckets[NUM_BUCKETS];
+
+    AddressTable(const AddressTable&) = delete;
+    AddressTable& operator=(const AddressTable&) = delete;
+};
+
+}  // namespace Drivers
+}  // namespace Homa
+
+#endif  // HOMA_DRIVERS_ADDRESSTABLE_H
@@ -0,0 +1,114 @@
+/* Copyright (c) 2019, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include "AddressTable.h"
+
+#include "Fake/FakeAddress.h"
+#include "RawAddressType.h"
+
+#include <thread>
+#include <vector>
+
+namespace Homa {
+namespace Drivers {
+namespace {
+
+using Fake::FakeAddress;
+
+Driver::Address::Raw
+fakeRaw(uint64_t addressId)
+{
+    Driver::Address::Raw raw;
+    FakeAddress(addressId).toRaw(&raw);
+    return raw;
+}
+
+TEST(AddressTableTest, Raw_equality)
+{
+    Driver::Address::Raw::Hasher hasher;
+    EXPECT_TRUE(fakeRaw(42) == fakeRaw(42));
+    EXPECT_FALSE(fakeRaw(42) != fakeRaw(42));
+    EXPECT_EQ(hasher(fakeRaw(42)), hasher(fakeRaw(42)));
+    EXPECT_TRUE(fakeRaw(42) != fakeRaw(43));
+    EXPECT_NE(hasher(fakeRaw(42)), hasher(fakeRaw(43)));
+}
+
+TEST(AddressTableTest, get)
+{
+    AddressTable<FakeAddress> table;
+
+    FakeAddress* address = table.get(fakeRaw(42));
+    EXPECT_EQ("42", address->toString());
+    EXPECT_EQ(address, table.get(fakeRaw(42)));
+
+    FakeAddress* other = table.get(fakeRaw(43));
+    EXPECT_EQ("43", other->toString());
+    EXPECT_NE(address, other);
+}
+
+TEST(AddressTableTest, get_collisions)
+{
+    AddressTable<FakeAddress> table;
+    std::vector<FakeAddress*> addresses;
+
+    // More addresses than buckets, so some buckets hold several entries.
+    for (uint64_t i = 1; i <= 3000; ++i) {
+        addresses.push_back(table.get(fakeRaw(i)));
+    }
+    for (uint64_t i = 1; i <= 3000; ++i) {
+        EXPECT_EQ(addresses.at(i - 1), table.get(fakeRaw(i)));
+        EXPECT_EQ(i, addresses.at(i - 1)->address);
+    }
+}
+
+TEST(AddressTableTest, get_bad)
+{
+    AddressTable<FakeAddress> table;
+    Driver::Address::Raw raw = fakeRaw(42);
+    raw.type = RawAddressType::MAC;
+
+    EXPECT_THROW(table.get(raw), BadAddress);
+}
+
+TEST(AddressTableTest, get_concurrent)
+{
+    AddressTable<FakeAddress> table;
+    const int NUM_THREADS = 4;
+    const uint64_t NUM_ADDRESSES = 1000;
+    std::vector<std::vector<FakeAddress*>> results(NUM_THREADS);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < NUM_THREADS; ++t) {
+        threads.emplace_back([&table, &results, t, NUM_ADDRESSES] {
+            for (uint64_t i = 1; i <= NUM_ADDRESSES; ++i) {
+                results[t].push_back(table.get(fakeRaw(i)));
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    // Every thread sees the same object for the same address.
+    for (int t = 1; t < NUM_THREADS; ++t) {
+        EXPECT_EQ(results[0], results[t]);
+    }
+}
+
+}  // namespace
+}  // namespace Drivers
+}  // namespace Homa
@@ -22,21 +22,23 @@ namespace Drivers {
 namespace DPDK {
 
 DpdkDriver*
-DpdkDriver::newDpdkDriver(int port)
+DpdkDriver::newDpdkDriver(int port, uint16_t numQueues)
 {
-    return new DpdkDriverImpl(port);
+    return new DpdkDriverImpl(port, numQueues);
 }
 
 DpdkDriver*
-DpdkDriver::newDpdkDriver(int port, int argc, char* argv[])
+DpdkDriver::newDpdkDriver(int port, int argc, char* argv[],
+                          uint16_t numQueues)
 {
-    return new DpdkDriverImpl(port, argc, argv);
+    return new DpdkDriverImpl(port, argc, argv, numQueues);
 }
 
 DpdkDriver*
-DpdkDriver::newDpdkDriver(int port, DpdkDriver::NoEalInit _)
+DpdkDriver::newDpdkDriver(int port, DpdkDriver::NoEalInit _,
+                          uint16_t numQueues)
 {
-    return new DpdkDriverImpl(port, _);
+    return new DpdkDriverImpl(port, _, numQueues);
 }
 
 }  // namespace DPDK
@@ -22,6 +22,7 @@
 #include "StringUtil.h"
 
 #include "../../CodeLocation.h"
+#include "../../ThreadId.h"
 
 #include <rte_common.h>
 #include <rte_config.h>
@@ -34,6 +35,9 @@
 
 #include <unistd.h>
 
+#include <algorithm>
+#include <mutex>
+
 namespace Homa {
 
 namespace Drivers {
@@ -91,23 +95,19 @@ enum EthPayloadType {
 };
 };  // namespace
 
-/**
- * Allocated to store packet data when mbufs are not available.
- */
-struct DpdkDriverImpl::OverflowBuffer {
-    /// Array of bytes used to store a packet's payload.
-    char* data[MAX_PAYLOAD_SIZE];
-};
-
 /**
  * DpdkDriverImpl specific Packet object used to track a its lifetime and
- * contents.
+ * contents.  Packets backed by an mbuf are stored in the mbuf's private area
+ * (see MBUF_PRIV_SIZE) so that no separate allocation is needed to go from an
+ * mbuf to its Packet.
  */
 class DpdkDriverImpl::DpdkPacket : public Driver::Packet {
   public:
     explicit DpdkPacket(struct rte_mbuf* mbuf, void* data);
     explicit DpdkPacket(OverflowBuffer* overflowBuf);
 
+    static DpdkPacket* fromMbuf(struct rte_mbuf* mbuf, void* data);
+
     /// see Driver::Packet::getMaxPayloadSize()
     virtual uint16_t getMaxPayloadSize()
     {
@@ -133,6 +133,26 @@ class DpdkDriverImpl::DpdkPacket : public Driver::Packet {
     DpdkPacket& operator=(const DpdkPacket&) = delete;
 };
 
+/**
+ * Allocated to store packet data when mbufs are not available.
+ */
+struct DpdkDriverImpl::OverflowBuffer {
+    /// Construct an OverflowBuffer along with the Packet that refers to it.
+    OverflowBuffer()
+        : packet(this)
+        , data()
+    {}
+
+    /// Packet object backed by this buffer.
+    DpdkPacket packet;
+
+    /// Array of bytes used to store a packet's payload.
+    char data[MAX_PAYLOAD_SIZE];
+};
+
+// DPDK requires the mbuf private area size to be a multiple of 8 bytes.
+const uint16_t DpdkDriverImpl::MBUF_PRIV_SIZE = (sizeof(DpdkPacket) + 7) & ~7;
+
 /**
  * Construct a DpdkPacket backed by a DPDK mbuf.
  *
@@ -163,6 +183,22 @@ DpdkDriverImpl::DpdkPacket::DpdkPacket(OverflowBuffer* overflowBuf)
     bufRef.overflowBuf = overflowBuf;
 }
 
+/**
+ * Construct the DpdkPacket for an mbuf in the mbuf's private area.  The
+ * DpdkPacket shares the mbuf's lifetime; it is released by freeing the mbuf.
+ *
+ * @param mbuf
+ *      Pointer to a DPDK mbuf allocated from the driver's mbufPool.
+ * @param data
+ *      Memory location in the mbuf where the packet data should be stored.
+ */
+DpdkDriverImpl::DpdkPacket*
+DpdkDriverImpl::DpdkPacket::fromMbuf(struct rte_mbuf* mbuf, void* data)
+{
+    assert(mbuf->priv_size >= sizeof(DpdkPacket));
+    return new (rte_mbuf_to_priv(mbuf)) DpdkPacket(mbuf, data);
+}
+
 /**
  * Construct a DpdkDriverImpl.
  *
@@ -172,12 +208,14 @@ DpdkDriverImpl::DpdkPacket::DpdkPacket(OverflowBuffer* overflowBuf)
  *
  * @param port
  *      Selects which physical port to use for communication.
+ * @param numQueues
+ *      Number of receive/transmit queue pairs to open on the NIC.
  * @throw DriverInitFailure
  *      Thrown if DpdkDriverImpl fails to initialize for any reason.
  */
-DpdkDriverImpl::DpdkDriverImpl(int port)
+DpdkDriverImpl::DpdkDriverImpl(int port, uint16_t numQueues)
     : DpdkDriverImpl(port, default_eal_argc,
-                     const_cast<char**>(default_eal_argv))
+                     const_cast<char**>(default_eal_argv), numQueues)
 {}
 
 /**
@@ -198,21 +236,22 @@ DpdkDriverImpl::DpdkDriverImpl(int port)
  *      Parameter passed to rte_eal_init().
  * @param argv
  *      Parameter passed to rte_eal_init().
+ * @param numQueues
+ *      Number of receive/transmit queue pairs to open on the NIC.
  * @throw DriverInitFailure
  *      Thrown if DpdkDriverImpl fails to initialize for any reason.
  */
-DpdkDriverImpl::DpdkDriverImpl(int port, int argc, char* argv[])
-    : addressLock()
-    , addressCache()
-    , packetLock()
-    , packetPool()
+DpdkDriverImpl::DpdkDriverImpl(int port, int argc, char* argv[],
+                               uint16_t numQueues)
+    : addressTable()
+    , overflowLock()
     , overflowBufferPool()
     , localMac()
     , portId(0)
     , mbufPool(nullptr)
     , loopbackRing(nullptr)
-    , rxLock()
-    , txLock()
+    , numQueues(1)  // Set by _init()
+    , queueLocks()
     , hasTxLockFreeSupport(false)  // Set later if applicable
     , hasHardwareFilter(true)      // Cleared later if not applicable
     , bandwidthMbps(10000)         // Default bandwidth = 10 gbs
@@ -233,7 +272,7 @@ DpdkDriverImpl::DpdkDriverImpl(int port, int argc, char* argv[])
     }
 
     _eal_init(argc, argv);
-    _init(port);
+    _init(port, numQueues);
 
     // restore the original thread affinity
     s = pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpuset);
@@ -256,27 +295,28 @@ DpdkDriverImpl::DpdkDriverImpl(int port, int argc, char* argv[])
  * @param _
  *      Parameter is used only to define this constructors alternate
  *      signature.
+ * @param numQueues
+ *      Number of receive/transmit queue pairs to open on the NIC.
  * @throw DriverInitFailure
  *      Thrown if DpdkDriverImpl fails to initialize for any reason.
  */
 DpdkDriverImpl::DpdkDriverImpl(int port,
-                               __attribute__((__unused__)) NoEalInit _)
-    : addressLock()
-    , addressCache()
-    , packetLock()
-    , packetPool()
+                               __attribute__((__unused__)) NoEalInit _,
+                               uint16_t numQueues)
+    : addressTable()
+    , overflowLock()
     , overflowBufferPool()
     , localMac()
     , portId(0)
     , mbufPool(nullptr)
     , loopbackRing(nullptr)
-    , rxLock()
-    , txLock()
+    , numQueues(1)  // Set by _init()
+    , queueLocks()
     , hasTxLockFreeSupport(false)  // Set later if applicable
     , hasHardwareFilter(true)      // Cleared later if not applicable
     , bandwidthMbps(10000)         // Default bandwidth = 10 gbs
 {
-    _init(port);
+    _init(port, numQueues);
 }
 
 /**
@@ -296,28 +336,19 @@ DpdkDriverImpl::~DpdkDriverImpl()
 Driver::Address*
 DpdkDriverImpl::getAddress(std::string const* const addressString)
 {
-    SpinLock::Lock lock(addressLock);
-
-    Driver::Address* addr;
-
-    auto it = addressCache.find(*addressString);
-    if (it == addressCache.end()) {
-        MacAddress* macAddr = new MacAddress(addressString->c_str());
-        addressCache[*addressString] = macAddr;
-        addr = macAddr;
-    } else {
-        addr = it->second;
-    }
-
-    return addr;
+    Driver::Address::Raw raw;
+    MacAddress(addressString->c_str()).toRaw(&raw);
+    return addressTable.get(raw);
 }
 
 // See Driver::getAddress()
 Driver::Address*
 DpdkDriverImpl::getAddress(Driver::Address::Raw const* const rawAddress)
 {
-    std::string addressString = MacAddress(rawAddress).toString();
-    return getAddress(&addressString);
+    // Re-serialize so that bytes unused by the MAC format are zeroed.
+    Driver::Address::Raw raw;
+    MacAddress(rawAddress).toRaw(&raw);
+    return addressTable.get(raw);
 }
 
 // See Driver::allocPacket()
@@ -326,20 +357,59 @@ DpdkDriverImpl::allocPacket()
 {
     DpdkPacket* packet = _allocMbufPacket();
     if (unlikely(packet == nullptr)) {
-        SpinLock::Lock lock(packetLock);
-        OverflowBuffer* buf = overflowBufferPool.construct();
-        packet = packetPool.construct(buf);
+        SpinLock::Lock lock(overflowLock);
+        packet = &overflowBufferPool.construct()->packet;
         NOTICE("OverflowBuffer used.");
     }
     return packet;
 }
 
+// See Driver::allocPackets()
+void
+DpdkDriverImpl::allocPackets(Packet* packets[], uint16_t numPackets)
+{
+    constexpr uint16_t MAX_BURST = 32;
+    struct rte_mbuf* mbufs[MAX_BURST];
+    uint16_t numAllocated = 0;
+
+    while (numAllocated < numPackets) {
+        uint16_t burst = std::min(MAX_BURST, Util::downCast<uint16_t>(
+                                                 numPackets - numAllocated));
+        if (unlikely(rte_mempool_avail_count(mbufPool) <=
+                         NB_MBUF_RESERVED + burst ||
+                     rte_pktmbuf_alloc_bulk(mbufPool, mbufs, burst) != 0)) {
+            // Not enough mbufs left for the whole burst; allocate the rest one
+            // at a time so that overflow buffers are used once mbufs run out.
+            while (numAllocated < numPackets) {
+                packets[numAllocated++] = allocPacket();
+            }
+            return;
+        }
+
+        for (uint16_t i = 0; i < burst; ++i) {
+            char* buf = rte_pktmbuf_append(
+                mbufs[i],
+                Util::downCast<uint16_t>(PACKET_HDR_LEN + MAX_PAYLOAD_SIZE));
+            if (unlikely(NULL == buf)) {
+                NOTICE("rte_pktmbuf_append call failed; OverflowBuffer used.");
+                rte_pktmbuf_free(mbufs[i]);
+                SpinLock::Lock lock(overflowLock);
+                packets[numAllocated++] =
+                    &overflowBufferPool.construct()->packet;
+            } else {
+                packets[numAllocated++] =
+                    DpdkPacket::fromMbuf(mbufs[i], buf + PACKET_HDR_LEN);
+            }
+        }
+    }
+}
+
 // See Driver::sendPackets()
 void
 DpdkDriverImpl::sendPackets(Packet* packets[], uint16_t numPackets)
 {
     constexpr uint16_t MAX_BURST = 32;
-    uint16_t nb_pkts;
+    uint16_t nb_pkts = 0;
     struct rte_mbuf* tx_pkts[MAX_BURST];
 
     // Process each packet
@@ -465,11 +535,24 @@ DpdkDriverImpl::receivePackets(uint32_t maxPackets, Packet* receivedPackets[])
     // attempt to dequeue a batch of received packets from the NIC
     // as well as from the loopback ring.
     uint32_t incomingPkts = 0;
+    uint16_t homeQueue = _getQueueId();
     {
-        SpinLock::Lock lock(rxLock);
-        incomingPkts = rte_eth_rx_burst(portId, 0, mPkts,
+        SpinLock::Lock lock(queueLocks[homeQueue].rxLock);
+        incomingPkts = rte_eth_rx_burst(portId, homeQueue, mPkts,
                                         Util::downCast<uint16_t>(maxPackets));
     }
+    // The NIC may not spread packets evenly (or at all) across the queues and
+    // some queues may not have a thread of their own; help out with the other
+    // queues that no other thread is currently polling.
+    for (uint16_t i = 1; i < numQueues && incomingPkts == 0; ++i) {
+        uint16_t queue = (homeQueue + i) % numQueues;
+        std::unique_lock<SpinLock> lock(queueLocks[queue].rxLock,
+                                        std::try_to_lock);
+        if (lock.owns_lock()) {
+            incomingPkts = rte_eth_rx_burst(
+                portId, queue, mPkts, Util::downCast<uint16_t>(maxPackets));
+        }
+    }
 
     uint32_t loopbackPkts = rte_ring_count(loopbackRing);
     if (incomingPkts + loopbackPkts > maxPackets) {
@@ -531,11 +614,7 @@ DpdkDriverImpl::receivePackets(uint32_t maxPackets, Packet* receivedPackets[])
         uint32_t length = rte_pktmbuf_pkt_len(m) - headerLength;
         assert(length <= MAX_PAYLOAD_SIZE);
 
-        DpdkPacket* packet = nullptr;
-        {
-            SpinLock::Lock lock(packetLock);
-            packet = packetPool.construct(m, payload);
-        }
+        DpdkPacket* packet = DpdkPacket::fromMbuf(m, payload);
         packet->address = sender;
         packet->length = length;
 
@@ -550,14 +629,14 @@ void
 DpdkDriverImpl::releasePackets(Packet* packets[], uint16_t numPackets)
 {
     for (uint16_t i = 0; i < numPackets; ++i) {
-        SpinLock::Lock lock(packetLock);
         DpdkPacket* packet = static_cast<DpdkPacket*>(packets[i]);
         if (likely(packet->bufType == DpdkPacket::MBUF)) {
+            // The DpdkPacket lives in the mbuf and is released along with it.
             rte_pktmbuf_free(packet->bufRef.mbuf);
         } else {
+            SpinLock::Lock lock(overflowLock);
             overflowBufferPool.destroy(packet->bufRef.overflowBuf);
         }
-        packetPool.destroy(packet);
     }
 }
 
@@ -625,9 +704,12 @@ DpdkDriverImpl::_eal_init(int argc, char* argv[])
  *
  * @param port
  *      Selects which physical port to use for communication.
+ * @param requestedQueues
+ *      Number of receive/transmit queue pairs to open on the NIC; fewer are
+ *      opened if the NIC doesn't support this many.
  */
 void
-DpdkDriverImpl::_init(int port)
+DpdkDriverImpl::_init(int port, uint16_t requestedQueues)
 {
     struct ether_addr mac;
     uint8_t numPorts;
@@ -642,10 +724,11 @@ DpdkDriverImpl::_init(int port)
 
     NOTICE("Using DPDK version %s", rte_version());
 
-    // create an memory pool for accommodating packet buffers
-    mbufPool =
-        rte_pktmbuf_pool_create(poolName.c_str(), NB_MBUF, MEMPOOL_CACHE_SIZE,
-                                0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+    // create an memory pool for accommodating packet buffers; each mbuf's
+    // private area holds the DpdkPacket that refers to it.
+    mbufPool = rte_pktmbuf_pool_create(
+        poolName.c_str(), NB_MBUF, MEMPOOL_CACHE_SIZE, MBUF_PRIV_SIZE,
+        RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
     if (!mbufPool) {
         throw DriverInitFailure(
             HERE_STR, StringUtil::format(
@@ -667,16 +750,53 @@ DpdkDriverImpl::_init(int port)
     rte_eth_macaddr_get(portId, &mac);
     localMac.construct(mac.addr_bytes);
 
+    rte_eth_dev_info_get(portId, &devInfo);
+
+    // Open one queue pair per requested queue, as far as the NIC allows.
+    numQueues = std::max(requestedQueues, uint16_t(1));
+    numQueues = std::min({numQueues, devInfo.max_rx_queues,
+                          devInfo.max_tx_queues});
+    if (numQueues < requestedQueues) {
+        NOTICE("Port %u only supports %u queues; %u requested", portId,
+               numQueues, requestedQueues);
+    }
+    queueLocks.reset(new QueueLocks[numQueues]);
+
     // configure some default NIC port parameters
     memset(&portConf, 0, sizeof(portConf));
     portConf.rxmode.max_rx_pkt_len = ETHER_MAX_VLAN_FRAME_LEN;
-    rte_eth_dev_configure(portId, 1, 1, &portConf);
+    if (numQueues > 1) {
+        // Homa packets carry no IP header so spread them across the queues
+        // by hashing the Ethernet payload, which starts with the MessageId.
+        portConf.rxmode.mq_mode = ETH_MQ_RX_RSS;
+        portConf.rx_adv_conf.rss_conf.rss_key = NULL;
+        portConf.rx_adv_conf.rss_conf.rss_hf =
+            ETH_RSS_L2_PAYLOAD & devInfo.flow_type_rss_offloads;
+        if (portConf.rx_adv_conf.rss_conf.rss_hf == 0) {
+            NOTICE(
+                "Port %u can't hash Ethernet payloads; incoming packets "
+                "will only use receive queue 0",
+                portId);
+            portConf.rxmode.mq_mode = ETH_MQ_RX_NONE;
+        }
+    }
+    ret = rte_eth_dev_configure(portId, numQueues, numQueues, &portConf);
+    if (ret < 0) {
+        throw DriverInitFailure(
+            HERE_STR,
+            StringUtil::format("Failed to configure %u queues on port %u: %s",
+                               numQueues, portId, rte_strerror(-ret)));
+    }
 
     // Set up a NIC/HW-based filter on the ethernet type so that only
-    // traffic to a particular port is received by this driver.
+    // traffic to a particular port is received by this driver.  The filter
+    // steers all matching packets to a single queue so it is only used if
+    // there is a single queue.
     struct rte_eth_ethertype_filter filter;
     ret = rte_eth_dev_filter_supported(portId, RTE_ETH_FILTER_ETHERTYPE);
-    if (ret < 0) {
+    if (numQueues > 1) {
+        hasHardwareFilter = false;
+    } else if (ret < 0) {
         NOTICE("ethertype filter is not supported on port %u.", portId);
         hasHardwareFilter = false;
     } else {
@@ -690,17 +810,18 @@ DpdkDriverImpl::_init(int port)
     }
 
     // Check if packets can be sent without locks.
-    rte_eth_dev_info_get(portId, &devInfo);
     if (devInfo.tx_offload_capa & DEV_TX_OFFLOAD_MT_LOCKFREE) {
         hasTxLockFreeSupport = true;
     }
 
     // setup and initialize the receive and transmit NIC queues,
     // and activate the port.
-    rte_eth_rx_queue_setup(portId, 0, NDESC, rte_eth_dev_socket_id(portId),
-                           NULL, mbufPool);
-    rte_eth_tx_queue_setup(portId, 0, NDESC, rte_eth_dev_socket_id(portId),
-                           NULL);
+    for (uint16_t queue = 0; queue < numQueues; ++queue) {
+        rte_eth_rx_queue_setup(portId, queue, NDESC,
+                               rte_eth_dev_socket_id(portId), NULL, mbufPool);
+        rte_eth_tx_queue_setup(portId, queue, NDESC,
+                               rte_eth_dev_socket_id(portId), NULL);
+    }
 
     // get the current MTU.
     ret = rte_eth_dev_get_mtu(portId, &mtu);
@@ -766,12 +887,22 @@ DpdkDriverImpl::_init(int port)
 
     NOTICE(
         "DpdkDriverImpl address: %s, bandwidth: %d Mbits/sec, MTU: %u, "
-        "lock-free "
+        "queues: %u, lock-free "
         "tx support: %s",
-        localMac->toString().c_str(), bandwidthMbps, mtu,
+        localMac->toString().c_str(), bandwidthMbps, mtu, numQueues,
         hasTxLockFreeSupport ? "YES" : "NO");
 }
 
+/**
+ * Return the NIC queue pair that the calling thread should use.  Threads are
+ * spread round-robin across the queues by their ThreadId.
+ */
+uint16_t
+DpdkDriverImpl::_getQueueId()
+{
+    return Util::downCast<uint16_t>(ThreadId::getId() % numQueues);
+}
+
 /**
  * Helper function to try to allocation a new DpdkPacket backed by an mbuf.
  *
@@ -782,7 +913,6 @@ DpdkDriverImpl::_init(int port)
 DpdkDriverImpl::DpdkPacket*
 DpdkDriverImpl::_allocMbufPacket()
 {
-    DpdkPacket* packet = nullptr;
     uint32_t numMbufsAvail = rte_mempool_avail_count(mbufPool);
     if (unlikely(numMbufsAvail <= NB_MBUF_RESERVED)) {
         uint32_t numMbufsInUse = rte_mempool_in_use_count(mbufPool);
@@ -814,12 +944,7 @@ DpdkDriverImpl::_allocMbufPacket()
         return nullptr;
     }
 
-    // Perform packet operations with the lock held.
-    {
-        SpinLock::Lock _(packetLock);
-        packet = packetPool.construct(mbuf, buf + PACKET_HDR_LEN);
-    }
-    return packet;
+    return DpdkPacket::fromMbuf(mbuf, buf + PACKET_HDR_LEN);
 }
 
 /**
@@ -836,6 +961,7 @@ DpdkDriverImpl::_sendPackets(struct rte_mbuf* tx_pkts[], uint16_t nb_pkts)
     uint16_t pkts_sent = 0;
     uint32_t attempts = 0;
     uint16_t ret = 0;
+    uint16_t queue = _getQueueId();
     while (pkts_sent < nb_pkts) {
         if (unlikely(attempts++ > 0)) {
             NOTICE(
@@ -844,12 +970,13 @@ DpdkDriverImpl::_sendPackets(struct rte_mbuf* tx_pkts[], uint16_t nb_pkts)
                 ret, attempts, pkts_sent, nb_pkts);
         }
         // calls to rte_eth_tx_burst() may require a software lock.
-        std::unique_lock<SpinLock> lock(txLock, std::defer_lock);
+        std::unique_lock<SpinLock> lock(queueLocks[queue].txLock,
+                                        std::defer_lock);
         if (!hasTxLockFreeSupport) {
             lock.lock();
         }
 
-        ret = rte_eth_tx_burst(portId, 0, &(tx_pkts[pkts_sent]),
+        ret = rte_eth_tx_burst(portId, queue, &(tx_pkts[pkts_sent]),
                                nb_pkts - pkts_sent);
         pkts_sent += ret;
     }
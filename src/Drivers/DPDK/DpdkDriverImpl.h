@@ -24,10 +24,11 @@
 #include "../../ObjectPool.h"
 #include "../../SpinLock.h"
 #include "../../Tub.h"
+#include "../AddressTable.h"
 
 #include "MacAddress.h"
 
-#include <unordered_map>
+#include <memory>
 #include <vector>
 
 // Forward declarations, so we don't have to include DPDK headers here.
@@ -53,10 +54,15 @@ class DpdkDriverImpl : public DpdkDriver {
     class DpdkPacket;
     struct OverflowBuffer;
 
+    /// Number of bytes reserved in each mbuf's private area to hold the
+    /// DpdkPacket that refers to the mbuf.
+    static const uint16_t MBUF_PRIV_SIZE;
+
   public:
-    explicit DpdkDriverImpl(int port);
-    explicit DpdkDriverImpl(int port, int argc, char* argv[]);
-    explicit DpdkDriverImpl(int port, NoEalInit _);
+    explicit DpdkDriverImpl(int port, uint16_t numQueues = 1);
+    explicit DpdkDriverImpl(int port, int argc, char* argv[],
+                            uint16_t numQueues = 1);
+    explicit DpdkDriverImpl(int port, NoEalInit _, uint16_t numQueues = 1);
     virtual ~DpdkDriverImpl();
 
     /// See Driver::getAddress()
@@ -69,6 +75,9 @@ class DpdkDriverImpl : public DpdkDriver {
     /// See Driver::allocPacket()
     virtual Packet* allocPacket();
 
+    /// See Driver::allocPackets()
+    virtual void allocPackets(Packet* packets[], uint16_t numPackets);
+
     /// See Driver::sendPackets()
     virtual void sendPackets(Packet* packets[], uint16_t numPackets);
 
@@ -95,19 +104,13 @@ class DpdkDriverImpl : public DpdkDriver {
     virtual void setLocalAddress(std::string const* const addressString);
 
   private:
-    /// Provides thread safety for Address operations.
-    SpinLock addressLock;
-
     /// Collection of requested DPDK address that can be reused if the same
     /// address is requested again.
-    std::unordered_map<std::string, MacAddress*> addressCache;
+    AddressTable<MacAddress> addressTable;
 
-    /// Provides thread safety for Packet management operations.
-    SpinLock packetLock;
-
-    /// Provides memory allocation for the DPDK specific implentation of a
-    /// Driver Packet.
-    ObjectPool<DpdkPacket> packetPool;
+    /// Provides thread safety for overflowBufferPool.  Packets backed by mbufs
+    /// live in the mbuf's private area and need no locking.
+    SpinLock overflowLock;
 
     /// Provides memory allocation for packet storage when mbuf are running out.
     ObjectPool<OverflowBuffer> overflowBufferPool;
@@ -126,11 +129,24 @@ class DpdkDriverImpl : public DpdkDriver {
     /// the HW queues.
     struct rte_ring* loopbackRing;
 
-    /// Provides thread safety for receive (rx) operations.
-    SpinLock rxLock;
-
-    /// Provides thread safte for transmit (tx) operations.
-    SpinLock txLock;
+    /**
+     * Serializes access to one of the NIC's receive/transmit queue pairs
+     * among the threads that share it.
+     */
+    struct QueueLocks {
+        /// Provides thread safety for receive (rx) operations on the queue.
+        SpinLock rxLock;
+        /// Provides thread safety for transmit (tx) operations on the queue.
+        SpinLock txLock;
+        /// Keeps the locks of different queues in different cache lines.
+        char padding[64];
+    };
+
+    /// Number of receive/transmit queue pairs opened on the NIC.
+    uint16_t numQueues;
+
+    /// Locks for each of the numQueues queue pairs.
+    std::unique_ptr<QueueLocks[]> queueLocks;
 
     /// NIC allows queuing of transmit packets without holding a software lock.
     bool hasTxLockFreeSupport;
@@ -142,7 +158,8 @@ class DpdkDriverImpl : public DpdkDriver {
     uint32_t bandwidthMbps;
 
     void _eal_init(int argc, char* argv[]);
-    void _init(int port);
+    void _init(int port, uint16_t requestedQueues);
+    uint16_t _getQueueId();
     DpdkPacket* _allocMbufPacket();
     void _sendPackets(struct rte_mbuf* tx_pkts[], uint16_t nb_pkts);
 
@@ -102,6 +102,7 @@ inline void
 MacAddress::toRaw(Raw* raw) const
 {
     assert(sizeof(raw->bytes) >= 6);
+    memset(raw, 0, sizeof(*raw));
     memcpy(raw->bytes, address, 6);
     raw->type = RawAddressType::MAC;
 }
@@ -55,6 +55,7 @@ TEST(MacAddressTest, toString)
 TEST(MacAddressTest, toRaw)
 {
     Driver::Address::Raw raw;
+    memset(&raw, 0xff, sizeof(raw));
     MacAddress("de:ad:be:ef:98:76").toRaw(&raw);
     EXPECT_EQ(RawAddressType::MAC, raw.type);
     EXPECT_EQ(0xde, raw.bytes[0]);
@@ -63,6 +64,8 @@ TEST(MacAddressTest, toRaw)
     EXPECT_EQ(0xef, raw.bytes[3]);
     EXPECT_EQ(0x98, raw.bytes[4]);
     EXPECT_EQ(0x76, raw.bytes[5]);
+    EXPECT_EQ(0x00, raw.bytes[6]);
+    EXPECT_EQ(0x00, raw.bytes[18]);
 }
 
 TEST(MacAddressTest, isNull)
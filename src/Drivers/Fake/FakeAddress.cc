@@ -21,6 +21,7 @@
 #include "../RawAddressType.h"
 
 #include <cstdlib>
+#include <cstring>
 
 namespace Homa {
 namespace Drivers {
@@ -87,6 +88,7 @@ FakeAddress::toString() const
 inline void
 FakeAddress::toRaw(Raw* raw) const
 {
+    memset(raw, 0, sizeof(*raw));
     raw->type = RawAddressType::FAKE;
     uint64_t* addr = reinterpret_cast<uint64_t*>(raw->bytes);
     *addr = address;
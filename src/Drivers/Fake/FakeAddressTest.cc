@@ -64,6 +64,17 @@ TEST(FakeAddressTest, toString)
     // tested sufficiently in constructor tests
 }
 
+TEST(FakeAddressTest, toRaw)
+{
+    Driver::Address::Raw raw;
+    memset(&raw, 0xff, sizeof(raw));
+    FakeAddress(42).toRaw(&raw);
+    EXPECT_EQ(RawAddressType::FAKE, raw.type);
+    EXPECT_EQ(42U, *reinterpret_cast<uint64_t*>(raw.bytes));
+    EXPECT_EQ(0U, raw.bytes[8]);
+    EXPECT_EQ(0U, raw.bytes[18]);
+}
+
 TEST(FakeAddressTest, toAddressId)
 {
     EXPECT_THROW(FakeAddress::toAddressId("D42"), BadAddress);
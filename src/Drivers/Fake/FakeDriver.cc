@@ -17,6 +17,8 @@
 
 #include "FakeAddress.h"
 
+#include "../AddressTable.h"
+
 #include <atomic>
 #include <cstring>
 #include <unordered_map>
@@ -35,14 +37,15 @@ static struct FakeNetwork {
     /// Holds all the packets being sent through the fake network.
     std::unordered_map<uint64_t, FakeNIC*> network;
 
-    /// Collection of FakeAddress objects that can be reused.
-    std::unordered_map<uint64_t, FakeAddress*> addressCache;
+    /// Collection of FakeAddress objects that can be reused; does not need
+    /// the mutex.
+    AddressTable<FakeAddress> addressTable;
 
     /// Constructor.
     FakeNetwork()
         : mutex()
         , network()
-        , addressCache()
+        , addressTable()
     {}
 
     /// Destructor;
@@ -52,25 +55,14 @@ static struct FakeNetwork {
         for (auto it = network.begin(); it != network.end(); ++it) {
             delete it->second;
         }
-        // Clean up addressCache
-        for (auto it = addressCache.begin(); it != addressCache.end(); ++it) {
-            delete it->second;
-        }
     }
 
     /// Return a pointer to a FakeAddress for a given addressId.
     FakeAddress* getAddress(uint64_t addressId)
     {
-        FakeAddress* addr;
-        auto it = addressCache.find(addressId);
-        if (it == addressCache.end()) {
-            FakeAddress* fakeAddr = new FakeAddress(addressId);
-            addressCache[addressId] = fakeAddr;
-            addr = fakeAddr;
-        } else {
-            addr = it->second;
-        }
-        return addr;
+        Driver::Address::Raw raw;
+        FakeAddress(addressId).toRaw(&raw);
+        return addressTable.get(raw);
     }
 
 } fakeNetwork;
@@ -108,6 +100,8 @@ FakeNIC::~FakeNIC()
 FakeDriver::FakeDriver()
     : localAddressId()
     , nic()
+    , packetPoolMutex()
+    , packetPool()
 {
     std::lock_guard<std::mutex> lock(fakeNetwork.mutex);
     localAddressId = nextAddressId.fetch_add(1);
@@ -119,8 +113,13 @@ FakeDriver::FakeDriver()
  */
 FakeDriver::~FakeDriver()
 {
-    std::lock_guard<std::mutex> lock_network(fakeNetwork.mutex);
-    fakeNetwork.network.erase(localAddressId);
+    {
+        std::lock_guard<std::mutex> lock_network(fakeNetwork.mutex);
+        fakeNetwork.network.erase(localAddressId);
+    }
+    for (FakePacket* packet : packetPool) {
+        delete packet;
+    }
 }
 
 /**
@@ -129,7 +128,6 @@ FakeDriver::~FakeDriver()
 Driver::Address*
 FakeDriver::getAddress(std::string const* const addressString)
 {
-    std::lock_guard<std::mutex> lock(fakeNetwork.mutex);
     uint64_t addressId = FakeAddress::toAddressId(addressString->c_str());
     return fakeNetwork.getAddress(addressId);
 }
@@ -140,7 +138,6 @@ FakeDriver::getAddress(std::string const* const addressString)
 Driver::Address*
 FakeDriver::getAddress(Driver::Address::Raw const* const rawAddress)
 {
-    std::lock_guard<std::mutex> lock(fakeNetwork.mutex);
     FakeAddress address(rawAddress);
     return fakeNetwork.getAddress(address.address);
 }
@@ -151,11 +148,34 @@ FakeDriver::getAddress(Driver::Address::Raw const* const rawAddress)
 Driver::Packet*
 FakeDriver::allocPacket()
 {
-    std::lock_guard<std::mutex> lock(fakeNetwork.mutex);
-    FakePacket* packet = new FakePacket();
+    Packet* packet;
+    allocPackets(&packet, 1);
     return packet;
 }
 
+/**
+ * See Driver::allocPackets()
+ */
+void
+FakeDriver::allocPackets(Packet* packets[], uint16_t numPackets)
+{
+    uint16_t numPooled = 0;
+    {
+        std::lock_guard<std::mutex> lock(packetPoolMutex);
+        while (numPooled < numPackets && !packetPool.empty()) {
+            FakePacket* packet = packetPool.back();
+            packetPool.pop_back();
+            packet->address = nullptr;
+            packet->priority = 0;
+            packet->length = 0;
+            packets[numPooled++] = packet;
+        }
+    }
+    for (uint16_t i = numPooled; i < numPackets; ++i) {
+        packets[i] = new FakePacket();
+    }
+}
+
 /**
  * See Driver::sendPackets()
  */
@@ -211,9 +231,9 @@ FakeDriver::receivePackets(uint32_t maxPackets, Packet* receivedPackets[])
 void
 FakeDriver::releasePackets(Packet* packets[], uint16_t numPackets)
 {
+    std::lock_guard<std::mutex> lock(packetPoolMutex);
     for (uint16_t i = 0; i < numPackets; ++i) {
-        FakePacket* packet = static_cast<FakePacket*>(packets[i]);
-        delete packet;
+        packetPool.push_back(static_cast<FakePacket*>(packets[i]));
     }
 }
 
@@ -250,7 +270,6 @@ FakeDriver::getBandwidth()
 Driver::Address*
 FakeDriver::getLocalAddress()
 {
-    std::lock_guard<std::mutex> lock(fakeNetwork.mutex);
     return fakeNetwork.getAddress(localAddressId);
 }
 
@@ -21,6 +21,7 @@
 #include <array>
 #include <deque>
 #include <mutex>
+#include <vector>
 
 namespace Homa {
 namespace Drivers {
@@ -107,6 +108,7 @@ class FakeDriver : public Driver {
     Address* getAddress(std::string const* const addressString);
     Address* getAddress(Driver::Address::Raw const* const rawAddress);
     Packet* allocPacket();
+    void allocPackets(Packet* packets[], uint16_t numPackets);
     void sendPackets(Packet* packets[], uint16_t numPackets);
     uint32_t receivePackets(uint32_t maxPackets, Packet* receivedPackets[]);
     void releasePackets(Packet* packets[], uint16_t numPackets);
@@ -122,6 +124,13 @@ class FakeDriver : public Driver {
     /// Holds the incomming packets for this driver.
     FakeNIC nic;
 
+    /// Protects packetPool.
+    std::mutex packetPoolMutex;
+
+    /// Released FakePacket objects that can be handed out again by
+    /// allocPacket() and allocPackets() without going back to the heap.
+    std::vector<FakePacket*> packetPool;
+
     // Disable copy and assign
     FakeDriver(const FakeDriver&) = delete;
     FakeDriver& operator=(const FakeDriver&) = delete;
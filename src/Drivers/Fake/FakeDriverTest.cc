@@ -61,6 +61,28 @@ TEST(FakeDriverTest, allocPacket)
     delete packet;
 }
 
+TEST(FakeDriverTest, allocPackets)
+{
+    FakeDriver driver;
+    Driver::Packet* packets[3];
+    driver.allocPackets(packets, 3);
+    packets[0]->length = 42;
+    packets[0]->priority = 3;
+    packets[0]->address = driver.getLocalAddress();
+    driver.releasePackets(packets, 3);
+    EXPECT_EQ(3U, driver.packetPool.size());
+
+    // Released packets are reused and reset.
+    Driver::Packet* reused[4];
+    driver.allocPackets(reused, 4);
+    EXPECT_EQ(0U, driver.packetPool.size());
+    EXPECT_EQ(packets[0], reused[2]);
+    EXPECT_EQ(0U, reused[2]->length);
+    EXPECT_EQ(0, reused[2]->priority);
+    EXPECT_EQ(nullptr, reused[2]->address);
+    driver.releasePackets(reused, 4);
+}
+
 TEST(FakeDriverTest, sendPackets)
 {
     FakeDriver driver1;
@@ -0,0 +1,454 @@
+/* Copyright (c) 2019, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_CORE_FLATMAP_H
+#define HOMA_CORE_FLATMAP_H
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace Homa {
+namespace Core {
+
+/**
+ * FlatMap is an open-addressing hash table in the style of Abseil's
+ * SwissTable.  Entries are stored inline in a single array; a parallel array
+ * of one-byte control words records whether each slot is empty, deleted, or
+ * full and, for full slots, 7 bits of the entry's hash.  Lookups compare a
+ * whole group of GROUP_SIZE control words at once (with SSE2 when available)
+ * and only touch the entries whose hash bits match.
+ *
+ * The interface is the subset of std::unordered_map used by the transport.
+ * Any insertion may invalidate iterators and references to entries; erase
+ * invalidates only iterators to the erased entry.
+ *
+ * This class is NOT thread-safe.
+ */
+template <typename Key, typename Value, typename Hash>
+class FlatMap {
+  public:
+    typedef std::pair<const Key, Value> value_type;
+
+    /**
+     * Iterates over the entries of a FlatMap in no particular order.
+     */
+    class iterator {
+      public:
+        value_type& operator*() const
+        {
+            return *map->slotAt(index);
+        }
+
+        value_type* operator->() const
+        {
+            return map->slotAt(index);
+        }
+
+        iterator& operator++()
+        {
+            index = map->nextFull(index + 1);
+            return *this;
+        }
+
+        bool operator==(const iterator& other) const
+        {
+            return map == other.map && index == other.index;
+        }
+
+        bool operator!=(const iterator& other) const
+        {
+            return !(*this == other);
+        }
+
+      private:
+        iterator(FlatMap* map, size_t index)
+            : map(map)
+            , index(index)
+        {}
+
+        /// Map over which this iterator iterates.
+        FlatMap* map;
+        /// Slot to which this iterator refers; capacity for end().
+        size_t index;
+
+        friend class FlatMap;
+    };
+
+    FlatMap()
+        : ctrl(nullptr)
+        , slots(nullptr)
+        , capacity(0)
+        , numEntries(0)
+        , growthLeft(0)
+        , hasher()
+    {}
+
+    ~FlatMap()
+    {
+        clear();
+        delete[] ctrl;
+        delete[] slots;
+    }
+
+    /// Return an iterator to the first entry.
+    iterator begin()
+    {
+        return iterator(this, nextFull(0));
+    }
+
+    /// Return an iterator past the last entry.
+    iterator end()
+    {
+        return iterator(this, capacity);
+    }
+
+    /// Return the number of entries in the map.
+    size_t size() const
+    {
+        return numEntries;
+    }
+
+    /// Return true if the map has no entries.
+    bool empty() const
+    {
+        return numEntries == 0;
+    }
+
+    /**
+     * Return an iterator to the entry with the given key or end() if there is
+     * no such entry.
+     */
+    iterator find(const Key& key)
+    {
+        return iterator(this, findIndex(key, hasher(key)));
+    }
+
+    /// Return 1 if the map contains an entry with the given key; 0, otherwise.
+    size_t count(const Key& key) const
+    {
+        return findIndex(key, hasher(key)) != capacity ? 1 : 0;
+    }
+
+    /**
+     * Insert an entry unless one with the same key already exists.
+     *
+     * @return
+     *      An iterator to the entry with the key and true if the entry was
+     *      inserted or false if an entry with the key was already present.
+     */
+    std::pair<iterator, bool> insert(const value_type& entry)
+    {
+        size_t hash = hasher(entry.first);
+        size_t index = findIndex(entry.first, hash);
+        if (index != capacity) {
+            return {iterator(this, index), false};
+        }
+        if (capacity == 0) {
+            rehash();
+        }
+        index = findFree(hash);
+        if (growthLeft == 0 && ctrl[index] == EMPTY) {
+            rehash();
+            index = findFree(hash);
+        }
+        if (ctrl[index] == EMPTY) {
+            growthLeft--;
+        }
+        new (&slots[index]) value_type(entry);
+        ctrl[index] = static_cast<int8_t>(h2(hash));
+        numEntries++;
+        return {iterator(this, index), true};
+    }
+
+    /**
+     * Remove the entry to which the iterator refers.
+     */
+    void erase(iterator it)
+    {
+        assert(it.map == this && it.index < capacity);
+        size_t index = it.index;
+        slotAt(index)->~value_type();
+        numEntries--;
+        // A probe only continues past a group that has no EMPTY slots; if
+        // this group already has one, no probe can depend on this slot being
+        // occupied and it can be marked EMPTY rather than DELETED.
+        size_t group = index & ~(GROUP_SIZE - 1);
+        if (Group(&ctrl[group]).matchEmpty() != 0) {
+            ctrl[index] = EMPTY;
+            growthLeft++;
+        } else {
+            ctrl[index] = DELETED;
+        }
+    }
+
+    /**
+     * Remove the entry with the given key, if any.
+     *
+     * @return
+     *      Number of entries removed (0 or 1).
+     */
+    size_t erase(const Key& key)
+    {
+        iterator it = find(key);
+        if (it == end()) {
+            return 0;
+        }
+        erase(it);
+        return 1;
+    }
+
+    /// Remove all entries; memory is retained for reuse.
+    void clear()
+    {
+        for (size_t i = 0; i < capacity; ++i) {
+            if (ctrl[i] >= 0) {
+                slotAt(i)->~value_type();
+            }
+            ctrl[i] = EMPTY;
+        }
+        numEntries = 0;
+        growthLeft = maxEntries(capacity);
+    }
+
+  private:
+    /// Number of control words compared together; also the minimum capacity.
+    static const size_t GROUP_SIZE = 16;
+
+    /// Control word for a slot that has never held an entry since the last
+    /// rehash.  Control words for full slots are non-negative.
+    static const int8_t EMPTY = -128;
+
+    /// Control word for a slot whose entry was erased.
+    static const int8_t DELETED = -2;
+
+    /// Raw storage for one entry.
+    typedef typename std::aligned_storage<sizeof(value_type),
+                                          alignof(value_type)>::type Slot;
+
+    /**
+     * Matches control words in a group of GROUP_SIZE slots; each match method
+     * returns a bitmask with bit i set if slot i of the group matches.
+     */
+    struct Group {
+#if defined(__SSE2__)
+        explicit Group(const int8_t* pos)
+            : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos)))
+        {}
+
+        uint32_t match(int8_t hash) const
+        {
+            return static_cast<uint32_t>(
+                _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(hash), ctrl)));
+        }
+
+        uint32_t matchEmpty() const
+        {
+            return match(EMPTY);
+        }
+
+        uint32_t matchEmptyOrDeleted() const
+        {
+            // EMPTY and DELETED are the only control words with the sign bit.
+            return static_cast<uint32_t>(_mm_movemask_epi8(ctrl));
+        }
+
+        __m128i ctrl;
+#else
+        explicit Group(const int8_t* pos)
+            : ctrl(pos)
+        {}
+
+        uint32_t match(int8_t hash) const
+        {
+            uint32_t mask = 0;
+            for (size_t i = 0; i < GROUP_SIZE; ++i) {
+                mask |= static_cast<uint32_t>(ctrl[i] == hash) << i;
+            }
+            return mask;
+        }
+
+        uint32_t matchEmpty() const
+        {
+            return match(EMPTY);
+        }
+
+        uint32_t matchEmptyOrDeleted() const
+        {
+            uint32_t mask = 0;
+            for (size_t i = 0; i < GROUP_SIZE; ++i) {
+                mask |= static_cast<uint32_t>(ctrl[i] < 0) << i;
+            }
+            return mask;
+        }
+
+        const int8_t* ctrl;
+#endif
+    };
+
+    /// Hash bits used to select the first group to probe.
+    static size_t h1(size_t hash)
+    {
+        return hash >> 7;
+    }
+
+    /// Hash bits stored in the control word of a full slot.
+    static int8_t h2(size_t hash)
+    {
+        return static_cast<int8_t>(hash & 0x7F);
+    }
+
+    /// Maximum number of entries (including DELETED slots) in a table with
+    /// the given capacity; keeps the load factor at or below 7/8.
+    static size_t maxEntries(size_t capacity)
+    {
+        return capacity - capacity / 8;
+    }
+
+    value_type* slotAt(size_t index) const
+    {
+        return reinterpret_cast<value_type*>(&slots[index]);
+    }
+
+    /// Return the index of the first full slot at or after index.
+    size_t nextFull(size_t index) const
+    {
+        while (index < capacity && ctrl[index] < 0) {
+            index++;
+        }
+        return index;
+    }
+
+    /**
+     * Return the index of the entry with the given key or capacity if there
+     * is no such entry.  Groups are probed in triangular order, which visits
+     * every group since the number of groups is a power of two; the probe
+     * ends at the first group with an EMPTY slot.
+     */
+    size_t findIndex(const Key& key, size_t hash) const
+    {
+        if (capacity == 0) {
+            return capacity;
+        }
+        size_t groupMask = capacity / GROUP_SIZE - 1;
+        size_t group = h1(hash) & groupMask;
+        int8_t tag = h2(hash);
+        for (size_t i = 1;; ++i) {
+            size_t base = group * GROUP_SIZE;
+            Group g(&ctrl[base]);
+            for (uint32_t mask = g.match(tag); mask != 0; mask &= mask - 1) {
+                size_t index = base + __builtin_ctz(mask);
+                if (slotAt(index)->first == key) {
+                    return index;
+                }
+            }
+            if (g.matchEmpty() != 0) {
+                return capacity;
+            }
+            group = (group + i) & groupMask;
+        }
+    }
+
+    /**
+     * Return the index of the first EMPTY or DELETED slot in the probe
+     * sequence for the given hash.  The table must have been allocated.
+     */
+    size_t findFree(size_t hash) const
+    {
+        size_t groupMask = capacity / GROUP_SIZE - 1;
+        size_t group = h1(hash) & groupMask;
+        for (size_t i = 1;; ++i) {
+            size_t base = group * GROUP_SIZE;
+            uint32_t mask = Group(&ctrl[base]).matchEmptyOrDeleted();
+            if (mask != 0) {
+                return base + __builtin_ctz(mask);
+            }
+            group = (group + i) & groupMask;
+        }
+    }
+
+    /**
+     * Rebuild the table, doubling its capacity unless enough of the used
+     * space is held by DELETED slots that reclaiming them is sufficient.
+     */
+    void rehash()
+    {
+        size_t newCapacity = capacity;
+        if (capacity == 0) {
+            newCapacity = GROUP_SIZE;
+        } else if (numEntries >= maxEntries(capacity) / 2) {
+            newCapacity = capacity * 2;
+        }
+
+        int8_t* oldCtrl = ctrl;
+        Slot* oldSlots = slots;
+        size_t oldCapacity = capacity;
+
+        ctrl = new int8_t[newCapacity];
+        slots = new Slot[newCapacity];
+        capacity = newCapacity;
+        for (size_t i = 0; i < capacity; ++i) {
+            ctrl[i] = EMPTY;
+        }
+        growthLeft = maxEntries(capacity) - numEntries;
+
+        for (size_t i = 0; i < oldCapacity; ++i) {
+            if (oldCtrl[i] < 0) {
+                continue;
+            }
+            value_type* entry = reinterpret_cast<value_type*>(&oldSlots[i]);
+            size_t hash = hasher(entry->first);
+            size_t index = findFree(hash);
+            new (&slots[index]) value_type(std::move(*entry));
+            ctrl[index] = h2(hash);
+            entry->~value_type();
+        }
+        delete[] oldCtrl;
+        delete[] oldSlots;
+    }
+
+    /// Control word for each slot.
+    int8_t* ctrl;
+
+    /// Storage for the entries; slot i is valid only if ctrl[i] >= 0.
+    Slot* slots;
+
+    /// Number of slots; 0 or a power of two no smaller than GROUP_SIZE.
+    size_t capacity;
+
+    /// Number of entries in the map.
+    size_t numEntries;
+
+    /// Number of EMPTY slots that can still be filled before a rehash.
+    size_t growthLeft;
+
+    /// Computes the hash of a key.
+    Hash hasher;
+
+    FlatMap(const FlatMap&) = delete;
+    FlatMap& operator=(const FlatMap&) = delete;
+};
+
+}  // namespace Core
+}  // namespace Homa
+
+#endif  // HOMA_CORE_FLATMAP_H
@@ -0,0 +1,218 @@
+/* Copyright (c) 2019, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include "FlatMap.h"
+
+#include <set>
+
+#include "Protocol.h"
+
+namespace Homa {
+namespace Core {
+namespace {
+
+/// Sends every key to the same group so that probing is exercised.
+struct ConstantHasher {
+    size_t operator()(int key) const
+    {
+        return 0x80 | (key & 0x1);
+    }
+};
+
+typedef FlatMap<int, int, std::hash<int>> IntMap;
+typedef FlatMap<int, int, ConstantHasher> CollidingMap;
+
+TEST(FlatMapTest, constructor)
+{
+    IntMap map;
+    EXPECT_EQ(0U, map.size());
+    EXPECT_TRUE(map.empty());
+    EXPECT_EQ(0U, map.capacity);
+    EXPECT_TRUE(map.begin() == map.end());
+    EXPECT_TRUE(map.find(1) == map.end());
+    EXPECT_EQ(0U, map.count(1));
+    EXPECT_EQ(0U, map.erase(1));
+}
+
+TEST(FlatMapTest, insert)
+{
+    IntMap map;
+    auto ret = map.insert({1, 10});
+    EXPECT_TRUE(ret.second);
+    EXPECT_EQ(1, ret.first->first);
+    EXPECT_EQ(10, ret.first->second);
+    EXPECT_EQ(1U, map.size());
+    EXPECT_EQ(16U, map.capacity);
+    EXPECT_EQ(13U, map.growthLeft);
+}
+
+TEST(FlatMapTest, insert_duplicate)
+{
+    IntMap map;
+    map.insert({1, 10});
+    auto ret = map.insert({1, 20});
+    EXPECT_FALSE(ret.second);
+    EXPECT_EQ(10, ret.first->second);
+    EXPECT_EQ(1U, map.size());
+}
+
+TEST(FlatMapTest, insert_grow)
+{
+    IntMap map;
+    for (int i = 0; i < 1000; ++i) {
+        EXPECT_TRUE(map.insert({i, i * 2}).second);
+    }
+    EXPECT_EQ(1000U, map.size());
+    EXPECT_EQ(2048U, map.capacity);
+    for (int i = 0; i < 1000; ++i) {
+        IntMap::iterator it = map.find(i);
+        ASSERT_TRUE(it != map.end());
+        EXPECT_EQ(i * 2, it->second);
+    }
+    EXPECT_TRUE(map.find(1000) == map.end());
+}
+
+TEST(FlatMapTest, insert_reuseDeleted)
+{
+    CollidingMap map;
+    for (int i = 0; i < 16; ++i) {
+        map.insert({i, i});
+    }
+    EXPECT_EQ(32U, map.capacity);
+    // The first group is full, so erasing from it leaves a DELETED slot.
+    size_t index = map.find(0).index;
+    map.erase(0);
+    EXPECT_EQ(int8_t(CollidingMap::DELETED), map.ctrl[index]);
+
+    map.insert({100, 100});
+    EXPECT_EQ(index, map.find(100).index);
+}
+
+TEST(FlatMapTest, insert_rehashInPlace)
+{
+    CollidingMap map;
+    for (int i = 0; i < 16; ++i) {
+        map.insert({i, i});
+    }
+    for (int i = 1; i < 16; ++i) {
+        map.erase(i);
+    }
+    // Churn fills the table with DELETED slots; rehashing reclaims them
+    // without growing.
+    for (int i = 100; i < 1000; ++i) {
+        map.insert({i, i});
+        map.erase(i);
+    }
+    EXPECT_EQ(1U, map.size());
+    EXPECT_EQ(32U, map.capacity);
+    EXPECT_EQ(0, map.find(0)->second);
+}
+
+TEST(FlatMapTest, find_collisions)
+{
+    CollidingMap map;
+    for (int i = 0; i < 100; ++i) {
+        map.insert({i, -i});
+    }
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_EQ(-i, map.find(i)->second);
+    }
+    EXPECT_TRUE(map.find(100) == map.end());
+    EXPECT_EQ(1U, map.count(99));
+    EXPECT_EQ(0U, map.count(101));
+}
+
+TEST(FlatMapTest, erase_empty)
+{
+    IntMap map;
+    map.insert({1, 10});
+    size_t index = map.find(1).index;
+    size_t growthLeft = map.growthLeft;
+
+    EXPECT_EQ(1U, map.erase(1));
+
+    // The group has other EMPTY slots, so the slot can be marked EMPTY.
+    EXPECT_EQ(int8_t(IntMap::EMPTY), map.ctrl[index]);
+    EXPECT_EQ(growthLeft + 1, map.growthLeft);
+    EXPECT_TRUE(map.empty());
+    EXPECT_TRUE(map.find(1) == map.end());
+    EXPECT_EQ(0U, map.erase(1));
+}
+
+TEST(FlatMapTest, erase_probeContinues)
+{
+    CollidingMap map;
+    for (int i = 0; i < 40; ++i) {
+        map.insert({i, i});
+    }
+    for (int i = 0; i < 40; i += 2) {
+        map.erase(map.find(i));
+    }
+    EXPECT_EQ(20U, map.size());
+    for (int i = 0; i < 40; ++i) {
+        EXPECT_EQ(i % 2, map.count(i));
+    }
+}
+
+TEST(FlatMapTest, iterator)
+{
+    IntMap map;
+    std::set<int> expected;
+    for (int i = 0; i < 100; ++i) {
+        map.insert({i, i});
+        expected.insert(i);
+    }
+    std::set<int> seen;
+    for (IntMap::iterator it = map.begin(); it != map.end(); ++it) {
+        EXPECT_EQ(it->first, (*it).second);
+        seen.insert(it->first);
+    }
+    EXPECT_EQ(expected, seen);
+}
+
+TEST(FlatMapTest, clear)
+{
+    IntMap map;
+    for (int i = 0; i < 100; ++i) {
+        map.insert({i, i});
+    }
+    size_t capacity = map.capacity;
+
+    map.clear();
+
+    EXPECT_TRUE(map.empty());
+    EXPECT_EQ(capacity, map.capacity);
+    EXPECT_TRUE(map.begin() == map.end());
+    EXPECT_TRUE(map.find(5) == map.end());
+}
+
+TEST(FlatMapTest, MessageId)
+{
+    FlatMap<Protocol::MessageId, int, Protocol::MessageId::Hasher> map;
+    for (uint64_t i = 0; i < 100; ++i) {
+        map.insert({Protocol::MessageId(42, i, 0), int(i)});
+        map.insert({Protocol::MessageId(42, i, 1), -int(i)});
+    }
+    EXPECT_EQ(200U, map.size());
+    EXPECT_EQ(7, map.find(Protocol::MessageId(42, 7, 0))->second);
+    EXPECT_EQ(-7, map.find(Protocol::MessageId(42, 7, 1))->second);
+    EXPECT_TRUE(map.find(Protocol::MessageId(43, 7, 0)) == map.end());
+}
+
+}  // namespace
+}  // namespace Core
+}  // namespace Homa
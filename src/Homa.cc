@@ -15,11 +15,32 @@
 
 #include <Homa/Homa.h>
 
+#include <algorithm>
+#include <unordered_set>
+
+#include "CompletionQueue.h"
+#include "Cycles.h"
 #include "OpContext.h"
 #include "Transport.h"
 
 namespace Homa {
 
+CompletionQueue::CompletionQueue()
+    : internal(new Core::CompletionQueue(Callback()))
+{}
+
+CompletionQueue::CompletionQueue(Callback callback)
+    : internal(new Core::CompletionQueue(std::move(callback)))
+{}
+
+CompletionQueue::~CompletionQueue() = default;
+
+size_t
+CompletionQueue::poll(RemoteOp* ops[], size_t maxOps)
+{
+    return internal->pop(ops, maxOps);
+}
+
 RemoteOp::RemoteOp(Transport* transport)
     : request(nullptr)
     , response(nullptr)
@@ -34,13 +55,18 @@ RemoteOp::~RemoteOp()
 }
 
 void
-RemoteOp::send(Driver::Address* destination)
+RemoteOp::send(Driver::Address* destination, CompletionQueue* completionQueue)
 {
     // Don't let applications touch the outbound message while it is being
     // processed by the Transport.
     request = nullptr;
     response = nullptr;
-    op->transport->sendRequest(op, destination);
+    if (completionQueue != nullptr) {
+        op->transport->sendRequest(op, destination,
+                                   completionQueue->internal.get(), this);
+    } else {
+        op->transport->sendRequest(op, destination);
+    }
 }
 
 bool
@@ -77,6 +103,139 @@ RemoteOp::wait()
     }
 }
 
+void
+RemoteOp::wait(uint64_t spinTimeUs)
+{
+    uint64_t stopSpinning = PerfUtils::Cycles::rdtsc() +
+                            PerfUtils::Cycles::fromMicroseconds(spinTimeUs);
+    while (!isReady()) {
+        if (PerfUtils::Cycles::rdtsc() < stopSpinning) {
+            op->transport->poll();
+            continue;
+        }
+        // Re-check after clearing so that no state change is missed before
+        // blocking.
+        op->transport->clearEvent();
+        if (isReady()) {
+            break;
+        }
+        op->transport->waitForEvent(
+            Core::Transport::EVENT_WAIT_TIMEOUT_MS);
+        op->transport->poll();
+    }
+}
+
+RemoteOpGroup::RemoteOpGroup(Transport* transport)
+    : transport(transport)
+    , completionQueue()
+    , unsent()
+    , unsentDestinations()
+    , sent()
+    , finished()
+    , nextFinished(0)
+{}
+
+RemoteOpGroup::~RemoteOpGroup()
+{
+    // Members that have not finished may outlive the group; make sure the
+    // Transport stops delivering them to the group's CompletionQueue.
+    collect();
+    std::unordered_set<RemoteOp*> done(finished.begin(), finished.end());
+    std::vector<Core::OpContext*> outstanding;
+    for (RemoteOp* op : sent) {
+        if (done.count(op) == 0) {
+            outstanding.push_back(op->op);
+        }
+    }
+    if (!outstanding.empty()) {
+        transport->internal->detachOps(outstanding.size(), outstanding.data(),
+                                       completionQueue.internal.get());
+    }
+}
+
+void
+RemoteOpGroup::add(RemoteOp* op, Driver::Address* destination)
+{
+    unsent.push_back(op);
+    unsentDestinations.push_back(destination);
+}
+
+void
+RemoteOpGroup::send()
+{
+    if (unsent.empty()) {
+        return;
+    }
+    std::vector<Core::OpContext*> contexts;
+    contexts.reserve(unsent.size());
+    for (RemoteOp* op : unsent) {
+        // Don't let applications touch the outbound message while it is being
+        // processed by the Transport.
+        op->request = nullptr;
+        op->response = nullptr;
+        contexts.push_back(op->op);
+    }
+    transport->internal->sendRequests(
+        unsent.size(), contexts.data(), unsentDestinations.data(),
+        completionQueue.internal.get(), unsent.data());
+    sent.insert(sent.end(), unsent.begin(), unsent.end());
+    unsent.clear();
+    unsentDestinations.clear();
+}
+
+RemoteOp*
+RemoteOpGroup::waitAny()
+{
+    collect();
+    while (nextFinished >= finished.size()) {
+        if (finished.size() >= sent.size()) {
+            return nullptr;
+        }
+        transport->poll();
+        collect();
+    }
+    return finished[nextFinished++];
+}
+
+size_t
+RemoteOpGroup::waitFor(size_t numOps)
+{
+    numOps = std::min(numOps, sent.size());
+    collect();
+    while (finished.size() < numOps) {
+        transport->poll();
+        collect();
+    }
+    return finished.size();
+}
+
+void
+RemoteOpGroup::waitAll()
+{
+    waitFor(sent.size());
+}
+
+/**
+ * Move any newly finished members from the CompletionQueue to the list of
+ * finished members.
+ */
+void
+RemoteOpGroup::collect()
+{
+    const size_t MAX_BATCH = 32;
+    RemoteOp* ops[MAX_BATCH];
+    size_t numOps;
+    do {
+        numOps = completionQueue.poll(ops, MAX_BATCH);
+        for (size_t i = 0; i < numOps; ++i) {
+            // Grant access to the response (or restore the request on
+            // failure); always true for a delivered RemoteOp.
+            ops[i]->isReady();
+            finished.push_back(ops[i]);
+        }
+    } while (numOps == MAX_BATCH);
+}
+
 ServerOp::ServerOp()
     : request(nullptr)
     , response(nullptr)
@@ -103,6 +262,9 @@ ServerOp::~ServerOp()
 ServerOp&
 ServerOp::operator=(ServerOp&& other)
 {
+    if (op != nullptr && op != other.op) {
+        op->transport->releaseOp(op);
+    }
     request = std::move(other.request);
     response = std::move(other.response);
     op = std::move(other.op);
@@ -143,8 +305,9 @@ ServerOp::delegate(Driver::Address* destination)
     }
 }
 
-Transport::Transport(Driver* driver, uint64_t transportId)
-    : internal(new Core::Transport(driver, transportId))
+Transport::Transport(Driver* driver, uint64_t transportId,
+                     uint32_t overcommitmentDegree)
+    : internal(new Core::Transport(driver, transportId, overcommitmentDegree))
 {}
 
 Transport::~Transport() = default;
@@ -161,6 +324,47 @@ Transport::receiveServerOp()
     return op;
 }
 
+size_t
+Transport::receiveServerOps(ServerOp ops[], size_t maxOps)
+{
+    const size_t MAX_BATCH = 32;
+    Core::OpContext* contexts[MAX_BATCH];
+    size_t numOps = 0;
+    while (numOps < maxOps) {
+        size_t batchSize = std::min(maxOps - numOps, MAX_BATCH);
+        size_t numReceived = internal->receiveOps(contexts, batchSize);
+        for (size_t i = 0; i < numReceived; ++i) {
+            ServerOp op;
+            op.op = contexts[i];
+            op.request = op.op->getInMessage();
+            op.response = op.op->getOutMessage();
+            ops[numOps++] = std::move(op);
+        }
+        if (numReceived < batchSize) {
+            break;
+        }
+    }
+    return numOps;
+}
+
+void
+Transport::reply(ServerOp ops[], size_t numOps)
+{
+    std::vector<Core::OpContext*> contexts;
+    contexts.reserve(numOps);
+    for (size_t i = 0; i < numOps; ++i) {
+        if (ops[i].op != nullptr) {
+            ops[i].response = nullptr;
+            contexts.push_back(ops[i].op);
+        } else {
+            WARNING("Calling reply() on empty ServerOp; nothing will be sent.");
+        }
+    }
+    if (!contexts.empty()) {
+        internal->sendReplies(contexts.size(), contexts.data());
+    }
+}
+
 Driver::Address*
 Transport::getAddress(std::string const* const addressString)
 {
@@ -173,4 +377,40 @@ Transport::poll()
     internal->poll();
 }
 
+void
+Transport::startPollingThreads(const std::vector<int>& cpus)
+{
+    internal->startPollingThreads(cpus);
+}
+
+void
+Transport::stopPollingThreads()
+{
+    internal->stopPollingThreads();
+}
+
+int
+Transport::getEventFd()
+{
+    return internal->getEventFd();
+}
+
+void
+Transport::clearEvent()
+{
+    internal->clearEvent();
+}
+
+uint32_t
+Transport::getNicQueuedBytes()
+{
+    return internal->getNicQueuedBytes();
+}
+
+uint32_t
+Transport::getNumReadyPackets()
+{
+    return internal->getNumReadyPackets();
+}
+
 }  // namespace Homa
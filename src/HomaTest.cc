@@ -18,6 +18,7 @@
 
 #include <Homa/Homa.h>
 
+#include "CompletionQueue.h"
 #include "Mock/MockDriver.h"
 #include "Mock/MockReceiver.h"
 #include "Mock/MockSender.h"
@@ -26,6 +27,8 @@
 namespace Homa {
 namespace {
 
+using ::testing::_;
+using ::testing::Eq;
 using ::testing::NiceMock;
 using ::testing::Return;
 
@@ -67,6 +70,39 @@ class HomaTest : public ::testing::Test {
     std::vector<std::pair<std::string, std::string>> savedLogPolicy;
 };
 
+TEST_F(HomaTest, CompletionQueue_poll)
+{
+    CompletionQueue completionQueue;
+    RemoteOp* ops[2];
+
+    EXPECT_EQ(0U, completionQueue.poll(ops, 2));
+
+    for (uintptr_t i = 1; i <= 3; ++i) {
+        completionQueue.internal->push((RemoteOp*)i);
+    }
+
+    EXPECT_EQ(2U, completionQueue.poll(ops, 2));
+    EXPECT_EQ((RemoteOp*)1, ops[0]);
+    EXPECT_EQ((RemoteOp*)2, ops[1]);
+    EXPECT_EQ(1U, completionQueue.poll(ops, 2));
+    EXPECT_EQ((RemoteOp*)3, ops[0]);
+    EXPECT_EQ(0U, completionQueue.poll(ops, 2));
+}
+
+TEST_F(HomaTest, CompletionQueue_callback)
+{
+    std::vector<RemoteOp*> finished;
+    CompletionQueue completionQueue(
+        [&finished](RemoteOp* op) { finished.push_back(op); });
+
+    completionQueue.internal->push((RemoteOp*)42);
+
+    EXPECT_EQ(1U, finished.size());
+    EXPECT_EQ((RemoteOp*)42, finished.at(0));
+    RemoteOp* ops[1];
+    EXPECT_EQ(0U, completionQueue.poll(ops, 1));
+}
+
 TEST_F(HomaTest, RemoteOp_constructor)
 {
     Homa::Mock::MockDriver::MockAddress mockAddress;
@@ -162,6 +198,128 @@ TEST_F(HomaTest, RemoteOp_wait)
     // Nothing to test.
 }
 
+TEST_F(HomaTest, RemoteOp_wait_block)
+{
+    EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&packet0));
+    EXPECT_CALL(mockDriver, getLocalAddress).WillOnce(Return(&mockAddress));
+    RemoteOp op(transport);
+    op.request = nullptr;
+    op.op->state = Core::OpContext::State::IN_PROGRESS;
+    transport->internal->signalEvent();
+
+    // Fail the op once the blocked waiter polls the Transport.
+    EXPECT_CALL(mockDriver, receivePackets)
+        .WillOnce([&op](uint32_t, Driver::Packet**) {
+            op.op->state = Core::OpContext::State::FAILED;
+            return 0;
+        });
+
+    op.wait(0);
+
+    EXPECT_EQ(op.op->getOutMessage(), op.request);
+    EXPECT_FALSE(transport->internal->eventPending);
+}
+
+TEST_F(HomaTest, RemoteOpGroup_send)
+{
+    EXPECT_CALL(mockDriver, allocPacket)
+        .WillOnce(Return(&packet0))
+        .WillOnce(Return(&packet1));
+    EXPECT_CALL(mockDriver, getLocalAddress)
+        .WillRepeatedly(Return(&mockAddress));
+    RemoteOp op0(transport);
+    RemoteOp op1(transport);
+    RemoteOpGroup group(transport);
+    Driver::Address* destination = (Driver::Address*)22;
+
+    // Nothing to send.
+    EXPECT_CALL(*mockSender, sendMessages).Times(0);
+    group.send();
+    ::testing::Mock::VerifyAndClearExpectations(mockSender);
+
+    group.add(&op0, destination);
+    group.add(&op1, destination);
+    EXPECT_EQ(0U, group.size());
+
+    EXPECT_CALL(*mockSender, sendMessages(Eq(2U), _, _, _, Eq(true)))
+        .Times(1);
+    group.send();
+
+    EXPECT_EQ(2U, group.size());
+    EXPECT_TRUE(group.unsent.empty());
+    EXPECT_EQ(nullptr, op0.request);
+    EXPECT_EQ(nullptr, op1.request);
+    EXPECT_EQ(&op1, static_cast<Core::Transport::Op*>(op1.op)->remoteOp);
+    EXPECT_EQ(group.completionQueue.internal.get(),
+              static_cast<Core::Transport::Op*>(op1.op)->completionQueue);
+}
+
+TEST_F(HomaTest, RemoteOpGroup_wait)
+{
+    EXPECT_CALL(mockDriver, allocPacket)
+        .WillOnce(Return(&packet0))
+        .WillOnce(Return(&packet1));
+    EXPECT_CALL(mockDriver, getLocalAddress)
+        .WillRepeatedly(Return(&mockAddress));
+    RemoteOp op0(transport);
+    RemoteOp op1(transport);
+    RemoteOpGroup group(transport);
+    group.add(&op0, (Driver::Address*)22);
+    group.add(&op1, (Driver::Address*)23);
+    group.send();
+    op0.op->state = Core::OpContext::State::FAILED;
+    op1.op->state = Core::OpContext::State::FAILED;
+
+    EXPECT_EQ(0U, group.waitFor(0));
+
+    group.completionQueue.internal->push(&op1);
+    EXPECT_EQ(1U, group.waitFor(1));
+    EXPECT_EQ(&op1, group.waitAny());
+    EXPECT_NE(nullptr, op1.request);
+
+    group.completionQueue.internal->push(&op0);
+    group.waitAll();
+    EXPECT_EQ(2U, group.getFinished().size());
+    EXPECT_EQ(&op1, group.getFinished().at(0));
+    EXPECT_EQ(&op0, group.getFinished().at(1));
+    EXPECT_EQ(2U, group.waitFor(5));
+    EXPECT_EQ(&op0, group.waitAny());
+    EXPECT_EQ(nullptr, group.waitAny());
+}
+
+TEST_F(HomaTest, RemoteOpGroup_destructor)
+{
+    EXPECT_CALL(mockDriver, allocPacket)
+        .WillOnce(Return(&packet0))
+        .WillOnce(Return(&packet1));
+    EXPECT_CALL(mockDriver, getLocalAddress)
+        .WillRepeatedly(Return(&mockAddress));
+    RemoteOp op0(transport);
+    Core::Transport::Op* internalOp0 =
+        static_cast<Core::Transport::Op*>(op0.op);
+    {
+        RemoteOpGroup group(transport);
+        RemoteOp op1(transport);
+        group.add(&op0, (Driver::Address*)22);
+        group.add(&op1, (Driver::Address*)23);
+        group.send();
+        EXPECT_EQ(group.completionQueue.internal.get(),
+                  internalOp0->completionQueue);
+
+        // op1 finishes and is destroyed before the group; op0 is still
+        // outstanding when the group goes away.
+        op1.op->state = Core::OpContext::State::FAILED;
+        static_cast<Core::Transport::Op*>(op1.op)->completionQueue = nullptr;
+        group.completionQueue.internal->push(&op1);
+        EXPECT_EQ(&op1, group.waitAny());
+    }
+
+    // op0 is no longer delivered to the destroyed group.
+    EXPECT_EQ(nullptr, internalOp0->completionQueue);
+    EXPECT_EQ(nullptr, internalOp0->remoteOp);
+    EXPECT_FALSE(op0.isReady());
+}
+
 TEST_F(HomaTest, ServerOp_constructor)
 {
     ServerOp op;
@@ -219,9 +377,7 @@ TEST_F(HomaTest, ServerOp_assignment_move)
 
 TEST_F(HomaTest, Transport_receiveServerOp)
 {
-    char payload[1024];
-    Homa::Mock::MockDriver::MockPacket packet(payload);
-    Core::Transport::Op* op = transport->internal->opPool.construct(
+    Core::Transport::Op* op = transport->internal->opSlab.construct(
         transport->internal.get(), transport->internal->driver);
     Core::InboundMessage inMessage;
     inMessage.id = Protocol::MessageId(42, 1, 1);
@@ -230,10 +386,6 @@ TEST_F(HomaTest, Transport_receiveServerOp)
     op->inMessage = &inMessage;
     transport->internal->pendingServerOps.queue.push_back(op);
 
-    EXPECT_CALL(mockDriver, allocPacket)
-        .WillOnce(Return(&packet))
-        .WillOnce(Return(&packet0));
-
     ServerOp serverOp = transport->receiveServerOp();
 
     EXPECT_TRUE(serverOp);
@@ -242,6 +394,81 @@ TEST_F(HomaTest, Transport_receiveServerOp)
     EXPECT_EQ(serverOp.response, serverOp.op->getOutMessage());
 }
 
+TEST_F(HomaTest, Transport_receiveServerOps)
+{
+    Core::Transport::Op* op[3];
+    Core::InboundMessage inMessage[3];
+    for (int i = 0; i < 3; ++i) {
+        op[i] = transport->internal->opSlab.construct(
+            transport->internal.get(), transport->internal->driver);
+        inMessage[i].id = Protocol::MessageId(42, i, 1);
+        inMessage[i].message.construct(
+            &mockDriver, sizeof(Protocol::Packet::DataHeader), 0);
+        op[i]->inMessage = &inMessage[i];
+        transport->internal->pendingServerOps.queue.push_back(op[i]);
+    }
+
+    ServerOp serverOps[2];
+    EXPECT_EQ(2U, transport->receiveServerOps(serverOps, 2));
+
+    for (int i = 0; i < 2; ++i) {
+        EXPECT_EQ(op[i], serverOps[i].op);
+        EXPECT_EQ(serverOps[i].request, op[i]->getInMessage());
+        EXPECT_EQ(serverOps[i].response, op[i]->getOutMessage());
+    }
+
+    // Receiving into a used ServerOp releases its previous request.
+    EXPECT_EQ(1U, transport->receiveServerOps(serverOps, 2));
+    EXPECT_EQ(op[2], serverOps[0].op);
+    EXPECT_FALSE(op[0]->retained);
+    EXPECT_TRUE(op[1]->retained);
+    EXPECT_TRUE(op[2]->retained);
+
+    EXPECT_EQ(0U, transport->receiveServerOps(serverOps, 2));
+}
+
+TEST_F(HomaTest, Transport_reply)
+{
+    Core::Transport::Op* op = transport->internal->opSlab.construct(
+        transport->internal.get(), transport->internal->driver);
+    ServerOp serverOps[2];
+    serverOps[1].op = op;
+    serverOps[1].response = (Message*)42;
+
+    EXPECT_CALL(*mockSender, sendMessages(Eq(1U), _, _, _, Eq(false)))
+        .WillOnce([op](size_t, const Protocol::MessageId[],
+                       Driver::Address* const[],
+                       Core::Transport::Op* const ops[],
+                       bool) { EXPECT_EQ(op, ops[0]); });
+    EXPECT_CALL(mockDriver, getAddress(::testing::An<
+                                       const Driver::Address::Raw*>()))
+        .WillOnce(Return(&mockAddress));
+    Core::InboundMessage inMessage;
+    inMessage.message.construct(&mockDriver,
+                                sizeof(Protocol::Packet::DataHeader), 0);
+    inMessage.message->setPacket(0, &packet0);
+    op->inMessage = &inMessage;
+
+    transport->reply(serverOps, 2);
+
+    EXPECT_EQ(nullptr, serverOps[1].response);
+    EXPECT_EQ(Core::OpContext::State::IN_PROGRESS, op->state.load());
+}
+
+TEST_F(HomaTest, Transport_getEventFd)
+{
+    EXPECT_EQ(transport->internal->eventFd, transport->getEventFd());
+    EXPECT_LE(0, transport->getEventFd());
+}
+
+TEST_F(HomaTest, Transport_getQueueDepth)
+{
+    EXPECT_CALL(*mockSender, getNicQueuedBytes).WillOnce(Return(2048));
+    EXPECT_CALL(*mockSender, getNumReadyPackets).WillOnce(Return(7));
+    EXPECT_EQ(2048U, transport->getNicQueuedBytes());
+    EXPECT_EQ(7U, transport->getNumReadyPackets());
+}
+
 TEST_F(HomaTest, Transport_receiveServerOp_empty)
 {
     ServerOp serverOp = transport->receiveServerOp();
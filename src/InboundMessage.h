@@ -19,6 +19,7 @@
 #include "Message.h"
 #include "Protocol.h"
 #include "SpinLock.h"
+#include "TimerWheel.h"
 #include "Tub.h"
 
 namespace Homa {
@@ -41,10 +42,17 @@ class InboundMessage {
         , source(nullptr)
         , numExpectedPackets(0)
         , grantIndexLimit(0)
+        , grantPriority(0)
         , message()
-        , newPacket(false)
         , active(false)
         , fullMessageReceived(false)
+        , timer(this)
+        , timeoutCount(0)
+        , grantTime(0)
+        , grantSampleIndex(0)
+        , firstPacketTime(0)
+        , scheduled(false)
+        , scheduledBytes(0)
     {}
 
     /**
@@ -93,18 +101,40 @@ class InboundMessage {
     /// Contains source address this message.
     Driver::Address* source;
     /// Number of packets the message is expected to contain.
-    uint16_t numExpectedPackets;
+    uint32_t numExpectedPackets;
     /// The packet index up to which the Receiver as granted.
-    uint16_t grantIndexLimit;
+    uint32_t grantIndexLimit;
+    /// Network priority that the Receiver most recently requested for the
+    /// scheduled packets of this message.
+    int grantPriority;
     /// Collection of packets being received.
     Tub<Message> message;
-    /// Marked true when a new data packet arrives; cleared by the scheduler.
-    bool newPacket;
     /// True if any packets (DATA, PING, BUSY) for this message has been
     /// received since the last timeout; false, otherwise.
     bool active;
     /// True if all packets of the message have been received.
     bool fullMessageReceived;
+    /// Used to periodically check this message for lost packets.
+    TimerWheel<InboundMessage>::Timer timer;
+    /// Number of consecutive timeouts since packets for this message were
+    /// last received.
+    uint32_t timeoutCount;
+    /// Time (in cycles) at which the GRANT currently used to sample the RTT
+    /// was sent; 0 if no sample is in progress.
+    uint64_t grantTime;
+    /// Index of the first packet allowed by the GRANT sent at grantTime; its
+    /// arrival completes the RTT sample.
+    uint32_t grantSampleIndex;
+    /// Time (in cycles) at which the first DATA packet of this message was
+    /// processed; GRANTs report the time since then to the Sender.
+    uint64_t firstPacketTime;
+    /// True if this message is in the Receiver's scheduledMessages; protected
+    /// by the Receiver's mutex.
+    bool scheduled;
+    /// Number of unreceived bytes under which this message was added to the
+    /// Receiver's scheduledMessages; only valid while scheduled is true and
+    /// protected by the Receiver's mutex.
+    uint32_t scheduledBytes;
 
     friend class Receiver;
 };
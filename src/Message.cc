@@ -45,8 +45,9 @@ Message::Message(Driver* driver, uint16_t packetHeaderLength,
     , MESSAGE_HEADER_LENGTH(0)
     , messageLength(messageLength)
     , numPackets(0)
-    , occupied()
-    , packets()
+    , firstMissingIndex(0)
+    , inlinePackets()
+    , overflowPages()
 {}
 
 /**
@@ -54,7 +55,30 @@ Message::Message(Driver* driver, uint16_t packetHeaderLength,
  */
 Message::~Message()
 {
-    driver->releasePackets(packets, numPackets);
+    const uint16_t BATCH_SIZE = 32;
+    Driver::Packet* batch[BATCH_SIZE];
+    uint16_t batchSize = 0;
+    auto release = [&](Driver::Packet* const* slots, uint32_t numSlots) {
+        for (uint32_t i = 0; i < numSlots; ++i) {
+            if (slots[i] == nullptr) {
+                continue;
+            }
+            batch[batchSize++] = slots[i];
+            if (batchSize == BATCH_SIZE) {
+                driver->releasePackets(batch, batchSize);
+                batchSize = 0;
+            }
+        }
+    };
+    release(inlinePackets, INLINE_PACKETS);
+    for (auto& page : overflowPages) {
+        if (page) {
+            release(page.get(), PACKETS_PER_PAGE);
+        }
+    }
+    if (batchSize > 0) {
+        driver->releasePackets(batch, batchSize);
+    }
 }
 
 /**
@@ -66,12 +90,16 @@ Message::append(const void* source, uint32_t num)
     uint32_t packetIndex = messageLength / PACKET_DATA_LENGTH;
     uint32_t packetOffset = messageLength % PACKET_DATA_LENGTH;
     uint32_t bytesCopied = 0;
-    uint32_t maxMessageLength = PACKET_DATA_LENGTH * MAX_MESSAGE_PACKETS;
 
-    if (messageLength + num > maxMessageLength) {
+    if (num > MAX_MESSAGE_LENGTH - messageLength) {
         WARNING("Max message size limit (%uB) reached; %u of %u bytes appended",
-                maxMessageLength, maxMessageLength - messageLength, num);
-        num = maxMessageLength - messageLength;
+                MAX_MESSAGE_LENGTH, MAX_MESSAGE_LENGTH - messageLength, num);
+        num = MAX_MESSAGE_LENGTH - messageLength;
+    }
+
+    if (num > PACKET_DATA_LENGTH - packetOffset) {
+        allocPackets(packetIndex,
+                     (uint64_t(messageLength) + num - 1) / PACKET_DATA_LENGTH);
     }
 
     while (bytesCopied < num) {
@@ -94,6 +122,79 @@ Message::append(const void* source, uint32_t num)
     messageLength += num;
 }
 
+/**
+ * @copydoc Homa::Message::reserve()
+ */
+uint32_t
+Message::reserve(uint32_t num, WritableSpan* spans, uint32_t maxSpans)
+{
+    uint32_t packetIndex = messageLength / PACKET_DATA_LENGTH;
+    uint32_t packetOffset = messageLength % PACKET_DATA_LENGTH;
+    uint32_t bytesReserved = 0;
+    uint32_t numSpans = 0;
+
+    if (num > MAX_MESSAGE_LENGTH - messageLength) {
+        num = MAX_MESSAGE_LENGTH - messageLength;
+    }
+
+    if (num > PACKET_DATA_LENGTH - packetOffset && maxSpans > 1) {
+        uint64_t lastIndex =
+            (uint64_t(messageLength) + num - 1) / PACKET_DATA_LENGTH;
+        allocPackets(packetIndex, std::min(lastIndex, uint64_t(packetIndex) +
+                                                          maxSpans - 1));
+    }
+
+    while (bytesReserved < num && numSpans < maxSpans) {
+        uint32_t bytesInPacket =
+            std::min(num - bytesReserved, PACKET_DATA_LENGTH - packetOffset);
+        Driver::Packet* packet = getOrAllocPacket(packetIndex);
+        char* data = static_cast<char*>(packet->payload);
+        spans[numSpans].data = data + packetOffset + PACKET_HEADER_LENGTH;
+        spans[numSpans].length = bytesInPacket;
+        numSpans++;
+        bytesReserved += bytesInPacket;
+        packetIndex++;
+        packetOffset = 0;
+    }
+    return numSpans;
+}
+
+/**
+ * @copydoc Homa::Message::commit()
+ */
+void
+Message::commit(uint32_t num)
+{
+    uint32_t packetIndex = messageLength / PACKET_DATA_LENGTH;
+    uint32_t packetOffset = messageLength % PACKET_DATA_LENGTH;
+    uint32_t bytesCommitted = 0;
+
+    while (bytesCommitted < num) {
+        uint32_t bytesInPacket =
+            std::min(num - bytesCommitted, PACKET_DATA_LENGTH - packetOffset);
+        Driver::Packet* packet = getPacket(packetIndex);
+        assert(packet != nullptr);
+        packet->length += bytesInPacket;
+        assert(packet->length <= PACKET_HEADER_LENGTH + PACKET_DATA_LENGTH);
+        bytesCommitted += bytesInPacket;
+        packetIndex++;
+        packetOffset = 0;
+    }
+    messageLength += num;
+
+    // Return packets that were reserved but not filled so that they are not
+    // sent as part of the Message.
+    uint32_t usedPackets = (uint64_t(messageLength) + PACKET_DATA_LENGTH - 1) /
+                           PACKET_DATA_LENGTH;
+    while (numPackets > usedPackets) {
+        numPackets--;
+        Driver::Packet** slot = getPacketSlot(numPackets);
+        driver->releasePackets(slot, 1);
+        *slot = nullptr;
+    }
+    firstMissingIndex = std::min(firstMissingIndex, numPackets);
+}
+
 /**
  * @copydoc Homa::Message::get()
  */
@@ -103,17 +204,19 @@ Message::get(uint32_t offset, void* destination, uint32_t num) const
     // This operation should be performed as if offset zero starts with the
     // first byte after the header.  This operation shouldn't be preformed on
     // a Message with an undefined header.
+
+    // Offset is passed the end of the message.  Checked before adding the
+    // header length so that large offsets can't wrap back into the message.
+    if (offset >= messageLength - MESSAGE_HEADER_LENGTH) {
+        return 0;
+    }
+
     uint32_t realOffset = offset + MESSAGE_HEADER_LENGTH;
     uint32_t packetIndex = realOffset / PACKET_DATA_LENGTH;
     uint32_t packetOffset = realOffset % PACKET_DATA_LENGTH;
     uint32_t bytesCopied = 0;
 
-    // Offset is passed the end of the message.
-    if (realOffset >= messageLength) {
-        return 0;
-    }
-
-    if (realOffset + num > messageLength) {
+    if (num > messageLength - realOffset) {
         num = messageLength - realOffset;
     }
 
@@ -138,6 +241,74 @@ Message::get(uint32_t offset, void* destination, uint32_t num) const
     return bytesCopied;
 }
 
+/**
+ * @copydoc Homa::Message::getSpans()
+ */
+uint32_t
+Message::getSpans(uint32_t offset, uint32_t num, Span* spans,
+                  uint32_t maxSpans) const
+{
+    // Offset is passed the end of the message.  Checked before adding the
+    // header length so that large offsets can't wrap back into the message.
+    if (offset >= messageLength - MESSAGE_HEADER_LENGTH) {
+        return 0;
+    }
+
+    uint32_t realOffset = offset + MESSAGE_HEADER_LENGTH;
+    uint32_t packetIndex = realOffset / PACKET_DATA_LENGTH;
+    uint32_t packetOffset = realOffset % PACKET_DATA_LENGTH;
+    uint32_t bytesFound = 0;
+    uint32_t numSpans = 0;
+
+    if (num > messageLength - realOffset) {
+        num = messageLength - realOffset;
+    }
+
+    while (bytesFound < num && numSpans < maxSpans) {
+        uint32_t bytesInPacket =
+            std::min(num - bytesFound, PACKET_DATA_LENGTH - packetOffset);
+        Driver::Packet* packet = getPacket(packetIndex);
+        if (packet == nullptr) {
+            ERROR("Message is missing data starting at packet index %u",
+                  packetIndex);
+            break;
+        }
+        char* data = static_cast<char*>(packet->payload);
+        spans[numSpans].data = data + packetOffset + PACKET_HEADER_LENGTH;
+        spans[numSpans].length = bytesInPacket;
+        numSpans++;
+        bytesFound += bytesInPacket;
+        packetIndex++;
+        packetOffset = 0;
+    }
+    return numSpans;
+}
+
+/**
+ * @copydoc Homa::Message::peek(uint32_t, uint32_t)
+ */
+const void*
+Message::peek(uint32_t offset, uint32_t num) const
+{
+    if (offset > messageLength - MESSAGE_HEADER_LENGTH) {
+        return nullptr;
+    }
+    uint32_t realOffset = offset + MESSAGE_HEADER_LENGTH;
+    uint32_t packetIndex = realOffset / PACKET_DATA_LENGTH;
+    uint32_t packetOffset = realOffset % PACKET_DATA_LENGTH;
+
+    if (num > messageLength - realOffset ||
+        num > PACKET_DATA_LENGTH - packetOffset) {
+        return nullptr;
+    }
+    Driver::Packet* packet = getPacket(packetIndex);
+    if (packet == nullptr) {
+        return nullptr;
+    }
+    return static_cast<char*>(packet->payload) + packetOffset +
+           PACKET_HEADER_LENGTH;
+}
+
 /**
  * @copydoc Homa::Message::length()
  */
@@ -157,10 +328,15 @@ Message::length() const
  *      Pointer to a Packet at the given index if it exists; nullptr otherwise.
  */
 Driver::Packet*
-Message::getPacket(uint16_t index) const
+Message::getPacket(uint32_t index) const
 {
-    if (occupied.test(index)) {
-        return packets[index];
+    if (index < INLINE_PACKETS) {
+        return inlinePackets[index];
+    }
+    uint32_t overflowIndex = index - INLINE_PACKETS;
+    uint32_t page = overflowIndex / PACKETS_PER_PAGE;
+    if (page < overflowPages.size() && overflowPages[page]) {
+        return overflowPages[page][overflowIndex % PACKETS_PER_PAGE];
     }
     return nullptr;
 }
@@ -182,26 +358,37 @@ Message::getPacket(uint16_t index) const
  *      packet is not stored).
  */
 bool
-Message::setPacket(uint16_t index, Driver::Packet* packet)
+Message::setPacket(uint32_t index, Driver::Packet* packet)
 {
-    if (occupied.test(index)) {
+    Driver::Packet** slot = getPacketSlot(index);
+    if (*slot != nullptr) {
         return false;
     }
-    packets[index] = packet;
-    occupied.set(index);
-    numPackets++;
+    *slot = packet;
+    packetAdded(index);
     return true;
 }
 
 /**
  * Return the number of packet this message currently holds.
  */
-uint16_t
+uint32_t
 Message::getNumPackets() const
 {
     return numPackets;
 }
 
+/**
+ * Return the index of the first packet this message does not hold; every
+ * packet with a lower index is present.  Used to find lost packets without
+ * scanning the whole message.
+ */
+uint32_t
+Message::getFirstMissingIndex() const
+{
+    return firstMissingIndex;
+}
+
 /**
  * Return the number of bytes this message holds (including the message header).
  */
@@ -211,6 +398,43 @@ Message::rawLength() const
     return messageLength;
 }
 
+/**
+ * Return the location where the Packet with the given index is stored,
+ * allocating the page that holds it if necessary.  The list of pages is
+ * sized for the whole Message when its length is already known (e.g. inbound
+ * messages) so that it is only grown once.
+ *
+ * @param index
+ *      The Packet's index in the array of packets that form the message.
+ */
+Driver::Packet**
+Message::getPacketSlot(uint32_t index)
+{
+    assert(index < (uint64_t(MAX_MESSAGE_LENGTH) + PACKET_DATA_LENGTH - 1) /
+                       PACKET_DATA_LENGTH);
+    if (index < INLINE_PACKETS) {
+        return &inlinePackets[index];
+    }
+    uint32_t overflowIndex = index - INLINE_PACKETS;
+    uint32_t page = overflowIndex / PACKETS_PER_PAGE;
+    if (page >= overflowPages.size()) {
+        uint64_t knownPackets =
+            (uint64_t(messageLength) + PACKET_DATA_LENGTH - 1) /
+            PACKET_DATA_LENGTH;
+        uint64_t numPages = page + 1;
+        if (knownPackets > INLINE_PACKETS) {
+            numPages = std::max(numPages, (knownPackets - INLINE_PACKETS +
+                                           PACKETS_PER_PAGE - 1) /
+                                              PACKETS_PER_PAGE);
+        }
+        overflowPages.resize(numPages);
+    }
+    if (!overflowPages[page]) {
+        overflowPages[page].reset(new Driver::Packet* [PACKETS_PER_PAGE]());
+    }
+    return &overflowPages[page][overflowIndex % PACKETS_PER_PAGE];
+}
+
 /**
  * Return the Packet with the given index.  If the Packet does yet exist,
  * allocate a new Packet.
@@ -222,17 +446,78 @@ Message::rawLength() const
  *      Pointer to a Packet at the given index.
  */
 inline Driver::Packet*
-Message::getOrAllocPacket(uint16_t index)
+Message::getOrAllocPacket(uint32_t index)
 {
-    if (!occupied.test(index)) {
-        packets[index] = driver->allocPacket();
-        occupied.set(index);
-        numPackets++;
+    Driver::Packet** slot = getPacketSlot(index);
+    if (*slot == nullptr) {
+        *slot = driver->allocPacket();
         // TODO(cstlee): A Message probably shouldn't be in charge of setting
         //               the packet length.
-        packets[index]->length = PACKET_HEADER_LENGTH;
+        (*slot)->length = PACKET_HEADER_LENGTH;
+        packetAdded(index);
+    }
+    return *slot;
+}
+
+/**
+ * Make sure the Packets with indices firstIndex through lastIndex (inclusive)
+ * exist.  Missing Packets are allocated from the Driver in batches so that
+ * large appends don't pay the Driver's per-allocation cost for every packet;
+ * a single missing Packet is allocated with Driver::allocPacket().
+ *
+ * @param firstIndex
+ *      Index of the first Packet in the range.
+ * @param lastIndex
+ *      Index of the last Packet in the range.
+ */
+void
+Message::allocPackets(uint32_t firstIndex, uint32_t lastIndex)
+{
+    const uint16_t BATCH_SIZE = 32;
+    Driver::Packet* batch[BATCH_SIZE];
+    uint32_t batchIndexes[BATCH_SIZE];
+    uint16_t batchSize = 0;
+    auto fill = [&]() {
+        if (batchSize == 1) {
+            batch[0] = driver->allocPacket();
+        } else {
+            driver->allocPackets(batch, batchSize);
+        }
+        for (uint16_t i = 0; i < batchSize; ++i) {
+            *getPacketSlot(batchIndexes[i]) = batch[i];
+            batch[i]->length = PACKET_HEADER_LENGTH;
+            packetAdded(batchIndexes[i]);
+        }
+        batchSize = 0;
+    };
+    for (uint64_t index = firstIndex; index <= lastIndex; ++index) {
+        if (*getPacketSlot(index) != nullptr) {
+            continue;
+        }
+        batchIndexes[batchSize++] = index;
+        if (batchSize == BATCH_SIZE) {
+            fill();
+        }
+    }
+    if (batchSize > 0) {
+        fill();
+    }
+}
+
+/**
+ * Update the packet bookkeeping after the Packet with the given index has been
+ * stored.  Advancing firstMissingIndex past packets that arrived early costs
+ * O(1) amortized per packet.
+ */
+void
+Message::packetAdded(uint32_t index)
+{
+    numPackets++;
+    if (index == firstMissingIndex) {
+        do {
+            firstMissingIndex++;
+        } while (getPacket(firstMissingIndex) != nullptr);
     }
-    return packets[index];
 }
 
 /**
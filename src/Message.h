@@ -20,7 +20,9 @@
 
 #include "Protocol.h"
 
-#include <bitset>
+#include <cstdint>
+#include <memory>
+#include <vector>
 
 namespace Homa {
 namespace Core {
@@ -34,21 +36,30 @@ namespace Core {
  */
 class Message : public Homa::Message {
   public:
-    /// Define the maximum number of packets that a message can hold.
-    static const uint16_t MAX_MESSAGE_PACKETS = 1024;
+    /// Define the maximum number of bytes that a message can hold, including
+    /// the message header; limited by DataHeader::totalLength.
+    static const uint32_t MAX_MESSAGE_LENGTH = UINT32_MAX;
 
     explicit Message(Driver* driver, uint16_t packetHeaderLength,
                      uint32_t messageLength);
     ~Message();
 
     virtual void append(const void* source, uint32_t num);
+    virtual uint32_t reserve(uint32_t num, WritableSpan* spans,
+                             uint32_t maxSpans);
+    virtual void commit(uint32_t num);
     virtual uint32_t get(uint32_t offset, void* destination,
                          uint32_t num) const;
+    virtual uint32_t getSpans(uint32_t offset, uint32_t num, Span* spans,
+                              uint32_t maxSpans) const;
+    virtual const void* peek(uint32_t offset, uint32_t num) const;
+    using Homa::Message::peek;
     virtual uint32_t length() const;
 
-    Driver::Packet* getPacket(uint16_t index) const;
-    bool setPacket(uint16_t index, Driver::Packet* packet);
-    uint16_t getNumPackets() const;
+    Driver::Packet* getPacket(uint32_t index) const;
+    bool setPacket(uint32_t index, Driver::Packet* packet);
+    uint32_t getNumPackets() const;
+    uint32_t getFirstMissingIndex() const;
 
     uint32_t rawLength() const;
 
@@ -105,17 +116,34 @@ class Message : public Homa::Message {
     uint32_t messageLength;
 
     /// Number of packets contained in this context.
-    uint16_t numPackets;
-
-    /// Bit array representing which entires in the _packets_ array are set.
-    /// Used to avoid having to zero out the entire _packets_ array.
-    std::bitset<MAX_MESSAGE_PACKETS> occupied;
-
-    /// Collection of Packet objects that make up this context's Message.
-    /// These Packets will be released when this context is destroyed.
-    Driver::Packet* packets[MAX_MESSAGE_PACKETS];
-
-    Driver::Packet* getOrAllocPacket(uint16_t index);
+    uint32_t numPackets;
+
+    /// Index of the first packet that has not been set; all packets before it
+    /// are present.
+    uint32_t firstMissingIndex;
+
+    /// Number of packets whose pointers are stored in the Message itself;
+    /// most messages are small enough that they never need more.
+    static const uint16_t INLINE_PACKETS = 4;
+
+    /// The first INLINE_PACKETS Packet objects that make up this context's
+    /// Message; nullptr entries have not been set.  These Packets will be
+    /// released when this context is destroyed.
+    Driver::Packet* inlinePackets[INLINE_PACKETS];
+
+    /// Number of Packet pointers in each page of overflowPages.
+    static const uint32_t PACKETS_PER_PAGE = 1024;
+
+    /// The remaining Packet objects, starting at index INLINE_PACKETS, in
+    /// pages of PACKETS_PER_PAGE pointers.  Pages are only allocated once a
+    /// packet that belongs in them is set, so very large messages never need
+    /// one contiguous table and growing the table never copies it.
+    std::vector<std::unique_ptr<Driver::Packet*[]>> overflowPages;
+
+    Driver::Packet** getPacketSlot(uint32_t index);
+    Driver::Packet* getOrAllocPacket(uint32_t index);
+    void allocPackets(uint32_t firstIndex, uint32_t lastIndex);
+    void packetAdded(uint32_t index);
     void* getHeader();
 
     Message(const Message&) = delete;
@@ -25,10 +25,16 @@ namespace Homa {
 namespace Core {
 namespace {
 
+using ::testing::_;
+using ::testing::Args;
+using ::testing::ElementsAre;
 using ::testing::Eq;
 using ::testing::Exactly;
+using ::testing::Mock;
 using ::testing::NiceMock;
+using ::testing::Pointee;
 using ::testing::Return;
+using ::testing::SetArrayArgument;
 
 class MessageTest : public ::testing::Test {
   public:
@@ -83,20 +89,27 @@ TEST_F(MessageTest, constructor)
     EXPECT_EQ(0U, msg->MESSAGE_HEADER_LENGTH);
     EXPECT_EQ(10U, msg->messageLength);
     EXPECT_EQ(0U, msg->numPackets);
-    EXPECT_FALSE(msg->occupied.any());
+    for (int i = 0; i < Message::INLINE_PACKETS; ++i) {
+        EXPECT_EQ(nullptr, msg->inlinePackets[i]);
+    }
+    EXPECT_EQ(0U, msg->firstMissingIndex);
+    EXPECT_TRUE(msg->overflowPages.empty());
 }
 
 TEST_F(MessageTest, destructor)
 {
-    const uint16_t NUM_PKTS = 5;
-
-    msg->numPackets = NUM_PKTS;
-    for (int i = 0; i < NUM_PKTS; ++i) {
-        msg->occupied.set(i);
+    Driver::Packet* packets[6];
+    for (int i = 0; i < 6; ++i) {
+        packets[i] = (Driver::Packet*)(uintptr_t)(i + 1);
+        if (i != 2) {
+            msg->setPacket(i, packets[i]);
+        }
     }
+    EXPECT_EQ(1U, msg->overflowPages.size());
 
-    EXPECT_CALL(mockDriver, releasePackets(Eq(msg->packets), Eq(NUM_PKTS)))
-        .Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(_, Eq(5)))
+        .With(Args<0, 1>(ElementsAre(packets[0], packets[1], packets[3],
+                                     packets[4], packets[5])));
 }
 
 TEST_F(MessageTest, append_basic)
@@ -112,32 +125,58 @@ TEST_F(MessageTest, append_basic)
 
     EXPECT_EQ(20 + 2000 + 7, msg->messageLength);
     EXPECT_EQ(2U, msg->numPackets);
-    EXPECT_TRUE(msg->packets[1] == &packet1);
+    EXPECT_TRUE(msg->getPacket(1) == &packet1);
     EXPECT_EQ(28 + 20 + 2000, packet0.length);
     EXPECT_EQ(28 + 7, packet1.length);
     EXPECT_TRUE(std::memcmp(buf + 28 + 20 + 2000 - 7, source, 7) == 0);
     EXPECT_TRUE(std::memcmp(buf + 28 + 20 + 2000 + 28, source + 7, 7) == 0);
 }
 
+TEST_F(MessageTest, append_bulkAlloc)
+{
+    char source[2048 + 14];
+    std::memset(source, 'x', sizeof(source));
+    char extraBuf[4096];
+    Homa::Mock::MockDriver::MockPacket packet2(extraBuf);
+    Driver::Packet* newPackets[] = {&packet1, &packet2};
+    msg->setPacket(0, &packet0);
+    packet0.length = 28 + 2020 - 7;
+    msg->messageLength = 2020 - 7;
+
+    EXPECT_CALL(mockDriver, allocPacket).Times(0);
+    EXPECT_CALL(mockDriver, allocPackets(_, Eq(2)))
+        .WillOnce(SetArrayArgument<0>(newPackets, newPackets + 2));
+
+    msg->append(source, 7 + 2020 + 7);
+
+    EXPECT_EQ(2020 + 2020 + 7, msg->messageLength);
+    EXPECT_EQ(3U, msg->numPackets);
+    EXPECT_EQ(3U, msg->firstMissingIndex);
+    EXPECT_TRUE(msg->getPacket(1) == &packet1);
+    EXPECT_TRUE(msg->getPacket(2) == &packet2);
+    EXPECT_EQ(28 + 2020, packet1.length);
+    EXPECT_EQ(28 + 7, packet2.length);
+}
+
 TEST_F(MessageTest, append_truncated)
 {
     VectorHandler handler;
     Debug::setLogHandler(std::ref(handler));
 
     char source[] = "Hello, world!";
-    msg->setPacket(msg->MAX_MESSAGE_PACKETS - 1, &packet0);
-    packet0.length = msg->PACKET_HEADER_LENGTH + msg->PACKET_DATA_LENGTH - 7;
-    msg->messageLength = msg->PACKET_DATA_LENGTH * msg->MAX_MESSAGE_PACKETS - 7;
+    uint32_t lastIndex = (Message::MAX_MESSAGE_LENGTH - 7) / 2020;
+    uint32_t lastOffset = (Message::MAX_MESSAGE_LENGTH - 7) % 2020;
+    msg->setPacket(lastIndex, &packet0);
+    packet0.length = msg->PACKET_HEADER_LENGTH + lastOffset;
+    msg->messageLength = Message::MAX_MESSAGE_LENGTH - 7;
     EXPECT_EQ(1U, msg->numPackets);
 
     msg->append(source, 14);
 
-    EXPECT_EQ(msg->PACKET_DATA_LENGTH * msg->MAX_MESSAGE_PACKETS,
-              msg->messageLength);
+    EXPECT_EQ(uint32_t(Message::MAX_MESSAGE_LENGTH), msg->messageLength);
     EXPECT_EQ(1U, msg->numPackets);
-    EXPECT_EQ(msg->PACKET_HEADER_LENGTH + msg->PACKET_DATA_LENGTH,
-              packet0.length);
-    EXPECT_TRUE(std::memcmp(buf + 28 + 20 + 2000 - 7, source, 7) == 0);
+    EXPECT_EQ(msg->PACKET_HEADER_LENGTH + lastOffset + 7, packet0.length);
+    EXPECT_TRUE(std::memcmp(buf + 28 + lastOffset, source, 7) == 0);
 
     EXPECT_EQ(1U, handler.messages.size());
     const Debug::DebugMessage& m = handler.messages.at(0);
@@ -145,12 +184,140 @@ TEST_F(MessageTest, append_truncated)
     EXPECT_STREQ("append", m.function);
     EXPECT_EQ(int(Debug::LogLevel::WARNING), m.logLevel);
     EXPECT_EQ(
-        "Max message size limit (2068480B) reached; 7 of 14 bytes appended",
+        "Max message size limit (4294967295B) reached; 7 of 14 bytes appended",
         m.message);
 
     Debug::setLogHandler(std::function<void(Debug::DebugMessage)>());
 }
 
+TEST_F(MessageTest, reserve_basic)
+{
+    msg->setPacket(0, &packet0);
+    packet0.length = 28 + 20 + 2000 - 7;
+    msg->messageLength = 20 + 2000 - 7;
+
+    EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&packet1));
+
+    Homa::Message::WritableSpan spans[4];
+    uint32_t numSpans = msg->reserve(14, spans, 4);
+
+    EXPECT_EQ(2U, numSpans);
+    EXPECT_EQ(buf + 28 + 20 + 2000 - 7, spans[0].data);
+    EXPECT_EQ(7U, spans[0].length);
+    EXPECT_EQ(buf + 2048 + 28, spans[1].data);
+    EXPECT_EQ(7U, spans[1].length);
+    EXPECT_EQ(2U, msg->numPackets);
+    // Nothing is added to the Message until it is committed.
+    EXPECT_EQ(20 + 2000 - 7, msg->messageLength);
+    EXPECT_EQ(28 + 20 + 2000 - 7, packet0.length);
+    EXPECT_EQ(28, packet1.length);
+}
+
+TEST_F(MessageTest, reserve_bulkAlloc)
+{
+    char extraBuf[4096];
+    Homa::Mock::MockDriver::MockPacket packet2(extraBuf);
+    Driver::Packet* newPackets[] = {&packet1, &packet2};
+    msg->setPacket(0, &packet0);
+    packet0.length = 28 + 2020 - 7;
+    msg->messageLength = 2020 - 7;
+
+    EXPECT_CALL(mockDriver, allocPacket).Times(0);
+    EXPECT_CALL(mockDriver, allocPackets(_, Eq(2)))
+        .WillOnce(SetArrayArgument<0>(newPackets, newPackets + 2));
+
+    // Only as many packets as there are spans are allocated.
+    Homa::Message::WritableSpan spans[3];
+    uint32_t numSpans = msg->reserve(2020 * 3, spans, 3);
+
+    EXPECT_EQ(3U, numSpans);
+    EXPECT_EQ(buf + 2048 + 28, spans[1].data);
+    EXPECT_EQ(2020U, spans[1].length);
+    EXPECT_EQ(extraBuf + 28, spans[2].data);
+    EXPECT_EQ(2020U, spans[2].length);
+    EXPECT_EQ(3U, msg->numPackets);
+    EXPECT_EQ(2020 - 7, msg->messageLength);
+    EXPECT_EQ(28, packet2.length);
+}
+
+TEST_F(MessageTest, reserve_maxSpans)
+{
+    msg->setPacket(0, &packet0);
+    packet0.length = 28 + 20 + 2000 - 7;
+    msg->messageLength = 20 + 2000 - 7;
+
+    EXPECT_CALL(mockDriver, allocPacket).Times(0);
+    EXPECT_CALL(mockDriver, allocPackets).Times(0);
+
+    Homa::Message::WritableSpan spans[1];
+    uint32_t numSpans = msg->reserve(14, spans, 1);
+
+    EXPECT_EQ(1U, numSpans);
+    EXPECT_EQ(7U, spans[0].length);
+    EXPECT_EQ(1U, msg->numPackets);
+}
+
+TEST_F(MessageTest, reserve_truncated)
+{
+    uint32_t lastIndex = (Message::MAX_MESSAGE_LENGTH - 7) / 2020;
+    uint32_t lastOffset = (Message::MAX_MESSAGE_LENGTH - 7) % 2020;
+    msg->setPacket(lastIndex, &packet0);
+    msg->messageLength = Message::MAX_MESSAGE_LENGTH - 7;
+
+    Homa::Message::WritableSpan spans[4];
+    uint32_t numSpans = msg->reserve(14, spans, 4);
+
+    EXPECT_EQ(1U, numSpans);
+    EXPECT_EQ(buf + 28 + lastOffset, spans[0].data);
+    EXPECT_EQ(7U, spans[0].length);
+}
+
+TEST_F(MessageTest, commit)
+{
+    char source[] = "Hello, world!";
+    msg->setPacket(0, &packet0);
+    packet0.length = 28 + 20 + 2000 - 7;
+    msg->messageLength = 20 + 2000 - 7;
+    EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&packet1));
+    Homa::Message::WritableSpan spans[4];
+    EXPECT_EQ(2U, msg->reserve(14, spans, 4));
+    std::memcpy(spans[0].data, source, spans[0].length);
+    std::memcpy(spans[1].data, source + 7, spans[1].length);
+
+    msg->commit(14);
+
+    EXPECT_EQ(20 + 2000 + 7, msg->messageLength);
+    EXPECT_EQ(2U, msg->numPackets);
+    EXPECT_EQ(28 + 20 + 2000, packet0.length);
+    EXPECT_EQ(28 + 7, packet1.length);
+    char dest[14];
+    msg->MESSAGE_HEADER_LENGTH = 20;
+    EXPECT_EQ(14U, msg->get(2000 - 7, dest, 14));
+    EXPECT_TRUE(std::memcmp(source, dest, 14) == 0);
+}
+
+TEST_F(MessageTest, commit_releaseUnused)
+{
+    msg->setPacket(0, &packet0);
+    packet0.length = 28 + 20 + 2000 - 7;
+    msg->messageLength = 20 + 2000 - 7;
+    EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&packet1));
+    Homa::Message::WritableSpan spans[4];
+    EXPECT_EQ(2U, msg->reserve(14, spans, 4));
+
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&packet1), Eq(1)))
+        .Times(1);
+
+    msg->commit(5);
+
+    EXPECT_EQ(20 + 2000 - 2, msg->messageLength);
+    EXPECT_EQ(1U, msg->numPackets);
+    EXPECT_EQ(nullptr, msg->getPacket(1));
+    EXPECT_EQ(1U, msg->firstMissingIndex);
+    EXPECT_EQ(28 + 20 + 2000 - 2, packet0.length);
+    Mock::VerifyAndClearExpectations(&mockDriver);
+}
+
 TEST_F(MessageTest, get_basic)
 {
     char source[] = "Hello, world!";
@@ -171,6 +338,19 @@ TEST_F(MessageTest, get_basic)
     EXPECT_STREQ(source, dest);
 }
 
+TEST_F(MessageTest, get_numTooLarge)
+{
+    msg->setPacket(0, &packet0);
+    msg->setPacket(1, &packet1);
+    msg->messageLength = 20 + 2007;
+    msg->MESSAGE_HEADER_LENGTH = 20;
+
+    // Asking for "the rest" must not wrap past the end of the message.
+    char dest[4096];
+    EXPECT_EQ(14U, msg->get(2000 - 7, dest, UINT32_MAX));
+    EXPECT_EQ(7U, msg->get(2000, dest, UINT32_MAX - 2000));
+}
+
 TEST_F(MessageTest, get_offsetTooLarge)
 {
     msg->setPacket(0, &packet0);
@@ -187,6 +367,18 @@ TEST_F(MessageTest, get_offsetTooLarge)
     EXPECT_EQ(0U, bytes);
 }
 
+TEST_F(MessageTest, get_offsetWraps)
+{
+    msg->setPacket(0, &packet0);
+    msg->setPacket(1, &packet1);
+    msg->messageLength = 20 + 2007;
+    msg->MESSAGE_HEADER_LENGTH = 20;
+
+    // offset + MESSAGE_HEADER_LENGTH wraps around to 14.
+    char dest[4096];
+    EXPECT_EQ(0U, msg->get(UINT32_MAX - 5, dest, 20));
+}
+
 TEST_F(MessageTest, get_missingPacket)
 {
     VectorHandler handler;
@@ -216,6 +408,164 @@ TEST_F(MessageTest, get_missingPacket)
     Debug::setLogHandler(std::function<void(Debug::DebugMessage)>());
 }
 
+TEST_F(MessageTest, getSpans_basic)
+{
+    msg->setPacket(0, &packet0);
+    msg->setPacket(1, &packet1);
+    msg->messageLength = 20 + 2007;
+    packet0.length = 28 + 20 + 2000;
+    packet1.length = 28 + 7;
+    msg->MESSAGE_HEADER_LENGTH = 20;
+
+    Homa::Message::Span spans[4];
+    uint32_t numSpans = msg->getSpans(2000 - 7, 20, spans, 4);
+
+    EXPECT_EQ(2U, numSpans);
+    EXPECT_EQ(buf + 28 + 20 + 2000 - 7, spans[0].data);
+    EXPECT_EQ(7U, spans[0].length);
+    EXPECT_EQ(buf + 2048 + 28, spans[1].data);
+    EXPECT_EQ(7U, spans[1].length);
+}
+
+TEST_F(MessageTest, getSpans_maxSpans)
+{
+    msg->setPacket(0, &packet0);
+    msg->setPacket(1, &packet1);
+    msg->messageLength = 20 + 2007;
+    msg->MESSAGE_HEADER_LENGTH = 20;
+
+    Homa::Message::Span spans[1];
+    uint32_t numSpans = msg->getSpans(0, 2007, spans, 1);
+
+    EXPECT_EQ(1U, numSpans);
+    EXPECT_EQ(buf + 28 + 20, spans[0].data);
+    EXPECT_EQ(2000U, spans[0].length);
+}
+
+TEST_F(MessageTest, getSpans_numTooLarge)
+{
+    msg->setPacket(0, &packet0);
+    msg->setPacket(1, &packet1);
+    msg->messageLength = 20 + 2007;
+    msg->MESSAGE_HEADER_LENGTH = 20;
+
+    // Asking for "the rest" must not wrap past the end of the message.
+    Homa::Message::Span spans[4];
+    uint32_t numSpans = msg->getSpans(2000 - 7, UINT32_MAX, spans, 4);
+
+    EXPECT_EQ(2U, numSpans);
+    EXPECT_EQ(7U, spans[0].length);
+    EXPECT_EQ(7U, spans[1].length);
+}
+
+TEST_F(MessageTest, getSpans_offsetTooLarge)
+{
+    msg->setPacket(0, &packet0);
+    msg->setPacket(1, &packet1);
+    msg->messageLength = 20 + 2007;
+    msg->MESSAGE_HEADER_LENGTH = 20;
+
+    Homa::Message::Span spans[4];
+    EXPECT_EQ(0U, msg->getSpans(4000, 20, spans, 4));
+    // offset + MESSAGE_HEADER_LENGTH wraps around to 14.
+    EXPECT_EQ(0U, msg->getSpans(UINT32_MAX - 5, 20, spans, 4));
+}
+
+TEST_F(MessageTest, getSpans_missingPacket)
+{
+    VectorHandler handler;
+    Debug::setLogHandler(std::ref(handler));
+
+    msg->setPacket(0, &packet0);
+    msg->messageLength = 20 + 2007;
+    msg->MESSAGE_HEADER_LENGTH = 20;
+
+    Homa::Message::Span spans[4];
+    uint32_t numSpans = msg->getSpans(2000 - 7, 20, spans, 4);
+
+    EXPECT_EQ(1U, numSpans);
+    EXPECT_EQ(7U, spans[0].length);
+
+    EXPECT_EQ(1U, handler.messages.size());
+    const Debug::DebugMessage& m = handler.messages.at(0);
+    EXPECT_STREQ("getSpans", m.function);
+    EXPECT_EQ(int(Debug::LogLevel::ERROR), m.logLevel);
+    EXPECT_EQ("Message is missing data starting at packet index 1", m.message);
+
+    Debug::setLogHandler(std::function<void(Debug::DebugMessage)>());
+}
+
+TEST_F(MessageTest, peek_basic)
+{
+    msg->setPacket(0, &packet0);
+    msg->setPacket(1, &packet1);
+    msg->messageLength = 20 + 2007;
+    msg->MESSAGE_HEADER_LENGTH = 20;
+
+    EXPECT_EQ(buf + 28 + 20 + 10, msg->peek(10, 100));
+    EXPECT_EQ(buf + 2048 + 28 + 1, msg->peek(2001, 6));
+}
+
+TEST_F(MessageTest, peek_notContiguous)
+{
+    msg->setPacket(0, &packet0);
+    msg->setPacket(1, &packet1);
+    msg->messageLength = 20 + 2007;
+    msg->MESSAGE_HEADER_LENGTH = 20;
+
+    EXPECT_EQ(nullptr, msg->peek(2000 - 7, 8));
+}
+
+TEST_F(MessageTest, peek_outOfRange)
+{
+    msg->setPacket(0, &packet0);
+    msg->setPacket(1, &packet1);
+    msg->messageLength = 20 + 2007;
+    msg->MESSAGE_HEADER_LENGTH = 20;
+
+    EXPECT_EQ(nullptr, msg->peek(2001, 7));
+    // offset + MESSAGE_HEADER_LENGTH wraps around to 14.
+    EXPECT_EQ(nullptr, msg->peek(UINT32_MAX - 5, 4));
+}
+
+TEST_F(MessageTest, peek_numTooLarge)
+{
+    msg->setPacket(0, &packet0);
+    msg->setPacket(1, &packet1);
+    msg->messageLength = 20 + 2007;
+    msg->MESSAGE_HEADER_LENGTH = 20;
+
+    EXPECT_EQ(nullptr, msg->peek(10, UINT32_MAX));
+    EXPECT_EQ(nullptr, msg->peek(10, UINT32_MAX - 20));
+}
+
+TEST_F(MessageTest, peek_missingPacket)
+{
+    msg->setPacket(0, &packet0);
+    msg->messageLength = 20 + 2007;
+    msg->MESSAGE_HEADER_LENGTH = 20;
+
+    EXPECT_EQ(nullptr, msg->peek(2001, 6));
+}
+
+TEST_F(MessageTest, peek_template)
+{
+    struct Header {
+        uint64_t a;
+        uint32_t b;
+    } __attribute__((packed));
+
+    msg->setPacket(0, &packet0);
+    msg->messageLength = 20 + 100;
+    msg->MESSAGE_HEADER_LENGTH = 20;
+    Homa::Message* base = msg;
+
+    EXPECT_EQ(reinterpret_cast<Header*>(buf + 28 + 20), base->peek<Header>());
+    EXPECT_EQ(reinterpret_cast<Header*>(buf + 28 + 20 + 8),
+              base->peek<Header>(8));
+    EXPECT_EQ(nullptr, base->peek<Header>(100 - 11));
+}
+
 TEST_F(MessageTest, length)
 {
     msg->messageLength = 200;
@@ -226,29 +576,90 @@ TEST_F(MessageTest, length)
 TEST_F(MessageTest, getPacket)
 {
     Driver::Packet* packet = (Driver::Packet*)42;
-    msg->packets[0] = packet;
 
     EXPECT_EQ(nullptr, msg->getPacket(0));
+    EXPECT_EQ(nullptr, msg->getPacket(Message::INLINE_PACKETS));
 
-    msg->occupied.set(0);
+    msg->inlinePackets[0] = packet;
+    *msg->getPacketSlot(Message::INLINE_PACKETS) = packet;
 
     EXPECT_EQ(packet, msg->getPacket(0));
+    EXPECT_EQ(packet, msg->getPacket(Message::INLINE_PACKETS));
+    EXPECT_EQ(nullptr, msg->getPacket(Message::INLINE_PACKETS + 1));
+    EXPECT_EQ(nullptr, msg->getPacket(Message::INLINE_PACKETS +
+                                      Message::PACKETS_PER_PAGE));
 }
 
 TEST_F(MessageTest, setPacket)
 {
     Driver::Packet* packet = (Driver::Packet*)42;
 
-    EXPECT_FALSE(msg->occupied.test(0));
     EXPECT_EQ(0U, msg->numPackets);
 
     EXPECT_TRUE(msg->setPacket(0, packet));
 
-    EXPECT_EQ(packet, msg->packets[0]);
-    EXPECT_TRUE(msg->occupied.test(0));
+    EXPECT_EQ(packet, msg->inlinePackets[0]);
     EXPECT_EQ(1U, msg->numPackets);
+    EXPECT_EQ(1U, msg->firstMissingIndex);
 
     EXPECT_FALSE(msg->setPacket(0, packet));
+
+    EXPECT_TRUE(msg->setPacket(Message::INLINE_PACKETS + 1, packet));
+
+    EXPECT_EQ(1U, msg->overflowPages.size());
+    EXPECT_EQ(nullptr, msg->overflowPages[0][0]);
+    EXPECT_EQ(packet, msg->overflowPages[0][1]);
+    EXPECT_EQ(2U, msg->numPackets);
+    EXPECT_EQ(1U, msg->firstMissingIndex);
+}
+
+TEST_F(MessageTest, getFirstMissingIndex)
+{
+    Driver::Packet* packet = (Driver::Packet*)42;
+    EXPECT_EQ(0U, msg->getFirstMissingIndex());
+
+    msg->setPacket(1, packet);
+    msg->setPacket(2, packet);
+    msg->setPacket(4, packet);
+    EXPECT_EQ(0U, msg->getFirstMissingIndex());
+
+    msg->setPacket(0, packet);
+    EXPECT_EQ(3U, msg->getFirstMissingIndex());
+
+    msg->setPacket(3, packet);
+    EXPECT_EQ(5U, msg->getFirstMissingIndex());
+}
+
+TEST_F(MessageTest, getPacketSlot)
+{
+    EXPECT_EQ(&msg->inlinePackets[3], msg->getPacketSlot(3));
+    EXPECT_TRUE(msg->overflowPages.empty());
+
+    Driver::Packet** slot = msg->getPacketSlot(4);
+
+    EXPECT_EQ(1U, msg->overflowPages.size());
+    EXPECT_EQ(&msg->overflowPages[0][0], slot);
+    EXPECT_EQ(nullptr, *slot);
+
+    slot = msg->getPacketSlot(4 + 2 * Message::PACKETS_PER_PAGE + 1);
+
+    EXPECT_EQ(3U, msg->overflowPages.size());
+    EXPECT_FALSE(msg->overflowPages[1]);
+    EXPECT_EQ(&msg->overflowPages[2][1], slot);
+}
+
+TEST_F(MessageTest, getPacketSlot_knownLength)
+{
+    // Inbound messages know their length up front; size the list of pages
+    // for the whole message on first use but only allocate the pages used.
+    msg->messageLength = 2020 * 3000;
+
+    EXPECT_EQ(&msg->overflowPages[0][0], msg->getPacketSlot(4));
+
+    EXPECT_EQ(3U, msg->overflowPages.size());
+    EXPECT_TRUE(msg->overflowPages[0]);
+    EXPECT_FALSE(msg->overflowPages[1]);
+    EXPECT_FALSE(msg->overflowPages[2]);
 }
 
 TEST_F(MessageTest, getNumPackets)
@@ -288,21 +699,63 @@ TEST_F(MessageTest, defineHeader_emptyMessage)
 
 TEST_F(MessageTest, getOrAllocPacket)
 {
-    EXPECT_FALSE(msg->occupied.test(0));
+    EXPECT_EQ(nullptr, msg->getPacket(0));
     EXPECT_EQ(0U, msg->numPackets);
     EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&packet0));
 
     EXPECT_TRUE(&packet0 == msg->getOrAllocPacket(0));
 
-    EXPECT_TRUE(msg->occupied.test(0));
+    EXPECT_EQ(&packet0, msg->getPacket(0));
     EXPECT_EQ(1U, msg->numPackets);
 
     EXPECT_TRUE(&packet0 == msg->getOrAllocPacket(0));
 
-    EXPECT_TRUE(msg->occupied.test(0));
+    EXPECT_EQ(&packet0, msg->getPacket(0));
     EXPECT_EQ(1U, msg->numPackets);
 }
 
+TEST_F(MessageTest, allocPackets)
+{
+    Driver::Packet* packets[40];
+    for (int i = 0; i < 40; ++i) {
+        packets[i] = (Driver::Packet*)(uintptr_t)(i + 1);
+    }
+    Homa::Mock::MockDriver::MockPacket* newPackets[40];
+    char extraBuf[40];
+    for (int i = 0; i < 40; ++i) {
+        newPackets[i] = new Homa::Mock::MockDriver::MockPacket(extraBuf + i);
+    }
+    msg->setPacket(1, packets[1]);
+    msg->setPacket(5, packets[5]);
+
+    // 38 missing packets in [0, 39] are allocated in batches of 32 and 6.
+    EXPECT_CALL(mockDriver, allocPackets(_, Eq(32)))
+        .WillOnce(SetArrayArgument<0>(newPackets, newPackets + 32));
+    EXPECT_CALL(mockDriver, allocPackets(_, Eq(6)))
+        .WillOnce(SetArrayArgument<0>(newPackets + 32, newPackets + 38));
+
+    msg->allocPackets(0, 39);
+
+    EXPECT_EQ(40U, msg->numPackets);
+    EXPECT_EQ(40U, msg->firstMissingIndex);
+    EXPECT_EQ(newPackets[0], msg->getPacket(0));
+    EXPECT_EQ(packets[1], msg->getPacket(1));
+    EXPECT_EQ(newPackets[1], msg->getPacket(2));
+    EXPECT_EQ(packets[5], msg->getPacket(5));
+    EXPECT_EQ(newPackets[37], msg->getPacket(39));
+    EXPECT_EQ(28U, newPackets[37]->length);
+
+    // Keep the Message from releasing the placeholder packets.
+    msg->inlinePackets[1] = nullptr;
+    msg->overflowPages[0][1] = nullptr;
+    EXPECT_CALL(mockDriver, releasePackets).Times(2);
+    delete msg;
+    msg = nullptr;
+    for (int i = 0; i < 40; ++i) {
+        delete newPackets[i];
+    }
+}
+
 TEST_F(MessageTest, getHeader)
 {
     msg->setPacket(0, &packet0);
@@ -59,6 +59,7 @@ class MockDriver : public Driver {
     MOCK_METHOD1(getAddress, Address*(std::string const* const addressString));
     MOCK_METHOD1(getAddress, Address*(Address::Raw const* const rawAddress));
     MOCK_METHOD0(allocPacket, Packet*());
+    MOCK_METHOD2(allocPackets, void(Packet* packets[], uint16_t numPackets));
     MOCK_METHOD2(sendPackets, void(Packet* packets[], uint16_t numPackets));
     MOCK_METHOD2(receivePackets,
                  uint32_t(uint32_t maxPackets, Packet* receivedPackets[]));
@@ -31,6 +31,10 @@ namespace Mock {
  */
 class MockSender : public Core::Sender {
   public:
+    MockSender()
+        : Sender(nullptr)
+    {}
+
     MOCK_METHOD2(handleDonePacket,
                  void(Driver::Packet* packet, Driver* driver));
     MOCK_METHOD2(handleGrantPacket,
@@ -42,8 +46,15 @@ class MockSender : public Core::Sender {
     MOCK_METHOD4(sendMessage,
                  void(Protocol::MessageId id, Driver::Address* destination,
                       Core::Transport::Op* op, bool expectAcknowledgement));
+    MOCK_METHOD5(sendMessages,
+                 void(size_t numMessages, const Protocol::MessageId ids[],
+                      Driver::Address* const destinations[],
+                      Core::Transport::Op* const ops[],
+                      bool expectAcknowledgement));
     MOCK_METHOD1(dropMessage, void(Core::Transport::Op* op));
     MOCK_METHOD0(poll, void());
+    MOCK_METHOD0(getNicQueuedBytes, uint32_t());
+    MOCK_METHOD0(getNumReadyPackets, uint32_t());
 };
 
 }  // namespace Mock
@@ -0,0 +1,150 @@
+/* Copyright (c) 2019, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_CORE_MPSCQUEUE_H
+#define HOMA_CORE_MPSCQUEUE_H
+
+#include <atomic>
+
+namespace Homa {
+namespace Core {
+
+/**
+ * An intrusive, lock-free, multi-producer single-consumer FIFO queue.
+ *
+ * Elements are linked through a Node embedded in each element so pushing and
+ * popping never allocate memory.  Any number of threads may push() at the same
+ * time; only one thread at a time may call pop().
+ *
+ * An element must not be pushed while it is already in the queue and must not
+ * be destroyed until it has been popped.
+ *
+ * @tparam ElementType
+ *      Type of the object that owns each Node.
+ */
+template <typename ElementType>
+class MpscQueue {
+  public:
+    /**
+     * Intrusive hook that allows an object to be added to an MpscQueue.
+     */
+    class Node {
+      public:
+        /**
+         * Node constructor.
+         *
+         * @param owner
+         *      Object that will be returned by MpscQueue::pop() when this Node
+         *      is removed from the queue.
+         */
+        explicit Node(ElementType* owner = nullptr)
+            : owner(owner)
+            , next(nullptr)
+        {}
+
+        /// Object to which this Node belongs.
+        ElementType* const owner;
+
+      private:
+        /// Node that was pushed after this one.
+        std::atomic<Node*> next;
+
+        friend class MpscQueue;
+
+        Node(const Node&) = delete;
+        Node& operator=(const Node&) = delete;
+    };
+
+    /**
+     * MpscQueue constructor.
+     */
+    MpscQueue()
+        : stub()
+        , head(&stub)
+        , tail(&stub)
+    {}
+
+    /**
+     * Add a Node to the back of the queue.  Safe to call concurrently with
+     * any other method.
+     *
+     * @param node
+     *      Node to be added.
+     */
+    void push(Node* node)
+    {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        Node* prev = head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    /**
+     * Remove the Node at the front of the queue and return its owner; returns
+     * nullptr if the queue is empty.  May also return nullptr if a concurrent
+     * push() has not yet finished linking its Node; the Node will be returned
+     * by a later call.
+     *
+     * Must not be called concurrently with itself.
+     */
+    ElementType* pop()
+    {
+        Node* node = tail;
+        Node* next = node->next.load(std::memory_order_acquire);
+        if (node == &stub) {
+            if (next == nullptr) {
+                return nullptr;
+            }
+            // Skip past the stub.
+            tail = next;
+            node = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr) {
+            tail = next;
+            return node->owner;
+        }
+        if (node != head.load(std::memory_order_acquire)) {
+            // A push() is in progress.
+            return nullptr;
+        }
+        // node is the last Node; re-add the stub so that node can be removed.
+        push(&stub);
+        next = node->next.load(std::memory_order_acquire);
+        if (next != nullptr) {
+            tail = next;
+            return node->owner;
+        }
+        return nullptr;
+    }
+
+  private:
+    /// Placeholder Node that keeps the queue from ever being empty so that
+    /// push() and pop() never touch the same Node.
+    Node stub;
+
+    /// Most recently pushed Node; producers add Node objects after it.
+    std::atomic<Node*> head;
+
+    /// Next Node to be popped; only accessed by the consumer.
+    Node* tail;
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+};
+
+}  // namespace Core
+}  // namespace Homa
+
+#endif  // HOMA_CORE_MPSCQUEUE_H
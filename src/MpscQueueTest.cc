@@ -0,0 +1,135 @@
+/* Copyright (c) 2019, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include "MpscQueue.h"
+
+#include <thread>
+#include <vector>
+
+namespace Homa {
+namespace Core {
+namespace {
+
+struct Element {
+    Element()
+        : node(this)
+    {}
+
+    MpscQueue<Element>::Node node;
+};
+
+TEST(MpscQueueTest, constructor)
+{
+    MpscQueue<Element> queue;
+    EXPECT_EQ(&queue.stub, queue.head.load());
+    EXPECT_EQ(&queue.stub, queue.tail);
+    EXPECT_EQ(nullptr, queue.pop());
+}
+
+TEST(MpscQueueTest, push)
+{
+    MpscQueue<Element> queue;
+    Element e[2];
+
+    queue.push(&e[0].node);
+    EXPECT_EQ(&e[0].node, queue.head.load());
+    EXPECT_EQ(&e[0].node, queue.stub.next.load());
+
+    queue.push(&e[1].node);
+    EXPECT_EQ(&e[1].node, queue.head.load());
+    EXPECT_EQ(&e[1].node, e[0].node.next.load());
+    EXPECT_EQ(nullptr, e[1].node.next.load());
+}
+
+TEST(MpscQueueTest, pop)
+{
+    MpscQueue<Element> queue;
+    Element e[3];
+    queue.push(&e[0].node);
+    queue.push(&e[1].node);
+
+    EXPECT_EQ(&e[0], queue.pop());
+    EXPECT_EQ(&e[1], queue.pop());
+    EXPECT_EQ(nullptr, queue.pop());
+
+    // Reuse after the queue has been emptied.
+    queue.push(&e[1].node);
+    queue.push(&e[2].node);
+    queue.push(&e[0].node);
+    EXPECT_EQ(&e[1], queue.pop());
+    EXPECT_EQ(&e[2], queue.pop());
+    EXPECT_EQ(&e[0], queue.pop());
+    EXPECT_EQ(nullptr, queue.pop());
+}
+
+TEST(MpscQueueTest, pop_pushInProgress)
+{
+    MpscQueue<Element> queue;
+    Element e[2];
+    queue.push(&e[0].node);
+
+    // Simulate a push() that has swapped the head but not yet linked.
+    e[1].node.next.store(nullptr);
+    queue.head.store(&e[1].node);
+
+    EXPECT_EQ(nullptr, queue.pop());
+
+    e[0].node.next.store(&e[1].node);
+    EXPECT_EQ(&e[0], queue.pop());
+    EXPECT_EQ(&e[1], queue.pop());
+    EXPECT_EQ(nullptr, queue.pop());
+}
+
+TEST(MpscQueueTest, concurrentPush)
+{
+    const int NUM_THREADS = 4;
+    const int NUM_ELEMENTS = 1000;
+    MpscQueue<Element> queue;
+    std::vector<Element> elements(NUM_THREADS * NUM_ELEMENTS);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < NUM_THREADS; ++t) {
+        threads.emplace_back([&queue, &elements, t] {
+            for (int i = 0; i < NUM_ELEMENTS; ++i) {
+                queue.push(&elements[t * NUM_ELEMENTS + i].node);
+            }
+        });
+    }
+
+    int count = 0;
+    std::vector<int> lastIndex(NUM_THREADS, -1);
+    while (count < NUM_THREADS * NUM_ELEMENTS) {
+        Element* element = queue.pop();
+        if (element == nullptr) {
+            continue;
+        }
+        // Elements from the same thread come out in the order they went in.
+        int index = static_cast<int>(element - elements.data());
+        int t = index / NUM_ELEMENTS;
+        EXPECT_LT(lastIndex[t], index);
+        lastIndex[t] = index;
+        ++count;
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    EXPECT_EQ(nullptr, queue.pop());
+}
+
+}  // namespace
+}  // namespace Core
+}  // namespace Homa
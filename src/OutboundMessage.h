@@ -20,6 +20,7 @@
 
 #include "Message.h"
 #include "Protocol.h"
+#include "TimerWheel.h"
 
 namespace Homa {
 namespace Core {
@@ -41,9 +42,18 @@ class OutboundMessage {
         , destination(nullptr)
         , message(driver, sizeof(Protocol::Packet::DataHeader), 0)
         , grantIndex(0)
+        , unscheduledIndexLimit(0)
+        , scheduledPriority(0)
         , sentIndex(0)
+        , resendIndex(0)
+        , resendEnd(0)
+        , unsentBytes(0)
         , sent(false)
         , acknowledged(true)
+        , active(false)
+        , timer(this)
+        , timeoutCount(0)
+        , rttStartTime(0)
     {}
 
     /**
@@ -73,14 +83,41 @@ class OutboundMessage {
     /// Collection of packets to be sent.
     Message message;
     /// Packets up to (but excluding) this index can be sent.
-    uint16_t grantIndex;
+    uint32_t grantIndex;
+    /// Packets up to (but excluding) this index are unscheduled; they are sent
+    /// without waiting for a GRANT.
+    uint32_t unscheduledIndexLimit;
+    /// Network priority for scheduled packets, as requested by the most recent
+    /// GRANT.
+    int scheduledPriority;
     /// Packets up to (but excluding) this index have been sent.
-    uint16_t sentIndex;
+    uint32_t sentIndex;
+    /// Packets from this index up to (but excluding) resendEnd were requested
+    /// by a RESEND and are waiting to be sent again.
+    uint32_t resendIndex;
+    /// See resendIndex; no packets are waiting to be resent if resendIndex is
+    /// not less than resendEnd.
+    uint32_t resendEnd;
+    /// Number of bytes of this message that have not yet been sent; used by
+    /// the Sender to order messages in SRPT order.
+    uint32_t unsentBytes;
     /// True if this message has been fully sent; false, otherwise.
     bool sent;
     /// True if this message is no longer waiting for a DONE acknowledgement;
     /// false, otherwise.
     bool acknowledged;
+    /// True if a control packet for this message has been received since the
+    /// last timeout; false, otherwise.
+    bool active;
+    /// Used to periodically check that the destination is still alive.
+    TimerWheel<OutboundMessage>::Timer timer;
+    /// Number of consecutive timeouts since a control packet for this message
+    /// was last received.
+    uint32_t timeoutCount;
+    /// Time (in cycles) at which the first packet of this message was handed
+    /// to the Driver; 0 if it has not been sent yet or once the first GRANT
+    /// to arrive afterwards has been used as an RTT sample.
+    uint64_t rttStartTime;
 
     friend class Sender;
 };
@@ -0,0 +1,310 @@
+/* Copyright (c) 2019, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "Policy.h"
+
+#include <Homa/Util.h>
+
+#include <algorithm>
+#include <limits>
+
+namespace Homa {
+namespace Core {
+namespace Policy {
+
+namespace {
+/// Message length (in bytes) cutoffs used for the unscheduled priority levels
+/// until a receiver advertises cutoffs of its own.  Messages no longer than
+/// DEFAULT_CUTOFFS[i] are sent i levels below the highest priority level;
+/// longer messages use the lowest unscheduled level.
+const uint32_t DEFAULT_CUTOFFS[] = {1000, 10000, 100000};
+
+/// Round-trip time (in nanoseconds) assumed for peers whose RTT has not yet
+/// been measured.
+const uint64_t DEFAULT_RTT_NS = 5000;
+}  // namespace
+
+/**
+ * Return the lowest priority level used for unscheduled packets.  The upper
+ * half of the Driver's priority levels (rounded up) is reserved for
+ * unscheduled packets.
+ *
+ * @param driver
+ *      Driver whose priority levels should be used.
+ */
+int
+getMinUnscheduledPriority(Driver* driver)
+{
+    int numPriorities = driver->getHighestPacketPriority() + 1;
+    return numPriorities / 2;
+}
+
+/**
+ * Return the highest priority level used for scheduled packets; scheduled
+ * packets use the levels below getMinUnscheduledPriority().  If the Driver
+ * only supports a single priority level, scheduled and unscheduled packets
+ * share it.
+ *
+ * @param driver
+ *      Driver whose priority levels should be used.
+ */
+int
+getMaxScheduledPriority(Driver* driver)
+{
+    return std::max(getMinUnscheduledPriority(driver) - 1, 0);
+}
+
+/**
+ * Return the priority at which the unscheduled packets of a message should be
+ * sent; shorter messages are given higher priorities.
+ *
+ * @param driver
+ *      Driver with which the message will be sent.
+ * @param cutoffs
+ *      Cutoffs advertised by the message's receiver.  Default cutoffs are used
+ *      if the receiver has not advertised any (version 0).
+ * @param messageLength
+ *      Number of bytes in the message.
+ */
+int
+getUnscheduledPriority(Driver* driver,
+                       const Protocol::Packet::UnscheduledCutoffs& cutoffs,
+                       uint32_t messageLength)
+{
+    bool useDefault = (cutoffs.version == 0);
+    uint32_t numLimits =
+        useDefault ? Util::arrayLength(DEFAULT_CUTOFFS)
+                   : Protocol::Packet::UnscheduledCutoffs::MAX_CUTOFFS;
+    int priority = driver->getHighestPacketPriority();
+    for (uint32_t i = 0; i < numLimits; ++i) {
+        uint32_t limit = useDefault ? DEFAULT_CUTOFFS[i] : cutoffs.cutoffs[i];
+        if (messageLength <= limit) {
+            break;
+        }
+        --priority;
+    }
+    return std::max(priority, getMinUnscheduledPriority(driver));
+}
+
+/**
+ * Return the priority a Receiver should ask a Sender to use for the scheduled
+ * packets of a message.  The message with rank 0 (fewest bytes remaining) gets
+ * the highest priority in use.  When fewer messages are scheduled than there
+ * are scheduled priority levels, only the lowest levels are used so that
+ * newly arriving shorter messages can preempt the current ones.
+ *
+ * @param driver
+ *      Driver whose priority levels should be used.
+ * @param rank
+ *      Position of the message among the scheduled messages, in SRPT order.
+ * @param numScheduled
+ *      Number of messages that are being granted to; must be greater than
+ *      rank.
+ */
+int
+getScheduledPriority(Driver* driver, uint32_t rank, uint32_t numScheduled)
+{
+    assert(rank < numScheduled);
+    int topPriority = std::min(getMaxScheduledPriority(driver),
+                               Util::downCast<int>(numScheduled - 1));
+    return std::max(topPriority - Util::downCast<int>(rank), 0);
+}
+
+/**
+ * MessageSizeHistogram constructor.
+ */
+MessageSizeHistogram::MessageSizeHistogram()
+    : counts()
+    , numSamples(0)
+{}
+
+/**
+ * Count the length of a newly arriving message.
+ *
+ * @param messageLength
+ *      Number of bytes in the message.
+ */
+void
+MessageSizeHistogram::record(uint32_t messageLength)
+{
+    counts[getBucket(messageLength)]++;
+    numSamples++;
+    if (numSamples >= MAX_SAMPLES) {
+        // Age out old samples.
+        numSamples = 0;
+        for (int i = 0; i < NUM_BUCKETS; ++i) {
+            counts[i] /= 2;
+            numSamples += counts[i];
+        }
+    }
+}
+
+/**
+ * Compute unscheduled priority cutoffs that split the unscheduled bytes of the
+ * recorded messages evenly across the unscheduled priority levels.
+ *
+ * @param driver
+ *      Driver whose priority levels should be used.
+ * @param unscheduledBytes
+ *      Number of bytes of each message that are sent unscheduled.
+ * @param[out] cutoffs
+ *      Cutoffs to be filled in; the version is left unchanged.  Entries that
+ *      are not needed for the Driver's priority levels are set to the largest
+ *      possible message length.
+ */
+void
+MessageSizeHistogram::computeCutoffs(
+    Driver* driver, uint32_t unscheduledBytes,
+    Protocol::Packet::UnscheduledCutoffs* cutoffs) const
+{
+    const int MAX_CUTOFFS = Protocol::Packet::UnscheduledCutoffs::MAX_CUTOFFS;
+    for (int i = 0; i < MAX_CUTOFFS; ++i) {
+        cutoffs->cutoffs[i] = UINT32_MAX;
+    }
+
+    int numLevels = driver->getHighestPacketPriority() -
+                    getMinUnscheduledPriority(driver) + 1;
+    int numCutoffs = std::min(numLevels - 1, MAX_CUTOFFS);
+
+    uint64_t bytes[NUM_BUCKETS];
+    uint64_t totalBytes = 0;
+    for (int i = 0; i < NUM_BUCKETS; ++i) {
+        bytes[i] = counts[i] * std::min(getBucketLimit(i), unscheduledBytes);
+        totalBytes += bytes[i];
+    }
+    if (totalBytes == 0) {
+        return;
+    }
+
+    // Level i (counting down from the highest priority) ends at the bucket
+    // where the cumulative bytes reach (i + 1) / numLevels of the total.
+    uint64_t cumulativeBytes = 0;
+    int level = 0;
+    for (int i = 0; i < NUM_BUCKETS && level < numCutoffs; ++i) {
+        cumulativeBytes += bytes[i];
+        while (level < numCutoffs &&
+               cumulativeBytes * numLevels >= totalBytes * (level + 1)) {
+            cutoffs->cutoffs[level] = getBucketLimit(i);
+            ++level;
+        }
+    }
+}
+
+/**
+ * Return the index of the bucket that counts the given message length.
+ */
+int
+MessageSizeHistogram::getBucket(uint32_t messageLength)
+{
+    if (messageLength <= 1) {
+        return 0;
+    }
+    // ceil(log2(messageLength))
+    return 32 - __builtin_clz(messageLength - 1);
+}
+
+/**
+ * Return the largest message length counted by the given bucket.
+ */
+uint32_t
+MessageSizeHistogram::getBucketLimit(int bucket)
+{
+    if (bucket >= 32) {
+        return UINT32_MAX;
+    }
+    return uint32_t(1) << bucket;
+}
+
+/**
+ * RttEstimator constructor.
+ */
+RttEstimator::RttEstimator()
+    : peers()
+{}
+
+/**
+ * Add a round-trip time sample for a peer.
+ *
+ * @param peer
+ *      Address of the peer to which the sample belongs.
+ * @param rttNs
+ *      Measured round-trip time in nanoseconds.
+ */
+void
+RttEstimator::record(Driver::Address* peer, uint64_t rttNs)
+{
+    auto it = peers.find(peer);
+    if (it == peers.end()) {
+        peers.insert({peer, {rttNs, rttNs, 1}});
+        return;
+    }
+    Peer* state = &it->second;
+    state->windowMinNs = std::min(state->windowMinNs, rttNs);
+    state->windowSamples++;
+    if (rttNs < state->rttNs) {
+        state->rttNs = rttNs;
+    }
+    if (state->windowSamples >= WINDOW_SAMPLES) {
+        // Start a new window so that the estimate can grow if the path's
+        // RTT has increased.
+        state->rttNs = state->windowMinNs;
+        state->windowMinNs = std::numeric_limits<uint64_t>::max();
+        state->windowSamples = 0;
+    }
+}
+
+/**
+ * Return the estimated round-trip time to a peer in nanoseconds.
+ *
+ * @param peer
+ *      Address of the peer; the default RTT is returned for peers without
+ *      samples.
+ */
+uint64_t
+RttEstimator::getRtt(Driver::Address* peer) const
+{
+    auto it = peers.find(peer);
+    if (it == peers.end()) {
+        return DEFAULT_RTT_NS;
+    }
+    return it->second.rttNs;
+}
+
+/**
+ * Return the number of full packets the Driver can transmit in one RTT to a
+ * peer; never less than one so that messages always make progress.
+ *
+ * @param peer
+ *      Address of the peer; the default RTT is used for peers without
+ *      samples (including nullptr).
+ * @param driver
+ *      Driver whose bandwidth should be used.
+ * @param packetDataLength
+ *      Number of message bytes carried by each full packet.
+ */
+uint32_t
+RttEstimator::getRttPackets(Driver::Address* peer, Driver* driver,
+                            uint16_t packetDataLength) const
+{
+    // Bandwidth is in Mbps, i.e. bits per microsecond.
+    uint64_t rttBytes = getRtt(peer) * driver->getBandwidth() / 8000;
+    uint64_t packets = std::max(rttBytes / packetDataLength, uint64_t(1));
+    return Util::downCast<uint32_t>(
+        std::min(packets, uint64_t(std::numeric_limits<uint32_t>::max())));
+}
+
+}  // namespace Policy
+}  // namespace Core
+}  // namespace Homa
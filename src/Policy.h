@@ -0,0 +1,138 @@
+/* Copyright (c) 2019, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_CORE_POLICY_H
+#define HOMA_CORE_POLICY_H
+
+#include <Homa/Driver.h>
+
+#include <cstdint>
+#include <unordered_map>
+
+#include "Protocol.h"
+
+namespace Homa {
+namespace Core {
+
+/**
+ * Contains the functions that decide which network priorities Homa packets
+ * should use.
+ *
+ * The priority levels supported by a Driver are split into two contiguous
+ * ranges.  The upper range is used for unscheduled packets (the packets a
+ * Sender transmits without waiting for a GRANT) where shorter messages get
+ * higher priorities.  The lower range is used for scheduled packets where the
+ * Receiver assigns priorities to the messages it is granting to.
+ */
+namespace Policy {
+
+int getMinUnscheduledPriority(Driver* driver);
+int getMaxScheduledPriority(Driver* driver);
+int getUnscheduledPriority(
+    Driver* driver, const Protocol::Packet::UnscheduledCutoffs& cutoffs,
+    uint32_t messageLength);
+int getScheduledPriority(Driver* driver, uint32_t rank,
+                         uint32_t numScheduled);
+
+/**
+ * Tracks the distribution of incoming message lengths so that unscheduled
+ * priority cutoffs can be computed from the observed workload.
+ *
+ * Lengths are counted in power-of-two sized buckets.  Once MAX_SAMPLES
+ * lengths have been recorded, all counts are halved so that older samples
+ * fade out and the cutoffs follow changes in the workload.
+ *
+ * This class is NOT thread-safe.
+ */
+class MessageSizeHistogram {
+  public:
+    explicit MessageSizeHistogram();
+
+    void record(uint32_t messageLength);
+    void computeCutoffs(Driver* driver, uint32_t unscheduledBytes,
+                        Protocol::Packet::UnscheduledCutoffs* cutoffs) const;
+
+    /**
+     * Return the number of message lengths currently counted in the
+     * histogram.
+     */
+    uint64_t getNumSamples() const
+    {
+        return numSamples;
+    }
+
+  private:
+    /// Bucket 0 counts lengths up to 1 byte; bucket i counts lengths in the
+    /// range (2^(i-1), 2^i].
+    static const int NUM_BUCKETS = 33;
+
+    /// Number of samples after which all counts are halved.
+    static const uint64_t MAX_SAMPLES = 1 << 16;
+
+    static int getBucket(uint32_t messageLength);
+    static uint32_t getBucketLimit(int bucket);
+
+    /// Number of recorded lengths that fall in each bucket.
+    uint64_t counts[NUM_BUCKETS];
+
+    /// Sum of all counts.
+    uint64_t numSamples;
+};
+
+/**
+ * Estimates the round-trip time to each peer from timing samples taken by
+ * the Sender and Receiver so that the number of bytes in flight per message
+ * (RTTbytes) follows the actual network rather than a fixed guess.
+ *
+ * Samples include any queueing delay along the path, so each peer's estimate
+ * is the smallest sample seen in the most recent window of WINDOW_SAMPLES
+ * samples.  A sample below the current estimate takes effect immediately; a
+ * larger RTT is only adopted once a whole window has stayed above the old
+ * estimate.  Peers without samples use a default RTT.
+ *
+ * This class is NOT thread-safe.
+ */
+class RttEstimator {
+  public:
+    explicit RttEstimator();
+
+    void record(Driver::Address* peer, uint64_t rttNs);
+    uint64_t getRtt(Driver::Address* peer) const;
+    uint32_t getRttPackets(Driver::Address* peer, Driver* driver,
+                           uint16_t packetDataLength) const;
+
+  private:
+    /// Number of samples over which each peer's minimum RTT is taken.
+    static const uint32_t WINDOW_SAMPLES = 16;
+
+    /// RTT state of a single peer.
+    struct Peer {
+        /// Current RTT estimate in nanoseconds.
+        uint64_t rttNs;
+        /// Smallest sample of the current window in nanoseconds.
+        uint64_t windowMinNs;
+        /// Number of samples in the current window.
+        uint32_t windowSamples;
+    };
+
+    /// RTT state of each peer from which samples have been recorded.
+    std::unordered_map<Driver::Address*, Peer> peers;
+};
+
+}  // namespace Policy
+}  // namespace Core
+}  // namespace Homa
+
+#endif  // HOMA_CORE_POLICY_H
@@ -0,0 +1,244 @@
+/* Copyright (c) 2019, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include "Policy.h"
+
+#include "Mock/MockDriver.h"
+
+namespace Homa {
+namespace Core {
+namespace {
+
+using ::testing::NiceMock;
+using ::testing::Return;
+
+TEST(PolicyTest, getMinUnscheduledPriority)
+{
+    NiceMock<Homa::Mock::MockDriver> mockDriver;
+
+    EXPECT_CALL(mockDriver, getHighestPacketPriority).WillOnce(Return(7));
+    EXPECT_EQ(4, Policy::getMinUnscheduledPriority(&mockDriver));
+
+    EXPECT_CALL(mockDriver, getHighestPacketPriority).WillOnce(Return(0));
+    EXPECT_EQ(0, Policy::getMinUnscheduledPriority(&mockDriver));
+}
+
+TEST(PolicyTest, getMaxScheduledPriority)
+{
+    NiceMock<Homa::Mock::MockDriver> mockDriver;
+
+    EXPECT_CALL(mockDriver, getHighestPacketPriority).WillOnce(Return(7));
+    EXPECT_EQ(3, Policy::getMaxScheduledPriority(&mockDriver));
+
+    EXPECT_CALL(mockDriver, getHighestPacketPriority).WillOnce(Return(1));
+    EXPECT_EQ(0, Policy::getMaxScheduledPriority(&mockDriver));
+
+    EXPECT_CALL(mockDriver, getHighestPacketPriority).WillOnce(Return(0));
+    EXPECT_EQ(0, Policy::getMaxScheduledPriority(&mockDriver));
+}
+
+TEST(PolicyTest, getUnscheduledPriority_default)
+{
+    NiceMock<Homa::Mock::MockDriver> mockDriver;
+    Protocol::Packet::UnscheduledCutoffs cutoffs;
+    EXPECT_EQ(0U, cutoffs.version);
+
+    ON_CALL(mockDriver, getHighestPacketPriority).WillByDefault(Return(7));
+    EXPECT_EQ(7, Policy::getUnscheduledPriority(&mockDriver, cutoffs, 1));
+    EXPECT_EQ(7, Policy::getUnscheduledPriority(&mockDriver, cutoffs, 1000));
+    EXPECT_EQ(6, Policy::getUnscheduledPriority(&mockDriver, cutoffs, 1001));
+    EXPECT_EQ(6, Policy::getUnscheduledPriority(&mockDriver, cutoffs, 10000));
+    EXPECT_EQ(5, Policy::getUnscheduledPriority(&mockDriver, cutoffs, 100000));
+    EXPECT_EQ(4, Policy::getUnscheduledPriority(&mockDriver, cutoffs, 100001));
+
+    // Fewer levels than cutoffs.
+    ON_CALL(mockDriver, getHighestPacketPriority).WillByDefault(Return(3));
+    EXPECT_EQ(3, Policy::getUnscheduledPriority(&mockDriver, cutoffs, 1000));
+    EXPECT_EQ(2, Policy::getUnscheduledPriority(&mockDriver, cutoffs, 1001));
+    EXPECT_EQ(2, Policy::getUnscheduledPriority(&mockDriver, cutoffs, 100001));
+
+    // Single priority level.
+    ON_CALL(mockDriver, getHighestPacketPriority).WillByDefault(Return(0));
+    EXPECT_EQ(0, Policy::getUnscheduledPriority(&mockDriver, cutoffs, 1000));
+    EXPECT_EQ(0, Policy::getUnscheduledPriority(&mockDriver, cutoffs, 100001));
+}
+
+TEST(PolicyTest, getUnscheduledPriority_advertised)
+{
+    NiceMock<Homa::Mock::MockDriver> mockDriver;
+    ON_CALL(mockDriver, getHighestPacketPriority).WillByDefault(Return(7));
+    Protocol::Packet::UnscheduledCutoffs cutoffs;
+    cutoffs.version = 1;
+    cutoffs.cutoffs[0] = 64;
+    cutoffs.cutoffs[1] = 512;
+    cutoffs.cutoffs[2] = 4096;
+    for (int i = 3; i < cutoffs.MAX_CUTOFFS; ++i) {
+        cutoffs.cutoffs[i] = UINT32_MAX;
+    }
+
+    EXPECT_EQ(7, Policy::getUnscheduledPriority(&mockDriver, cutoffs, 64));
+    EXPECT_EQ(6, Policy::getUnscheduledPriority(&mockDriver, cutoffs, 65));
+    EXPECT_EQ(5, Policy::getUnscheduledPriority(&mockDriver, cutoffs, 1000));
+    EXPECT_EQ(4, Policy::getUnscheduledPriority(&mockDriver, cutoffs, 5000));
+    EXPECT_EQ(4, Policy::getUnscheduledPriority(&mockDriver, cutoffs,
+                                                UINT32_MAX));
+}
+
+TEST(PolicyTest, getScheduledPriority)
+{
+    NiceMock<Homa::Mock::MockDriver> mockDriver;
+
+    ON_CALL(mockDriver, getHighestPacketPriority).WillByDefault(Return(7));
+    // More messages than scheduled levels.
+    EXPECT_EQ(3, Policy::getScheduledPriority(&mockDriver, 0, 6));
+    EXPECT_EQ(0, Policy::getScheduledPriority(&mockDriver, 3, 6));
+    EXPECT_EQ(0, Policy::getScheduledPriority(&mockDriver, 5, 6));
+    // Fewer messages than scheduled levels; use the lowest levels.
+    EXPECT_EQ(1, Policy::getScheduledPriority(&mockDriver, 0, 2));
+    EXPECT_EQ(0, Policy::getScheduledPriority(&mockDriver, 1, 2));
+    EXPECT_EQ(0, Policy::getScheduledPriority(&mockDriver, 0, 1));
+}
+
+TEST(PolicyTest, MessageSizeHistogram_record)
+{
+    Policy::MessageSizeHistogram histogram;
+
+    histogram.record(0);
+    histogram.record(1);
+    histogram.record(2);
+    histogram.record(1000);
+    histogram.record(1024);
+    histogram.record(1025);
+    histogram.record(UINT32_MAX);
+
+    EXPECT_EQ(7U, histogram.getNumSamples());
+    EXPECT_EQ(2U, histogram.counts[0]);
+    EXPECT_EQ(1U, histogram.counts[1]);
+    EXPECT_EQ(2U, histogram.counts[10]);
+    EXPECT_EQ(1U, histogram.counts[11]);
+    EXPECT_EQ(1U, histogram.counts[32]);
+}
+
+TEST(PolicyTest, MessageSizeHistogram_record_aging)
+{
+    Policy::MessageSizeHistogram histogram;
+
+    for (uint64_t i = 0; i < histogram.MAX_SAMPLES - 1; ++i) {
+        histogram.record(100);
+    }
+    EXPECT_EQ(histogram.MAX_SAMPLES - 1, histogram.getNumSamples());
+
+    histogram.record(100);
+    EXPECT_EQ(histogram.MAX_SAMPLES / 2, histogram.getNumSamples());
+    EXPECT_EQ(histogram.MAX_SAMPLES / 2, histogram.counts[7]);
+}
+
+TEST(PolicyTest, MessageSizeHistogram_computeCutoffs)
+{
+    NiceMock<Homa::Mock::MockDriver> mockDriver;
+    ON_CALL(mockDriver, getHighestPacketPriority).WillByDefault(Return(7));
+    Policy::MessageSizeHistogram histogram;
+    Protocol::Packet::UnscheduledCutoffs cutoffs;
+
+    // No samples.
+    histogram.computeCutoffs(&mockDriver, 10000, &cutoffs);
+    for (int i = 0; i < cutoffs.MAX_CUTOFFS; ++i) {
+        EXPECT_EQ(UINT32_MAX, cutoffs.cutoffs[i]);
+    }
+
+    // 4 unscheduled levels; each bucket holds a quarter of the unscheduled
+    // bytes.  Messages longer than 10240 bytes only count 10240 bytes.
+    histogram.counts[8] = 40;   // 256 bytes
+    histogram.counts[10] = 10;  // 1024 bytes
+    histogram.counts[11] = 5;   // 2048 bytes
+    histogram.counts[20] = 1;   // 1MB
+    histogram.numSamples = 56;
+    histogram.computeCutoffs(&mockDriver, 10240, &cutoffs);
+    EXPECT_EQ(256U, cutoffs.cutoffs[0]);
+    EXPECT_EQ(1024U, cutoffs.cutoffs[1]);
+    EXPECT_EQ(2048U, cutoffs.cutoffs[2]);
+    for (int i = 3; i < cutoffs.MAX_CUTOFFS; ++i) {
+        EXPECT_EQ(UINT32_MAX, cutoffs.cutoffs[i]);
+    }
+
+    // A single bucket holds all the bytes.
+    histogram = Policy::MessageSizeHistogram();
+    histogram.record(100);
+    histogram.computeCutoffs(&mockDriver, 10000, &cutoffs);
+    EXPECT_EQ(128U, cutoffs.cutoffs[0]);
+    EXPECT_EQ(128U, cutoffs.cutoffs[1]);
+    EXPECT_EQ(128U, cutoffs.cutoffs[2]);
+    EXPECT_EQ(UINT32_MAX, cutoffs.cutoffs[3]);
+}
+
+TEST(PolicyTest, RttEstimator_record)
+{
+    Policy::RttEstimator estimator;
+    Driver::Address* peer = (Driver::Address*)22;
+
+    // Unknown peer uses the default.
+    EXPECT_EQ(5000U, estimator.getRtt(peer));
+
+    // First sample is used directly.
+    estimator.record(peer, 8000);
+    EXPECT_EQ(8000U, estimator.getRtt(peer));
+    EXPECT_EQ(5000U, estimator.getRtt(nullptr));
+
+    // Smaller samples take effect immediately; larger ones don't.
+    estimator.record(peer, 3000);
+    EXPECT_EQ(3000U, estimator.getRtt(peer));
+    estimator.record(peer, 9000);
+    EXPECT_EQ(3000U, estimator.getRtt(peer));
+
+    // The window ends; its minimum becomes the estimate.
+    for (uint32_t i = 3; i < estimator.WINDOW_SAMPLES; ++i) {
+        estimator.record(peer, 9000);
+    }
+    EXPECT_EQ(3000U, estimator.getRtt(peer));
+    EXPECT_EQ(0U, estimator.peers.at(peer).windowSamples);
+
+    // A whole window of larger samples raises the estimate.
+    for (uint32_t i = 0; i < estimator.WINDOW_SAMPLES - 1; ++i) {
+        estimator.record(peer, 7000 + i);
+        EXPECT_EQ(3000U, estimator.getRtt(peer));
+    }
+    estimator.record(peer, 9000);
+    EXPECT_EQ(7000U, estimator.getRtt(peer));
+}
+
+TEST(PolicyTest, RttEstimator_getRttPackets)
+{
+    NiceMock<Homa::Mock::MockDriver> mockDriver;
+    Policy::RttEstimator estimator;
+    Driver::Address* peer = (Driver::Address*)22;
+
+    // 5us at 8Gbps is 5000 bytes.
+    EXPECT_CALL(mockDriver, getBandwidth).WillOnce(Return(8000));
+    EXPECT_EQ(5U, estimator.getRttPackets(peer, &mockDriver, 1000));
+
+    estimator.record(peer, 12000);
+    EXPECT_CALL(mockDriver, getBandwidth).WillOnce(Return(8000));
+    EXPECT_EQ(12U, estimator.getRttPackets(peer, &mockDriver, 1000));
+
+    // Never less than one packet.
+    EXPECT_CALL(mockDriver, getBandwidth).WillOnce(Return(0));
+    EXPECT_EQ(1U, estimator.getRttPackets(peer, &mockDriver, 1000));
+}
+
+}  // namespace
+}  // namespace Core
+}  // namespace Homa
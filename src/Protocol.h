@@ -129,15 +129,24 @@ struct MessageId : public OpId {
 
     /**
      * This class computes a hash of an MessageId, so that MessageId can be used
-     * as keys in unordered_maps.
+     * as keys in unordered_maps and FlatMaps.  FlatMap uses both the low and
+     * high bits of the hash, so every field is multiplied into the result and
+     * then finalized to spread its bits across the whole word.
      */
-    struct Hasher : public OpId::Hasher {
-        /// Return a "hash" of the given MessageId.
+    struct Hasher {
+        /// Return a hash of the given MessageId.
         std::size_t operator()(const MessageId& msgId) const
         {
-            std::size_t h1 = OpId::Hasher::operator()(msgId);
-            std::size_t h2 = std::hash<uint64_t>()(msgId.tag);
-            return h1 ^ (h2 << 1);
+            uint64_t h = msgId.transportId * 0x9E3779B97F4A7C15UL;
+            h ^= msgId.sequence * 0xC2B2AE3D27D4EB4FUL;
+            h ^= uint64_t(msgId.tag) * 0x165667B19E3779F9UL;
+            // MurmurHash3 64-bit finalizer.
+            h ^= h >> 33;
+            h *= 0xFF51AFD7ED558CCDUL;
+            h ^= h >> 33;
+            h *= 0xC4CEB9FE1A85EC53UL;
+            h ^= h >> 33;
+            return h;
         }
     };
 } __attribute__((packed));
@@ -204,20 +213,50 @@ struct DataHeader {
     CommonHeader common;   ///< Common header fields.
     uint32_t totalLength;  ///< Total # bytes in the message (*not* just in this
                            ///< packet).
-    uint16_t index;  ///< Index of this packet in the array of packets that form
+    uint32_t index;  ///< Index of this packet in the array of packets that form
                      ///< the message.
+    uint32_t unscheduledIndexLimit;  ///< Packets up to (but excluding) this
+                                     ///< index are sent without waiting for a
+                                     ///< GRANT.
 
     // The remaining packet bytes after the header constitute message data
     // starting at the offset corresponding to the given packet index.
 
     /// DataHeader constructor.
-    DataHeader(MessageId messageId, uint32_t totalLength, uint16_t index)
+    DataHeader(MessageId messageId, uint32_t totalLength, uint32_t index,
+               uint32_t unscheduledIndexLimit)
         : common(Opcode::DATA, messageId)
         , totalLength(totalLength)
         , index(index)
+        , unscheduledIndexLimit(unscheduledIndexLimit)
     {}
 } __attribute__((packed));
 
+/**
+ * Describes the wire format for the unscheduled priority cutoffs that a
+ * receiver advertises to the senders of its incoming messages.  A message
+ * no longer than cutoffs[i] bytes should have its unscheduled packets sent
+ * i priority levels below the highest priority level.
+ */
+struct UnscheduledCutoffs {
+    /// Maximum number of cutoffs that can be advertised.
+    static const int MAX_CUTOFFS = 7;
+
+    uint8_t version;  ///< Changes each time the receiver computes new cutoffs;
+                      ///< 0 means the receiver has not computed any cutoffs.
+    uint32_t cutoffs[MAX_CUTOFFS];  ///< Message length (in bytes) limits for
+                                    ///< each unscheduled priority level.
+
+    /// UnscheduledCutoffs constructor.
+    UnscheduledCutoffs()
+        : version(0)
+    {
+        for (int i = 0; i < MAX_CUTOFFS; ++i) {
+            cutoffs[i] = 0;
+        }
+    }
+} __attribute__((packed));
+
 /**
  * Describes the wire format for GRANT packets. A GRANT is sent by the receiver
  * back to the sender to indicate that it is now safe for the sender to transmit
@@ -226,13 +265,26 @@ struct DataHeader {
  */
 struct GrantHeader {
     CommonHeader common;  ///< Common header fields.
-    uint16_t indexLimit;  ///< Packets with an index up to (but not including)
+    uint32_t indexLimit;  ///< Packets with an index up to (but not including)
                           ///< this value can be transmitted by the sender.
+    uint8_t priority;     ///< Network priority at which the sender should
+                          ///< transmit the scheduled packets of the message.
+    UnscheduledCutoffs cutoffs;  ///< The receiver's current unscheduled
+                                 ///< priority cutoffs.
+    uint32_t delay;  ///< Nanoseconds between the receiver processing the
+                     ///< first DATA packet of the message and sending this
+                     ///< GRANT (saturates at UINT32_MAX); lets the sender
+                     ///< leave the receiver's scheduling delay out of its
+                     ///< RTT samples.
 
     /// GrantHeader constructor.
-    GrantHeader(MessageId messageId, uint16_t indexLimit)
+    GrantHeader(MessageId messageId, uint32_t indexLimit, uint8_t priority,
+                const UnscheduledCutoffs& cutoffs, uint32_t delay)
         : common(Opcode::GRANT, messageId)
         , indexLimit(indexLimit)
+        , priority(priority)
+        , cutoffs(cutoffs)
+        , delay(delay)
     {}
 } __attribute__((packed));
 
@@ -256,13 +308,13 @@ struct DoneHeader {
  */
 struct ResendHeader {
     CommonHeader common;  ///< Common header fields.
-    uint16_t index;  ///< Index of the first packet that should be resent among
+    uint32_t index;  ///< Index of the first packet that should be resent among
                      ///< the array of packets that form the message.
-    uint16_t num;  ///< Number of packet in the range of packets that should be
+    uint32_t num;  ///< Number of packet in the range of packets that should be
                    ///< resent starting with the packet at _index_.
 
     /// DoneHeader constructor.
-    ResendHeader(MessageId messageId, uint16_t index, uint16_t num)
+    ResendHeader(MessageId messageId, uint32_t index, uint32_t num)
         : common(Opcode::RESEND, messageId)
         , index(index)
         , num(num)
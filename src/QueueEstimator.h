@@ -0,0 +1,103 @@
+/* Copyright (c) 2019, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_CORE_QUEUEESTIMATOR_H
+#define HOMA_CORE_QUEUEESTIMATOR_H
+
+#include <cstdint>
+
+namespace Homa {
+namespace Core {
+
+/**
+ * Estimates the number of bytes waiting in a NIC's transmit queue by assuming
+ * the NIC drains the queue at the full network bandwidth.  Allows the Sender
+ * to keep the NIC queue short so that packet ordering decisions (e.g. SRPT)
+ * are made in software rather than being stuck behind a deep hardware FIFO.
+ *
+ * The estimate errs on the side of a longer queue since packets can't leave
+ * faster than the link rate; it may be an underestimate if the NIC is also
+ * sending traffic that was not reported.
+ *
+ * This class is NOT thread-safe.
+ */
+class QueueEstimator {
+  public:
+    /**
+     * QueueEstimator constructor.
+     *
+     * @param bandwidth
+     *      Rate at which the NIC transmits, in Mbits/second; 0 means the rate
+     *      is unknown in which case the queue is always estimated empty.
+     * @param cyclesPerSecond
+     *      Number of cycles per second in the time unit used by callers.
+     */
+    QueueEstimator(uint32_t bandwidth, double cyclesPerSecond)
+        : bytesPerCycle(bandwidth * 1e6 / 8 / cyclesPerSecond)
+        , queuedBytes(0)
+        , lastUpdateTime(0)
+    {}
+
+    /**
+     * Account for a packet that has just been handed to the NIC.
+     *
+     * @param length
+     *      Number of bytes in the packet.
+     * @param now
+     *      Current time in cycles.
+     */
+    void packetQueued(uint32_t length, uint64_t now)
+    {
+        if (bytesPerCycle == 0) {
+            return;
+        }
+        getQueuedBytes(now);
+        queuedBytes += length;
+    }
+
+    /**
+     * Return the estimated number of bytes in the NIC's transmit queue.
+     *
+     * @param now
+     *      Current time in cycles; must not be earlier than the time of a
+     *      previous call.
+     */
+    uint32_t getQueuedBytes(uint64_t now)
+    {
+        if (now > lastUpdateTime) {
+            double drainedBytes = double(now - lastUpdateTime) * bytesPerCycle;
+            queuedBytes =
+                (drainedBytes >= queuedBytes) ? 0 : queuedBytes - drainedBytes;
+            lastUpdateTime = now;
+        }
+        return uint32_t(queuedBytes);
+    }
+
+  private:
+    /// Number of bytes the NIC transmits per cycle; 0 if unknown.
+    const double bytesPerCycle;
+
+    /// Estimated number of bytes in the NIC's transmit queue as of
+    /// lastUpdateTime.
+    double queuedBytes;
+
+    /// Time (in cycles) at which queuedBytes was last updated.
+    uint64_t lastUpdateTime;
+};
+
+}  // namespace Core
+}  // namespace Homa
+
+#endif  // HOMA_CORE_QUEUEESTIMATOR_H
@@ -0,0 +1,56 @@
+/* Copyright (c) 2019, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include "QueueEstimator.h"
+
+namespace Homa {
+namespace Core {
+namespace {
+
+TEST(QueueEstimatorTest, getQueuedBytes)
+{
+    // 8 Gbps with 1 cycle per ns drains 1 byte per cycle.
+    QueueEstimator estimator(8000, 1e9);
+    EXPECT_EQ(0U, estimator.getQueuedBytes(100));
+
+    estimator.packetQueued(1000, 100);
+    estimator.packetQueued(500, 100);
+    EXPECT_EQ(1500U, estimator.getQueuedBytes(100));
+    EXPECT_EQ(1100U, estimator.getQueuedBytes(500));
+
+    // Time going backwards doesn't change the estimate.
+    EXPECT_EQ(1100U, estimator.getQueuedBytes(400));
+
+    estimator.packetQueued(100, 1000);
+    EXPECT_EQ(700U, estimator.getQueuedBytes(1000));
+
+    // Queue can't drain below empty.
+    EXPECT_EQ(0U, estimator.getQueuedBytes(5000));
+    estimator.packetQueued(100, 5000);
+    EXPECT_EQ(100U, estimator.getQueuedBytes(5000));
+}
+
+TEST(QueueEstimatorTest, unknownBandwidth)
+{
+    QueueEstimator estimator(0, 1e9);
+    estimator.packetQueued(1000, 100);
+    EXPECT_EQ(0U, estimator.getQueuedBytes(100));
+}
+
+}  // namespace
+}  // namespace Core
+}  // namespace Homa
@@ -16,23 +16,53 @@
 
 #include "Receiver.h"
 
+#include <limits>
+
+#include "Cycles.h"
+#include "Debug.h"
+
 namespace Homa {
 namespace Core {
 
 namespace {
-const uint32_t RTT_TIME_US = 5;
-}
+/// Number of new incoming messages between recomputations of the unscheduled
+/// priority cutoffs.
+const uint64_t CUTOFF_UPDATE_INTERVAL = 1000;
+
+/// Length of each tick of the Receiver's timer wheel.
+const uint64_t TIMER_TICK_US = 1000;
+
+/// Time between checks for lost packets of an incoming message.
+const uint64_t RESEND_INTERVAL_US = 10000;
+
+/// Number of consecutive RESEND intervals without progress after which an
+/// incoming message, and the Op waiting for it, is considered failed.
+const uint32_t MESSAGE_TIMEOUT_INTERVALS = 50;
+}  // namespace
 
 /**
  * Receiver constructor.
  *
- * @param scheduler
- *      Scheduler that should be informed when message packets are received.
+ * @param controlQueue
+ *      Queue through which this Receiver will send control packets.
+ * @param overcommitmentDegree
+ *      Maximum number of incoming messages to which this Receiver will grant
+ *      at the same time.
  */
-Receiver::Receiver()
+Receiver::Receiver(ControlPacket::Queue* controlQueue,
+                   uint32_t overcommitmentDegree)
     : mutex()
+    , controlQueue(controlQueue)
+    , overcommitmentDegree(overcommitmentDegree)
     , registeredOps()
     , unregisteredMessages()
+    , scheduledMessages()
+    , messageSizes()
+    , unscheduledCutoffs()
+    , peerRtts()
+    , resendInterval(PerfUtils::Cycles::fromMicroseconds(RESEND_INTERVAL_US))
+    , timerWheel(PerfUtils::Cycles::fromMicroseconds(TIMER_TICK_US),
+                 PerfUtils::Cycles::rdtsc())
     , receivedMessages()
     , messagePool()
     , scheduling()
@@ -90,7 +120,7 @@ Receiver::handleDataPacket(Driver::Packet* packet, Driver* driver)
             message = messagePool.construct();
             // Touch OK w/o lock before externalizing.
             message->id = id;
-            unregisteredMessages.insert(it, {id, message});
+            unregisteredMessages.insert({id, message});
             receivedMessages.push_back(message);
         }
     }
@@ -99,21 +129,31 @@ Receiver::handleDataPacket(Driver::Packet* packet, Driver* driver)
     if (op != nullptr) {
         lock_op.construct(op->mutex);
     }
-    SpinLock::Lock lock_message(message->mutex);
+    Tub<SpinLock::Lock> lock_message;
+    lock_message.construct(message->mutex);
     lock.unlock();
 
     assert(id == message->id);
+    bool newMessage = false;
     if (!message->message) {
+        newMessage = true;
         uint32_t messageLength = header->totalLength;
         message->message.construct(driver, dataHeaderLength, messageLength);
         // Get an address pointer from the driver; the one in the packet
         // may disappear when the packet goes away.
-        std::string addrStr = packet->address->toString();
-        message->source = driver->getAddress(&addrStr);
+        Driver::Address::Raw rawAddress;
+        packet->address->toRaw(&rawAddress);
+        message->source = driver->getAddress(&rawAddress);
         message->numExpectedPackets =
             messageLength / message->message->PACKET_DATA_LENGTH;
         message->numExpectedPackets +=
             messageLength % message->message->PACKET_DATA_LENGTH ? 1 : 0;
+        // The Sender sends the first packets, as many as it thinks fit in
+        // one RTT, without waiting for a GRANT.
+        message->grantIndexLimit =
+            std::min(std::max(header->unscheduledIndexLimit, 1U),
+                     message->numExpectedPackets);
+        message->firstPacketTime = PerfUtils::Cycles::rdtsc();
     }
 
     // Sender is still sending; consider this message active.
@@ -127,30 +167,93 @@ Receiver::handleDataPacket(Driver::Packet* packet, Driver* driver)
     }
 
     // Things that must be true (sanity check)
-    assert(message->source->toString() == packet->address->toString());
     assert(message->message->rawLength() == header->totalLength);
 
     // Add the packet
-    bool packetAdded = message->message->setPacket(header->index, packet);
-    if (packetAdded) {
-        // This value is technically sloppy since last packet of the message
-        // which may not be a full packet. However, this should be fine since
-        // receiving the last packet means we don't need the scheduler to GRANT
-        // more packets anyway.
-        uint32_t totalReceivedBytes = message->message->PACKET_DATA_LENGTH *
-                                      message->message->getNumPackets();
-        message->newPacket = true;
-        if (totalReceivedBytes >= message->message->rawLength()) {
-            message->fullMessageReceived = true;
-            if (op != nullptr) {
-                op->hintUpdate();
-            }
-        }
-    } else {
+    uint32_t index = header->index;
+    if (index >= message->numExpectedPackets) {
+        // Not part of this message; drop packet.
+        WARNING("Dropping DATA packet with out-of-range index %u", index);
+        driver->releasePackets(&packet, 1);
+        return;
+    }
+    bool packetAdded = message->message->setPacket(index, packet);
+    if (!packetAdded) {
         // must be a duplicate packet; drop packet.
         driver->releasePackets(&packet, 1);
+        return;
+    }
+    uint64_t rttNs = 0;
+    if (message->grantTime != 0 && index >= message->grantSampleIndex) {
+        // First packet allowed by the last timed GRANT.
+        rttNs = PerfUtils::Cycles::toNanoseconds(PerfUtils::Cycles::rdtsc() -
+                                                 message->grantTime);
+        message->grantTime = 0;
+    }
+    if (message->message->getNumPackets() >= message->numExpectedPackets) {
+        message->fullMessageReceived = true;
+        if (op != nullptr) {
+            op->hintUpdate();
+        }
+    }
+
+    // Everything below needs the Receiver's mutex, which must be acquired
+    // before the message's; copy what is needed while the message is locked.
+    Driver::Address* source = message->source;
+    uint32_t messageLength = message->message->rawLength();
+    uint16_t packetDataLength = message->message->PACKET_DATA_LENGTH;
+    lock_message.destroy();
+    lock_op.destroy();
+    lock.lock();
+
+    if (rttNs != 0) {
+        peerRtts.record(source, rttNs);
+    }
+    if (newMessage) {
+        messageSizes.record(messageLength);
+        if (messageSizes.getNumSamples() % CUTOFF_UPDATE_INTERVAL == 0) {
+            updateCutoffs(driver, packetDataLength);
+        }
+    }
+
+    // The message may have been dropped while it was unlocked.
+    InboundMessage* current = nullptr;
+    auto opIt = registeredOps.find(id);
+    if (opIt != registeredOps.end()) {
+        current = opIt->second->inMessage;
+    } else {
+        auto messageIt = unregisteredMessages.find(id);
+        if (messageIt != unregisteredMessages.end()) {
+            current = messageIt->second;
+        }
+    }
+    if (current != message) {
+        return;
+    }
+
+    lock_message.construct(message->mutex);
+    if (newMessage) {
+        uint64_t now = PerfUtils::Cycles::rdtsc();
+        if (message->numExpectedPackets > 1 &&
+            message->grantIndexLimit >= message->numExpectedPackets) {
+            // The whole message is unscheduled so it will never be granted
+            // by schedule(); GRANT it right away anyway so that the Sender
+            // still gets to sample its RTT to this Receiver.
+            controlQueue->send<Protocol::Packet::GrantHeader>(
+                message->source, message->id, message->grantIndexLimit,
+                Util::downCast<uint8_t>(message->grantPriority),
+                unscheduledCutoffs, getGrantDelay(message, now));
+        }
+        if (!message->fullMessageReceived) {
+            // Start checking for lost packets.
+            timerWheel.schedule(&message->timer, now + resendInterval);
+        }
+    }
+    if (message->fullMessageReceived) {
+        timerWheel.cancel(&message->timer);
     }
-    return;
+    unschedule(message);
+    reschedule(message);
 }
 
 /**
@@ -245,22 +348,34 @@ Receiver::handlePingPacket(Driver::Packet* packet, Driver* driver)
             lock_op.construct(op->mutex);
         }
         SpinLock::Lock lock_message(message->mutex);
+        Protocol::Packet::UnscheduledCutoffs cutoffs = unscheduledCutoffs;
         lock.unlock();
 
         // Sender is checking on this message; consider it still active.
         message->active = true;
 
-        // We are here either because a GRANT got lost, or we haven't issued
-        // a GRANT in along time.  In either case, resend the latest GRANT so
-        // the Sender knows we are still working on the message.
-        ControlPacket::send<Protocol::Packet::GrantHeader>(
-            driver, message->source, message->id, message->grantIndexLimit);
+        if (message->source == nullptr) {
+            // The Op is registered but none of the message's DATA has been
+            // processed yet (it may have been lost or may be in the hands of
+            // another poller); there is no GRANT to resend.  Reply UNKNOWN so
+            // the Sender starts the message over.
+            controlQueue->send<Protocol::Packet::UnknownHeader>(
+                packet->address, id);
+        } else {
+            // We are here either because a GRANT got lost, or we haven't
+            // issued a GRANT in along time.  In either case, resend the latest
+            // GRANT so the Sender knows we are still working on the message.
+            controlQueue->send<Protocol::Packet::GrantHeader>(
+                message->source, message->id, message->grantIndexLimit,
+                Util::downCast<uint8_t>(message->grantPriority), cutoffs,
+                getGrantDelay(message, PerfUtils::Cycles::rdtsc()));
+        }
     } else {
         lock.unlock();
         // We are here because we have no knowledge of the message the Sender is
         // asking about.  Reply UNKNOWN so the Sender can react accordingly.
-        ControlPacket::send<Protocol::Packet::UnknownHeader>(
-            driver, packet->address, id);
+        controlQueue->send<Protocol::Packet::UnknownHeader>(packet->address,
+                                                            id);
     }
     driver->releasePackets(&packet, 1);
 }
@@ -306,6 +421,8 @@ Receiver::dropMessage(InboundMessage* message)
     SpinLock::Lock lock(mutex);
     message->mutex.lock();
     if (unregisteredMessages.erase(message->id) > 0) {
+        unschedule(message);
+        timerWheel.cancel(&message->timer);
         messagePool.destroy(message);
     }
 }
@@ -358,6 +475,8 @@ Receiver::dropOp(Transport::Op* op)
         message->mutex.lock();
         op->inMessage = nullptr;
         registeredOps.erase(message->id);
+        unschedule(message);
+        timerWheel.cancel(&message->timer);
         messagePool.destroy(message);
     }
 }
@@ -369,44 +488,83 @@ void
 Receiver::poll()
 {
     schedule();
+    checkTimeouts(PerfUtils::Cycles::rdtsc());
 }
 
 /**
- * Send a GRANT packet to the Sender of an incomming Message.
+ * Send a GRANT packet to the Sender of an incomming Message if the Message's
+ * granted window has fallen below one RTT worth of packets or if the priority
+ * of its scheduled packets has changed.
  *
  * @param message
  *      InboundMessage for which to send a GRANT.
  * @param driver
- *      Driver with which the GRANT packet should be sent.
+ *      Driver with which to send the GRANT.
+ * @param priority
+ *      Network priority the Sender should use for scheduled packets.
  * @param lock_message
  *      Used to remind the caller to hold the message's mutex while calling
  *      this method.
  */
 void
-Receiver::sendGrantPacket(InboundMessage* message, Driver* driver,
+Receiver::sendGrantPacket(InboundMessage* message, Driver* driver, int priority,
                           const SpinLock::Lock& lock_message)
 {
     (void)lock_message;
-    // TODO(cstlee): Implement Homa's grant policy.
-    // Implements a very simple grant policy which tries to maintain RTT bytes
-    // granted for every Message.
-    // TODO(cstlee): Add safe guards to prevent RTT_BYTES from being less than
-    //               a single packet length. The sender might get stuck if the
-    //               grants are smaller than a single packet.
-    uint32_t RTT_BYTES = RTT_TIME_US * (driver->getBandwidth() / 8);
-    uint32_t RTT_PACKETS = RTT_BYTES / message->message->PACKET_DATA_LENGTH;
-    uint16_t indexLimit =
-        std::min(Util::downCast<uint16_t>(message->message->getNumPackets() +
-                                          RTT_PACKETS),
+    // Try to keep RTT bytes granted but not yet received for each scheduled
+    // Message.
+    uint32_t RTT_PACKETS = peerRtts.getRttPackets(
+        message->source, driver, message->message->PACKET_DATA_LENGTH);
+    uint32_t indexLimit =
+        std::min(message->message->getNumPackets() + RTT_PACKETS,
                  message->numExpectedPackets);
-    message->grantIndexLimit = indexLimit;
+    if (indexLimit <= message->grantIndexLimit &&
+        priority == message->grantPriority) {
+        // Nothing new to grant.
+        return;
+    }
+    uint64_t now = PerfUtils::Cycles::rdtsc();
+    if (indexLimit > message->grantIndexLimit && message->grantTime == 0) {
+        // Time this GRANT until the first packet it allows arrives.
+        message->grantTime = now;
+        message->grantSampleIndex = message->grantIndexLimit;
+    }
+    message->grantIndexLimit = std::max(indexLimit, message->grantIndexLimit);
+    message->grantPriority = priority;
 
-    ControlPacket::send<Protocol::Packet::GrantHeader>(driver, message->source,
-                                                       message->id, indexLimit);
+    controlQueue->send<Protocol::Packet::GrantHeader>(
+        message->source, message->id, message->grantIndexLimit,
+        Util::downCast<uint8_t>(priority), unscheduledCutoffs,
+        getGrantDelay(message, now));
+}
+
+/**
+ * Return the delay to report in a GRANT for a message: the number of
+ * nanoseconds since the message's first DATA packet was processed, saturated
+ * at UINT32_MAX.
+ *
+ * @param message
+ *      InboundMessage for which a GRANT is being sent.
+ * @param now
+ *      Current time in cycles.
+ */
+uint32_t
+Receiver::getGrantDelay(const InboundMessage* message, uint64_t now)
+{
+    uint64_t delay = PerfUtils::Cycles::toNanoseconds(
+        now - std::min(now, message->firstPacketTime));
+    return Util::downCast<uint32_t>(
+        std::min(delay, uint64_t(std::numeric_limits<uint32_t>::max())));
 }
 
 /**
  * Schedule incomming messages by sending GRANTs.
+ *
+ * Implements Homa's receiver-driven grant policy: the overcommitmentDegree
+ * messages with the fewest bytes left to receive are each granted up to one
+ * RTT worth of packets beyond what has already been received.  Each granted
+ * message is assigned its own scheduled priority; shorter messages get higher
+ * priorities.
  */
 void
 Receiver::schedule()
@@ -416,53 +574,184 @@ Receiver::schedule()
         return;
     }
 
-    SpinLock::UniqueLock lock(mutex);
-    Tub<SpinLock::Lock> lock_op;
-    Tub<SpinLock::Lock> lock_message;
-
-    Transport::Op* op = nullptr;
-    InboundMessage* message = nullptr;
+    SpinLock::Lock lock(mutex);
 
-    // First look in registered ops
-    auto it = registeredOps.begin();
-    while (it != registeredOps.end()) {
-        op = it->second;
-        lock_op.construct(op->mutex);
-        message = op->inMessage;
-        lock_message.construct(message->mutex);
-        if (message->newPacket) {
-            // found a message to send.
-            break;
+    uint32_t numScheduled =
+        std::min(overcommitmentDegree,
+                 Util::downCast<uint32_t>(scheduledMessages.size()));
+    uint32_t rank = 0;
+    auto it = scheduledMessages.begin();
+    while (it != scheduledMessages.end() && rank < numScheduled) {
+        InboundMessage* message = it->message;
+        SpinLock::Lock lock_message(message->mutex);
+        Driver* driver = message->message->driver;
+        int priority = Policy::getScheduledPriority(driver, rank, numScheduled);
+        sendGrantPacket(message, driver, priority, lock_message);
+        if (message->grantIndexLimit >= message->numExpectedPackets) {
+            // Fully granted; the message no longer needs to be scheduled.
+            message->scheduled = false;
+            it = scheduledMessages.erase(it);
+        } else {
+            ++it;
         }
-        lock_message.destroy();
-        message = nullptr;
-        lock_op.destroy();
-        op = nullptr;
-        it++;
+        ++rank;
     }
 
-    // Look in unregisteredMessages if we still don't have one.
-    if (message == nullptr) {
-        auto it = unregisteredMessages.begin();
-        while (it != unregisteredMessages.end()) {
-            message = it->second;
-            lock_message.construct(message->mutex);
-            if (message->newPacket) {
-                // found a message to send.
-                break;
+    scheduling.clear();
+}
+
+/**
+ * Recompute the unscheduled priority cutoffs from the lengths of recently
+ * received messages.  The cutoffs' version is changed if they are different
+ * from the ones previously advertised.
+ *
+ * The caller must hold the Receiver's mutex.
+ *
+ * @param driver
+ *      Driver whose priority levels and bandwidth should be used.
+ * @param packetDataLength
+ *      Number of message bytes carried by each full packet.
+ */
+void
+Receiver::updateCutoffs(Driver* driver, uint16_t packetDataLength)
+{
+    // The cutoffs are shared by all Senders so they are based on the default
+    // RTT rather than any one Sender's.
+    uint32_t unscheduledBytes =
+        peerRtts.getRttPackets(nullptr, driver, packetDataLength) *
+        packetDataLength;
+    Protocol::Packet::UnscheduledCutoffs cutoffs;
+    messageSizes.computeCutoffs(driver, unscheduledBytes, &cutoffs);
+    bool changed = (unscheduledCutoffs.version == 0);
+    for (int i = 0; i < cutoffs.MAX_CUTOFFS; ++i) {
+        changed |= (cutoffs.cutoffs[i] != unscheduledCutoffs.cutoffs[i]);
+    }
+    if (!changed) {
+        return;
+    }
+    cutoffs.version = unscheduledCutoffs.version + 1;
+    if (cutoffs.version == 0) {
+        // Version 0 is reserved for "no cutoffs".
+        cutoffs.version = 1;
+    }
+    unscheduledCutoffs = cutoffs;
+}
+
+/**
+ * Check the incoming messages whose timers have expired for lost packets.
+ *
+ * A message that has not received any packets since its last timeout is sent
+ * a RESEND for its first range of missing granted packets.  After
+ * MESSAGE_TIMEOUT_INTERVALS consecutive timeouts, the Op waiting for the
+ * message is considered failed.
+ *
+ * @param now
+ *      The current time in cycles.
+ */
+void
+Receiver::checkTimeouts(uint64_t now)
+{
+    SpinLock::Lock lock(mutex);
+    timerWheel.advance(now);
+    for (InboundMessage* message = timerWheel.popExpired(); message != nullptr;
+         message = timerWheel.popExpired()) {
+        Transport::Op* op = nullptr;
+        auto it = registeredOps.find(message->id);
+        if (it != registeredOps.end()) {
+            op = it->second;
+        }
+        Tub<SpinLock::Lock> lock_op;
+        if (op != nullptr) {
+            lock_op.construct(op->mutex);
+        }
+        SpinLock::Lock lock_message(message->mutex);
+
+        if (message->fullMessageReceived) {
+            continue;
+        }
+
+        // First range of granted packets that have not been received.
+        uint32_t index = std::min(message->message->getFirstMissingIndex(),
+                                  message->grantIndexLimit);
+        uint32_t num = 0;
+        while (index + num < message->grantIndexLimit &&
+               message->message->getPacket(index + num) == nullptr) {
+            ++num;
+        }
+
+        if (message->active) {
+            // Packets have arrived since the last timeout.
+            message->active = false;
+            message->timeoutCount = 0;
+        } else if (num == 0) {
+            // All granted packets have been received; the message is waiting
+            // to be scheduled by this Receiver.
+        } else {
+            message->timeoutCount++;
+            // Unregistered messages will soon be registered by the Transport;
+            // only Ops can fail.
+            if (op != nullptr &&
+                message->timeoutCount >= MESSAGE_TIMEOUT_INTERVALS) {
+                WARNING(
+                    "Incoming message (%lu:%lu:%u) timed out; Op failed.",
+                    message->id.transportId, message->id.sequence,
+                    message->id.tag);
+                op->reportFailure(*lock_op);
+                continue;
             }
-            lock_message.destroy();
-            message = nullptr;
-            it++;
+            controlQueue->send<Protocol::Packet::ResendHeader>(
+                message->source, message->id, index, num);
         }
+        timerWheel.schedule(&message->timer, now + resendInterval);
     }
+}
 
-    if (message != nullptr) {
-        sendGrantPacket(message, message->message->driver, *lock_message);
-        message->newPacket = false;
+/**
+ * Remove a message from the scheduledMessages, if it is scheduled.
+ *
+ * The caller must hold both the Receiver's mutex and the message's mutex.
+ *
+ * @param message
+ *      InboundMessage to be removed.
+ */
+void
+Receiver::unschedule(InboundMessage* message)
+{
+    if (!message->scheduled) {
+        return;
     }
+    scheduledMessages.erase(
+        {message->scheduledBytes, message->id, message});
+    message->scheduled = false;
+}
 
-    scheduling.clear();
+/**
+ * Add a message to the scheduledMessages if it still needs to be granted
+ * packets.  Packets may be added to a message without holding the Receiver's
+ * mutex, so the message should be unscheduled and rescheduled afterwards to
+ * update its position.
+ *
+ * The caller must hold both the Receiver's mutex and the message's mutex.
+ *
+ * @param message
+ *      InboundMessage to be added.
+ */
+void
+Receiver::reschedule(InboundMessage* message)
+{
+    if (message->scheduled || !message->message ||
+        message->fullMessageReceived ||
+        message->grantIndexLimit >= message->numExpectedPackets) {
+        return;
+    }
+    uint32_t receivedBytes = Util::downCast<uint32_t>(
+        std::min(uint64_t(message->message->rawLength()),
+                 uint64_t(message->message->PACKET_DATA_LENGTH) *
+                     message->message->getNumPackets()));
+    message->scheduledBytes = message->message->rawLength() - receivedBytes;
+    message->scheduled = true;
+    scheduledMessages.insert(
+        {message->scheduledBytes, message->id, message});
 }
 
 }  // namespace Core
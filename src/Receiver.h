@@ -20,13 +20,16 @@
 
 #include <atomic>
 #include <deque>
-#include <unordered_map>
+#include <set>
 
 #include "ControlPacket.h"
+#include "FlatMap.h"
 #include "InboundMessage.h"
 #include "ObjectPool.h"
+#include "Policy.h"
 #include "Protocol.h"
 #include "SpinLock.h"
+#include "TimerWheel.h"
 #include "Transport.h"
 
 namespace Homa {
@@ -42,7 +45,14 @@ namespace Core {
  */
 class Receiver {
   public:
-    explicit Receiver();
+    /// Default number of incoming messages that the Receiver will grant to at
+    /// the same time.
+    static const uint32_t DEFAULT_OVERCOMMITMENT_DEGREE =
+        Homa::Transport::DEFAULT_OVERCOMMITMENT_DEGREE;
+
+    explicit Receiver(
+        ControlPacket::Queue* controlQueue,
+        uint32_t overcommitmentDegree = DEFAULT_OVERCOMMITMENT_DEGREE);
     virtual ~Receiver();
     virtual void handleDataPacket(Driver::Packet* packet, Driver* driver);
     virtual void handleBusyPacket(Driver::Packet* packet, Driver* driver);
@@ -58,39 +68,98 @@ class Receiver {
      *
      * @param op
      *      Op whose incomming request should be acknowledged.
-     * @param driver
-     *      Driver with which the DONE packet should be sent.
+     * @param controlQueue
+     *      Queue through which the DONE packet should be sent.
      * @param lock_op
      *      Used to remind the caller to hold the op's mutex while calling
      *      this method.
      */
-    static inline void sendDonePacket(Transport::Op* op, Driver* driver,
+    static inline void sendDonePacket(Transport::Op* op,
+                                      ControlPacket::Queue* controlQueue,
                                       const SpinLock::Lock& lock_op)
     {
         (void)lock_op;
-        ControlPacket::send<Protocol::Packet::DoneHeader>(
-            driver, op->inMessage->source, op->inMessage->getId());
+        controlQueue->send<Protocol::Packet::DoneHeader>(
+            op->inMessage->source, op->inMessage->getId());
     }
 
   private:
+    /**
+     * Entry in the Receiver's scheduledMessages.  Entries are ordered so that
+     * the message with the fewest bytes left to receive comes first (SRPT);
+     * ties are broken by MessageId so that the order is deterministic.
+     */
+    struct ScheduleEntry {
+        /// Number of bytes of the message that have not yet been received.
+        uint32_t unreceivedBytes;
+        /// Identifier of the scheduled message.
+        Protocol::MessageId id;
+        /// The scheduled message.
+        InboundMessage* message;
+
+        /// SRPT ordering; see ScheduleEntry.
+        bool operator<(const ScheduleEntry& other) const
+        {
+            return (unreceivedBytes < other.unreceivedBytes) ||
+                   ((unreceivedBytes == other.unreceivedBytes) &&
+                    (id < other.id));
+        }
+    };
+
     void schedule();
     void sendGrantPacket(InboundMessage* message, Driver* driver,
-                         const SpinLock::Lock& lock_message);
+                         int priority, const SpinLock::Lock& lock_message);
+    static uint32_t getGrantDelay(const InboundMessage* message, uint64_t now);
+    void updateCutoffs(Driver* driver, uint16_t packetDataLength);
+    void checkTimeouts(uint64_t now);
+    void unschedule(InboundMessage* message);
+    void reschedule(InboundMessage* message);
 
     /// Mutex for monitor-style locking of Receiver state.
     SpinLock mutex;
 
+    /// Queue through which this Receiver sends control packets.
+    ControlPacket::Queue* const controlQueue;
+
+    /// Maximum number of incoming messages that can be granted to at the same
+    /// time; the top overcommitmentDegree messages in scheduledMessages.
+    const uint32_t overcommitmentDegree;
+
     /// Tracks the set of Transport::Op objects with expected InboundMessages.
-    std::unordered_map<Protocol::MessageId, Transport::Op*,
-                       Protocol::MessageId::Hasher>
+    FlatMap<Protocol::MessageId, Transport::Op*, Protocol::MessageId::Hasher>
         registeredOps;
 
     /// Tracks the set of InboundMessage objects that do not have an associated
     /// Transport::Op.
-    std::unordered_map<Protocol::MessageId, InboundMessage*,
-                       Protocol::MessageId::Hasher>
+    FlatMap<Protocol::MessageId, InboundMessage*, Protocol::MessageId::Hasher>
         unregisteredMessages;
 
+    /// Partially received messages that have not yet been granted all of
+    /// their packets, in SRPT order.  Each message remembers the key of its
+    /// entry so that packets can be added without holding the Receiver's
+    /// mutex; the entry is updated afterwards with unschedule() and
+    /// reschedule().
+    std::set<ScheduleEntry> scheduledMessages;
+
+    /// Lengths of recently arrived messages; used to compute
+    /// unscheduledCutoffs.
+    Policy::MessageSizeHistogram messageSizes;
+
+    /// Unscheduled priority cutoffs advertised to Senders in GRANT packets.
+    Protocol::Packet::UnscheduledCutoffs unscheduledCutoffs;
+
+    /// Round-trip times to each Sender; measured from the time a GRANT is
+    /// sent until the first packet it allowed arrives.
+    Policy::RttEstimator peerRtts;
+
+    /// Number of cycles between checks for lost packets of an incoming
+    /// message.
+    const uint64_t resendInterval;
+
+    /// Tracks when each partially received message should next be checked
+    /// for lost packets.
+    TimerWheel<InboundMessage> timerWheel;
+
     /// Unregistered InboundMessage objects to be processed by the transport.
     std::deque<InboundMessage*> receivedMessages;
 
@@ -17,10 +17,12 @@
 
 #include "Receiver.h"
 
+#include <limits>
 #include <mutex>
 
 #include <Homa/Debug.h>
 
+#include "Cycles.h"
 #include "Mock/MockDriver.h"
 #include "Transport.h"
 
@@ -28,6 +30,7 @@ namespace Homa {
 namespace Core {
 namespace {
 
+using ::testing::_;
 using ::testing::Eq;
 using ::testing::InSequence;
 using ::testing::Matcher;
@@ -42,27 +45,39 @@ class ReceiverTest : public ::testing::Test {
         : mockDriver()
         , mockPacket(&payload)
         , payload()
+        , controlQueue(&mockDriver)
         , receiver()
         , savedLogPolicy(Debug::getLogPolicy())
     {
         ON_CALL(mockDriver, getBandwidth).WillByDefault(Return(8000));
-        ON_CALL(mockDriver, getMaxPayloadSize).WillByDefault(Return(1028));
+        ON_CALL(mockDriver, getMaxPayloadSize).WillByDefault(Return(1034));
         Debug::setLogPolicy(
             Debug::logPolicyFromString("src/ObjectPool@SILENT"));
-        receiver = new Receiver();
+        receiver = new Receiver(&controlQueue);
         transport = new Transport(&mockDriver, 1);
     }
 
     ~ReceiverTest()
     {
+        // Ops still in the slab release their packets on teardown.
+        Mock::VerifyAndClearExpectations(&mockDriver);
         delete receiver;
+        // Ops built by the tests hold messages owned by the test receiver,
+        // not the transport's; release them before the transport cleans up.
+        for (uint32_t i = 0; i < transport->opSlab.getNumSlots(); ++i) {
+            Transport::Op* op = transport->opSlab.getByIndex(i);
+            if (op != nullptr) {
+                transport->opSlab.destroy(op);
+            }
+        }
         delete transport;
         Debug::setLogPolicy(savedLogPolicy);
     }
 
     NiceMock<Homa::Mock::MockDriver> mockDriver;
     NiceMock<Homa::Mock::MockDriver::MockPacket> mockPacket;
-    char payload[1028];
+    char payload[1034];
+    ControlPacket::Queue controlQueue;
     Receiver* receiver;
     Transport* transport;
     std::vector<std::pair<std::string, std::string>> savedLogPolicy;
@@ -71,14 +86,13 @@ class ReceiverTest : public ::testing::Test {
 TEST_F(ReceiverTest, handleDataPacket_basic)
 {
     // Setup registered op
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     Protocol::MessageId id(42, 32, 22);
     InboundMessage* message = receiver->messagePool.construct();
     message->id = id;
     message->active = false;
     op->inMessage = message;
     receiver->registeredOps.insert({id, op});
-    op->inMessage->newPacket = false;
 
     EXPECT_TRUE(receiver->unregisteredMessages.empty());
     EXPECT_TRUE(receiver->receivedMessages.empty());
@@ -89,18 +103,14 @@ TEST_F(ReceiverTest, handleDataPacket_basic)
     header->common.messageId = id;
     header->index = 1;
     header->totalLength = 1420;
-    std::string addressStr("remote-location");
     Homa::Mock::MockDriver::MockAddress mockAddress;
     mockPacket.address = &mockAddress;
 
     EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
         .Times(0);
-    EXPECT_CALL(mockAddress, toString)
-        .Times(3)
-        .WillRepeatedly(Return(addressStr))
-        .RetiresOnSaturation();
+    EXPECT_CALL(mockAddress, toRaw).Times(1);
     EXPECT_CALL(mockDriver,
-                getAddress(Matcher<std::string const*>(Pointee(addressStr))))
+                getAddress(Matcher<Driver::Address::Raw const*>(_)))
         .WillOnce(Return(&mockAddress));
 
     receiver->handleDataPacket(&mockPacket, &mockDriver);
@@ -111,85 +121,72 @@ TEST_F(ReceiverTest, handleDataPacket_basic)
     EXPECT_EQ(&mockAddress, op->inMessage->source);
     EXPECT_EQ(2U, message->numExpectedPackets);
     EXPECT_EQ(1420U, op->inMessage->message->messageLength);
-    EXPECT_TRUE(op->inMessage->message->occupied.test(1));
+    EXPECT_NE(nullptr, op->inMessage->message->getPacket(1));
     EXPECT_EQ(1U, op->inMessage->message->getNumPackets());
     EXPECT_EQ(1000U, op->inMessage->message->PACKET_DATA_LENGTH);
     EXPECT_TRUE(op->inMessage->active);
-    EXPECT_TRUE(op->inMessage->newPacket);
     EXPECT_FALSE(op->inMessage->fullMessageReceived);
-    EXPECT_EQ(0U, transport->updateHints.ops.count(op));
+    EXPECT_FALSE(op->hintQueued);
 
     Mock::VerifyAndClearExpectations(&mockDriver);
     Mock::VerifyAndClearExpectations(&mockAddress);
 
     // receive packet 1 again; duplicate packet
-    op->inMessage->newPacket = false;
 
     EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
         .Times(1);
     EXPECT_CALL(mockDriver,
-                getAddress(Matcher<std::string const*>(Pointee(addressStr))))
+                getAddress(Matcher<Driver::Address::Raw const*>(_)))
         .Times(0);
-    EXPECT_CALL(mockAddress, toString)
-        .Times(2)
-        .WillRepeatedly(Return(addressStr))
-        .RetiresOnSaturation();
+    EXPECT_CALL(mockAddress, toRaw).Times(0);
 
     receiver->handleDataPacket(&mockPacket, &mockDriver);
 
     EXPECT_TRUE(receiver->unregisteredMessages.empty());
     EXPECT_TRUE(receiver->receivedMessages.empty());
-    EXPECT_TRUE(op->inMessage->message->occupied.test(1));
+    EXPECT_NE(nullptr, op->inMessage->message->getPacket(1));
     EXPECT_EQ(1U, op->inMessage->message->getNumPackets());
     EXPECT_EQ(1000U, op->inMessage->message->PACKET_DATA_LENGTH);
-    EXPECT_FALSE(op->inMessage->newPacket);
     EXPECT_FALSE(op->inMessage->fullMessageReceived);
-    EXPECT_EQ(0U, transport->updateHints.ops.count(op));
+    EXPECT_FALSE(op->hintQueued);
 
     Mock::VerifyAndClearExpectations(&mockDriver);
     Mock::VerifyAndClearExpectations(&mockAddress);
 
     // receive packet 0; complete the message
     header->index = 0;
-    op->inMessage->newPacket = false;
 
     EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
         .Times(0);
     EXPECT_CALL(mockDriver,
-                getAddress(Matcher<std::string const*>(Pointee(addressStr))))
+                getAddress(Matcher<Driver::Address::Raw const*>(_)))
         .Times(0);
-    EXPECT_CALL(mockAddress, toString)
-        .Times(2)
-        .WillRepeatedly(Return(addressStr))
-        .RetiresOnSaturation();
+    EXPECT_CALL(mockAddress, toRaw).Times(0);
 
     receiver->handleDataPacket(&mockPacket, &mockDriver);
 
     EXPECT_TRUE(receiver->unregisteredMessages.empty());
     EXPECT_TRUE(receiver->receivedMessages.empty());
-    EXPECT_TRUE(op->inMessage->message->occupied.test(0));
+    EXPECT_NE(nullptr, op->inMessage->message->getPacket(0));
     EXPECT_EQ(2U, op->inMessage->message->getNumPackets());
     EXPECT_EQ(1000U, op->inMessage->message->PACKET_DATA_LENGTH);
-    EXPECT_TRUE(op->inMessage->newPacket);
     EXPECT_TRUE(op->inMessage->fullMessageReceived);
-    EXPECT_EQ(1U, transport->updateHints.ops.count(op));
+    EXPECT_TRUE(op->hintQueued);
 
     Mock::VerifyAndClearExpectations(&mockDriver);
     Mock::VerifyAndClearExpectations(&mockAddress);
 
     // receive packet 0 again on a complete message
-    op->inMessage->newPacket = false;
 
     EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
         .Times(1);
     EXPECT_CALL(mockDriver,
-                getAddress(Matcher<std::string const*>(Pointee(addressStr))))
+                getAddress(Matcher<Driver::Address::Raw const*>(_)))
         .Times(0);
-    EXPECT_CALL(mockAddress, toString).Times(0);
+    EXPECT_CALL(mockAddress, toRaw).Times(0);
 
     receiver->handleDataPacket(&mockPacket, &mockDriver);
 
-    EXPECT_FALSE(op->inMessage->newPacket);
     EXPECT_TRUE(receiver->unregisteredMessages.empty());
     EXPECT_TRUE(receiver->receivedMessages.empty());
     Mock::VerifyAndClearExpectations(&mockDriver);
@@ -203,7 +200,6 @@ TEST_F(ReceiverTest, handleDataPacket_existingUnregistered)
     header->common.messageId = id;
     header->index = 1;
     header->totalLength = 1420;
-    std::string addressStr("remote-location");
     Homa::Mock::MockDriver::MockAddress mockAddress;
     mockPacket.address = &mockAddress;
 
@@ -214,12 +210,9 @@ TEST_F(ReceiverTest, handleDataPacket_existingUnregistered)
     EXPECT_EQ(1U, receiver->unregisteredMessages.size());
     EXPECT_TRUE(receiver->receivedMessages.empty());
 
-    EXPECT_CALL(mockAddress, toString)
-        .Times(3)
-        .WillRepeatedly(Return(addressStr))
-        .RetiresOnSaturation();
+    EXPECT_CALL(mockAddress, toRaw).Times(1);
     EXPECT_CALL(mockDriver,
-                getAddress(Matcher<std::string const*>(Pointee(addressStr))))
+                getAddress(Matcher<Driver::Address::Raw const*>(_)))
         .WillOnce(Return(&mockAddress));
 
     receiver->handleDataPacket(&mockPacket, &mockDriver);
@@ -238,7 +231,6 @@ TEST_F(ReceiverTest, handleDataPacket_newUnregistered)
     header->common.messageId = id;
     header->index = 1;
     header->totalLength = 1420;
-    std::string addressStr("remote-location");
     Homa::Mock::MockDriver::MockAddress mockAddress;
     mockPacket.address = &mockAddress;
 
@@ -246,12 +238,9 @@ TEST_F(ReceiverTest, handleDataPacket_newUnregistered)
     EXPECT_TRUE(receiver->unregisteredMessages.empty());
     EXPECT_TRUE(receiver->receivedMessages.empty());
 
-    EXPECT_CALL(mockAddress, toString)
-        .Times(3)
-        .WillRepeatedly(Return(addressStr))
-        .RetiresOnSaturation();
+    EXPECT_CALL(mockAddress, toRaw).Times(1);
     EXPECT_CALL(mockDriver,
-                getAddress(Matcher<std::string const*>(Pointee(addressStr))))
+                getAddress(Matcher<Driver::Address::Raw const*>(_)))
         .WillOnce(Return(&mockAddress));
 
     receiver->handleDataPacket(&mockPacket, &mockDriver);
@@ -261,10 +250,167 @@ TEST_F(ReceiverTest, handleDataPacket_newUnregistered)
     EXPECT_EQ(id, receiver->receivedMessages.front()->getId());
 }
 
+TEST_F(ReceiverTest, handleDataPacket_scheduled)
+{
+    Protocol::MessageId id(42, 32, 22);
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(mockPacket.payload);
+    header->common.messageId = id;
+    header->index = 0;
+    header->totalLength = 9000;
+    header->unscheduledIndexLimit = 5;
+    NiceMock<Homa::Mock::MockDriver::MockAddress> mockAddress;
+    mockPacket.address = &mockAddress;
+
+    ON_CALL(mockDriver, getAddress(Matcher<Driver::Address::Raw const*>(_)))
+        .WillByDefault(Return(&mockAddress));
+
+    receiver->handleDataPacket(&mockPacket, &mockDriver);
+
+    // The Sender sends 5 packets unscheduled.
+    InboundMessage* message = receiver->unregisteredMessages.find(id)->second;
+    EXPECT_EQ(9U, message->numExpectedPackets);
+    EXPECT_EQ(5U, message->grantIndexLimit);
+    EXPECT_EQ(1U, receiver->messageSizes.getNumSamples());
+    EXPECT_EQ(1U, receiver->scheduledMessages.size());
+    EXPECT_EQ(8000U, receiver->scheduledMessages.begin()->unreceivedBytes);
+
+    header->index = 1;
+    receiver->handleDataPacket(&mockPacket, &mockDriver);
+
+    EXPECT_EQ(1U, receiver->messageSizes.getNumSamples());
+    EXPECT_EQ(1U, receiver->scheduledMessages.size());
+    EXPECT_EQ(7000U, receiver->scheduledMessages.begin()->unreceivedBytes);
+
+    receiver->dropMessage(message);
+
+    EXPECT_TRUE(receiver->scheduledMessages.empty());
+}
+
+TEST_F(ReceiverTest, handleDataPacket_lockHandoff)
+{
+    Protocol::MessageId id(42, 32, 22);
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(mockPacket.payload);
+    header->common.messageId = id;
+    header->index = 0;
+    header->totalLength = 9000;
+    header->unscheduledIndexLimit = 5;
+    NiceMock<Homa::Mock::MockDriver::MockAddress> mockAddress;
+    mockPacket.address = &mockAddress;
+
+    // The Receiver's mutex is not held while the packet is processed.
+    bool receiverLocked = true;
+    EXPECT_CALL(mockDriver,
+                getAddress(Matcher<Driver::Address::Raw const*>(_)))
+        .WillOnce([this, &receiverLocked, &mockAddress](
+                      Driver::Address::Raw const*) -> Driver::Address* {
+            receiverLocked = !receiver->mutex.try_lock();
+            if (!receiverLocked) {
+                receiver->mutex.unlock();
+            }
+            return &mockAddress;
+        });
+
+    receiver->handleDataPacket(&mockPacket, &mockDriver);
+
+    EXPECT_FALSE(receiverLocked);
+    InboundMessage* message = receiver->unregisteredMessages.find(id)->second;
+    EXPECT_TRUE(message->timer.isScheduled());
+    EXPECT_TRUE(message->scheduled);
+    EXPECT_EQ(8000U, receiver->scheduledMessages.begin()->unreceivedBytes);
+
+    receiver->dropMessage(message);
+}
+
+TEST_F(ReceiverTest, handleDataPacket_unscheduledGrant)
+{
+    Protocol::MessageId id(42, 32, 22);
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(mockPacket.payload);
+    header->common.messageId = id;
+    header->index = 0;
+    header->totalLength = 3000;
+    header->unscheduledIndexLimit = 5;
+    NiceMock<Homa::Mock::MockDriver::MockAddress> mockAddress;
+    mockPacket.address = &mockAddress;
+
+    ON_CALL(mockDriver, getAddress(Matcher<Driver::Address::Raw const*>(_)))
+        .WillByDefault(Return(&mockAddress));
+
+    // The whole message is unscheduled; it is GRANTed right away so the
+    // Sender can sample the RTT.
+    char grantPayload[1034];
+    Homa::Mock::MockDriver::MockPacket grantPacket(grantPayload);
+    EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&grantPacket));
+    EXPECT_CALL(mockDriver, sendPackets(Pointee(&grantPacket), Eq(1)))
+        .Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&grantPacket), Eq(1)))
+        .Times(1);
+
+    receiver->handleDataPacket(&mockPacket, &mockDriver);
+    controlQueue.flush();
+
+    InboundMessage* message = receiver->unregisteredMessages.find(id)->second;
+    EXPECT_NE(0U, message->firstPacketTime);
+    EXPECT_TRUE(receiver->scheduledMessages.empty());
+    Protocol::Packet::GrantHeader* grantHeader =
+        (Protocol::Packet::GrantHeader*)grantPayload;
+    EXPECT_EQ(Protocol::Packet::GRANT, grantHeader->common.opcode);
+    EXPECT_EQ(id, grantHeader->common.messageId);
+    EXPECT_EQ(3U, grantHeader->indexLimit);
+    EXPECT_EQ(&mockAddress, grantPacket.address);
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // Single packet messages are never GRANTed.
+    Protocol::MessageId id2(42, 33, 22);
+    header->common.messageId = id2;
+    header->totalLength = 500;
+    EXPECT_CALL(mockDriver, allocPacket).Times(0);
+
+    receiver->handleDataPacket(&mockPacket, &mockDriver);
+    controlQueue.flush();
+}
+
+TEST_F(ReceiverTest, handleDataPacket_rttSample)
+{
+    Protocol::MessageId id(42, 32, 22);
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(mockPacket.payload);
+    header->common.messageId = id;
+    header->index = 0;
+    header->totalLength = 9000;
+    header->unscheduledIndexLimit = 5;
+    NiceMock<Homa::Mock::MockDriver::MockAddress> mockAddress;
+    mockPacket.address = &mockAddress;
+
+    ON_CALL(mockDriver, getAddress(Matcher<Driver::Address::Raw const*>(_)))
+        .WillByDefault(Return(&mockAddress));
+
+    receiver->handleDataPacket(&mockPacket, &mockDriver);
+    InboundMessage* message = receiver->unregisteredMessages.find(id)->second;
+    message->grantTime = PerfUtils::Cycles::rdtsc();
+    message->grantSampleIndex = 5;
+
+    // Unscheduled packet; no sample.
+    header->index = 1;
+    receiver->handleDataPacket(&mockPacket, &mockDriver);
+    EXPECT_NE(0U, message->grantTime);
+    EXPECT_TRUE(receiver->peerRtts.peers.empty());
+
+    // First granted packet.
+    header->index = 5;
+    receiver->handleDataPacket(&mockPacket, &mockDriver);
+    EXPECT_EQ(0U, message->grantTime);
+    EXPECT_EQ(1U, receiver->peerRtts.peers.count(&mockAddress));
+
+    receiver->dropMessage(message);
+}
+
 TEST_F(ReceiverTest, handleDataPacket_numExpectedPackets)
 {
     // Register op
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     Protocol::MessageId id(42, 32, 22);
     InboundMessage* message = receiver->messagePool.construct();
     message->id = id;
@@ -275,13 +421,10 @@ TEST_F(ReceiverTest, handleDataPacket_numExpectedPackets)
         static_cast<Protocol::Packet::DataHeader*>(mockPacket.payload);
     header->common.messageId = id;
     header->index = 0;
-    std::string addressStr("remote-location");
     NiceMock<Homa::Mock::MockDriver::MockAddress> mockAddress;
     mockPacket.address = &mockAddress;
 
-    ON_CALL(mockAddress, toString).WillByDefault(Return(addressStr));
-    ON_CALL(mockDriver,
-            getAddress(Matcher<std::string const*>(Pointee(addressStr))))
+    ON_CALL(mockDriver, getAddress(Matcher<Driver::Address::Raw const*>(_)))
         .WillByDefault(Return(&mockAddress));
 
     // 1 partial packet
@@ -310,17 +453,55 @@ TEST_F(ReceiverTest, handleDataPacket_numExpectedPackets)
     EXPECT_EQ(1000U, op->inMessage->message->PACKET_DATA_LENGTH);
 }
 
+TEST_F(ReceiverTest, handleDataPacket_indexOutOfRange)
+{
+    // Register op
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
+    Protocol::MessageId id(42, 32, 22);
+    InboundMessage* message = receiver->messagePool.construct();
+    message->id = id;
+    op->inMessage = message;
+    receiver->registeredOps.insert({id, op});
+
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(mockPacket.payload);
+    header->common.messageId = id;
+    header->index = 0xFFFFFFF0;
+    header->totalLength = 1420;
+    NiceMock<Homa::Mock::MockDriver::MockAddress> mockAddress;
+    mockPacket.address = &mockAddress;
+
+    ON_CALL(mockDriver, getAddress(Matcher<Driver::Address::Raw const*>(_)))
+        .WillByDefault(Return(&mockAddress));
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(2);
+
+    receiver->handleDataPacket(&mockPacket, &mockDriver);
+
+    EXPECT_EQ(2U, message->numExpectedPackets);
+    EXPECT_EQ(0U, message->message->getNumPackets());
+    EXPECT_TRUE(message->message->overflowPages.empty());
+    EXPECT_FALSE(message->fullMessageReceived);
+
+    // First index past the end of the message.
+    header->index = 2;
+    receiver->handleDataPacket(&mockPacket, &mockDriver);
+
+    EXPECT_EQ(0U, message->message->getNumPackets());
+    EXPECT_FALSE(message->fullMessageReceived);
+    EXPECT_FALSE(op->hintQueued);
+}
+
 TEST_F(ReceiverTest, handleBusyPacket_basic)
 {
     // Setup registered op
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     Protocol::MessageId id(42, 32, 22);
     InboundMessage* message = receiver->messagePool.construct();
     message->id = id;
     message->active = false;
     op->inMessage = message;
     receiver->registeredOps.insert({id, op});
-    op->inMessage->newPacket = false;
 
     Protocol::Packet::BusyHeader* busyHeader =
         (Protocol::Packet::BusyHeader*)mockPacket.payload;
@@ -372,19 +553,21 @@ TEST_F(ReceiverTest, handleBusyPacket_unknown)
 TEST_F(ReceiverTest, handlePingPacket_basic)
 {
     // Setup registered op
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     Protocol::MessageId id(42, 32, 22);
     Homa::Mock::MockDriver::MockAddress mockAddress;
     InboundMessage* message = receiver->messagePool.construct();
     message->id = id;
     message->grantIndexLimit = 11;
+    message->grantPriority = 3;
     message->source = &mockAddress;
     message->active = false;
+    message->firstPacketTime =
+        PerfUtils::Cycles::rdtsc() - PerfUtils::Cycles::fromMicroseconds(100);
     op->inMessage = message;
     receiver->registeredOps.insert({id, op});
-    op->inMessage->newPacket = false;
 
-    char pingPayload[1028];
+    char pingPayload[1034];
     Homa::Mock::MockDriver::MockPacket pingPacket(pingPayload);
     pingPacket.address = &mockAddress;
     Protocol::Packet::PingHeader* pingHeader =
@@ -399,6 +582,7 @@ TEST_F(ReceiverTest, handlePingPacket_basic)
         .Times(1);
 
     receiver->handlePingPacket(&pingPacket, &mockDriver);
+    controlQueue.flush();
 
     EXPECT_TRUE(message->active);
 
@@ -408,6 +592,47 @@ TEST_F(ReceiverTest, handlePingPacket_basic)
     EXPECT_EQ(Protocol::Packet::GRANT, header->common.opcode);
     EXPECT_EQ(id, header->common.messageId);
     EXPECT_EQ(message->grantIndexLimit, header->indexLimit);
+    EXPECT_EQ(3U, header->priority);
+    EXPECT_LE(100000U, header->delay);
+}
+
+TEST_F(ReceiverTest, handlePingPacket_noData)
+{
+    // Setup registered op whose message has not received any DATA.
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
+    Protocol::MessageId id(42, 32, 22);
+    Homa::Mock::MockDriver::MockAddress mockAddress;
+    InboundMessage* message = receiver->messagePool.construct();
+    message->id = id;
+    message->active = false;
+    op->inMessage = message;
+    receiver->registeredOps.insert({id, op});
+    EXPECT_EQ(nullptr, message->source);
+
+    char pingPayload[1034];
+    Homa::Mock::MockDriver::MockPacket pingPacket(pingPayload);
+    pingPacket.address = &mockAddress;
+    Protocol::Packet::PingHeader* pingHeader =
+        (Protocol::Packet::PingHeader*)pingPacket.payload;
+    pingHeader->common.messageId = id;
+
+    EXPECT_CALL(mockDriver, allocPacket()).WillOnce(Return(&mockPacket));
+    EXPECT_CALL(mockDriver, sendPackets(Pointee(&mockPacket), Eq(1))).Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&pingPacket), Eq(1)))
+        .Times(1);
+
+    receiver->handlePingPacket(&pingPacket, &mockDriver);
+    controlQueue.flush();
+
+    EXPECT_TRUE(message->active);
+
+    EXPECT_EQ(&mockAddress, mockPacket.address);
+    Protocol::Packet::UnknownHeader* header =
+        (Protocol::Packet::UnknownHeader*)payload;
+    EXPECT_EQ(Protocol::Packet::UNKNOWN, header->common.opcode);
+    EXPECT_EQ(id, header->common.messageId);
 }
 
 TEST_F(ReceiverTest, handlePingPacket_unregisteredMessage)
@@ -418,11 +643,12 @@ TEST_F(ReceiverTest, handlePingPacket_unregisteredMessage)
     InboundMessage* message = receiver->messagePool.construct();
     message->id = id;
     message->grantIndexLimit = 11;
+    message->grantPriority = 3;
     message->source = &mockAddress;
     message->active = false;
     receiver->unregisteredMessages.insert({id, message});
 
-    char pingPayload[1028];
+    char pingPayload[1034];
     Homa::Mock::MockDriver::MockPacket pingPacket(pingPayload);
     pingPacket.address = &mockAddress;
     Protocol::Packet::PingHeader* pingHeader =
@@ -437,6 +663,7 @@ TEST_F(ReceiverTest, handlePingPacket_unregisteredMessage)
         .Times(1);
 
     receiver->handlePingPacket(&pingPacket, &mockDriver);
+    controlQueue.flush();
 
     EXPECT_TRUE(message->active);
 
@@ -446,6 +673,7 @@ TEST_F(ReceiverTest, handlePingPacket_unregisteredMessage)
     EXPECT_EQ(Protocol::Packet::GRANT, header->common.opcode);
     EXPECT_EQ(id, header->common.messageId);
     EXPECT_EQ(message->grantIndexLimit, header->indexLimit);
+    EXPECT_EQ(3U, header->priority);
 }
 
 TEST_F(ReceiverTest, handlePingPacket_unknown)
@@ -453,7 +681,7 @@ TEST_F(ReceiverTest, handlePingPacket_unknown)
     Protocol::MessageId id(42, 32, 22);
     Homa::Mock::MockDriver::MockAddress mockAddress;
 
-    char pingPayload[1028];
+    char pingPayload[1034];
     Homa::Mock::MockDriver::MockPacket pingPacket(pingPayload);
     pingPacket.address = &mockAddress;
     Protocol::Packet::PingHeader* pingHeader =
@@ -468,6 +696,7 @@ TEST_F(ReceiverTest, handlePingPacket_unknown)
         .Times(1);
 
     receiver->handlePingPacket(&pingPacket, &mockDriver);
+    controlQueue.flush();
 
     EXPECT_EQ(&mockAddress, mockPacket.address);
     Protocol::Packet::UnknownHeader* header =
@@ -514,7 +743,7 @@ TEST_F(ReceiverTest, dropMessage)
 TEST_F(ReceiverTest, registerOp_existingMessage)
 {
     Protocol::MessageId id = {42, 32, 1};
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     InboundMessage* message = receiver->messagePool.construct();
     message->id = id;
     receiver->unregisteredMessages.insert({id, message});
@@ -535,7 +764,7 @@ TEST_F(ReceiverTest, registerOp_existingMessage)
 TEST_F(ReceiverTest, registerOp_newMessage)
 {
     Protocol::MessageId id = {42, 32, 0};
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
 
     EXPECT_EQ(0U, receiver->messagePool.outstandingObjects);
     EXPECT_EQ(receiver->registeredOps.end(), receiver->registeredOps.find(id));
@@ -550,7 +779,7 @@ TEST_F(ReceiverTest, registerOp_newMessage)
 TEST_F(ReceiverTest, dropOp)
 {
     Protocol::MessageId id = {42, 32, 1};
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     InboundMessage* message = receiver->messagePool.construct();
     message->id = id;
     op->inMessage = message;
@@ -576,7 +805,7 @@ TEST_F(ReceiverTest, sendDonePacket)
 {
     Protocol::MessageId id = {42, 32, 1};
     Homa::Mock::MockDriver::MockAddress mockAddress;
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     InboundMessage* message = receiver->messagePool.construct();
     message->source = &mockAddress;
     message->id = id;
@@ -588,7 +817,8 @@ TEST_F(ReceiverTest, sendDonePacket)
         .Times(1);
     {
         SpinLock::Lock lock(op->mutex);
-        Receiver::sendDonePacket(op, &mockDriver, lock);
+        Receiver::sendDonePacket(op, &controlQueue, lock);
+        controlQueue.flush();
     }
     Protocol::Packet::CommonHeader* header =
         static_cast<Protocol::Packet::CommonHeader*>(mockPacket.payload);
@@ -607,8 +837,10 @@ TEST_F(ReceiverTest, sendGrantPacket)
     InboundMessage message;
     message.id = msgId;
     message.source = sourceAddr;
-    message.message.construct(&mockDriver, 28, TOTAL_MESSAGE_LEN);
+    message.message.construct(&mockDriver, 34, TOTAL_MESSAGE_LEN);
     message.numExpectedPackets = 9;
+    message.firstPacketTime =
+        PerfUtils::Cycles::rdtsc() - PerfUtils::Cycles::fromMicroseconds(100);
     EXPECT_EQ(1000U, message.message->PACKET_DATA_LENGTH);
 
     InSequence _seq;
@@ -624,13 +856,17 @@ TEST_F(ReceiverTest, sendGrantPacket)
             .Times(1);
 
         SpinLock::Lock lock_message(message.mutex);
-        receiver->sendGrantPacket(&message, &mockDriver, lock_message);
+        receiver->sendGrantPacket(&message, &mockDriver, 0, lock_message);
+        controlQueue.flush();
 
         Protocol::Packet::GrantHeader* header =
             (Protocol::Packet::GrantHeader*)payload;
         EXPECT_EQ(msgId, header->common.messageId);
         EXPECT_EQ(6U, header->indexLimit);
         EXPECT_EQ(6U, message.grantIndexLimit);
+        EXPECT_NE(0U, message.grantTime);
+        EXPECT_EQ(0U, message.grantSampleIndex);
+        EXPECT_LE(100000U, header->delay);
         EXPECT_EQ(sizeof(Protocol::Packet::GrantHeader), mockPacket.length);
         EXPECT_EQ(sourceAddr, mockPacket.address);
 
@@ -648,7 +884,8 @@ TEST_F(ReceiverTest, sendGrantPacket)
             .Times(1);
 
         SpinLock::Lock lock_message(message.mutex);
-        receiver->sendGrantPacket(&message, &mockDriver, lock_message);
+        receiver->sendGrantPacket(&message, &mockDriver, 0, lock_message);
+        controlQueue.flush();
 
         Protocol::Packet::GrantHeader* header =
             (Protocol::Packet::GrantHeader*)payload;
@@ -660,63 +897,293 @@ TEST_F(ReceiverTest, sendGrantPacket)
 
         Mock::VerifyAndClearExpectations(&mockDriver);
     }
+
+    {
+        // Nothing new to GRANT.
+        EXPECT_CALL(mockDriver, allocPacket).Times(0);
+
+        SpinLock::Lock lock_message(message.mutex);
+        receiver->sendGrantPacket(&message, &mockDriver, 0, lock_message);
+        controlQueue.flush();
+
+        Mock::VerifyAndClearExpectations(&mockDriver);
+    }
+
+    {
+        // No more packets but the priority changed.
+        EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&mockPacket));
+        EXPECT_CALL(mockDriver, sendPackets(Pointee(&mockPacket), Eq(1)))
+            .Times(1);
+        EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+            .Times(1);
+
+        SpinLock::Lock lock_message(message.mutex);
+        receiver->sendGrantPacket(&message, &mockDriver, 2, lock_message);
+        controlQueue.flush();
+
+        Protocol::Packet::GrantHeader* header =
+            (Protocol::Packet::GrantHeader*)payload;
+        EXPECT_EQ(9U, header->indexLimit);
+        EXPECT_EQ(2U, header->priority);
+        EXPECT_EQ(2, message.grantPriority);
+        EXPECT_EQ(receiver->unscheduledCutoffs.version,
+                  header->cutoffs.version);
+
+        Mock::VerifyAndClearExpectations(&mockDriver);
+    }
+}
+
+TEST_F(ReceiverTest, getGrantDelay)
+{
+    InboundMessage message;
+    uint64_t now = PerfUtils::Cycles::rdtsc();
+
+    message.firstPacketTime = now - PerfUtils::Cycles::fromMicroseconds(100);
+    EXPECT_NEAR(100000, Receiver::getGrantDelay(&message, now), 1);
+
+    // Saturated.
+    message.firstPacketTime = now - PerfUtils::Cycles::fromSeconds(10);
+    EXPECT_EQ(std::numeric_limits<uint32_t>::max(),
+              Receiver::getGrantDelay(&message, now));
+
+    // First packet processed by another poller after now was read.
+    message.firstPacketTime = now + 1000;
+    EXPECT_EQ(0U, Receiver::getGrantDelay(&message, now));
 }
 
 TEST_F(ReceiverTest, schedule)
 {
-    Protocol::MessageId id(42, 32, 22);
+    ON_CALL(mockDriver, getHighestPacketPriority).WillByDefault(Return(7));
+    delete receiver;
+    receiver = new Receiver(&controlQueue, 2);
     Driver::Address* sourceAddr = (Driver::Address*)22;
-    uint32_t TOTAL_MESSAGE_LEN = 9000;
 
-    InboundMessage* message = receiver->messagePool.construct();
-    message->id = id;
-    message->source = sourceAddr;
-    message->message.construct(&mockDriver, 28, TOTAL_MESSAGE_LEN);
-    message->message->numPackets = 1;
-    EXPECT_EQ(1000U, message->message->PACKET_DATA_LENGTH);
-    EXPECT_EQ(1U, message->message->getNumPackets());
-    EXPECT_FALSE(message->newPacket);
-
-    receiver->unregisteredMessages.insert({id, message});
+    // Three partially received messages with 5000, 14000, and 19000 bytes
+    // left to receive; each was given 5 unscheduled packets.
+    uint32_t length[3] = {9000, 15000, 20000};
+    uint16_t numPackets[3] = {4, 1, 1};
+    InboundMessage* message[3];
+    for (int i = 0; i < 3; ++i) {
+        Protocol::MessageId id(42, 32, i);
+        message[i] = receiver->messagePool.construct();
+        message[i]->id = id;
+        message[i]->source = sourceAddr;
+        message[i]->message.construct(&mockDriver, 34, length[i]);
+        message[i]->message->numPackets = numPackets[i];
+        message[i]->numExpectedPackets = length[i] / 1000;
+        message[i]->grantIndexLimit = 5;
+        receiver->unregisteredMessages.insert({id, message[i]});
+        receiver->reschedule(message[i]);
+    }
+    EXPECT_EQ(3U, receiver->scheduledMessages.size());
+    EXPECT_EQ(message[0], receiver->scheduledMessages.begin()->message);
 
-    EXPECT_CALL(mockDriver, allocPacket).Times(0);
-    EXPECT_CALL(mockDriver, sendPackets).Times(0);
-    EXPECT_CALL(mockDriver, releasePackets).Times(0);
+    // Only the 2 shortest messages are granted; message 0 is fully granted.
+    EXPECT_CALL(mockDriver, allocPacket)
+        .Times(2)
+        .WillRepeatedly(Return(&mockPacket));
+    EXPECT_CALL(mockDriver, sendPackets(Pointee(&mockPacket), Eq(2))).Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(2)))
+        .Times(1);
 
     receiver->schedule();
+    controlQueue.flush();
 
     Mock::VerifyAndClearExpectations(&mockDriver);
 
-    EXPECT_FALSE(message->newPacket);
-    message->newPacket = true;
-
-    EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&mockPacket));
-    EXPECT_CALL(mockDriver, sendPackets(Pointee(&mockPacket), Eq(1))).Times(1);
-    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+    EXPECT_EQ(9U, message[0]->grantIndexLimit);
+    EXPECT_EQ(1, message[0]->grantPriority);
+    EXPECT_EQ(6U, message[1]->grantIndexLimit);
+    EXPECT_EQ(0, message[1]->grantPriority);
+    EXPECT_EQ(5U, message[2]->grantIndexLimit);
+    EXPECT_EQ(2U, receiver->scheduledMessages.size());
+    EXPECT_EQ(message[1], receiver->scheduledMessages.begin()->message);
+
+    // Message 1 already has an RTT granted but moves up a priority level;
+    // message 2 moves into the top 2.
+    EXPECT_CALL(mockDriver, allocPacket)
+        .Times(2)
+        .WillRepeatedly(Return(&mockPacket));
+    EXPECT_CALL(mockDriver, sendPackets(Pointee(&mockPacket), Eq(2))).Times(1);
+    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(2)))
         .Times(1);
 
     receiver->schedule();
+    controlQueue.flush();
 
     Mock::VerifyAndClearExpectations(&mockDriver);
 
-    EXPECT_FALSE(message->newPacket);
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    EXPECT_EQ(6U, message[1]->grantIndexLimit);
+    EXPECT_EQ(1, message[1]->grantPriority);
+    EXPECT_EQ(6U, message[2]->grantIndexLimit);
+    EXPECT_EQ(0, message[2]->grantPriority);
+    Protocol::Packet::GrantHeader* header =
+        (Protocol::Packet::GrantHeader*)payload;
+    EXPECT_EQ(message[2]->id, header->common.messageId);
+    EXPECT_EQ(6U, header->indexLimit);
+    EXPECT_EQ(0U, header->priority);
+}
+
+TEST_F(ReceiverTest, updateCutoffs)
+{
+    ON_CALL(mockDriver, getHighestPacketPriority).WillByDefault(Return(7));
+    EXPECT_EQ(0U, receiver->unscheduledCutoffs.version);
+
+    receiver->messageSizes.record(100);
+    receiver->updateCutoffs(&mockDriver, 1000);
+
+    EXPECT_EQ(1U, receiver->unscheduledCutoffs.version);
+    EXPECT_EQ(128U, receiver->unscheduledCutoffs.cutoffs[0]);
+
+    // No change; same version.
+    receiver->messageSizes.record(100);
+    receiver->updateCutoffs(&mockDriver, 1000);
+
+    EXPECT_EQ(1U, receiver->unscheduledCutoffs.version);
+
+    // Changed cutoffs; version 0 is skipped.
+    receiver->unscheduledCutoffs.version = 255;
+    receiver->messageSizes.record(1000);
+    receiver->messageSizes.record(1000);
+    receiver->updateCutoffs(&mockDriver, 1000);
+
+    EXPECT_EQ(1U, receiver->unscheduledCutoffs.version);
+    EXPECT_EQ(1024U, receiver->unscheduledCutoffs.cutoffs[2]);
+}
+
+TEST_F(ReceiverTest, checkTimeouts)
+{
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
+    Protocol::MessageId id(42, 32, 22);
+    Homa::Mock::MockDriver::MockAddress mockAddress;
+    InboundMessage* message = receiver->messagePool.construct();
+    message->id = id;
+    message->source = &mockAddress;
+    message->message.construct(&mockDriver, 34, 5000);
+    message->grantIndexLimit = 4;
+    message->message->setPacket(0, &mockPacket);
+    message->message->setPacket(3, &mockPacket);
     op->inMessage = message;
+    op->state.store(OpContext::State::IN_PROGRESS);
     receiver->registeredOps.insert({id, op});
-    receiver->unregisteredMessages.erase(id);
+    uint64_t now = PerfUtils::Cycles::rdtsc() + receiver->resendInterval;
 
-    message->newPacket = true;
+    // Packets received since the last timeout.
+    message->active = true;
+    message->timeoutCount = 3;
+    receiver->timerWheel.schedule(&message->timer, 0);
+    EXPECT_CALL(mockDriver, sendPackets).Times(0);
 
-    EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&mockPacket));
-    EXPECT_CALL(mockDriver, sendPackets(Pointee(&mockPacket), Eq(1))).Times(1);
-    EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
+    receiver->checkTimeouts(now);
+
+    EXPECT_FALSE(message->active);
+    EXPECT_EQ(0U, message->timeoutCount);
+    EXPECT_TRUE(message->timer.isScheduled());
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // No progress; request the missing packets.
+    char resendPayload[1034];
+    NiceMock<Homa::Mock::MockDriver::MockPacket> resendPacket(resendPayload);
+    receiver->timerWheel.schedule(&message->timer, 0);
+    EXPECT_CALL(mockDriver, allocPacket()).WillOnce(Return(&resendPacket));
+    EXPECT_CALL(mockDriver, sendPackets(Pointee(&resendPacket), Eq(1)))
         .Times(1);
 
-    receiver->schedule();
+    now += receiver->resendInterval;
+    receiver->checkTimeouts(now);
+    controlQueue.flush();
 
+    EXPECT_EQ(1U, message->timeoutCount);
+    EXPECT_TRUE(message->timer.isScheduled());
+    EXPECT_EQ(OpContext::State::IN_PROGRESS, op->state.load());
+    Protocol::Packet::ResendHeader* header =
+        (Protocol::Packet::ResendHeader*)resendPayload;
+    EXPECT_EQ(Protocol::Packet::RESEND, header->common.opcode);
+    EXPECT_EQ(id, header->common.messageId);
+    EXPECT_EQ(1U, header->index);
+    EXPECT_EQ(2U, header->num);
+    EXPECT_EQ(&mockAddress, resendPacket.address);
     Mock::VerifyAndClearExpectations(&mockDriver);
 
-    EXPECT_FALSE(message->newPacket);
+    // Too many timeouts; the op fails.
+    message->timeoutCount = 1000;
+    receiver->timerWheel.schedule(&message->timer, 0);
+    EXPECT_CALL(mockDriver, sendPackets).Times(0);
+    receiver->checkTimeouts(now + receiver->resendInterval);
+
+    // The failure is left for the Transport to act on.
+    EXPECT_TRUE(op->failed);
+    EXPECT_EQ(OpContext::State::IN_PROGRESS, op->state.load());
+    EXPECT_FALSE(message->timer.isScheduled());
+    EXPECT_TRUE(op->hintQueued);
+}
+
+TEST_F(ReceiverTest, checkTimeouts_noResend)
+{
+    Protocol::MessageId id(42, 32, 22);
+    InboundMessage* message = receiver->messagePool.construct();
+    message->id = id;
+    message->message.construct(&mockDriver, 34, 5000);
+    message->grantIndexLimit = 1;
+    message->message->setPacket(0, &mockPacket);
+    receiver->unregisteredMessages.insert({id, message});
+    uint64_t now = PerfUtils::Cycles::rdtsc() + receiver->resendInterval;
+
+    EXPECT_CALL(mockDriver, sendPackets).Times(0);
+
+    // All granted packets received; wait for the Receiver to grant more.
+    receiver->timerWheel.schedule(&message->timer, 0);
+    receiver->checkTimeouts(now);
+    EXPECT_EQ(0U, message->timeoutCount);
+    EXPECT_TRUE(message->timer.isScheduled());
+
+    // Fully received messages are no longer checked.
+    message->fullMessageReceived = true;
+    receiver->timerWheel.schedule(&message->timer, 0);
+    receiver->checkTimeouts(now + receiver->resendInterval);
+    EXPECT_FALSE(message->timer.isScheduled());
+}
+
+TEST_F(ReceiverTest, unschedule_reschedule)
+{
+    Protocol::MessageId id(42, 32, 22);
+    InboundMessage* message = receiver->messagePool.construct();
+    message->id = id;
+
+    // No message data yet; nothing to schedule.
+    receiver->reschedule(message);
+    EXPECT_TRUE(receiver->scheduledMessages.empty());
+
+    message->message.construct(&mockDriver, 34, 9000);
+    message->message->numPackets = 2;
+    message->numExpectedPackets = 9;
+    message->grantIndexLimit = 5;
+
+    receiver->reschedule(message);
+    EXPECT_EQ(1U, receiver->scheduledMessages.size());
+    EXPECT_EQ(7000U, receiver->scheduledMessages.begin()->unreceivedBytes);
+    EXPECT_EQ(message, receiver->scheduledMessages.begin()->message);
+
+    // The entry is found even if packets were added in the meantime.
+    message->message->numPackets = 3;
+    receiver->unschedule(message);
+    EXPECT_TRUE(receiver->scheduledMessages.empty());
+    EXPECT_FALSE(message->scheduled);
+
+    receiver->reschedule(message);
+    EXPECT_EQ(6000U, receiver->scheduledMessages.begin()->unreceivedBytes);
+    receiver->unschedule(message);
+
+    // Fully granted messages are not scheduled.
+    message->grantIndexLimit = 9;
+    receiver->reschedule(message);
+    EXPECT_TRUE(receiver->scheduledMessages.empty());
+
+    // Fully received messages are not scheduled.
+    message->grantIndexLimit = 5;
+    message->fullMessageReceived = true;
+    receiver->reschedule(message);
+    EXPECT_TRUE(receiver->scheduledMessages.empty());
 }
 
 }  // namespace
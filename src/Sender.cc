@@ -16,23 +16,54 @@
 #include "Sender.h"
 
 #include <algorithm>
+#include <limits>
 
 #include "ControlPacket.h"
+#include "Cycles.h"
 #include "Debug.h"
+#include "Policy.h"
 
 namespace Homa {
 namespace Core {
 
 namespace {
-const uint32_t RTT_TIME_US = 5;
+/// Maximum number of DATA packets handed to the Driver in a single call to
+/// Driver::sendPackets().
+const uint16_t MAX_BURST = 32;
+
+/// Number of full packets' worth of bytes the Sender allows to be queued in
+/// the NIC; more packets are held back so that they are sent in SRPT order.
+const uint32_t NIC_QUEUE_PACKETS = 2;
+
+/// Length of each tick of the Sender's timer wheel.
+const uint64_t TIMER_TICK_US = 1000;
+
+/// Time between checks that an outgoing message is still making progress.
+const uint64_t PING_INTERVAL_US = 10000;
+
+/// Number of consecutive PING intervals without hearing from the destination
+/// after which an outgoing message, and its Op, is considered failed.
+const uint32_t MESSAGE_TIMEOUT_INTERVALS = 50;
 }
 
 /**
  * Sender Constructor.
+ *
+ * @param controlQueue
+ *      Queue through which this Sender will send control packets.
  */
-Sender::Sender()
+Sender::Sender(ControlPacket::Queue* controlQueue)
     : mutex()
+    , controlQueue(controlQueue)
     , outboundMessages()
+    , peerCutoffs()
+    , peerRtts()
+    , readyQueue()
+    , numReadyPackets(0)
+    , nicQueue()
+    , pingInterval(PerfUtils::Cycles::fromMicroseconds(PING_INTERVAL_US))
+    , timerWheel(PerfUtils::Cycles::fromMicroseconds(TIMER_TICK_US),
+                 PerfUtils::Cycles::rdtsc())
     , sending()
 {}
 
@@ -75,6 +106,7 @@ Sender::handleDonePacket(Driver::Packet* packet, Driver* driver)
 
     OutboundMessage* message = &op->outMessage;
     message->acknowledged = true;
+    message->active = true;
     op->hintUpdate();
     driver->releasePackets(&packet, 1);
 }
@@ -108,34 +140,44 @@ Sender::handleResendPacket(Driver::Packet* packet, Driver* driver)
         return;
     }
 
-    // Lock handoff
     SpinLock::Lock lock_op(op->mutex);
-    lock.unlock();
 
     OutboundMessage* message = &op->outMessage;
+    message->active = true;
 
-    uint16_t index = header->index;
-    uint16_t resendEnd = index + header->num;
+    uint32_t index = header->index;
+    uint32_t resendEnd = index + header->num;
 
     // In case a GRANT may have been lost, consider the RESEND a GRANT.
     assert(resendEnd <= message->message.getNumPackets());
+    dequeueReady(op, lock_op);
     message->grantIndex = std::max(message->grantIndex, resendEnd);
+    bool sentRequested = index < message->sentIndex;
+    if (sentRequested) {
+        // Only packets that have already been sent need to be resent; the
+        // rest will go out as part of the normal flow.  The resent packets
+        // are sent by trySend() along with the other ready packets so that
+        // they are paced like any other DATA.
+        resendEnd = std::min(resendEnd, message->sentIndex);
+        if (message->resendIndex < message->resendEnd) {
+            // Merge with the packets still waiting from an earlier RESEND.
+            message->resendIndex = std::min(message->resendIndex, index);
+            message->resendEnd = std::max(message->resendEnd, resendEnd);
+        } else {
+            message->resendIndex = index;
+            message->resendEnd = resendEnd;
+        }
+    }
+    enqueueReady(op, lock_op);
+    lock.unlock();
 
-    if (index >= message->sentIndex) {
+    if (!sentRequested) {
         // If this RESEND is only requesting unsent packets, it must be that
         // this Sender has been busy and the Receiver is trying to ensure there
         // are no lost packets.  Reply BUSY and allow this Sender to send DATA
         // when it's ready.
-        ControlPacket::send<Protocol::Packet::BusyHeader>(
-            driver, message->destination, message->id);
-    } else {
-        // There are some packets to resend but only resend packets that have
-        // already been sent.
-        resendEnd = std::min(resendEnd, message->sentIndex);
-        for (uint16_t i = index; i < resendEnd; ++i) {
-            Driver::Packet* packet = message->message.getPacket(index++);
-            message->message.driver->sendPackets(&packet, 1);
-        }
+        controlQueue->send<Protocol::Packet::BusyHeader>(message->destination,
+                                                         message->id);
     }
 
     driver->releasePackets(&packet, 1);
@@ -169,13 +211,33 @@ Sender::handleGrantPacket(Driver::Packet* packet, Driver* driver)
         return;
     }
 
-    // Lock handoff
     SpinLock::Lock lock_op(op->mutex);
-    lock.unlock();
 
     OutboundMessage* message = &op->outMessage;
+    message->active = true;
     assert(header->indexLimit <= message->message.getNumPackets());
+    dequeueReady(op, lock_op);
     message->grantIndex = std::max(message->grantIndex, header->indexLimit);
+    message->scheduledPriority = header->priority;
+    enqueueReady(op, lock_op);
+    if (header->cutoffs.version != 0) {
+        peerCutoffs[message->destination] = header->cutoffs;
+    }
+    if (message->rttStartTime != 0) {
+        // First GRANT since the message's first packet was sent.  The GRANT
+        // may have been held back by the Receiver's scheduling for a while
+        // (e.g. while the message wasn't among the Receiver's top
+        // overcommitmentDegree messages); the Receiver reports how long,
+        // which is left out of the sample.
+        uint64_t elapsed = PerfUtils::Cycles::toNanoseconds(
+            PerfUtils::Cycles::rdtsc() - message->rttStartTime);
+        if (header->delay < std::numeric_limits<uint32_t>::max() &&
+            elapsed > header->delay) {
+            peerRtts.record(message->destination, elapsed - header->delay);
+        }
+        message->rttStartTime = 0;
+    }
+    lock.unlock();
 
     driver->releasePackets(&packet, 1);
 }
@@ -208,23 +270,28 @@ Sender::handleUnknownPacket(Driver::Packet* packet, Driver* driver)
         return;
     }
 
-    // Lock handoff
     SpinLock::Lock lock_op(op->mutex);
-    lock.unlock();
 
     OutboundMessage* message = &op->outMessage;
+    message->active = true;
 
     if (!message->isDone()) {
+        dequeueReady(op, lock_op);
         message->sent = false;
         message->sentIndex = 0;
+        message->resendIndex = 0;
+        message->resendEnd = 0;
+        message->unsentBytes = message->message.rawLength();
         // TODO(cstlee): May want to use the unscheduled-limit here instead of
         // just granting a single packet.
         message->grantIndex = 1;
+        enqueueReady(op, lock_op);
         op->hintUpdate();
     } else {
         // The message is already considered "done" so the UNKNOWN packet must
         // be a stale response to a ping.
     }
+    lock.unlock();
     driver->releasePackets(&packet, 1);
 }
 
@@ -248,7 +315,125 @@ void
 Sender::sendMessage(Protocol::MessageId id, Driver::Address* destination,
                     Transport::Op* op, bool expectAcknowledgement)
 {
-    SpinLock::UniqueLock lock(mutex);
+    SpinLock::Lock lock(mutex);
+    queueMessage(id, destination, op, expectAcknowledgement,
+                 PerfUtils::Cycles::rdtsc(), lock);
+}
+
+/**
+ * Queue a batch of messages to be sent.  Equivalent to calling sendMessage()
+ * for each message but only acquires the Sender's lock once.
+ *
+ * @param numMessages
+ *      Number of messages in the batch.
+ * @param ids
+ *      Unique identifier for each message.
+ * @param destinations
+ *      Destination address for each message.
+ * @param ops
+ *      Transport::Op containing the OutboundMessage for each message.
+ * @param expectAcknowledgement
+ *      True means the Sender should wait for a DONE packet before declaring
+ *      each message "done"; false means each message is "done" after its last
+ *      byte is sent.
+ *
+ * @sa sendMessage()
+ */
+void
+Sender::sendMessages(size_t numMessages, const Protocol::MessageId ids[],
+                     Driver::Address* const destinations[],
+                     Transport::Op* const ops[], bool expectAcknowledgement)
+{
+    uint64_t now = PerfUtils::Cycles::rdtsc();
+    SpinLock::Lock lock(mutex);
+    for (size_t i = 0; i < numMessages; ++i) {
+        queueMessage(ids[i], destinations[i], ops[i], expectAcknowledgement,
+                     now, lock);
+    }
+}
+
+/**
+ * Inform the Sender that a Message is no longer needed and the associated
+ * Transport::Op should no longer be used.
+ *
+ * @param op
+ *      The Transport::Op which contains the Message that is no longer needed.
+ */
+void
+Sender::dropMessage(Transport::Op* op)
+{
+    SpinLock::Lock lock(mutex);
+    SpinLock::Lock lock_message(op->mutex);
+    auto it = outboundMessages.find(op->outMessage.id);
+    if (it != outboundMessages.end()) {
+        assert(op == it->second);
+        dequeueReady(op, lock_message);
+        timerWheel.cancel(&op->outMessage.timer);
+        outboundMessages.erase(it);
+    }
+}
+
+/**
+ * Allow the Sender to make incremental progress on background tasks.
+ */
+void
+Sender::poll()
+{
+    trySend();
+    checkTimeouts(PerfUtils::Cycles::rdtsc());
+}
+
+/**
+ * Return the estimated number of bytes that have been handed to the Driver
+ * but are still waiting in the NIC's transmit queue.
+ */
+uint32_t
+Sender::getNicQueuedBytes()
+{
+    SpinLock::Lock lock(mutex);
+    if (!nicQueue) {
+        return 0;
+    }
+    return nicQueue->getQueuedBytes(PerfUtils::Cycles::rdtsc());
+}
+
+/**
+ * Return the number of granted packets, including those to be resent, that are
+ * waiting in the Sender to be handed to the Driver.
+ */
+uint32_t
+Sender::getNumReadyPackets()
+{
+    SpinLock::Lock lock(mutex);
+    return numReadyPackets;
+}
+
+/**
+ * Helper method which queues a message to be sent; shared by sendMessage() and
+ * sendMessages().
+ *
+ * @param id
+ *      Unique identifier for this message.
+ * @param destination
+ *      Destination address for this message.
+ * @param op
+ *      Transport::Op containing the OutboundMessage to be sent.
+ * @param expectAcknowledgement
+ *      True means the Sender should wait for a DONE packet before declaring
+ *      this message "done"; false means the message is "done" after the last
+ *      byte of the message is sent.
+ * @param now
+ *      Current time in cycles; used to schedule the message's first timeout.
+ * @param lock
+ *      Used to remind the caller to hold the Sender's mutex while calling
+ *      this method.
+ */
+void
+Sender::queueMessage(Protocol::MessageId id, Driver::Address* destination,
+                     Transport::Op* op, bool expectAcknowledgement,
+                     uint64_t now, const SpinLock::Lock& lock)
+{
+    (void)lock;
     SpinLock::Lock lock_op(op->mutex);
 
     if (outboundMessages.find(id) != outboundMessages.end()) {
@@ -262,18 +447,30 @@ Sender::sendMessage(Protocol::MessageId id, Driver::Address* destination,
         outboundMessages.insert({id, op});
     }
 
-    lock.unlock();  // End sender critical section.
-
     OutboundMessage* message = &op->outMessage;
     message->id = id;
     message->destination = destination;
     message->acknowledged = !expectAcknowledgement;
-    uint32_t unscheduledBytes =
-        RTT_TIME_US * (message->message.driver->getBandwidth() / 8);
+    // Send one RTT worth of packets unscheduled; always at least one packet
+    // so that the Receiver learns about the message.
+    uint32_t unscheduledPackets = peerRtts.getRttPackets(
+        destination, message->message.driver,
+        message->message.PACKET_DATA_LENGTH);
+    message->unscheduledIndexLimit =
+        std::min(unscheduledPackets, message->message.getNumPackets());
+    message->rttStartTime = 0;
+    message->scheduledPriority = 0;
+    Protocol::Packet::UnscheduledCutoffs cutoffs;
+    auto cutoffsIt = peerCutoffs.find(destination);
+    if (cutoffsIt != peerCutoffs.end()) {
+        cutoffs = cutoffsIt->second;
+    }
+    int unscheduledPriority = Policy::getUnscheduledPriority(
+        message->message.driver, cutoffs, message->message.rawLength());
 
     uint32_t actualMessageLen = 0;
     // fill out metadata.
-    for (uint16_t i = 0; i < message->message.getNumPackets(); ++i) {
+    for (uint32_t i = 0; i < message->message.getNumPackets(); ++i) {
         Driver::Packet* packet = message->message.getPacket(i);
         if (packet == nullptr) {
             PANIC(
@@ -284,9 +481,11 @@ Sender::sendMessage(Protocol::MessageId id, Driver::Address* destination,
         }
 
         packet->address = message->destination;
-        packet->priority = 0;
+        // Scheduled packets are given a priority when they are sent.
+        packet->priority = unscheduledPriority;
         new (packet->payload) Protocol::Packet::DataHeader(
-            message->id, message->message.rawLength(), i);
+            message->id, message->message.rawLength(), i,
+            message->unscheduledIndexLimit);
         actualMessageLen +=
             (packet->length - message->message.PACKET_HEADER_LENGTH);
     }
@@ -296,45 +495,25 @@ Sender::sendMessage(Protocol::MessageId id, Driver::Address* destination,
     assert(message->message.PACKET_HEADER_LENGTH ==
            sizeof(Protocol::Packet::DataHeader));
 
-    message->grantIndex =
-        unscheduledBytes / message->message.PACKET_DATA_LENGTH;
-    message->grantIndex =
-        std::min(message->grantIndex, message->message.getNumPackets());
-    // TODO(cstlee): handle case when unscheduledBytes is less than 1 packet.
-    assert(message->grantIndex != 0);
-}
-
-/**
- * Inform the Sender that a Message is no longer needed and the associated
- * Transport::Op should no longer be used.
- *
- * @param op
- *      The Transport::Op which contains the Message that is no longer needed.
- */
-void
-Sender::dropMessage(Transport::Op* op)
-{
-    SpinLock::Lock lock(mutex);
-    SpinLock::Lock lock_message(op->mutex);
-    auto it = outboundMessages.find(op->outMessage.id);
-    if (it != outboundMessages.end()) {
-        assert(op == it->second);
-        outboundMessages.erase(it);
-    }
-}
+    message->grantIndex = message->unscheduledIndexLimit;
+    message->unsentBytes = message->message.rawLength();
+    enqueueReady(op, lock_op);
 
-/**
- * Allow the Sender to make incremental progress on background tasks.
- */
-void
-Sender::poll()
-{
-    trySend();
+    message->active = false;
+    message->timeoutCount = 0;
+    timerWheel.schedule(&message->timer, now + pingInterval);
 }
 
 /**
  * Does most of the work of actually trying to send out packets for messages.
  *
+ * Sends the granted but unsent packets of the messages with the fewest unsent
+ * bytes (SRPT) in a single burst of up to MAX_BURST packets; packets requested
+ * by a RESEND are sent ahead of a message's unsent packets.  Packets are only
+ * handed to the Driver while the NIC's transmit queue is estimated to hold
+ * less than NIC_QUEUE_PACKETS full packets; the rest stay in the readyQueue
+ * where a newly arriving shorter message can still overtake them.
+ *
  * Pulled out of poll() for clarity.
  */
 void
@@ -346,45 +525,215 @@ Sender::trySend()
     }
 
     SpinLock::Lock lock(mutex);
-    Transport::Op* op = nullptr;
-    auto it = outboundMessages.begin();
-    while (it != outboundMessages.end()) {
-        op = it->second;
-        op->mutex.lock();
-        OutboundMessage* message = &op->outMessage;
-        if (message->sentIndex < message->message.getNumPackets() &&
-            message->sentIndex < message->grantIndex) {
-            // found a message to send.
-            break;
-        }
-        op->mutex.unlock();
-        op = nullptr;
-        it++;
+
+    if (readyQueue.empty()) {
+        sending.clear();
+        return;
     }
 
-    // If there is a message to send; send the next packets.
-    if (op != nullptr) {
-        SpinLock::Lock lock_op(op->mutex, std::adopt_lock);
+    uint64_t now = PerfUtils::Cycles::rdtsc();
+    // All of a Transport's messages share the same Driver.
+    Driver* driver = readyQueue.begin()->op->outMessage.message.driver;
+    if (!nicQueue) {
+        nicQueue.reset(new QueueEstimator(driver->getBandwidth(),
+                                          PerfUtils::Cycles::perSecond()));
+    }
+    const uint32_t maxQueuedBytes =
+        NIC_QUEUE_PACKETS * driver->getMaxPayloadSize();
+
+    // Collect granted packets in SRPT order and hand them to the Driver in a
+    // single burst.
+    Driver::Packet* packets[MAX_BURST];
+    uint16_t numPackets = 0;
+    bool throttled = false;
+    while (numPackets < MAX_BURST && !readyQueue.empty() && !throttled) {
+        Transport::Op* op = readyQueue.begin()->op;
+        SpinLock::Lock lock_op(op->mutex);
         OutboundMessage* message = &op->outMessage;
+        dequeueReady(op, lock_op);
         assert(message->grantIndex <= message->message.getNumPackets());
-        assert(message->grantIndex >= message->sentIndex);
-        uint16_t numPkts = message->grantIndex - message->sentIndex;
-        for (uint16_t i = 0; i < numPkts; ++i) {
-            Driver::Packet* packet =
-                message->message.getPacket(message->sentIndex + i);
+        uint32_t firstIndex = message->sentIndex;
+        while (numPackets < MAX_BURST) {
+            // Packets requested by a RESEND go out ahead of new packets; the
+            // Receiver is already waiting for them.
+            bool resend = message->resendIndex < message->resendEnd;
+            uint32_t index;
+            if (resend) {
+                index = message->resendIndex;
+            } else if (message->sentIndex < message->grantIndex) {
+                index = message->sentIndex;
+            } else {
+                break;
+            }
+            Driver::Packet* packet = message->message.getPacket(index);
             assert(packet != nullptr);
-            message->message.driver->sendPackets(&packet, 1);
+            uint32_t queuedBytes = nicQueue->getQueuedBytes(now);
+            if (queuedBytes > 0 &&
+                queuedBytes + packet->length > maxQueuedBytes) {
+                // The NIC has enough to keep it busy; hold the rest back.
+                throttled = true;
+                break;
+            }
+            nicQueue->packetQueued(packet->length, now);
+            if (resend) {
+                message->resendIndex++;
+            } else {
+                if (index >= message->unscheduledIndexLimit) {
+                    packet->priority = message->scheduledPriority;
+                }
+                message->sentIndex++;
+            }
+            packets[numPackets++] = packet;
+        }
+        if (firstIndex == 0 && message->sentIndex > 0) {
+            // Start timing the RTT to the destination.
+            message->rttStartTime = now;
         }
-        message->sentIndex += numPkts;
+        message->unsentBytes =
+            message->message.rawLength() -
+            Util::downCast<uint32_t>(
+                std::min(uint64_t(message->message.rawLength()),
+                         uint64_t(message->sentIndex) *
+                             message->message.PACKET_DATA_LENGTH));
         if (message->sentIndex >= message->message.getNumPackets()) {
             // We have finished sending the message.
             message->sent = true;
             op->hintUpdate();
         }
+        enqueueReady(op, lock_op);
+    }
+    if (numPackets > 0) {
+        driver->sendPackets(packets, numPackets);
     }
 
     sending.clear();
 }
 
+/**
+ * Check the outgoing messages whose timers have expired for progress.
+ *
+ * A destination that has not sent any control packets for a message since the
+ * last timeout is sent a PING.  After MESSAGE_TIMEOUT_INTERVALS consecutive
+ * timeouts, the Op containing the message is considered failed.
+ *
+ * @param now
+ *      The current time in cycles.
+ */
+void
+Sender::checkTimeouts(uint64_t now)
+{
+    SpinLock::Lock lock(mutex);
+    timerWheel.advance(now);
+    for (OutboundMessage* message = timerWheel.popExpired();
+         message != nullptr; message = timerWheel.popExpired()) {
+        auto it = outboundMessages.find(message->id);
+        assert(it != outboundMessages.end());
+        Transport::Op* op = it->second;
+        SpinLock::Lock lock_op(op->mutex);
+
+        // Keep checking on the destination until the Op is finished; a
+        // RemoteOp still depends on the destination after its request has
+        // been sent.
+        OpContext::State state = op->state.load();
+        if (state == OpContext::State::COMPLETED ||
+            state == OpContext::State::FAILED) {
+            continue;
+        }
+
+        if (message->active) {
+            // The destination has been heard from since the last timeout.
+            message->active = false;
+            message->timeoutCount = 0;
+        } else if (message->resendIndex < message->resendEnd ||
+                   (message->sentIndex < message->grantIndex &&
+                    message->sentIndex < message->message.getNumPackets())) {
+            // This Sender is busy sending other messages; the destination
+            // can't be expected to respond.
+        } else {
+            message->timeoutCount++;
+            if (message->timeoutCount >= MESSAGE_TIMEOUT_INTERVALS) {
+                WARNING(
+                    "Outgoing message (%lu:%lu:%u) timed out; Op failed.",
+                    message->id.transportId, message->id.sequence,
+                    message->id.tag);
+                op->reportFailure(lock_op);
+                continue;
+            }
+            controlQueue->send<Protocol::Packet::PingHeader>(
+                message->destination, message->id);
+        }
+        timerWheel.schedule(&message->timer, now + pingInterval);
+    }
+}
+
+/**
+ * Remove a message from the readyQueue, if it is queued.  Must be called
+ * before modifying the message's unsentBytes, sentIndex, grantIndex, or resend
+ * range.
+ *
+ * The caller must hold the Sender's mutex.
+ *
+ * @param op
+ *      Op containing the OutboundMessage to remove.
+ * @param lock_op
+ *      Used to remind the caller to hold the op's mutex while calling this
+ *      method.
+ */
+void
+Sender::dequeueReady(Transport::Op* op, const SpinLock::Lock& lock_op)
+{
+    (void)lock_op;
+    OutboundMessage* message = &op->outMessage;
+    if (readyQueue.erase({message->unsentBytes, message->id, op}) > 0) {
+        numReadyPackets -= numReady(message);
+    }
+}
+
+/**
+ * Add a message to the readyQueue if it has packets that are granted but not
+ * yet sent or that are waiting to be resent.  Should be called after modifying
+ * the message's unsentBytes, sentIndex, grantIndex, or resend range.
+ *
+ * The caller must hold the Sender's mutex.
+ *
+ * @param op
+ *      Op containing the OutboundMessage to add.
+ * @param lock_op
+ *      Used to remind the caller to hold the op's mutex while calling this
+ *      method.
+ */
+void
+Sender::enqueueReady(Transport::Op* op, const SpinLock::Lock& lock_op)
+{
+    (void)lock_op;
+    OutboundMessage* message = &op->outMessage;
+    uint32_t numPackets = numReady(message);
+    if (numPackets > 0) {
+        readyQueue.insert({message->unsentBytes, message->id, op});
+        numReadyPackets += numPackets;
+    }
+}
+
+/**
+ * Return the number of packets of a message that trySend() could send right
+ * now: those waiting to be resent plus those granted but not yet sent.
+ *
+ * @param message
+ *      OutboundMessage whose ready packets should be counted.
+ */
+uint32_t
+Sender::numReady(const OutboundMessage* message)
+{
+    uint32_t numPackets = 0;
+    if (message->resendIndex < message->resendEnd) {
+        numPackets += message->resendEnd - message->resendIndex;
+    }
+    if (message->sentIndex < message->message.getNumPackets() &&
+        message->sentIndex < message->grantIndex) {
+        numPackets += message->grantIndex - message->sentIndex;
+    }
+    return numPackets;
+}
+
 }  // namespace Core
 }  // namespace Homa
@@ -19,12 +19,19 @@
 #include "Homa/Driver.h"
 
 #include <atomic>
+#include <memory>
+#include <set>
 #include <unordered_map>
 
+#include "ControlPacket.h"
+#include "FlatMap.h"
 #include "Message.h"
 #include "OutboundMessage.h"
+#include "Policy.h"
 #include "Protocol.h"
+#include "QueueEstimator.h"
 #include "SpinLock.h"
+#include "TimerWheel.h"
 #include "Transport.h"
 
 namespace Homa {
@@ -39,7 +46,7 @@ namespace Core {
  */
 class Sender {
   public:
-    explicit Sender();
+    explicit Sender(ControlPacket::Queue* controlQueue);
     virtual ~Sender();
 
     virtual void handleDonePacket(Driver::Packet* packet, Driver* driver);
@@ -49,24 +56,95 @@ class Sender {
     virtual void sendMessage(Protocol::MessageId id,
                              Driver::Address* destination, Transport::Op* op,
                              bool expectAcknowledgement = false);
+    virtual void sendMessages(size_t numMessages,
+                              const Protocol::MessageId ids[],
+                              Driver::Address* const destinations[],
+                              Transport::Op* const ops[],
+                              bool expectAcknowledgement = false);
     virtual void dropMessage(Transport::Op* op);
     virtual void poll();
+    virtual uint32_t getNicQueuedBytes();
+    virtual uint32_t getNumReadyPackets();
 
   private:
+    /**
+     * Entry in the Sender's readyQueue.  Entries are ordered so that the
+     * message with the fewest unsent bytes comes first (SRPT); ties are broken
+     * by MessageId so that the order is deterministic.
+     */
+    struct ReadyEntry {
+        /// Number of bytes of the message that have not yet been sent.
+        uint32_t unsentBytes;
+        /// Identifier of the queued message.
+        Protocol::MessageId id;
+        /// Op that contains the queued OutboundMessage.
+        Transport::Op* op;
+
+        /// SRPT ordering; see ReadyEntry.
+        bool operator<(const ReadyEntry& other) const
+        {
+            return (unsentBytes < other.unsentBytes) ||
+                   ((unsentBytes == other.unsentBytes) && (id < other.id));
+        }
+    };
+
     /// Protects the top-level
     SpinLock mutex;
 
+    /// Queue through which this Sender sends control packets.
+    ControlPacket::Queue* const controlQueue;
+
     /// Tracks the set of outbound messages; contains the associated Op
     /// for a given MessageId.
-    std::unordered_map<Protocol::MessageId, Transport::Op*,
-                       Protocol::MessageId::Hasher>
+    FlatMap<Protocol::MessageId, Transport::Op*, Protocol::MessageId::Hasher>
         outboundMessages;
 
+    /// Most recent unscheduled priority cutoffs advertised by each
+    /// destination; destinations that have not advertised any are missing.
+    std::unordered_map<Driver::Address*, Protocol::Packet::UnscheduledCutoffs>
+        peerCutoffs;
+
+    /// Round-trip times to each destination; measured from the time the
+    /// first packet of a message is sent until its first GRANT arrives, less
+    /// the delay the destination reports in the GRANT for holding it back.
+    Policy::RttEstimator peerRtts;
+
+    /// Outbound messages that have granted but unsent packets or packets
+    /// waiting to be resent, ordered by the number of bytes that remain to be
+    /// sent.  A message's entry must be removed before its unsentBytes,
+    /// sentIndex, grantIndex, or resend range is modified and re-added
+    /// afterwards; see dequeueReady() and enqueueReady().
+    std::set<ReadyEntry> readyQueue;
+
+    /// Number of granted but unsent packets, plus packets waiting to be
+    /// resent, of the messages in readyQueue.
+    uint32_t numReadyPackets;
+
+    /// Estimates the number of bytes waiting in the NIC's transmit queue so
+    /// that trySend() can hold packets back in readyQueue instead of the NIC;
+    /// every DATA packet, including retransmissions, is accounted here.
+    /// Constructed by the first call to trySend() that has packets to send.
+    std::unique_ptr<QueueEstimator> nicQueue;
+
+    /// Number of cycles between checks that an outgoing message is still
+    /// making progress.
+    const uint64_t pingInterval;
+
+    /// Tracks when each outgoing message should next be checked for progress.
+    TimerWheel<OutboundMessage> timerWheel;
+
     /// True if the Sender is currently executing trySend(); false, otherwise.
     /// Use to prevent concurrent calls to trySend() from blocking on eachother.
     std::atomic_flag sending = ATOMIC_FLAG_INIT;
 
+    void queueMessage(Protocol::MessageId id, Driver::Address* destination,
+                      Transport::Op* op, bool expectAcknowledgement,
+                      uint64_t now, const SpinLock::Lock& lock);
     void trySend();
+    void checkTimeouts(uint64_t now);
+    void dequeueReady(Transport::Op* op, const SpinLock::Lock& lock_op);
+    void enqueueReady(Transport::Op* op, const SpinLock::Lock& lock_op);
+    static uint32_t numReady(const OutboundMessage* message);
 };
 
 }  // namespace Core
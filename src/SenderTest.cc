@@ -17,8 +17,11 @@
 
 #include "Sender.h"
 
+#include <limits>
+
 #include <Homa/Debug.h>
 
+#include "Cycles.h"
 #include "Mock/MockDriver.h"
 #include "Transport.h"
 
@@ -26,6 +29,10 @@ namespace Homa {
 namespace Core {
 namespace {
 
+using ::testing::_;
+using ::testing::Args;
+using ::testing::Each;
+using ::testing::ElementsAre;
 using ::testing::Eq;
 using ::testing::Mock;
 using ::testing::NiceMock;
@@ -37,26 +44,32 @@ class SenderTest : public ::testing::Test {
     SenderTest()
         : mockDriver()
         , mockPacket(&payload)
+        , controlQueue(&mockDriver)
         , transport()
-        , sender()
+        , sender(&controlQueue)
         , savedLogPolicy(Debug::getLogPolicy())
     {
         ON_CALL(mockDriver, getBandwidth).WillByDefault(Return(8000));
-        ON_CALL(mockDriver, getMaxPayloadSize).WillByDefault(Return(1028));
+        ON_CALL(mockDriver, getMaxPayloadSize).WillByDefault(Return(1034));
         Debug::setLogPolicy(
             Debug::logPolicyFromString("src/ObjectPool@SILENT"));
         transport = new Transport(&mockDriver, 1);
+        // Don't throttle unless a test asks for it.
+        sender.nicQueue.reset(new QueueEstimator(0, 1e9));
     }
 
     ~SenderTest()
     {
+        // Ops still in the slab release their packets on teardown.
+        Mock::VerifyAndClearExpectations(&mockDriver);
         delete transport;
         Debug::setLogPolicy(savedLogPolicy);
     }
 
     NiceMock<Homa::Mock::MockDriver> mockDriver;
     NiceMock<Homa::Mock::MockDriver::MockPacket> mockPacket;
-    char payload[1028];
+    char payload[1034];
+    ControlPacket::Queue controlQueue;
     Transport* transport;
     Sender sender;
     std::vector<std::pair<std::string, std::string>> savedLogPolicy;
@@ -71,12 +84,18 @@ class SenderTest : public ::testing::Test {
         sender->outboundMessages.insert({id, op});
         return message;
     }
+
+    static void enqueueMessage(Sender* sender, Transport::Op* op)
+    {
+        SpinLock::Lock lock_op(op->mutex);
+        sender->enqueueReady(op, lock_op);
+    }
 };
 
 TEST_F(SenderTest, handleDonePacket)
 {
     Protocol::MessageId id = {42, 1, 32};
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     op->outMessage.acknowledged = false;
 
     Protocol::Packet::DoneHeader* header =
@@ -100,7 +119,7 @@ TEST_F(SenderTest, handleDonePacket)
 TEST_F(SenderTest, handleResendPacket_basic)
 {
     Protocol::MessageId msgId = {42, 1, 1};
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     OutboundMessage* message = SenderTest::addMessage(&sender, msgId, op, 5);
     std::vector<Homa::Mock::MockDriver::MockPacket*> packets;
     for (int i = 0; i < 10; ++i) {
@@ -117,8 +136,8 @@ TEST_F(SenderTest, handleResendPacket_basic)
     resendHdr->index = 3;
     resendHdr->num = 5;
 
-    EXPECT_CALL(mockDriver, sendPackets(Pointee(packets[3]), Eq(1))).Times(1);
-    EXPECT_CALL(mockDriver, sendPackets(Pointee(packets[4]), Eq(1))).Times(1);
+    // Resent packets are left for trySend().
+    EXPECT_CALL(mockDriver, sendPackets).Times(0);
     EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
         .Times(1);
 
@@ -126,12 +145,59 @@ TEST_F(SenderTest, handleResendPacket_basic)
 
     EXPECT_EQ(5U, message->sentIndex);
     EXPECT_EQ(8U, message->grantIndex);
+    EXPECT_EQ(3U, message->resendIndex);
+    EXPECT_EQ(5U, message->resendEnd);
+    EXPECT_EQ(1U, sender.readyQueue.size());
+    EXPECT_EQ(5U, sender.getNumReadyPackets());
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    EXPECT_CALL(mockDriver, sendPackets(_, Eq(5)))
+        .With(Args<0, 1>(ElementsAre(packets[3], packets[4], packets[5],
+                                     packets[6], packets[7])))
+        .Times(1);
+
+    sender.trySend();
+
+    EXPECT_EQ(8U, message->sentIndex);
+    EXPECT_EQ(5U, message->resendIndex);
+    EXPECT_EQ(0U, sender.getNumReadyPackets());
+    EXPECT_TRUE(sender.readyQueue.empty());
 
     for (int i = 0; i < 10; ++i) {
         delete packets[i];
     }
 }
 
+TEST_F(SenderTest, handleResendPacket_merge)
+{
+    Protocol::MessageId msgId = {42, 1, 1};
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
+    OutboundMessage* message = SenderTest::addMessage(&sender, msgId, op, 8);
+    for (int i = 0; i < 10; ++i) {
+        message->message.setPacket(i, &mockPacket);
+    }
+    message->sentIndex = 8;
+    message->resendIndex = 4;
+    message->resendEnd = 6;
+    SenderTest::enqueueMessage(&sender, op);
+    EXPECT_EQ(2U, sender.getNumReadyPackets());
+
+    Protocol::Packet::ResendHeader* resendHdr =
+        static_cast<Protocol::Packet::ResendHeader*>(mockPacket.payload);
+    resendHdr->common.messageId = msgId;
+    resendHdr->index = 2;
+    resendHdr->num = 3;
+
+    EXPECT_CALL(mockDriver, sendPackets).Times(0);
+
+    sender.handleResendPacket(&mockPacket, &mockDriver);
+
+    EXPECT_EQ(2U, message->resendIndex);
+    EXPECT_EQ(6U, message->resendEnd);
+    EXPECT_EQ(1U, sender.readyQueue.size());
+    EXPECT_EQ(4U, sender.getNumReadyPackets());
+}
+
 TEST_F(SenderTest, handleResendPacket_staleResend)
 {
     Protocol::MessageId msgId = {42, 1, 1};
@@ -150,9 +216,9 @@ TEST_F(SenderTest, handleResendPacket_staleResend)
 TEST_F(SenderTest, handleResendPacket_eagerResend)
 {
     Protocol::MessageId msgId = {42, 1, 1};
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     OutboundMessage* message = SenderTest::addMessage(&sender, msgId, op, 5);
-    char data[1028];
+    char data[1034];
     Homa::Mock::MockDriver::MockPacket dataPacket(data);
     for (int i = 0; i < 10; ++i) {
         message->message.setPacket(i, &dataPacket);
@@ -168,7 +234,7 @@ TEST_F(SenderTest, handleResendPacket_eagerResend)
     resendHdr->num = 3;
 
     // Expect the BUSY control packet.
-    char busy[1028];
+    char busy[1034];
     Homa::Mock::MockDriver::MockPacket busyPacket(busy);
     EXPECT_CALL(mockDriver, allocPacket()).WillOnce(Return(&busyPacket));
     EXPECT_CALL(mockDriver, sendPackets(Pointee(&busyPacket), Eq(1))).Times(1);
@@ -181,6 +247,7 @@ TEST_F(SenderTest, handleResendPacket_eagerResend)
         .Times(1);
 
     sender.handleResendPacket(&mockPacket, &mockDriver);
+    controlQueue.flush();
 
     EXPECT_EQ(5U, message->sentIndex);
     EXPECT_EQ(8U, message->grantIndex);
@@ -193,7 +260,7 @@ TEST_F(SenderTest, handleResendPacket_eagerResend)
 TEST_F(SenderTest, handleGrantPacket_basic)
 {
     Protocol::MessageId msgId = {42, 1, 1};
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     OutboundMessage* message = SenderTest::addMessage(&sender, msgId, op, 5);
     message->message.numPackets = 10;
     EXPECT_EQ(5, message->grantIndex);
@@ -202,19 +269,90 @@ TEST_F(SenderTest, handleGrantPacket_basic)
         static_cast<Protocol::Packet::GrantHeader*>(mockPacket.payload);
     header->common.messageId = msgId;
     header->indexLimit = 7;
+    header->priority = 3;
+    header->cutoffs.version = 2;
+    header->cutoffs.cutoffs[0] = 42;
 
     EXPECT_CALL(mockDriver, releasePackets(Pointee(&mockPacket), Eq(1)))
         .Times(1);
 
+    EXPECT_TRUE(sender.readyQueue.empty());
+
     sender.handleGrantPacket(&mockPacket, &mockDriver);
 
     EXPECT_EQ(7, message->grantIndex);
+    EXPECT_EQ(3, message->scheduledPriority);
+    EXPECT_TRUE(message->active);
+    EXPECT_EQ(2U, sender.peerCutoffs.at(message->destination).version);
+    EXPECT_EQ(42U, sender.peerCutoffs.at(message->destination).cutoffs[0]);
+    EXPECT_EQ(1U, sender.readyQueue.size());
+    EXPECT_EQ(op, sender.readyQueue.begin()->op);
+}
+
+TEST_F(SenderTest, handleGrantPacket_rttSample)
+{
+    Protocol::MessageId msgId = {42, 1, 1};
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
+    OutboundMessage* message = SenderTest::addMessage(&sender, msgId, op, 5);
+    message->message.numPackets = 10;
+    message->rttStartTime =
+        PerfUtils::Cycles::rdtsc() - PerfUtils::Cycles::fromMicroseconds(100);
+
+    Protocol::Packet::GrantHeader* header =
+        static_cast<Protocol::Packet::GrantHeader*>(mockPacket.payload);
+    header->common.messageId = msgId;
+    header->indexLimit = 7;
+    header->cutoffs.version = 0;
+    header->delay = 60000;
+
+    sender.handleGrantPacket(&mockPacket, &mockDriver);
+
+    // The delay reported by the Receiver is not part of the RTT.
+    EXPECT_EQ(0U, message->rttStartTime);
+    uint64_t rtt = sender.peerRtts.getRtt(message->destination);
+    EXPECT_LE(40000U, rtt);
+    EXPECT_GT(60000U, rtt);
+
+    // Later GRANTs are not sampled.
+    sender.peerRtts.peers.clear();
+    header->indexLimit = 8;
+    sender.handleGrantPacket(&mockPacket, &mockDriver);
+    EXPECT_TRUE(sender.peerRtts.peers.empty());
+}
+
+TEST_F(SenderTest, handleGrantPacket_rttSampleBadDelay)
+{
+    Protocol::MessageId msgId = {42, 1, 1};
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
+    OutboundMessage* message = SenderTest::addMessage(&sender, msgId, op, 5);
+    message->message.numPackets = 10;
+
+    Protocol::Packet::GrantHeader* header =
+        static_cast<Protocol::Packet::GrantHeader*>(mockPacket.payload);
+    header->common.messageId = msgId;
+    header->indexLimit = 7;
+    header->cutoffs.version = 0;
+
+    // Delay longer than the elapsed time.
+    message->rttStartTime =
+        PerfUtils::Cycles::rdtsc() - PerfUtils::Cycles::fromMicroseconds(100);
+    header->delay = 200000;
+    sender.handleGrantPacket(&mockPacket, &mockDriver);
+    EXPECT_EQ(0U, message->rttStartTime);
+    EXPECT_TRUE(sender.peerRtts.peers.empty());
+
+    // Saturated delay.
+    message->rttStartTime = 1;
+    header->delay = std::numeric_limits<uint32_t>::max();
+    sender.handleGrantPacket(&mockPacket, &mockDriver);
+    EXPECT_EQ(0U, message->rttStartTime);
+    EXPECT_TRUE(sender.peerRtts.peers.empty());
 }
 
 TEST_F(SenderTest, handleGrantPacket_staleGrant)
 {
     Protocol::MessageId msgId = {42, 1, 1};
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     OutboundMessage* message = SenderTest::addMessage(&sender, msgId, op, 5);
     message->message.numPackets = 10;
     EXPECT_EQ(5, message->grantIndex);
@@ -249,7 +387,7 @@ TEST_F(SenderTest, handleGrantPacket_dropGrant)
 TEST_F(SenderTest, handleUnknownPacket_basic)
 {
     Protocol::MessageId msgId = {42, 1, 1};
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     OutboundMessage* message = SenderTest::addMessage(&sender, msgId, op, 5);
     message->sent = true;
     message->acknowledged = false;
@@ -270,6 +408,31 @@ TEST_F(SenderTest, handleUnknownPacket_basic)
     EXPECT_EQ(1U, message->grantIndex);
 }
 
+TEST_F(SenderTest, handleUnknownPacket_requeue)
+{
+    Protocol::MessageId msgId = {42, 1, 1};
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
+    OutboundMessage* message = SenderTest::addMessage(&sender, msgId, op, 5);
+    for (int i = 0; i < 10; ++i) {
+        message->message.setPacket(i, &mockPacket);
+    }
+    message->message.messageLength = 10000;
+    message->sentIndex = 5;
+    message->unsentBytes = 5000;
+    EXPECT_TRUE(sender.readyQueue.empty());
+
+    Protocol::Packet::UnknownHeader* header =
+        static_cast<Protocol::Packet::UnknownHeader*>(mockPacket.payload);
+    header->common.messageId = msgId;
+
+    sender.handleUnknownPacket(&mockPacket, &mockDriver);
+
+    EXPECT_EQ(10000U, message->unsentBytes);
+    EXPECT_EQ(1U, sender.readyQueue.size());
+    EXPECT_EQ(10000U, sender.readyQueue.begin()->unsentBytes);
+    EXPECT_EQ(op, sender.readyQueue.begin()->op);
+}
+
 TEST_F(SenderTest, handleUnknownPacket_no_message)
 {
     Protocol::MessageId msgId = {42, 1, 1};
@@ -287,7 +450,7 @@ TEST_F(SenderTest, handleUnknownPacket_no_message)
 TEST_F(SenderTest, handleUnknownPacket_done)
 {
     Protocol::MessageId msgId = {42, 1, 1};
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     OutboundMessage* message = SenderTest::addMessage(&sender, msgId, op, 5);
     message->sent = true;
     message->acknowledged = true;
@@ -312,7 +475,7 @@ TEST_F(SenderTest, handleUnknownPacket_done)
 TEST_F(SenderTest, sendMessage_basic)
 {
     Protocol::MessageId msgId = {42, 1, 1};
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
 
     op->outMessage.message.setPacket(0, &mockPacket);
     op->outMessage.message.messageLength = 420;
@@ -337,12 +500,16 @@ TEST_F(SenderTest, sendMessage_basic)
                 sender.outboundMessages.end());
     EXPECT_EQ(op, sender.outboundMessages.find(msgId)->second);
     EXPECT_EQ(1U, op->outMessage.grantIndex);
+    EXPECT_EQ(420U, op->outMessage.unsentBytes);
+    EXPECT_EQ(1U, sender.readyQueue.size());
+    EXPECT_EQ(op, sender.readyQueue.begin()->op);
+    EXPECT_TRUE(op->outMessage.timer.isScheduled());
 }
 
 TEST_F(SenderTest, sendMessage_expectAcknowledgement)
 {
     Protocol::MessageId id = {42, 1, 1};
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     op->outMessage.message.setPacket(0, &mockPacket);
     op->outMessage.message.messageLength = 420;
     mockPacket.length = op->outMessage.message.messageLength +
@@ -361,21 +528,21 @@ TEST_F(SenderTest, sendMessage_expectAcknowledgement)
 
 TEST_F(SenderTest, sendMessage_multipacket)
 {
-    char payload0[1028];
-    char payload1[1028];
+    char payload0[1034];
+    char payload1[1034];
     NiceMock<Homa::Mock::MockDriver::MockPacket> packet0(payload0);
     NiceMock<Homa::Mock::MockDriver::MockPacket> packet1(payload1);
     Protocol::MessageId msgId = {42, 1, 1};
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
 
     op->outMessage.message.setPacket(0, &packet0);
     op->outMessage.message.setPacket(1, &packet1);
     op->outMessage.message.messageLength = 1420;
-    packet0.length = 1000 + 28;
-    packet1.length = 420 + 28;
+    packet0.length = 1000 + 34;
+    packet1.length = 420 + 34;
     Driver::Address* destination = (Driver::Address*)22;
 
-    EXPECT_EQ(28U, sizeof(Protocol::Packet::DataHeader));
+    EXPECT_EQ(34U, sizeof(Protocol::Packet::DataHeader));
     EXPECT_EQ(1000U, op->outMessage.message.PACKET_DATA_LENGTH);
 
     sender.sendMessage(msgId, destination, op);
@@ -397,6 +564,63 @@ TEST_F(SenderTest, sendMessage_multipacket)
     EXPECT_EQ(op->outMessage.message.messageLength, header->totalLength);
 }
 
+TEST_F(SenderTest, sendMessage_unscheduledPriority)
+{
+    ON_CALL(mockDriver, getHighestPacketPriority).WillByDefault(Return(7));
+    Protocol::MessageId msgId = {42, 1, 1};
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
+    op->outMessage.message.setPacket(0, &mockPacket);
+    Driver::Address* destination = (Driver::Address*)22;
+
+    // Short message; highest priority.
+    op->outMessage.message.messageLength = 420;
+    mockPacket.length = 420 + op->outMessage.message.PACKET_HEADER_LENGTH;
+    sender.sendMessage(msgId, destination, op);
+    EXPECT_EQ(7, mockPacket.priority);
+    EXPECT_EQ(1U, op->outMessage.unscheduledIndexLimit);
+
+    // Longer message; lower priority.
+    msgId = {42, 1, 2};
+    op = transport->opSlab.construct(transport, &mockDriver);
+    char payloads[12][1034];
+    Homa::Mock::MockDriver::MockPacket* packet[12];
+    for (int i = 0; i < 12; ++i) {
+        packet[i] = new Homa::Mock::MockDriver::MockPacket(payloads[i], 1034);
+        op->outMessage.message.setPacket(i, packet[i]);
+    }
+    op->outMessage.message.messageLength = 12000;
+    sender.sendMessage(msgId, destination, op);
+    EXPECT_EQ(5, packet[0]->priority);
+    EXPECT_EQ(5, packet[4]->priority);
+    EXPECT_EQ(5U, op->outMessage.unscheduledIndexLimit);
+
+    for (int i = 0; i < 12; ++i) {
+        delete packet[i];
+    }
+}
+
+TEST_F(SenderTest, sendMessage_peerCutoffs)
+{
+    ON_CALL(mockDriver, getHighestPacketPriority).WillByDefault(Return(7));
+    Protocol::MessageId msgId = {42, 1, 1};
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
+    op->outMessage.message.setPacket(0, &mockPacket);
+    op->outMessage.message.messageLength = 420;
+    mockPacket.length = 420 + op->outMessage.message.PACKET_HEADER_LENGTH;
+    Driver::Address* destination = (Driver::Address*)22;
+
+    Protocol::Packet::UnscheduledCutoffs cutoffs;
+    cutoffs.version = 1;
+    cutoffs.cutoffs[0] = 100;
+    cutoffs.cutoffs[1] = 400;
+    cutoffs.cutoffs[2] = 1000;
+    sender.peerCutoffs[destination] = cutoffs;
+
+    sender.sendMessage(msgId, destination, op);
+
+    EXPECT_EQ(5, mockPacket.priority);
+}
+
 // Used to capture log output.
 struct VectorHandler {
     VectorHandler()
@@ -415,7 +639,7 @@ TEST_F(SenderTest, sendMessage_missingPacket)
     // Debug::setLogHandler(std::ref(handler));
 
     Protocol::MessageId msgId = {42, 1, 1};
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     op->outMessage.message.setPacket(1, &mockPacket);
 
     EXPECT_DEATH(sender.sendMessage(msgId, nullptr, op),
@@ -429,7 +653,7 @@ TEST_F(SenderTest, sendMessage_duplicateMessage)
     Debug::setLogHandler(std::ref(handler));
 
     Protocol::MessageId msgId = {42, 1, 1};
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     op->outMessage.message.setPacket(0, &mockPacket);
     op->outMessage.message.messageLength = 420;
     mockPacket.length = op->outMessage.message.messageLength +
@@ -447,7 +671,7 @@ TEST_F(SenderTest, sendMessage_duplicateMessage)
     EXPECT_EQ(1U, handler.messages.size());
     const Debug::DebugMessage& m = handler.messages.at(0);
     EXPECT_STREQ("src/Sender.cc", m.filename);
-    EXPECT_STREQ("sendMessage", m.function);
+    EXPECT_STREQ("queueMessage", m.function);
     EXPECT_EQ(int(Debug::LogLevel::WARNING), m.logLevel);
     EXPECT_EQ(
         "Duplicate call to sendMessage for msgId (42:1:1); "
@@ -460,7 +684,7 @@ TEST_F(SenderTest, sendMessage_duplicateMessage)
 TEST_F(SenderTest, sendMessage_unscheduledLimit)
 {
     Protocol::MessageId msgId = {42, 1, 1};
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     for (int i = 0; i < 9; ++i) {
         op->outMessage.message.setPacket(i, &mockPacket);
     }
@@ -480,19 +704,74 @@ TEST_F(SenderTest, sendMessage_unscheduledLimit)
     EXPECT_EQ(msgId, op->outMessage.id);
     EXPECT_EQ(destination, op->outMessage.destination);
     EXPECT_EQ(5U, op->outMessage.grantIndex);
+    Protocol::Packet::DataHeader* header =
+        static_cast<Protocol::Packet::DataHeader*>(mockPacket.payload);
+    EXPECT_EQ(5U, header->unscheduledIndexLimit);
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // Measured RTT of 2us to the destination.
+    sender.outboundMessages.erase(msgId);
+    sender.peerRtts.record(destination, 2000);
+    EXPECT_CALL(mockDriver, getBandwidth).WillOnce(Return(8000));
+
+    sender.sendMessage(msgId, destination, op);
+
+    EXPECT_EQ(2U, op->outMessage.grantIndex);
+    EXPECT_EQ(2U, header->unscheduledIndexLimit);
+}
+
+TEST_F(SenderTest, sendMessages)
+{
+    char payload1[1034];
+    NiceMock<Homa::Mock::MockDriver::MockPacket> packet1(payload1);
+    Homa::Mock::MockDriver::MockPacket* packets[2] = {&mockPacket, &packet1};
+    Protocol::MessageId ids[2] = {{42, 1, 1}, {42, 2, 1}};
+    Driver::Address* destinations[2] = {(Driver::Address*)22,
+                                        (Driver::Address*)23};
+    Transport::Op* ops[2];
+    for (int i = 0; i < 2; ++i) {
+        ops[i] = transport->opSlab.construct(transport, &mockDriver);
+        ops[i]->outMessage.message.setPacket(0, packets[i]);
+        ops[i]->outMessage.message.messageLength = 420 + i;
+        packets[i]->length = ops[i]->outMessage.message.messageLength +
+                             ops[i]->outMessage.message.PACKET_HEADER_LENGTH;
+    }
+
+    sender.sendMessages(2, ids, destinations, ops, true);
+
+    EXPECT_EQ(2U, sender.outboundMessages.size());
+    EXPECT_EQ(2U, sender.readyQueue.size());
+    for (int i = 0; i < 2; ++i) {
+        EXPECT_EQ(ops[i], sender.outboundMessages.find(ids[i])->second);
+        EXPECT_EQ(ids[i], ops[i]->outMessage.id);
+        EXPECT_EQ(destinations[i], ops[i]->outMessage.destination);
+        EXPECT_EQ(destinations[i], packets[i]->address);
+        EXPECT_FALSE(ops[i]->outMessage.acknowledged);
+        EXPECT_TRUE(ops[i]->outMessage.timer.isScheduled());
+    }
+    EXPECT_EQ(ops[0]->outMessage.timer.expiration,
+              ops[1]->outMessage.timer.expiration);
 }
 
 TEST_F(SenderTest, dropMessage)
 {
     Protocol::MessageId msgId = {42, 1, 1};
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     op->outMessage.message.messageLength = 9000;
     OutboundMessage* message = SenderTest::addMessage(&sender, msgId, op, 5);
+    for (int i = 0; i < 9; ++i) {
+        message->message.setPacket(i, nullptr);
+    }
+    SenderTest::enqueueMessage(&sender, op);
+    sender.timerWheel.schedule(&message->timer, 0);
+    EXPECT_EQ(1U, sender.readyQueue.size());
 
     sender.dropMessage(op);
 
     EXPECT_FALSE(sender.outboundMessages.find(msgId) !=
                  sender.outboundMessages.end());
+    EXPECT_TRUE(sender.readyQueue.empty());
+    EXPECT_FALSE(message->timer.isScheduled());
 }
 
 TEST_F(SenderTest, poll)
@@ -501,9 +780,90 @@ TEST_F(SenderTest, poll)
     sender.poll();
 }
 
+TEST_F(SenderTest, checkTimeouts)
+{
+    Protocol::MessageId msgId = {42, 1, 1};
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
+    OutboundMessage* message = SenderTest::addMessage(&sender, msgId, op, 5);
+    Driver::Address* destination = (Driver::Address*)22;
+    message->destination = destination;
+    message->message.numPackets = 10;
+    message->sentIndex = 5;
+    op->state.store(OpContext::State::IN_PROGRESS);
+    uint64_t now = PerfUtils::Cycles::rdtsc() + sender.pingInterval;
+
+    // Heard from the destination since the last timeout.
+    message->active = true;
+    message->timeoutCount = 3;
+    sender.timerWheel.schedule(&message->timer, 0);
+    EXPECT_CALL(mockDriver, sendPackets).Times(0);
+
+    sender.checkTimeouts(now);
+
+    EXPECT_FALSE(message->active);
+    EXPECT_EQ(0U, message->timeoutCount);
+    EXPECT_TRUE(message->timer.isScheduled());
+
+    // Still sending granted packets; don't expect to hear back.
+    message->grantIndex = 7;
+    now += sender.pingInterval;
+    sender.timerWheel.schedule(&message->timer, 0);
+
+    sender.checkTimeouts(now);
+
+    EXPECT_EQ(0U, message->timeoutCount);
+    EXPECT_TRUE(message->timer.isScheduled());
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // No response; PING the destination.
+    message->grantIndex = 5;
+    now += sender.pingInterval;
+    sender.timerWheel.schedule(&message->timer, 0);
+    EXPECT_CALL(mockDriver, allocPacket()).WillOnce(Return(&mockPacket));
+    EXPECT_CALL(mockDriver, sendPackets(Pointee(&mockPacket), Eq(1)))
+        .Times(1);
+
+    sender.checkTimeouts(now);
+    controlQueue.flush();
+
+    EXPECT_EQ(1U, message->timeoutCount);
+    EXPECT_TRUE(message->timer.isScheduled());
+    Protocol::Packet::PingHeader* header =
+        static_cast<Protocol::Packet::PingHeader*>(mockPacket.payload);
+    EXPECT_EQ(Protocol::Packet::PING, header->common.opcode);
+    EXPECT_EQ(msgId, header->common.messageId);
+    EXPECT_EQ(destination, mockPacket.address);
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // Too many timeouts; the op fails.
+    message->timeoutCount = 1000;
+    now += sender.pingInterval;
+    sender.timerWheel.schedule(&message->timer, 0);
+    EXPECT_CALL(mockDriver, sendPackets).Times(0);
+
+    OpContext::State state = op->state.load();
+
+    sender.checkTimeouts(now);
+
+    // The failure is left for the Transport to act on.
+    EXPECT_TRUE(op->failed);
+    EXPECT_EQ(state, op->state.load());
+    EXPECT_FALSE(message->timer.isScheduled());
+    EXPECT_TRUE(op->hintQueued);
+
+    // Finished ops are no longer checked.
+    op->state.store(OpContext::State::FAILED);
+    now += sender.pingInterval;
+    sender.timerWheel.schedule(&message->timer, 0);
+
+    sender.checkTimeouts(now);
+
+    EXPECT_FALSE(message->timer.isScheduled());
+}
+
 TEST_F(SenderTest, trySend_basic)
 {
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     Protocol::MessageId id = {42, 10, 1};
     OutboundMessage* message = SenderTest::addMessage(&sender, id, op, 2);
     Homa::Mock::MockDriver::MockPacket* packet[5];
@@ -512,18 +872,23 @@ TEST_F(SenderTest, trySend_basic)
         message->message.setPacket(i, packet[i]);
     }
     message->message.messageLength = 4000;
+    message->unsentBytes = 4000;
+    SenderTest::enqueueMessage(&sender, op);
     EXPECT_EQ(5U, message->message.getNumPackets());
     EXPECT_EQ(2U, message->grantIndex);
     EXPECT_EQ(0U, message->sentIndex);
     EXPECT_FALSE(message->sent);
 
     // 2 granted packets to be sent; won't be finished.
-    EXPECT_CALL(mockDriver, sendPackets(Pointee(packet[0]), Eq(1)));
-    EXPECT_CALL(mockDriver, sendPackets(Pointee(packet[1]), Eq(1)));
+    EXPECT_CALL(mockDriver, sendPackets(_, Eq(2)))
+        .With(Args<0, 1>(ElementsAre(packet[0], packet[1])));
     sender.trySend();  // < test call
     EXPECT_EQ(2U, message->grantIndex);
     EXPECT_EQ(2U, message->sentIndex);
+    EXPECT_EQ(2000U, message->unsentBytes);
+    EXPECT_NE(0U, message->rttStartTime);
     EXPECT_FALSE(message->sent);
+    EXPECT_TRUE(sender.readyQueue.empty());
     Mock::VerifyAndClearExpectations(&mockDriver);
 
     // No additional grants; no packets sent; won't be finished.
@@ -536,17 +901,20 @@ TEST_F(SenderTest, trySend_basic)
 
     // 3 more granted packets; will finish.
     message->grantIndex = 5;
-    EXPECT_CALL(mockDriver, sendPackets(Pointee(packet[2]), Eq(1)));
-    EXPECT_CALL(mockDriver, sendPackets(Pointee(packet[3]), Eq(1)));
-    EXPECT_CALL(mockDriver, sendPackets(Pointee(packet[4]), Eq(1)));
+    SenderTest::enqueueMessage(&sender, op);
+    EXPECT_CALL(mockDriver, sendPackets(_, Eq(3)))
+        .With(Args<0, 1>(ElementsAre(packet[2], packet[3], packet[4])));
     sender.trySend();  // < test call
     EXPECT_EQ(5U, message->grantIndex);
     EXPECT_EQ(5U, message->sentIndex);
+    EXPECT_EQ(0U, message->unsentBytes);
     EXPECT_TRUE(message->sent);
     Mock::VerifyAndClearExpectations(&mockDriver);
 
     // Message already finished.
     message->grantIndex = 6;
+    SenderTest::enqueueMessage(&sender, op);
+    EXPECT_TRUE(sender.readyQueue.empty());
     EXPECT_CALL(mockDriver, sendPackets).Times(0);
     sender.trySend();  // < test call
     EXPECT_EQ(5U, message->sentIndex);
@@ -558,12 +926,41 @@ TEST_F(SenderTest, trySend_basic)
     }
 }
 
+TEST_F(SenderTest, trySend_priority)
+{
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
+    Protocol::MessageId id = {42, 10, 1};
+    OutboundMessage* message = SenderTest::addMessage(&sender, id, op, 3);
+    Homa::Mock::MockDriver::MockPacket* packet[3];
+    for (int i = 0; i < 3; ++i) {
+        packet[i] = new Homa::Mock::MockDriver::MockPacket(payload);
+        packet[i]->priority = 7;
+        message->message.setPacket(i, packet[i]);
+    }
+    message->message.messageLength = 3000;
+    message->unsentBytes = 3000;
+    message->unscheduledIndexLimit = 1;
+    message->scheduledPriority = 2;
+    SenderTest::enqueueMessage(&sender, op);
+
+    sender.trySend();  // < test call
+
+    // Unscheduled packets keep the priority assigned by sendMessage().
+    EXPECT_EQ(7, packet[0]->priority);
+    EXPECT_EQ(2, packet[1]->priority);
+    EXPECT_EQ(2, packet[2]->priority);
+
+    for (int i = 0; i < 3; ++i) {
+        delete packet[i];
+    }
+}
+
 TEST_F(SenderTest, trySend_multipleMessages)
 {
     Transport::Op* op[4];
     OutboundMessage* message[4];
     for (uint64_t i = 0; i < 4; ++i) {
-        op[i] = transport->opPool.construct(transport, &mockDriver);
+        op[i] = transport->opSlab.construct(transport, &mockDriver);
         Protocol::MessageId msgId = {42, 10 + i, 1};
         message[i] = SenderTest::addMessage(&sender, msgId, op[i], 5);
     }
@@ -579,6 +976,7 @@ TEST_F(SenderTest, trySend_multipleMessages)
 
     // Message 1: Waiting for more grants
     message[1]->message.messageLength = 9000;
+    message[1]->unsentBytes = 4000;
     EXPECT_EQ(5, message[1]->grantIndex);
     message[1]->sentIndex = 5;
     for (int i = 0; i < 9; ++i) {
@@ -587,54 +985,285 @@ TEST_F(SenderTest, trySend_multipleMessages)
 
     // Message 2: New message, send 5 packets
     message[2]->message.messageLength = 9000;
+    message[2]->unsentBytes = 9000;
     EXPECT_EQ(5, message[2]->grantIndex);
     EXPECT_EQ(0, message[2]->sentIndex);
     for (int i = 0; i < 9; ++i) {
         message[2]->message.setPacket(i, &mockPacket);
     }
 
-    // Message 3: Send 3 packets to complete send.
+    // Message 3: Send 5 packets to complete send.
     message[3]->message.messageLength = 5000;
+    message[3]->unsentBytes = 5000;
     EXPECT_EQ(5, message[3]->grantIndex);
     EXPECT_EQ(0, message[3]->sentIndex);
     for (int i = 0; i < 5; ++i) {
         message[3]->message.setPacket(i, &mockPacket);
     }
 
-    EXPECT_CALL(mockDriver, sendPackets(Pointee(&mockPacket), Eq(1))).Times(5);
+    for (int i = 0; i < 4; ++i) {
+        SenderTest::enqueueMessage(&sender, op[i]);
+    }
+    EXPECT_EQ(2U, sender.readyQueue.size());
+
+    // Message 3 has the fewest unsent bytes; it should go first followed by
+    // message 2 in the same burst.
+    EXPECT_CALL(mockDriver, sendPackets(_, Eq(10)))
+        .With(Args<0, 1>(Each(&mockPacket)))
+        .Times(1);
 
     sender.trySend();
 
     EXPECT_EQ(5U, message[0]->sentIndex);
     EXPECT_TRUE(message[0]->sent);
-    EXPECT_EQ(0U, transport->updateHints.ops.count(op[0]));
+    EXPECT_FALSE(op[0]->hintQueued);
     EXPECT_EQ(5U, message[1]->sentIndex);
     EXPECT_FALSE(message[1]->sent);
-    EXPECT_EQ(0U, transport->updateHints.ops.count(op[1]));
+    EXPECT_FALSE(op[1]->hintQueued);
     EXPECT_EQ(5U, message[2]->sentIndex);
+    EXPECT_EQ(4000U, message[2]->unsentBytes);
     EXPECT_FALSE(message[2]->sent);
-    EXPECT_EQ(0U, transport->updateHints.ops.count(op[2]));
-    EXPECT_EQ(0U, message[3]->sentIndex);
-    EXPECT_FALSE(message[3]->sent);
-    EXPECT_EQ(0U, transport->updateHints.ops.count(op[3]));
+    EXPECT_FALSE(op[2]->hintQueued);
+    EXPECT_EQ(5U, message[3]->sentIndex);
+    EXPECT_TRUE(message[3]->sent);
+    EXPECT_TRUE(op[3]->hintQueued);
+    EXPECT_TRUE(sender.readyQueue.empty());
+}
+
+TEST_F(SenderTest, trySend_srptOrder)
+{
+    Transport::Op* op[2];
+    OutboundMessage* message[2];
+    for (uint64_t i = 0; i < 2; ++i) {
+        op[i] = transport->opSlab.construct(transport, &mockDriver);
+        Protocol::MessageId msgId = {42, 10 + i, 1};
+        message[i] = SenderTest::addMessage(&sender, msgId, op[i], 1);
+        for (int j = 0; j < 5; ++j) {
+            message[i]->message.setPacket(j, &mockPacket);
+        }
+        message[i]->message.messageLength = 5000;
+    }
 
-    EXPECT_CALL(mockDriver, sendPackets(Pointee(&mockPacket), Eq(1))).Times(5);
+    // Message 1 has fewer unsent bytes than message 0.
+    message[0]->unsentBytes = 5000;
+    message[1]->unsentBytes = 3000;
+    SenderTest::enqueueMessage(&sender, op[0]);
+    SenderTest::enqueueMessage(&sender, op[1]);
+    EXPECT_EQ(op[1], sender.readyQueue.begin()->op);
+
+    // A GRANT for message 0 doesn't change its SRPT position.
+    Protocol::Packet::GrantHeader* header =
+        static_cast<Protocol::Packet::GrantHeader*>(mockPacket.payload);
+    header->common.messageId = message[0]->id;
+    header->indexLimit = 5;
+    sender.handleGrantPacket(&mockPacket, &mockDriver);
+    EXPECT_EQ(2U, sender.readyQueue.size());
+    EXPECT_EQ(op[1], sender.readyQueue.begin()->op);
+
+    // Distinguish message 1's packet to check the order of the burst.
+    Homa::Mock::MockDriver::MockPacket packet1(payload);
+    message[1]->message.inlinePackets[0] = &packet1;
+    EXPECT_CALL(mockDriver, sendPackets(_, Eq(6)))
+        .With(Args<0, 1>(ElementsAre(&packet1, &mockPacket, &mockPacket,
+                                     &mockPacket, &mockPacket, &mockPacket)));
 
     sender.trySend();
 
-    EXPECT_EQ(5U, message[3]->sentIndex);
-    EXPECT_TRUE(message[3]->sent);
-    EXPECT_EQ(1U, transport->updateHints.ops.count(op[3]));
+    EXPECT_EQ(1U, message[1]->sentIndex);
+    EXPECT_EQ(5U, message[0]->sentIndex);
+    EXPECT_TRUE(sender.readyQueue.empty());
+}
+
+TEST_F(SenderTest, trySend_resend)
+{
+    Transport::Op* op[2];
+    OutboundMessage* message[2];
+    Homa::Mock::MockDriver::MockPacket* packet[2][4];
+    for (uint64_t i = 0; i < 2; ++i) {
+        op[i] = transport->opSlab.construct(transport, &mockDriver);
+        Protocol::MessageId id = {22, 10 + i, 1};
+        message[i] = SenderTest::addMessage(&sender, id, op[i], 4);
+        for (int j = 0; j < 4; ++j) {
+            packet[i][j] = new Homa::Mock::MockDriver::MockPacket(payload);
+            message[i]->message.setPacket(j, packet[i][j]);
+        }
+        message[i]->message.messageLength = 4000;
+    }
+    // Message 0 is fully sent but lost its second packet.
+    message[0]->sentIndex = 4;
+    message[0]->sent = true;
+    message[0]->resendIndex = 1;
+    message[0]->resendEnd = 2;
+    // Message 1 lost its first packet and still has unsent packets.
+    message[1]->sentIndex = 2;
+    message[1]->unsentBytes = 2000;
+    message[1]->resendIndex = 0;
+    message[1]->resendEnd = 1;
+    SenderTest::enqueueMessage(&sender, op[0]);
+    SenderTest::enqueueMessage(&sender, op[1]);
+    EXPECT_EQ(4U, sender.getNumReadyPackets());
+
+    // Retransmissions of both messages go out in the same burst as new data,
+    // resent packets first within each message.
+    EXPECT_CALL(mockDriver, sendPackets(_, Eq(4)))
+        .With(Args<0, 1>(ElementsAre(packet[0][1], packet[1][0],
+                                     packet[1][2], packet[1][3])))
+        .Times(1);
+
+    sender.trySend();
+
+    EXPECT_EQ(2U, message[0]->resendIndex);
+    EXPECT_EQ(4U, message[0]->sentIndex);
+    EXPECT_EQ(1U, message[1]->resendIndex);
+    EXPECT_EQ(4U, message[1]->sentIndex);
+    EXPECT_TRUE(message[1]->sent);
+    EXPECT_TRUE(sender.readyQueue.empty());
+    EXPECT_EQ(0U, sender.getNumReadyPackets());
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    for (int i = 0; i < 2; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            delete packet[i][j];
+        }
+    }
+}
+
+TEST_F(SenderTest, trySend_burstLimit)
+{
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
+    Protocol::MessageId id = {42, 10, 1};
+    OutboundMessage* message = SenderTest::addMessage(&sender, id, op, 40);
+    for (int i = 0; i < 40; ++i) {
+        message->message.setPacket(i, &mockPacket);
+    }
+    message->message.messageLength = 40000;
+    message->unsentBytes = 40000;
+    SenderTest::enqueueMessage(&sender, op);
+
+    EXPECT_CALL(mockDriver, sendPackets(_, Eq(32))).Times(1);
+
+    sender.trySend();
+
+    EXPECT_EQ(32U, message->sentIndex);
+    EXPECT_EQ(1U, sender.readyQueue.size());
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    EXPECT_CALL(mockDriver, sendPackets(_, Eq(8))).Times(1);
+
+    sender.trySend();
+
+    EXPECT_EQ(40U, message->sentIndex);
+    EXPECT_TRUE(message->sent);
+    EXPECT_TRUE(sender.readyQueue.empty());
+}
+
+TEST_F(SenderTest, trySend_throttled)
+{
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
+    Protocol::MessageId id = {42, 10, 1};
+    OutboundMessage* message = SenderTest::addMessage(&sender, id, op, 5);
+    for (int i = 0; i < 5; ++i) {
+        message->message.setPacket(i, &mockPacket);
+    }
+    message->message.messageLength = 5000;
+    message->unsentBytes = 5000;
+    mockPacket.length = 1034;
+    SenderTest::enqueueMessage(&sender, op);
+    EXPECT_EQ(5U, sender.getNumReadyPackets());
+
+    // The NIC drains (almost) nothing during the test.
+    sender.nicQueue.reset(new QueueEstimator(8000, 1e15));
+
+    // Two full packets fit in the NIC queue.
+    EXPECT_CALL(mockDriver, sendPackets(_, Eq(2))).Times(1);
+    sender.trySend();
+    EXPECT_EQ(2U, message->sentIndex);
+    EXPECT_EQ(3U, sender.getNumReadyPackets());
+    EXPECT_LT(2000U, sender.getNicQueuedBytes());
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    // Nothing is sent until the NIC queue drains.
+    EXPECT_CALL(mockDriver, sendPackets).Times(0);
+    sender.trySend();
+    EXPECT_EQ(2U, message->sentIndex);
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    sender.nicQueue->queuedBytes = 0;
+    EXPECT_CALL(mockDriver, sendPackets(_, Eq(2))).Times(1);
+    sender.trySend();
+    EXPECT_EQ(4U, message->sentIndex);
+    EXPECT_EQ(1U, sender.getNumReadyPackets());
+}
+
+TEST_F(SenderTest, trySend_resendThrottled)
+{
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
+    Protocol::MessageId id = {42, 10, 1};
+    OutboundMessage* message = SenderTest::addMessage(&sender, id, op, 5);
+    for (int i = 0; i < 5; ++i) {
+        message->message.setPacket(i, &mockPacket);
+    }
+    message->message.messageLength = 5000;
+    message->sentIndex = 5;
+    message->sent = true;
+    message->resendIndex = 0;
+    message->resendEnd = 3;
+    mockPacket.length = 1034;
+    SenderTest::enqueueMessage(&sender, op);
+
+    // The NIC drains (almost) nothing during the test.
+    sender.nicQueue.reset(new QueueEstimator(8000, 1e15));
+
+    // Retransmissions fill the NIC queue like any other DATA.
+    EXPECT_CALL(mockDriver, sendPackets(_, Eq(2))).Times(1);
+    sender.trySend();
+    EXPECT_EQ(2U, message->resendIndex);
+    EXPECT_EQ(1U, sender.getNumReadyPackets());
+    EXPECT_LT(2000U, sender.getNicQueuedBytes());
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    EXPECT_CALL(mockDriver, sendPackets).Times(0);
+    sender.trySend();
+    EXPECT_EQ(2U, message->resendIndex);
+    Mock::VerifyAndClearExpectations(&mockDriver);
+
+    sender.nicQueue->queuedBytes = 0;
+    EXPECT_CALL(mockDriver, sendPackets(_, Eq(1))).Times(1);
+    sender.trySend();
+    EXPECT_EQ(3U, message->resendIndex);
+    EXPECT_EQ(0U, sender.getNumReadyPackets());
+}
+
+TEST_F(SenderTest, trySend_nicQueueConstruct)
+{
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
+    Protocol::MessageId id = {42, 10, 1};
+    OutboundMessage* message = SenderTest::addMessage(&sender, id, op, 1);
+    message->message.setPacket(0, &mockPacket);
+    message->message.messageLength = 1000;
+    message->unsentBytes = 1000;
+    SenderTest::enqueueMessage(&sender, op);
+    sender.nicQueue.reset();
+    EXPECT_EQ(0U, sender.getNicQueuedBytes());
+
+    EXPECT_CALL(mockDriver, getBandwidth).WillOnce(Return(8000));
+    EXPECT_CALL(mockDriver, sendPackets(_, Eq(1))).Times(1);
+
+    sender.trySend();
+
+    EXPECT_TRUE(sender.nicQueue);
+    EXPECT_EQ(1U, message->sentIndex);
 }
 
 TEST_F(SenderTest, trySend_alreadyRunning)
 {
     Protocol::MessageId msgId = {42, 1, 1};
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     op->outMessage.message.setPacket(0, &mockPacket);
     op->outMessage.message.messageLength = 1000;
     EXPECT_EQ(1U, op->outMessage.message.getNumPackets());
     OutboundMessage* message = SenderTest::addMessage(&sender, msgId, op, 1);
+    SenderTest::enqueueMessage(&sender, op);
     EXPECT_EQ(1, message->grantIndex);
     EXPECT_EQ(0, message->sentIndex);
 
@@ -650,6 +1279,7 @@ TEST_F(SenderTest, trySend_alreadyRunning)
 TEST_F(SenderTest, trySend_nothingToSend)
 {
     EXPECT_TRUE(sender.outboundMessages.empty());
+    EXPECT_TRUE(sender.readyQueue.empty());
     EXPECT_CALL(mockDriver, sendPackets).Times(0);
     sender.trySend();
 }
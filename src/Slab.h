@@ -0,0 +1,282 @@
+/* Copyright (c) 2010-2018, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_CORE_SLAB_H
+#define HOMA_CORE_SLAB_H
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#include "Debug.h"
+
+namespace Homa {
+namespace Core {
+
+/**
+ * Slab is a templated allocator that keeps objects in fixed-size chunks of
+ * slots that are never returned to the system.  Each slot carries a
+ * generation number that changes every time an object in the slot is
+ * constructed or destroyed, so a Handle (slot index plus generation) can be
+ * checked for liveness with a single atomic load even after the object it
+ * refers to has been destroyed and its slot reused.
+ *
+ * construct() and destroy() are NOT thread-safe and must be externally
+ * synchronized; get() and isLive() may be called concurrently with any other
+ * method.
+ */
+template <typename T>
+class Slab {
+  public:
+    /**
+     * Refers to an object in a Slab; remains safe to use after the object has
+     * been destroyed.
+     */
+    struct Handle {
+        /// Slot in which the object was constructed.
+        uint32_t index;
+        /// Generation of the slot while it held the object.
+        uint32_t generation;
+    };
+
+    /**
+     * Construct a new Slab.  No memory is allocated until the first object
+     * is constructed.
+     */
+    Slab()
+        : chunks()
+        , numSlots(0)
+        , numLive(0)
+        , freeList()
+    {
+        for (uint32_t i = 0; i < MAX_CHUNKS; ++i) {
+            chunks[i].store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Destroy the Slab and release its memory.  The Slab expects that all
+     * objects constructed in it have already been destroyed.
+     */
+    ~Slab()
+    {
+        if (numLive > 0) {
+            ERROR("Slab destroyed with %u objects still live!", numLive);
+        }
+        for (uint32_t i = 0; i < MAX_CHUNKS; ++i) {
+            delete[] chunks[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Construct a new object of templated type T in a free slot.
+     *
+     * @param args
+     *      Arguments to provide to T's constructor.
+     */
+    template <typename... Args>
+    T* construct(Args&&... args)
+    {
+        Slot* slot = nullptr;
+        if (!freeList.empty()) {
+            slot = slotAt(freeList.back());
+            freeList.pop_back();
+        } else {
+            uint32_t chunk = numSlots / CHUNK_SIZE;
+            if (chunk >= MAX_CHUNKS) {
+                PANIC("Slab is full; cannot construct more than %u objects",
+                      MAX_CHUNKS * CHUNK_SIZE);
+            }
+            if (numSlots % CHUNK_SIZE == 0) {
+                Slot* slots = new Slot[CHUNK_SIZE];
+                for (uint32_t i = 0; i < CHUNK_SIZE; ++i) {
+                    slots[i].index = numSlots + i;
+                }
+                chunks[chunk].store(slots, std::memory_order_release);
+            }
+            slot = slotAt(numSlots++);
+        }
+
+        T* object = nullptr;
+        try {
+            object = new (&slot->storage) T(static_cast<Args&&>(args)...);
+        } catch (...) {
+            freeList.push_back(slot->index);
+            throw;
+        }
+        // Odd generations mark live slots.
+        slot->generation.fetch_add(1, std::memory_order_release);
+        numLive++;
+        return object;
+    }
+
+    /**
+     * Destroy an object previously constructed in this Slab; all Handle
+     * objects that refer to it become stale.
+     */
+    void destroy(T* object)
+    {
+        assert(numLive > 0);
+        Slot* slot = slotOf(object);
+        assert(slot->generation.load(std::memory_order_relaxed) % 2 == 1);
+        slot->generation.fetch_add(1, std::memory_order_release);
+        object->~T();
+        freeList.push_back(slot->index);
+        numLive--;
+    }
+
+    /**
+     * Return a Handle which refers to the given live object.
+     */
+    static Handle getHandle(const T* object)
+    {
+        const Slot* slot = slotOf(const_cast<T*>(object));
+        return {slot->index, slot->generation.load(std::memory_order_acquire)};
+    }
+
+    /**
+     * Return true if the object to which the Handle refers has not been
+     * destroyed; false, otherwise.
+     */
+    bool isLive(Handle handle) const
+    {
+        const Slot* slot = findSlot(handle.index);
+        return slot != nullptr &&
+               slot->generation.load(std::memory_order_acquire) ==
+                   handle.generation;
+    }
+
+    /**
+     * Return the object to which the Handle refers or nullptr if the object
+     * has been destroyed.
+     */
+    T* get(Handle handle) const
+    {
+        if (!isLive(handle)) {
+            return nullptr;
+        }
+        return reinterpret_cast<T*>(&findSlot(handle.index)->storage);
+    }
+
+    /**
+     * Return the live object in the given slot or nullptr if the slot is
+     * free.  Used with getNumSlots() to iterate over the live objects.
+     */
+    T* getByIndex(uint32_t index) const
+    {
+        Slot* slot = findSlot(index);
+        if (slot == nullptr ||
+            slot->generation.load(std::memory_order_acquire) % 2 == 0) {
+            return nullptr;
+        }
+        return reinterpret_cast<T*>(&slot->storage);
+    }
+
+    /**
+     * Return the number of slots that have ever been used; all live objects
+     * are in slots with a lower index.
+     */
+    uint32_t getNumSlots() const
+    {
+        return numSlots;
+    }
+
+    /**
+     * Return the number of objects that have been constructed but not yet
+     * destroyed.
+     */
+    uint32_t getNumLive() const
+    {
+        return numLive;
+    }
+
+  private:
+    /// Holds at most one object.
+    struct Slot {
+        Slot()
+            : generation(0)
+            , index(0)
+            , storage()
+        {}
+
+        /// Incremented each time an object is constructed in or destroyed
+        /// from this slot; odd while the slot holds a live object.
+        std::atomic<uint32_t> generation;
+        /// Position of this slot in the Slab.
+        uint32_t index;
+        /// Backing memory for the object.
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    /// Number of slots allocated together.
+    static const uint32_t CHUNK_SIZE = 256;
+
+    /// Maximum number of chunks; chunks are never moved so that they can be
+    /// accessed without synchronization.
+    static const uint32_t MAX_CHUNKS = 4096;
+
+    /// Return the slot with the given index, which must have been allocated.
+    Slot* slotAt(uint32_t index) const
+    {
+        return &chunks[index / CHUNK_SIZE].load(
+            std::memory_order_relaxed)[index % CHUNK_SIZE];
+    }
+
+    /// Return the slot that holds the given object.
+    static Slot* slotOf(T* object)
+    {
+        return reinterpret_cast<Slot*>(reinterpret_cast<char*>(object) -
+                                       offsetof(Slot, storage));
+    }
+
+    /// Return the slot with the given index or nullptr if no such slot has
+    /// been allocated.
+    Slot* findSlot(uint32_t index) const
+    {
+        if (index / CHUNK_SIZE >= MAX_CHUNKS) {
+            return nullptr;
+        }
+        Slot* slots =
+            chunks[index / CHUNK_SIZE].load(std::memory_order_acquire);
+        if (slots == nullptr) {
+            return nullptr;
+        }
+        return &slots[index % CHUNK_SIZE];
+    }
+
+    /// Chunks of CHUNK_SIZE slots; unallocated chunks are nullptr.
+    std::atomic<Slot*> chunks[MAX_CHUNKS];
+
+    /// Number of slots that have been handed out at least once.
+    uint32_t numSlots;
+
+    /// Number of live objects.
+    uint32_t numLive;
+
+    /// Indexes of slots that have been freed and can be reused.
+    std::vector<uint32_t> freeList;
+
+    Slab(const Slab&) = delete;
+    Slab& operator=(const Slab&) = delete;
+};
+
+}  // namespace Core
+}  // namespace Homa
+
+#endif  // HOMA_CORE_SLAB_H
@@ -0,0 +1,135 @@
+/* Copyright (c) 2019, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include "Slab.h"
+
+#include <vector>
+
+namespace Homa {
+namespace Core {
+namespace {
+
+struct TestObject {
+    explicit TestObject(int value, bool* destroyed = nullptr)
+        : value(value)
+        , destroyed(destroyed)
+    {}
+
+    ~TestObject()
+    {
+        if (destroyed != nullptr) {
+            *destroyed = true;
+        }
+    }
+
+    int value;
+    bool* destroyed;
+};
+
+TEST(SlabTest, constructor)
+{
+    Slab<TestObject> slab;
+    EXPECT_EQ(0U, slab.getNumSlots());
+    EXPECT_EQ(0U, slab.getNumLive());
+    EXPECT_EQ(nullptr, slab.chunks[0].load());
+    EXPECT_EQ(nullptr, slab.getByIndex(0));
+}
+
+TEST(SlabTest, construct)
+{
+    Slab<TestObject> slab;
+    TestObject* a = slab.construct(1);
+    TestObject* b = slab.construct(2);
+
+    EXPECT_EQ(1, a->value);
+    EXPECT_EQ(2, b->value);
+    EXPECT_EQ(2U, slab.getNumSlots());
+    EXPECT_EQ(2U, slab.getNumLive());
+    EXPECT_EQ(1U, Slab<TestObject>::getHandle(a).generation);
+    EXPECT_EQ(0U, Slab<TestObject>::getHandle(a).index);
+    EXPECT_EQ(1U, Slab<TestObject>::getHandle(b).index);
+
+    slab.destroy(a);
+    slab.destroy(b);
+}
+
+TEST(SlabTest, construct_newChunk)
+{
+    Slab<TestObject> slab;
+    std::vector<TestObject*> objects;
+    for (uint32_t i = 0; i < Slab<TestObject>::CHUNK_SIZE + 1; ++i) {
+        objects.push_back(slab.construct(i));
+    }
+    EXPECT_NE(nullptr, slab.chunks[1].load());
+    EXPECT_EQ(nullptr, slab.chunks[2].load());
+    EXPECT_EQ(objects.back(), slab.getByIndex(Slab<TestObject>::CHUNK_SIZE));
+    for (TestObject* object : objects) {
+        slab.destroy(object);
+    }
+}
+
+TEST(SlabTest, destroy)
+{
+    Slab<TestObject> slab;
+    bool destroyed = false;
+    TestObject* object = slab.construct(1, &destroyed);
+    Slab<TestObject>::Handle handle = Slab<TestObject>::getHandle(object);
+
+    slab.destroy(object);
+
+    EXPECT_TRUE(destroyed);
+    EXPECT_EQ(0U, slab.getNumLive());
+    EXPECT_EQ(1U, slab.getNumSlots());
+    EXPECT_FALSE(slab.isLive(handle));
+    EXPECT_EQ(nullptr, slab.get(handle));
+    EXPECT_EQ(nullptr, slab.getByIndex(0));
+}
+
+TEST(SlabTest, get_slotReused)
+{
+    Slab<TestObject> slab;
+    TestObject* oldObject = slab.construct(1);
+    Slab<TestObject>::Handle oldHandle =
+        Slab<TestObject>::getHandle(oldObject);
+    slab.destroy(oldObject);
+
+    TestObject* newObject = slab.construct(2);
+    Slab<TestObject>::Handle newHandle =
+        Slab<TestObject>::getHandle(newObject);
+
+    EXPECT_EQ(oldObject, newObject);
+    EXPECT_EQ(oldHandle.index, newHandle.index);
+    EXPECT_EQ(3U, newHandle.generation);
+    EXPECT_EQ(nullptr, slab.get(oldHandle));
+    EXPECT_EQ(newObject, slab.get(newHandle));
+    EXPECT_EQ(1U, slab.getNumSlots());
+
+    slab.destroy(newObject);
+}
+
+TEST(SlabTest, isLive_unallocatedSlot)
+{
+    Slab<TestObject> slab;
+    EXPECT_FALSE(slab.isLive({0, 1}));
+    EXPECT_FALSE(slab.isLive({Slab<TestObject>::CHUNK_SIZE *
+                                  Slab<TestObject>::MAX_CHUNKS,
+                              1}));
+}
+
+}  // namespace
+}  // namespace Core
+}  // namespace Homa
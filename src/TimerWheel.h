@@ -0,0 +1,243 @@
+/* Copyright (c) 2019, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef HOMA_CORE_TIMERWHEEL_H
+#define HOMA_CORE_TIMERWHEEL_H
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+
+namespace Homa {
+namespace Core {
+
+/**
+ * A hashed timing wheel which tracks the timeouts of a large number of
+ * objects.  Scheduling and canceling a timeout are both O(1) regardless of the
+ * number of timeouts being tracked.
+ *
+ * Time (measured in arbitrary units, e.g. cycles) is divided into ticks of a
+ * fixed length.  Each scheduled Timer is kept in an intrusive list belonging
+ * to the wheel slot that its expiration tick hashes to.  Advancing the wheel
+ * only visits the slots of the ticks that have passed; Timer objects that
+ * expire are moved to a list of expired timers from which they can be
+ * collected with popExpired().
+ *
+ * This class is NOT thread-safe.
+ *
+ * @tparam ElementType
+ *      Type of the object that owns each Timer.
+ */
+template <typename ElementType>
+class TimerWheel {
+  public:
+    /**
+     * Intrusive hook that allows an object to be scheduled in a TimerWheel.
+     * A Timer can be scheduled in at most one TimerWheel at a time.
+     */
+    class Timer {
+      public:
+        /**
+         * Timer constructor.
+         *
+         * @param owner
+         *      Object that will be returned by TimerWheel::popExpired() when
+         *      this Timer expires.
+         */
+        explicit Timer(ElementType* owner = nullptr)
+            : owner(owner)
+            , expiration(0)
+            , prev(this)
+            , next(this)
+        {}
+
+        /**
+         * Timer destructor; unschedules the timer if necessary.
+         */
+        ~Timer()
+        {
+            unlink();
+        }
+
+        /**
+         * Return true if this Timer is scheduled or has expired but has not
+         * yet been returned by TimerWheel::popExpired(); false, otherwise.
+         */
+        bool isScheduled() const
+        {
+            return next != this;
+        }
+
+        /// Object to which this Timer belongs.
+        ElementType* const owner;
+
+      private:
+        /// Remove this Timer from the list it is in, if any.
+        void unlink()
+        {
+            prev->next = next;
+            next->prev = prev;
+            prev = this;
+            next = this;
+        }
+
+        /// Add this Timer to the end of the list with the given head.
+        void linkBefore(Timer* head)
+        {
+            assert(!isScheduled());
+            prev = head->prev;
+            next = head;
+            head->prev->next = this;
+            head->prev = this;
+        }
+
+        /// Tick in which this Timer expires.
+        uint64_t expiration;
+
+        /// Previous Timer in the list that holds this Timer.
+        Timer* prev;
+
+        /// Next Timer in the list that holds this Timer.
+        Timer* next;
+
+        friend class TimerWheel;
+
+        Timer(const Timer&) = delete;
+        Timer& operator=(const Timer&) = delete;
+    };
+
+    /**
+     * TimerWheel constructor.
+     *
+     * @param tickLength
+     *      Length of each tick in the same units that will be passed to
+     *      schedule() and advance().
+     * @param now
+     *      The current time.
+     */
+    explicit TimerWheel(uint64_t tickLength, uint64_t now = 0)
+        : tickLength(tickLength > 0 ? tickLength : 1)
+        , currentTick(now / this->tickLength)
+        , slots()
+        , expired()
+    {}
+
+    /**
+     * Schedule a Timer to expire once the wheel has been advanced to the
+     * given time.  A Timer that is already scheduled is rescheduled.
+     *
+     * @param timer
+     *      Timer to be scheduled.
+     * @param when
+     *      Time at which the Timer should expire.
+     */
+    void schedule(Timer* timer, uint64_t when)
+    {
+        timer->unlink();
+        // Timers always expire in a future tick so that advance() never has
+        // to revisit a slot it has already processed.
+        timer->expiration = std::max(when / tickLength, currentTick + 1);
+        timer->linkBefore(&slots[timer->expiration % NUM_SLOTS]);
+    }
+
+    /**
+     * Unschedule a Timer so that it will not be returned by popExpired().
+     * Does nothing if the Timer is not scheduled.
+     *
+     * @param timer
+     *      Timer to be canceled.
+     */
+    void cancel(Timer* timer)
+    {
+        timer->unlink();
+    }
+
+    /**
+     * Move all Timer objects that expire at or before the given time to the
+     * list of expired timers.
+     *
+     * @param now
+     *      The current time.
+     */
+    void advance(uint64_t now)
+    {
+        uint64_t nowTick = now / tickLength;
+        if (nowTick <= currentTick) {
+            return;
+        }
+        // Each slot only needs to be visited once no matter how many ticks
+        // have passed.
+        uint64_t firstTick = currentTick + 1;
+        if (nowTick - currentTick > NUM_SLOTS) {
+            firstTick = nowTick - NUM_SLOTS + 1;
+        }
+        for (uint64_t tick = firstTick; tick <= nowTick; ++tick) {
+            Timer* head = &slots[tick % NUM_SLOTS];
+            Timer* timer = head->next;
+            while (timer != head) {
+                Timer* next = timer->next;
+                if (timer->expiration <= nowTick) {
+                    timer->unlink();
+                    timer->linkBefore(&expired);
+                }
+                timer = next;
+            }
+        }
+        currentTick = nowTick;
+    }
+
+    /**
+     * Return the owner of a Timer that has expired and unschedule the Timer;
+     * returns nullptr if there are no expired Timer objects.
+     *
+     * @sa advance()
+     */
+    ElementType* popExpired()
+    {
+        Timer* timer = expired.next;
+        if (timer == &expired) {
+            return nullptr;
+        }
+        timer->unlink();
+        return timer->owner;
+    }
+
+  private:
+    /// Number of slots in the wheel.  Timers that expire more than NUM_SLOTS
+    /// ticks in the future share slots with earlier timers and are skipped
+    /// until their tick arrives.
+    static const uint64_t NUM_SLOTS = 256;
+
+    /// Length of a tick.
+    const uint64_t tickLength;
+
+    /// All Timer objects expiring at or before this tick have been moved to
+    /// the expired list.
+    uint64_t currentTick;
+
+    /// Head of the list of Timer objects for each slot.
+    Timer slots[NUM_SLOTS];
+
+    /// Head of the list of Timer objects that have expired.
+    Timer expired;
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+};
+
+}  // namespace Core
+}  // namespace Homa
+
+#endif  // HOMA_CORE_TIMERWHEEL_H
@@ -0,0 +1,155 @@
+/* Copyright (c) 2019, Stanford University
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <gtest/gtest.h>
+
+#include "TimerWheel.h"
+
+namespace Homa {
+namespace Core {
+namespace {
+
+struct Element {
+    Element()
+        : timer(this)
+    {}
+
+    TimerWheel<Element>::Timer timer;
+};
+
+TEST(TimerWheelTest, constructor)
+{
+    TimerWheel<Element> wheel(10, 1234);
+    EXPECT_EQ(10U, wheel.tickLength);
+    EXPECT_EQ(123U, wheel.currentTick);
+
+    TimerWheel<Element> zeroTick(0);
+    EXPECT_EQ(1U, zeroTick.tickLength);
+}
+
+TEST(TimerWheelTest, Timer_destructor)
+{
+    TimerWheel<Element> wheel(10);
+    Element e1;
+    {
+        Element e2;
+        wheel.schedule(&e1.timer, 50);
+        wheel.schedule(&e2.timer, 50);
+        EXPECT_EQ(&e2.timer, e1.timer.next);
+    }
+    EXPECT_EQ(&wheel.slots[5], e1.timer.next);
+    EXPECT_EQ(&wheel.slots[5], e1.timer.prev);
+}
+
+TEST(TimerWheelTest, schedule)
+{
+    TimerWheel<Element> wheel(10, 100);
+    Element e;
+    EXPECT_FALSE(e.timer.isScheduled());
+
+    wheel.schedule(&e.timer, 155);
+    EXPECT_TRUE(e.timer.isScheduled());
+    EXPECT_EQ(15U, e.timer.expiration);
+    EXPECT_EQ(&wheel.slots[15], e.timer.next);
+
+    // Reschedule
+    wheel.schedule(&e.timer, 10 * (TimerWheel<Element>::NUM_SLOTS + 20));
+    EXPECT_EQ(TimerWheel<Element>::NUM_SLOTS + 20, e.timer.expiration);
+    EXPECT_EQ(&wheel.slots[20], e.timer.next);
+    EXPECT_EQ(&wheel.slots[15], wheel.slots[15].next);
+
+    // Past
+    wheel.schedule(&e.timer, 0);
+    EXPECT_EQ(11U, e.timer.expiration);
+    EXPECT_EQ(&wheel.slots[11], e.timer.next);
+}
+
+TEST(TimerWheelTest, cancel)
+{
+    TimerWheel<Element> wheel(10);
+    Element e;
+    wheel.schedule(&e.timer, 50);
+    EXPECT_TRUE(e.timer.isScheduled());
+
+    wheel.cancel(&e.timer);
+    EXPECT_FALSE(e.timer.isScheduled());
+    wheel.advance(100);
+    EXPECT_EQ(nullptr, wheel.popExpired());
+
+    // Not scheduled
+    wheel.cancel(&e.timer);
+    EXPECT_FALSE(e.timer.isScheduled());
+}
+
+TEST(TimerWheelTest, advance)
+{
+    TimerWheel<Element> wheel(10);
+    Element e[3];
+    wheel.schedule(&e[0].timer, 20);
+    wheel.schedule(&e[1].timer, 30);
+    wheel.schedule(&e[2].timer,
+                   10 * (TimerWheel<Element>::NUM_SLOTS + 2));
+
+    wheel.advance(25);
+    EXPECT_EQ(2U, wheel.currentTick);
+    EXPECT_EQ(&e[0], wheel.popExpired());
+    EXPECT_EQ(nullptr, wheel.popExpired());
+
+    // Same tick; nothing to do.
+    wheel.advance(29);
+    EXPECT_EQ(nullptr, wheel.popExpired());
+
+    // e[2] shares a slot with e[0] but expires a round later.
+    wheel.advance(10 * (TimerWheel<Element>::NUM_SLOTS + 1));
+    EXPECT_EQ(&e[1], wheel.popExpired());
+    EXPECT_EQ(nullptr, wheel.popExpired());
+    EXPECT_TRUE(e[2].timer.isScheduled());
+
+    wheel.advance(10 * (TimerWheel<Element>::NUM_SLOTS + 2));
+    EXPECT_EQ(&e[2], wheel.popExpired());
+    EXPECT_EQ(nullptr, wheel.popExpired());
+}
+
+TEST(TimerWheelTest, advance_multipleRounds)
+{
+    TimerWheel<Element> wheel(1);
+    Element e[2];
+    wheel.schedule(&e[0].timer, 5);
+    wheel.schedule(&e[1].timer, 3 * TimerWheel<Element>::NUM_SLOTS + 7);
+
+    wheel.advance(10 * TimerWheel<Element>::NUM_SLOTS);
+    EXPECT_EQ(10 * TimerWheel<Element>::NUM_SLOTS, wheel.currentTick);
+    EXPECT_EQ(&e[0], wheel.popExpired());
+    EXPECT_EQ(&e[1], wheel.popExpired());
+    EXPECT_EQ(nullptr, wheel.popExpired());
+}
+
+TEST(TimerWheelTest, popExpired)
+{
+    TimerWheel<Element> wheel(10);
+    Element e;
+    EXPECT_EQ(nullptr, wheel.popExpired());
+
+    wheel.schedule(&e.timer, 10);
+    wheel.advance(10);
+    EXPECT_TRUE(e.timer.isScheduled());
+    EXPECT_EQ(&e, wheel.popExpired());
+    EXPECT_FALSE(e.timer.isScheduled());
+    EXPECT_EQ(nullptr, wheel.popExpired());
+}
+
+}  // namespace
+}  // namespace Core
+}  // namespace Homa
@@ -15,10 +15,20 @@
 
 #include "Transport.h"
 
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <cerrno>
 #include <memory>
+#include <string>
 #include <utility>
 
+#include <Homa/Exception.h>
+
+#include "CodeLocation.h"
 #include "Protocol.h"
 #include "Receiver.h"
 #include "Sender.h"
@@ -32,22 +42,45 @@ namespace Core {
  * @param lock
  *      Used to remind the caller to hold the Op's mutex while calling
  *      this method.
+ * @return
+ *      True if this Op has finished and its RemoteOp should now be delivered
+ *      to the Op's completionQueue; false otherwise.
  */
-void
+bool
 Transport::Op::processUpdates(const SpinLock::Lock& lock)
 {
     (void)lock;
     if (destroy) {
-        return;
+        return false;
     }
 
     State copyOfState = state.load();
 
+    if (failed && copyOfState != State::COMPLETED &&
+        copyOfState != State::FAILED) {
+        if (isServerOp && copyOfState == State::NOT_STARTED) {
+            // The request never fully arrived so the application has never
+            // seen this ServerOp; there is no one to tell.
+            drop(lock);
+            return false;
+        }
+        state.store(State::FAILED);
+        copyOfState = State::FAILED;
+    }
+
     if (isServerOp) {
         if (copyOfState == State::NOT_STARTED) {
             if (inMessage->isReady()) {
                 // Strip-off the Message::Header.
                 inMessage->get()->defineHeader<Protocol::Message::Header>();
+                // Prepare the response while the Op's lock is already held so
+                // that delivering the ServerOp only requires the queue lock.
+                Protocol::Message::Header* header =
+                    outMessage.get()->defineHeader<Protocol::Message::Header>();
+                header->replyAddress =
+                    inMessage->get()
+                        ->getHeader<Protocol::Message::Header>()
+                        ->replyAddress;
                 SpinLock::Lock lock_queue(transport->pendingServerOps.mutex);
                 transport->pendingServerOps.queue.push_back(this);
                 state.store(State::IN_PROGRESS);
@@ -57,7 +90,8 @@ Transport::Op::processUpdates(const SpinLock::Lock& lock)
                 state.store(State::COMPLETED);
                 if (inMessage->getId().tag !=
                     Protocol::MessageId::INITIAL_REQUEST_TAG) {
-                    Receiver::sendDonePacket(this, transport->driver, lock);
+                    Receiver::sendDonePacket(this, &transport->controlQueue,
+                                             lock);
                 }
                 hintUpdate();
             }
@@ -93,6 +127,12 @@ Transport::Op::processUpdates(const SpinLock::Lock& lock)
             PANIC("Unknown RemoteOp state.");
         }
     }
+
+    if (completionQueue != nullptr && retained) {
+        State finalState = state.load();
+        return finalState == State::COMPLETED || finalState == State::FAILED;
+    }
+    return false;
 }
 
 /**
@@ -103,34 +143,53 @@ Transport::Op::processUpdates(const SpinLock::Lock& lock)
  * @param transportId
  *      This transport's unique identifier in the group of transports among
  *      which this transport will communicate.
+ * @param overcommitmentDegree
+ *      Maximum number of incoming messages to which this transport will grant
+ *      at the same time.
  */
-Transport::Transport(Driver* driver, uint64_t transportId)
+Transport::Transport(Driver* driver, uint64_t transportId,
+                     uint32_t overcommitmentDegree)
     : driver(driver)
     , transportId(transportId)
     , nextOpSequenceNumber(1)
-    , sender(new Sender())
-    , receiver(new Receiver())
+    , controlQueue(driver)
+    , sender(new Sender(&controlQueue))
+    , receiver(new Receiver(&controlQueue, overcommitmentDegree))
     , mutex()
-    , opPool()
-    , activeOps()
+    , opSlab()
     , updateHints()
+    , checkingForUpdates()
+    , deliveringTo(nullptr)
+    , eventFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    , eventPending(false)
+    , pollingThreads()
+    , stopPolling(false)
     , unusedOps()
     , pendingServerOps()
-{}
+{
+    if (eventFd < 0) {
+        throw FatalError(HERE_STR, "Failed to create eventfd", errno);
+    }
+}
 
 /**
  * Transport Destructor.
  */
 Transport::~Transport()
 {
+    stopPollingThreads();
     mutex.lock();
-    for (auto it = activeOps.begin(); it != activeOps.end(); ++it) {
-        Op* op = *it;
+    for (uint32_t i = 0; i < opSlab.getNumSlots(); ++i) {
+        Op* op = opSlab.getByIndex(i);
+        if (op == nullptr) {
+            continue;
+        }
         sender->dropMessage(op);
         receiver->dropOp(op);
         op->mutex.lock();
-        opPool.destroy(op);
+        opSlab.destroy(op);
     }
+    close(eventFd);
 };
 
 /**
@@ -140,8 +199,7 @@ OpContext*
 Transport::allocOp()
 {
     SpinLock::UniqueLock lock(mutex);
-    Op* op = opPool.construct(this, driver, false);
-    activeOps.insert(op);
+    Op* op = opSlab.construct(this, driver, false);
 
     // Lock handoff
     SpinLock::Lock lock_op(op->mutex);
@@ -161,24 +219,39 @@ Transport::allocOp()
 OpContext*
 Transport::receiveOp()
 {
-    SpinLock::UniqueLock lock_queue(pendingServerOps.mutex);
-    Op* op = nullptr;
-    if (!pendingServerOps.queue.empty()) {
-        op = pendingServerOps.queue.front();
-        pendingServerOps.queue.pop_front();
-        lock_queue.unlock();
+    OpContext* context = nullptr;
+    receiveOps(&context, 1);
+    return context;
+}
 
-        SpinLock::Lock lock_op(op->mutex);
-        Protocol::Message::Header* header =
-            op->outMessage.get()->defineHeader<Protocol::Message::Header>();
-        assert(op->inMessage != nullptr);
-        assert(op->inMessage->get() != nullptr);
-        header->replyAddress = op->inMessage->get()
-                                   ->getHeader<Protocol::Message::Header>()
-                                   ->replyAddress;
-        op->retained.store(true);
+/**
+ * Return the OpContexts of up to _maxOps_ incomming requests (ServerOps) in a
+ * single batch.
+ *
+ * @param[out] contexts
+ *      Array into which the OpContexts are written.
+ * @param maxOps
+ *      Number of entries available in _contexts_.
+ * @return
+ *      Number of OpContexts written to _contexts_.
+ */
+size_t
+Transport::receiveOps(OpContext* contexts[], size_t maxOps)
+{
+    size_t numOps = 0;
+    {
+        SpinLock::Lock lock_queue(pendingServerOps.mutex);
+        while (numOps < maxOps && !pendingServerOps.queue.empty()) {
+            contexts[numOps++] = pendingServerOps.queue.front();
+            pendingServerOps.queue.pop_front();
+        }
     }
-    return op;
+    // The responses were already prepared when the Ops were queued (see
+    // Op::processUpdates()); only the hand-off to the application remains.
+    for (size_t i = 0; i < numOps; ++i) {
+        static_cast<Op*>(contexts[i])->retained.store(true);
+    }
+    return numOps;
 }
 
 /**
@@ -195,10 +268,49 @@ void
 Transport::releaseOp(OpContext* context)
 {
     Op* op = static_cast<Op*>(context);
+    // The Op's lock is held until the hint is queued; otherwise a poller could
+    // drop and destroy the Op (see cleanupOps()) before hintUpdate() links it
+    // back into updateHints.
+    SpinLock::Lock lock_op(op->mutex);
+    // The RemoteOp is going away; it must no longer be delivered.
+    op->completionQueue = nullptr;
     op->retained.store(false);
     op->hintUpdate();
 }
 
+/**
+ * Stop delivering the given Ops to a CompletionQueue that is about to be
+ * destroyed.  The Ops otherwise continue normally; their RemoteOps can still
+ * be waited on directly.  When this method returns, the Transport will no
+ * longer access _completionQueue_ on behalf of any of the Ops.
+ *
+ * Must not be called from a callback of _completionQueue_.
+ *
+ * @param numOps
+ *      Number of OpContexts in _contexts_.
+ * @param contexts
+ *      OpContexts that were sent with _completionQueue_.
+ * @param completionQueue
+ *      The CompletionQueue from which the Ops should be detached.
+ */
+void
+Transport::detachOps(size_t numOps, OpContext* const contexts[],
+                     CompletionQueue* completionQueue)
+{
+    for (size_t i = 0; i < numOps; ++i) {
+        Op* op = static_cast<Op*>(contexts[i]);
+        SpinLock::Lock lock_op(op->mutex);
+        if (op->completionQueue == completionQueue) {
+            op->completionQueue = nullptr;
+            op->remoteOp = nullptr;
+        }
+    }
+    // An Op may have been taken for delivery before it was detached; wait
+    // for that delivery to finish.
+    while (deliveringTo.load() == completionQueue) {
+    }
+}
+
 /**
  * Signal that the outbound Message should be sent as a request.
  *
@@ -206,11 +318,17 @@ Transport::releaseOp(OpContext* context)
  *      OpContext that contains the request Message to be sent.
  * @param destination
  *      Network address to which the request should be sent.
+ * @param completionQueue
+ *      Queue to which _remoteOp_ should be delivered once the RemoteOp
+ *      finishes; nullptr if no delivery is needed.  Ignored for ServerOps.
+ * @param remoteOp
+ *      The application's RemoteOp that holds _context_.
 
  * @sa Homa::Core::Transport; no support for concurrent calls to same OpContext.
  */
 void
-Transport::sendRequest(OpContext* context, Driver::Address* destination)
+Transport::sendRequest(OpContext* context, Driver::Address* destination,
+                       CompletionQueue* completionQueue, RemoteOp* remoteOp)
 {
     Op* op = static_cast<Op*>(context);
     SpinLock::UniqueLock lock_op(op->mutex);
@@ -223,6 +341,8 @@ Transport::sendRequest(OpContext* context, Driver::Address* destination)
     } else {
         Protocol::OpId opId(transportId, nextOpSequenceNumber++);
         op->state.store(OpContext::State::IN_PROGRESS);
+        op->completionQueue = completionQueue;
+        op->remoteOp = remoteOp;
         lock_op.unlock();  // Allow Sender/Receiver to take the lock.
         receiver->registerOp({opId, Protocol::MessageId::ULTIMATE_RESPONSE_TAG},
                              op);
@@ -231,6 +351,56 @@ Transport::sendRequest(OpContext* context, Driver::Address* destination)
     }
 }
 
+/**
+ * Signal that a batch of RemoteOp outbound Messages should be sent as
+ * requests.  Equivalent to calling sendRequest() for each RemoteOp but hands
+ * the whole batch to the Sender at once.
+ *
+ * @param numOps
+ *      Number of RemoteOp contexts in the batch.
+ * @param contexts
+ *      OpContext of each RemoteOp whose request Message should be sent.
+ * @param destinations
+ *      Network address to which each request should be sent.
+ * @param completionQueue
+ *      Queue to which each RemoteOp should be delivered once it finishes;
+ *      nullptr if no delivery is needed.
+ * @param remoteOps
+ *      The application's RemoteOp that holds each context; may be nullptr if
+ *      _completionQueue_ is nullptr.
+ *
+ * @sa Homa::Core::Transport; no support for concurrent calls to same OpContext.
+ */
+void
+Transport::sendRequests(size_t numOps, OpContext* const contexts[],
+                        Driver::Address* const destinations[],
+                        CompletionQueue* completionQueue,
+                        RemoteOp* const remoteOps[])
+{
+    std::vector<Protocol::MessageId> ids;
+    std::vector<Op*> ops;
+    ids.reserve(numOps);
+    ops.reserve(numOps);
+
+    uint64_t firstSequenceNumber = nextOpSequenceNumber.fetch_add(numOps);
+    for (size_t i = 0; i < numOps; ++i) {
+        Op* op = static_cast<Op*>(contexts[i]);
+        assert(!op->isServerOp);
+        Protocol::OpId opId(transportId, firstSequenceNumber + i);
+        {
+            SpinLock::Lock lock_op(op->mutex);
+            op->state.store(OpContext::State::IN_PROGRESS);
+            op->completionQueue = completionQueue;
+            op->remoteOp = (remoteOps != nullptr) ? remoteOps[i] : nullptr;
+        }
+        receiver->registerOp({opId, Protocol::MessageId::ULTIMATE_RESPONSE_TAG},
+                             op);
+        ids.push_back({opId, Protocol::MessageId::INITIAL_REQUEST_TAG});
+        ops.push_back(op);
+    }
+    sender->sendMessages(numOps, ids.data(), destinations, ops.data(), true);
+}
+
 /**
  * Signal that the outbound Message should be sent as a reply.
  *
@@ -256,6 +426,44 @@ Transport::sendReply(OpContext* context)
                         replyAddress, op);
 }
 
+/**
+ * Signal that a batch of outbound Messages should be sent as replies.
+ * Equivalent to calling sendReply() for each OpContext but hands the whole
+ * batch to the Sender at once.
+ *
+ * @param numOps
+ *      Number of OpContexts in the batch.
+ * @param contexts
+ *      OpContext of each ServerOp whose reply Message should be sent.
+ *
+ * @sa Homa::Core::Transport; no support for concurrent calls to same OpContext.
+ */
+void
+Transport::sendReplies(size_t numOps, OpContext* const contexts[])
+{
+    std::vector<Protocol::MessageId> ids;
+    std::vector<Driver::Address*> replyAddresses;
+    std::vector<Op*> ops;
+    ids.reserve(numOps);
+    replyAddresses.reserve(numOps);
+    ops.reserve(numOps);
+
+    for (size_t i = 0; i < numOps; ++i) {
+        Op* op = static_cast<Op*>(contexts[i]);
+        SpinLock::Lock lock_op(op->mutex);
+        assert(op->isServerOp);
+        Protocol::OpId opId(op->inMessage->getId());
+        ids.push_back({opId, Protocol::MessageId::ULTIMATE_RESPONSE_TAG});
+        replyAddresses.push_back(
+            driver->getAddress(&op->inMessage->get()
+                                    ->getHeader<Protocol::Message::Header>()
+                                    ->replyAddress));
+        ops.push_back(op);
+        op->state.store(OpContext::State::IN_PROGRESS);
+    }
+    sender->sendMessages(numOps, ids.data(), replyAddresses.data(), ops.data());
+}
+
 /// See Homa::Transport::poll()
 void
 Transport::poll()
@@ -270,6 +478,138 @@ Transport::poll()
     processInboundMessages();
     checkForUpdates();
     cleanupOps();
+
+    // Send the control packets generated above in a single burst.
+    controlQueue.flush();
+}
+
+/**
+ * Reset the Transport's eventfd so that it only becomes readable again once
+ * Op state changes after this call.  Threads that block on the eventfd should
+ * call this method, then check the state they are waiting on, and only then
+ * block; this ensures no state change is missed.
+ */
+void
+Transport::clearEvent()
+{
+    uint64_t count;
+    // Drain the eventfd before allowing it to be signaled again; a signal
+    // raced in between is redundant since the caller has yet to re-check.
+    ssize_t ret = read(eventFd, &count, sizeof(count));
+    (void)ret;
+    eventPending.store(false);
+}
+
+/**
+ * Block the calling thread until the Transport's eventfd is signaled or until
+ * the timeout expires.
+ *
+ * @param timeoutMs
+ *      Maximum time, in milliseconds, to block.
+ *
+ * @sa clearEvent()
+ */
+void
+Transport::waitForEvent(int timeoutMs)
+{
+    struct pollfd pfd = {eventFd, POLLIN, 0};
+    ::poll(&pfd, 1, timeoutMs);
+}
+
+/**
+ * Start background threads that drive the Transport by repeatedly calling
+ * poll() so that progress (e.g. grants and retransmissions) does not depend on
+ * application threads calling poll().  Any previously started polling threads
+ * are stopped first.
+ *
+ * @param cpus
+ *      One entry per polling thread to start: the CPU core to which the thread
+ *      should be pinned, or a negative value to leave the thread unpinned.
+ * @throw FatalError
+ *      A polling thread could not be pinned to its CPU core; no polling
+ *      threads will be running.
+ */
+void
+Transport::startPollingThreads(const std::vector<int>& cpus)
+{
+    stopPollingThreads();
+    for (int cpu : cpus) {
+        pollingThreads.emplace_back(&Transport::pollingThreadMain, this);
+        if (cpu < 0) {
+            continue;
+        }
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        int ret = pthread_setaffinity_np(pollingThreads.back().native_handle(),
+                                         sizeof(cpu_set_t), &cpuset);
+        if (ret != 0) {
+            stopPollingThreads();
+            throw FatalError(HERE_STR,
+                             "Unable to pin polling thread to CPU " +
+                                 std::to_string(cpu),
+                             ret);
+        }
+    }
+}
+
+/**
+ * Stop and join any background threads started by startPollingThreads().
+ */
+void
+Transport::stopPollingThreads()
+{
+    stopPolling.store(true);
+    for (std::thread& thread : pollingThreads) {
+        thread.join();
+    }
+    pollingThreads.clear();
+    stopPolling.store(false);
+}
+
+/**
+ * Return the estimated number of bytes waiting in the NIC's transmit queue;
+ * see Sender::getNicQueuedBytes().
+ */
+uint32_t
+Transport::getNicQueuedBytes()
+{
+    return sender->getNicQueuedBytes();
+}
+
+/**
+ * Return the number of granted packets held back by the Sender; see
+ * Sender::getNumReadyPackets().
+ */
+uint32_t
+Transport::getNumReadyPackets()
+{
+    return sender->getNumReadyPackets();
+}
+
+/**
+ * Main loop of each background polling thread.
+ */
+void
+Transport::pollingThreadMain()
+{
+    while (!stopPolling.load(std::memory_order_relaxed)) {
+        poll();
+    }
+}
+
+/**
+ * Signal the Transport's eventfd to wake any thread blocked waiting for Op
+ * state to change.
+ */
+void
+Transport::signalEvent()
+{
+    if (!eventPending.exchange(true)) {
+        uint64_t one = 1;
+        ssize_t ret = write(eventFd, &one, sizeof(one));
+        (void)ret;
+    }
 }
 
 /**
@@ -332,8 +672,7 @@ Transport::processInboundMessages()
             Op* op = nullptr;
             {
                 SpinLock::Lock lock(mutex);
-                op = opPool.construct(this, driver, true);
-                activeOps.insert(op);
+                op = opSlab.construct(this, driver, true);
             }
             receiver->registerOp(id, op);
         }
@@ -343,43 +682,63 @@ Transport::processInboundMessages()
 /**
  * Helper method to check on any updated Op objects and trigger any necessary
  * actions.
+ *
+ * At most MAX_HINTS_PER_CHECK hints are processed per call; any remaining
+ * hints are left for the next call.
  */
 void
 Transport::checkForUpdates()
 {
-    // Limit the number of hints to check this round.
-    uint hints = 0;
-    {
-        SpinLock::Lock lock(updateHints.mutex);
-        hints = updateHints.ops.size();
-        assert(updateHints.order.size() == hints);
+    // Skip checking if another poller is already working on it.
+    if (checkingForUpdates.test_and_set()) {
+        return;
     }
 
-    for (uint i = 0; i < hints; ++i) {
-        Op* op = nullptr;
-        // Take a hint.
+    // Limit the number of hints to check this round; processing an Op may
+    // hint it again and other pollers may keep adding hints.
+    uint32_t numHints = 0;
+    while (numHints < MAX_HINTS_PER_CHECK) {
+        Op* op = updateHints.pop();
+        if (op == nullptr) {
+            break;
+        }
+        ++numHints;
+        CompletionQueue* completionQueue = nullptr;
+        RemoteOp* remoteOp = nullptr;
         {
-            SpinLock::Lock lock(updateHints.mutex);
-            if (updateHints.order.empty()) {
-                break;
-            } else {
-                op = updateHints.order.front();
-                updateHints.order.pop_front();
-                updateHints.ops.erase(op);
+            // The hinted Op is still live; Op objects are not destroyed while
+            // they are in updateHints (see cleanupOps()).
+            SpinLock::Lock lock_op(op->mutex);
+
+            // Allow the Op to be hinted again before its updates are processed
+            // so that no update is missed.
+            op->hintQueued.store(false);
+
+            // Trigger any necessary actions.
+            if (op->processUpdates(lock_op)) {
+                completionQueue = op->completionQueue;
+                remoteOp = op->remoteOp;
+                op->completionQueue = nullptr;
+                if (completionQueue != nullptr) {
+                    // Published before the Op is unlocked; see detachOps().
+                    deliveringTo.store(completionQueue);
+                }
             }
         }
-        // Check that the hinted Op is still active.
-        SpinLock::UniqueLock lock(mutex);
-        if (activeOps.count(op) == 0) {
-            continue;
+
+        // Deliver outside the Op's lock so that a callback can access the
+        // RemoteOp.
+        if (completionQueue != nullptr) {
+            completionQueue->push(remoteOp);
+            deliveringTo.store(nullptr);
         }
+    }
 
-        // Lock handoff
-        SpinLock::Lock lock_op(op->mutex);
-        lock.unlock();
+    checkingForUpdates.clear();
 
-        // Trigger any necessary actions.
-        op->processUpdates(lock_op);
+    // Wake up any threads blocked waiting for the updates.
+    if (numHints > 0) {
+        signalEvent();
     }
 }
 
@@ -397,19 +756,19 @@ Transport::cleanupOps()
     }
 
     for (uint i = 0; i < count; ++i) {
-        Op* op = nullptr;
+        Slab<Op>::Handle handle;
         {
             SpinLock::Lock lock(unusedOps.mutex);
             if (unusedOps.queue.empty()) {
                 break;
             } else {
-                op = unusedOps.queue.front();
+                handle = unusedOps.queue.front();
                 unusedOps.queue.pop_front();
             }
         }
 
-        SpinLock::Lock lock(mutex);
-        if (activeOps.count(op) == 0) {
+        Op* op = opSlab.get(handle);
+        if (op == nullptr) {
             continue;
         }
 
@@ -419,8 +778,15 @@ Transport::cleanupOps()
         receiver->dropOp(op);
 
         op->mutex.lock();
-        activeOps.erase(op);
-        opPool.destroy(op);
+        if (op->hintQueued.load()) {
+            // The Op is still linked into updateHints; try again later.
+            op->mutex.unlock();
+            SpinLock::Lock lock_queue(unusedOps.mutex);
+            unusedOps.queue.push_back(handle);
+            continue;
+        }
+        SpinLock::Lock lock(mutex);
+        opSlab.destroy(op);
     }
 }
 
@@ -19,13 +19,16 @@
 #include <atomic>
 #include <bitset>
 #include <deque>
-#include <unordered_set>
+#include <thread>
 #include <vector>
 
+#include "CompletionQueue.h"
+#include "ControlPacket.h"
 #include "InboundMessage.h"
-#include "ObjectPool.h"
+#include "MpscQueue.h"
 #include "OpContext.h"
 #include "OutboundMessage.h"
+#include "Slab.h"
 #include "SpinLock.h"
 
 /**
@@ -66,6 +69,11 @@ class Transport {
             , retained(false)
             , isServerOp(isServerOp)
             , destroy()
+            , failed(false)
+            , completionQueue(nullptr)
+            , remoteOp(nullptr)
+            , hintNode(this)
+            , hintQueued(false)
         {}
 
         /**
@@ -94,13 +102,27 @@ class Transport {
          */
         inline void hintUpdate()
         {
-            SpinLock::Lock lock(transport->updateHints.mutex);
-            auto ret = transport->updateHints.ops.insert(this);
-            if (ret.second) {
-                transport->updateHints.order.push_back(this);
+            if (!hintQueued.exchange(true)) {
+                transport->updateHints.push(&hintNode);
             }
         }
 
+        /**
+         * Signal that one of this Op's messages has failed (e.g. timed out).
+         * The Transport decides what that means for the Op the next time it
+         * processes the Op's updates; see processUpdates().
+         *
+         * @param lock
+         *      Used to remind the caller to hold the Op's mutex while calling
+         *      this method.
+         */
+        inline void reportFailure(const SpinLock::Lock& lock)
+        {
+            (void)lock;
+            failed = true;
+            hintUpdate();
+        }
+
         /// Mutex for controlling internal access to Op members.
         SpinLock mutex;
 
@@ -125,11 +147,12 @@ class Transport {
             if (!destroy) {
                 destroy = true;
                 SpinLock::Lock lock(transport->unusedOps.mutex);
-                transport->unusedOps.queue.push_back(this);
+                transport->unusedOps.queue.push_back(
+                    Slab<Op>::getHandle(this));
             }
         }
 
-        void processUpdates(const SpinLock::Lock& lock);
+        bool processUpdates(const SpinLock::Lock& lock);
 
         /// True if this Op is being held by the application in a RemoteOp or a
         /// ServerOp; otherwise, false.
@@ -141,18 +164,76 @@ class Transport {
         /// True if this Op will be destroyed soon; false otherwise.
         bool destroy;
 
+        /// True if one of this Op's messages has failed; turned into the
+        /// FAILED state by processUpdates().  See reportFailure().
+        bool failed;
+
+        /// Queue to which the remoteOp should be delivered once this Op
+        /// finishes; nullptr if the application is not waiting on a queue or
+        /// if the remoteOp has already been delivered.
+        CompletionQueue* completionQueue;
+
+        /// The application's RemoteOp that holds this Op; only valid while
+        /// completionQueue is set.
+        RemoteOp* remoteOp;
+
+        /// Links this Op into the Transport's updateHints queue.
+        MpscQueue<Op>::Node hintNode;
+
+        /// True if this Op is in the Transport's updateHints queue; false
+        /// otherwise.  Prevents the Op from being queued more than once and
+        /// from being destroyed while queued.
+        std::atomic<bool> hintQueued;
+
         friend class Transport;
     };
 
-    explicit Transport(Driver* driver, uint64_t transportId);
+    explicit Transport(Driver* driver, uint64_t transportId,
+                       uint32_t overcommitmentDegree =
+                           Homa::Transport::DEFAULT_OVERCOMMITMENT_DEGREE);
 
     ~Transport();
     OpContext* allocOp();
     OpContext* receiveOp();
+    size_t receiveOps(OpContext* contexts[], size_t maxOps);
     void releaseOp(OpContext* context);
-    void sendRequest(OpContext* context, Driver::Address* destination);
+    void detachOps(size_t numOps, OpContext* const contexts[],
+                   CompletionQueue* completionQueue);
+    void sendRequest(OpContext* context, Driver::Address* destination,
+                     CompletionQueue* completionQueue = nullptr,
+                     RemoteOp* remoteOp = nullptr);
+    void sendRequests(size_t numOps, OpContext* const contexts[],
+                      Driver::Address* const destinations[],
+                      CompletionQueue* completionQueue,
+                      RemoteOp* const remoteOps[]);
     void sendReply(OpContext* context);
+    void sendReplies(size_t numOps, OpContext* const contexts[]);
     void poll();
+    void clearEvent();
+    void waitForEvent(int timeoutMs);
+    void startPollingThreads(const std::vector<int>& cpus);
+    void stopPollingThreads();
+    uint32_t getNicQueuedBytes();
+    uint32_t getNumReadyPackets();
+
+    /**
+     * Return the file descriptor of the eventfd which becomes readable when
+     * the state of some Op may have changed.
+     */
+    int getEventFd() const
+    {
+        return eventFd;
+    }
+
+    /// Maximum time, in milliseconds, that a blocked waiter sleeps before
+    /// polling the Transport itself; bounds the delay when no other thread is
+    /// polling the Transport.
+    static const int EVENT_WAIT_TIMEOUT_MS = 1;
+
+    /// Maximum number of update hints a single call to checkForUpdates()
+    /// processes; bounds the time a poller spends there while other pollers
+    /// keep adding hints.
+    static const uint32_t MAX_HINTS_PER_CHECK = 256;
 
     /// Driver from which this transport will send and receive packets.
     Driver* const driver;
@@ -162,6 +243,8 @@ class Transport {
     void processInboundMessages();
     void checkForUpdates();
     void cleanupOps();
+    void signalEvent();
+    void pollingThreadMain();
 
     /// Unique identifier for this transport.
     const std::atomic<uint64_t> transportId;
@@ -169,6 +252,9 @@ class Transport {
     /// Unique identifier for the next RemoteOp this transport sends.
     std::atomic<uint64_t> nextOpSequenceNumber;
 
+    /// Collects the control packets sent during each call to poll().
+    ControlPacket::Queue controlQueue;
+
     /// Module which controls the sending of message.
     std::unique_ptr<Core::Sender> sender;
 
@@ -178,30 +264,48 @@ class Transport {
     /// Protects the internal state of the Transport.
     SpinLock mutex;
 
-    /// Pool from which this transport will allocate Op objects.
-    ObjectPool<Op> opPool;
+    /// Holds the Op objects that are currently being managed by this
+    /// Transport.  Protected by the Transport's mutex, except for liveness
+    /// checks which need no lock.
+    Slab<Op> opSlab;
 
-    /// Set of Op objects are currently being managed by this Transport.
-    std::unordered_set<Op*> activeOps;
+    /// Op objects that may have been recently updated, in the order in which
+    /// they were (possibly) updated.  Used to ensure Op object processing is
+    /// not starved.
+    MpscQueue<Op> updateHints;
 
-    /// Collection of Op objects that may have been recently updated.
-    struct {
-        /// Protects updateHints.
-        SpinLock mutex;
-        /// Set of Op objects that might have been updated.
-        std::unordered_set<Op*> ops;
-        /// The order in which Op objects were (possibly) updated.  Used to
-        /// ensure Op object processing is not starved.
-        std::deque<Op*> order;
-    } updateHints;
+    /// True if a poller is executing checkForUpdates(); false, otherwise.
+    /// Ensures that updateHints has a single consumer.
+    std::atomic_flag checkingForUpdates = ATOMIC_FLAG_INIT;
+
+    /// CompletionQueue into which checkForUpdates() is currently delivering a
+    /// RemoteOp outside the Op's lock; nullptr if none.  Lets detachOps()
+    /// wait until the queue is no longer in use.
+    std::atomic<CompletionQueue*> deliveringTo;
+
+    /// Linux eventfd signaled whenever Op state may have changed so that
+    /// threads can block instead of spinning on poll().
+    const int eventFd;
+
+    /// True if eventFd has been signaled since it was last cleared; false,
+    /// otherwise.  Limits the number of writes to eventFd to one per
+    /// clearEvent() so that pollers rarely make system calls.
+    std::atomic<bool> eventPending;
+
+    /// Background threads that drive the Transport by calling poll(); empty
+    /// unless startPollingThreads() has been called.
+    std::vector<std::thread> pollingThreads;
+
+    /// True if the pollingThreads should exit; false, otherwise.
+    std::atomic<bool> stopPolling;
 
     /// Colletion of Op objects that are waiting to be destructed.  Allow the
     /// Op the asynchronously request its own destruction.
     struct {
         /// Protects unusedOps.
         SpinLock mutex;
-        /// Holds the Op objects that should be eventually freed.
-        std::deque<Op*> queue;
+        /// Refers to the Op objects that should be eventually freed.
+        std::deque<Slab<Op>::Handle> queue;
     } unusedOps;
 
     /// Collection of ServerOp contexts that are ready but have not yet been
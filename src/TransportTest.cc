@@ -17,11 +17,20 @@
 
 #include "Transport.h"
 
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
 #include "Mock/MockDriver.h"
 #include "Mock/MockReceiver.h"
 #include "Mock/MockSender.h"
 
 #include <Homa/Debug.h>
+#include <Homa/Exception.h>
 
 namespace Homa {
 namespace Core {
@@ -57,6 +66,8 @@ class TransportTest : public ::testing::Test {
 
     ~TransportTest()
     {
+        // Ops still in the slab release their packets on teardown.
+        Mock::VerifyAndClearExpectations(&mockDriver);
         delete transport;
         Debug::setLogPolicy(savedLogPolicy);
     }
@@ -70,27 +81,24 @@ class TransportTest : public ::testing::Test {
 
 TEST_F(TransportTest, Op_hintUpdate)
 {
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
 
-    EXPECT_EQ(0U, transport->updateHints.ops.count(op));
-    EXPECT_TRUE(transport->updateHints.order.empty());
+    EXPECT_FALSE(op->hintQueued);
 
     op->hintUpdate();
 
-    EXPECT_EQ(1U, transport->updateHints.ops.count(op));
-    EXPECT_EQ(1U, transport->updateHints.order.size());
-    EXPECT_EQ(op, transport->updateHints.order.front());
+    EXPECT_TRUE(op->hintQueued);
 
     op->hintUpdate();
 
-    EXPECT_EQ(1U, transport->updateHints.ops.count(op));
-    EXPECT_EQ(1U, transport->updateHints.order.size());
-    EXPECT_EQ(op, transport->updateHints.order.front());
+    EXPECT_TRUE(op->hintQueued);
+    EXPECT_EQ(op, transport->updateHints.pop());
+    EXPECT_EQ(nullptr, transport->updateHints.pop());
 }
 
 TEST_F(TransportTest, Op_drop)
 {
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
 
     EXPECT_FALSE(op->destroy);
     EXPECT_TRUE(transport->unusedOps.queue.empty());
@@ -102,7 +110,7 @@ TEST_F(TransportTest, Op_drop)
 
     EXPECT_TRUE(op->destroy);
     EXPECT_EQ(1U, transport->unusedOps.queue.size());
-    EXPECT_EQ(op, transport->unusedOps.queue.front());
+    EXPECT_EQ(op, transport->opSlab.get(transport->unusedOps.queue.front()));
     transport->unusedOps.queue.pop_front();
 
     {
@@ -116,7 +124,7 @@ TEST_F(TransportTest, Op_drop)
 
 TEST_F(TransportTest, Op_processUpdates_destroy)
 {
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     op->state.store(OpContext::State::IN_PROGRESS);
     op->destroy = true;
 
@@ -130,7 +138,7 @@ TEST_F(TransportTest, Op_processUpdates_destroy)
 TEST_F(TransportTest, Op_processUpdates_ServerOp_NOT_STARTED)
 {
     Transport::Op* op =
-        transport->opPool.construct(transport, &mockDriver, true);
+        transport->opSlab.construct(transport, &mockDriver, true);
     InboundMessage inMessage;
     inMessage.message.construct(&mockDriver, 0, 0);
     op->inMessage = &inMessage;
@@ -151,9 +159,17 @@ TEST_F(TransportTest, Op_processUpdates_ServerOp_NOT_STARTED)
 
     inMessage.fullMessageReceived = true;
 
-    char payload[1028];
+    char payload[1030];
+    char outPayload[1030];
     NiceMock<Homa::Mock::MockDriver::MockPacket> mockPacket(payload);
-    EXPECT_CALL(mockDriver, allocPacket()).WillOnce(Return(&mockPacket));
+    NiceMock<Homa::Mock::MockDriver::MockPacket> outPacket(outPayload);
+    EXPECT_CALL(mockDriver, allocPacket())
+        .WillOnce(Return(&mockPacket))
+        .WillOnce(Return(&outPacket));
+    Driver::Address::Raw rawAddress;
+    rawAddress.bytes[0] = 22;
+    reinterpret_cast<Protocol::Message::Header*>(payload)->replyAddress =
+        rawAddress;
     {
         SpinLock::Lock lock(op->mutex);
         op->processUpdates(lock);
@@ -162,6 +178,11 @@ TEST_F(TransportTest, Op_processUpdates_ServerOp_NOT_STARTED)
     EXPECT_EQ(OpContext::State::IN_PROGRESS, op->state.load());
     EXPECT_EQ(sizeof(Protocol::Message::Header),
               op->inMessage->get()->MESSAGE_HEADER_LENGTH);
+    EXPECT_EQ(sizeof(Protocol::Message::Header),
+              op->outMessage.message.rawLength());
+    EXPECT_EQ(rawAddress.bytes[0], op->outMessage.get()
+                                       ->getHeader<Protocol::Message::Header>()
+                                       ->replyAddress.bytes[0]);
     EXPECT_EQ(1U, transport->pendingServerOps.queue.size());
     EXPECT_EQ(op, transport->pendingServerOps.queue.front());
     EXPECT_FALSE(op->destroy);
@@ -170,10 +191,10 @@ TEST_F(TransportTest, Op_processUpdates_ServerOp_NOT_STARTED)
 TEST_F(TransportTest, Op_processUpdates_ServerOp_IN_PROGRESS_notDone)
 {
     Transport::Op* op =
-        transport->opPool.construct(transport, &mockDriver, true);
+        transport->opSlab.construct(transport, &mockDriver, true);
     op->state.store(OpContext::State::IN_PROGRESS);
     EXPECT_FALSE(op->outMessage.isDone());
-    EXPECT_EQ(0U, transport->updateHints.ops.count(op));
+    EXPECT_FALSE(op->hintQueued);
 
     {
         SpinLock::Lock lock(op->mutex);
@@ -181,21 +202,21 @@ TEST_F(TransportTest, Op_processUpdates_ServerOp_IN_PROGRESS_notDone)
     }
 
     EXPECT_EQ(OpContext::State::IN_PROGRESS, op->state.load());
-    EXPECT_EQ(0U, transport->updateHints.ops.count(op));
+    EXPECT_FALSE(op->hintQueued);
     EXPECT_FALSE(op->destroy);
 }
 
 TEST_F(TransportTest, Op_processUpdates_ServerOp_IN_PROGRESS_done_noSendDone)
 {
     Transport::Op* op =
-        transport->opPool.construct(transport, &mockDriver, true);
+        transport->opSlab.construct(transport, &mockDriver, true);
     op->state.store(OpContext::State::IN_PROGRESS);
     op->outMessage.sent = true;
     InboundMessage inMessage;
     op->inMessage = &inMessage;
     inMessage.id.tag = Protocol::MessageId::INITIAL_REQUEST_TAG;
     EXPECT_TRUE(op->outMessage.isDone());
-    EXPECT_EQ(0U, transport->updateHints.ops.count(op));
+    EXPECT_FALSE(op->hintQueued);
 
     {
         SpinLock::Lock lock(op->mutex);
@@ -203,23 +224,23 @@ TEST_F(TransportTest, Op_processUpdates_ServerOp_IN_PROGRESS_done_noSendDone)
     }
 
     EXPECT_EQ(OpContext::State::COMPLETED, op->state.load());
-    EXPECT_EQ(1U, transport->updateHints.ops.count(op));
+    EXPECT_TRUE(op->hintQueued);
     EXPECT_FALSE(op->destroy);
 }
 
 TEST_F(TransportTest, Op_processUpdates_ServerOp_IN_PROGRESS_done_sendDone)
 {
     Transport::Op* op =
-        transport->opPool.construct(transport, &mockDriver, true);
+        transport->opSlab.construct(transport, &mockDriver, true);
     op->state.store(OpContext::State::IN_PROGRESS);
     op->outMessage.sent = true;
     InboundMessage inMessage;
     op->inMessage = &inMessage;
     inMessage.id.tag = Protocol::MessageId::INITIAL_REQUEST_TAG + 1;
     EXPECT_TRUE(op->outMessage.isDone());
-    EXPECT_EQ(0U, transport->updateHints.ops.count(op));
+    EXPECT_FALSE(op->hintQueued);
 
-    char payload[1028];
+    char payload[1030];
     NiceMock<Homa::Mock::MockDriver::MockPacket> mockPacket(payload);
     EXPECT_CALL(mockDriver, allocPacket()).WillOnce(Return(&mockPacket));
     EXPECT_CALL(mockDriver, sendPackets(Pointee(&mockPacket), Eq(1))).Times(1);
@@ -229,16 +250,17 @@ TEST_F(TransportTest, Op_processUpdates_ServerOp_IN_PROGRESS_done_sendDone)
         SpinLock::Lock lock(op->mutex);
         op->processUpdates(lock);
     }
+    transport->controlQueue.flush();
 
     EXPECT_EQ(OpContext::State::COMPLETED, op->state.load());
-    EXPECT_EQ(1U, transport->updateHints.ops.count(op));
+    EXPECT_TRUE(op->hintQueued);
     EXPECT_FALSE(op->destroy);
 }
 
 TEST_F(TransportTest, Op_processUpdates_ServerOp_COMPLETED)
 {
     Transport::Op* op =
-        transport->opPool.construct(transport, &mockDriver, true);
+        transport->opSlab.construct(transport, &mockDriver, true);
     op->state.store(OpContext::State::COMPLETED);
     op->retained = true;
     EXPECT_FALSE(op->destroy);
@@ -265,7 +287,7 @@ TEST_F(TransportTest, Op_processUpdates_ServerOp_COMPLETED)
 TEST_F(TransportTest, Op_processUpdates_ServerOp_FAILED)
 {
     Transport::Op* op =
-        transport->opPool.construct(transport, &mockDriver, true);
+        transport->opSlab.construct(transport, &mockDriver, true);
     op->state.store(OpContext::State::FAILED);
     op->retained = true;
     EXPECT_FALSE(op->destroy);
@@ -289,10 +311,45 @@ TEST_F(TransportTest, Op_processUpdates_ServerOp_FAILED)
     EXPECT_TRUE(op->destroy);
 }
 
+TEST_F(TransportTest, Op_processUpdates_ServerOp_failed)
+{
+    Transport::Op* op =
+        transport->opSlab.construct(transport, &mockDriver, true);
+    op->state.store(OpContext::State::IN_PROGRESS);
+    op->retained = true;
+    op->failed = true;
+
+    {
+        SpinLock::Lock lock(op->mutex);
+        op->processUpdates(lock);
+    }
+
+    EXPECT_EQ(OpContext::State::FAILED, op->state.load());
+    EXPECT_FALSE(op->destroy);
+}
+
+TEST_F(TransportTest, Op_processUpdates_ServerOp_failed_NOT_STARTED)
+{
+    Transport::Op* op =
+        transport->opSlab.construct(transport, &mockDriver, true);
+    op->failed = true;
+    EXPECT_EQ(OpContext::State::NOT_STARTED, op->state.load());
+
+    {
+        SpinLock::Lock lock(op->mutex);
+        EXPECT_FALSE(op->processUpdates(lock));
+    }
+
+    // Never seen by the application; just dropped.
+    EXPECT_EQ(OpContext::State::NOT_STARTED, op->state.load());
+    EXPECT_TRUE(op->destroy);
+    EXPECT_TRUE(transport->pendingServerOps.queue.empty());
+}
+
 TEST_F(TransportTest, Op_processUpdates_RemoteOp_not_retained)
 {
     Transport::Op* op =
-        transport->opPool.construct(transport, &mockDriver, false);
+        transport->opSlab.construct(transport, &mockDriver, false);
     op->retained = true;
     EXPECT_FALSE(op->destroy);
 
@@ -316,7 +373,7 @@ TEST_F(TransportTest, Op_processUpdates_RemoteOp_not_retained)
 TEST_F(TransportTest, Op_processUpdates_RemoteOp_NOT_STARTED)
 {
     Transport::Op* op =
-        transport->opPool.construct(transport, &mockDriver, false);
+        transport->opSlab.construct(transport, &mockDriver, false);
     op->state.store(OpContext::State::NOT_STARTED);
     op->retained = true;
 
@@ -332,7 +389,7 @@ TEST_F(TransportTest, Op_processUpdates_RemoteOp_NOT_STARTED)
 TEST_F(TransportTest, Op_processUpdates_RemoteOp_IN_PROGRESS)
 {
     Transport::Op* op =
-        transport->opPool.construct(transport, &mockDriver, false);
+        transport->opSlab.construct(transport, &mockDriver, false);
     InboundMessage inMessage;
     inMessage.message.construct(&mockDriver, 0, 0);
     op->inMessage = &inMessage;
@@ -340,7 +397,7 @@ TEST_F(TransportTest, Op_processUpdates_RemoteOp_IN_PROGRESS)
     op->retained = true;
     EXPECT_FALSE(op->inMessage->isReady());
     EXPECT_EQ(0U, op->inMessage->get()->MESSAGE_HEADER_LENGTH);
-    EXPECT_EQ(0U, transport->updateHints.ops.count(op));
+    EXPECT_FALSE(op->hintQueued);
 
     {
         SpinLock::Lock lock(op->mutex);
@@ -349,12 +406,12 @@ TEST_F(TransportTest, Op_processUpdates_RemoteOp_IN_PROGRESS)
 
     EXPECT_EQ(OpContext::State::IN_PROGRESS, op->state.load());
     EXPECT_EQ(0U, op->inMessage->get()->MESSAGE_HEADER_LENGTH);
-    EXPECT_EQ(0U, transport->updateHints.ops.count(op));
+    EXPECT_FALSE(op->hintQueued);
     EXPECT_FALSE(op->destroy);
 
     inMessage.fullMessageReceived = true;
 
-    char payload[1028];
+    char payload[1030];
     NiceMock<Homa::Mock::MockDriver::MockPacket> mockPacket(payload);
     EXPECT_CALL(mockDriver, allocPacket()).WillOnce(Return(&mockPacket));
     {
@@ -365,14 +422,14 @@ TEST_F(TransportTest, Op_processUpdates_RemoteOp_IN_PROGRESS)
     EXPECT_EQ(OpContext::State::COMPLETED, op->state.load());
     EXPECT_EQ(sizeof(Protocol::Message::Header),
               op->inMessage->get()->MESSAGE_HEADER_LENGTH);
-    EXPECT_EQ(1U, transport->updateHints.ops.count(op));
+    EXPECT_TRUE(op->hintQueued);
     EXPECT_FALSE(op->destroy);
 }
 
 TEST_F(TransportTest, Op_processUpdates_RemoteOp_COMPLETED)
 {
     Transport::Op* op =
-        transport->opPool.construct(transport, &mockDriver, false);
+        transport->opSlab.construct(transport, &mockDriver, false);
     op->state.store(OpContext::State::COMPLETED);
     op->retained = true;
 
@@ -388,7 +445,7 @@ TEST_F(TransportTest, Op_processUpdates_RemoteOp_COMPLETED)
 TEST_F(TransportTest, Op_processUpdates_RemoteOp_FAILED)
 {
     Transport::Op* op =
-        transport->opPool.construct(transport, &mockDriver, false);
+        transport->opSlab.construct(transport, &mockDriver, false);
     op->state.store(OpContext::State::FAILED);
     op->retained = true;
 
@@ -401,14 +458,96 @@ TEST_F(TransportTest, Op_processUpdates_RemoteOp_FAILED)
     EXPECT_FALSE(op->destroy);
 }
 
+TEST_F(TransportTest, Op_processUpdates_RemoteOp_failed)
+{
+    Transport::Op* op =
+        transport->opSlab.construct(transport, &mockDriver, false);
+    op->state.store(OpContext::State::IN_PROGRESS);
+    op->retained = true;
+    op->failed = true;
+
+    {
+        SpinLock::Lock lock(op->mutex);
+        op->processUpdates(lock);
+    }
+
+    EXPECT_EQ(OpContext::State::FAILED, op->state.load());
+    EXPECT_FALSE(op->destroy);
+
+    // A failure reported after the Op completed is ignored.
+    op->state.store(OpContext::State::COMPLETED);
+
+    {
+        SpinLock::Lock lock(op->mutex);
+        op->processUpdates(lock);
+    }
+
+    EXPECT_EQ(OpContext::State::COMPLETED, op->state.load());
+}
+
+TEST_F(TransportTest, Op_processUpdates_completionQueue)
+{
+    Transport::Op* op =
+        transport->opSlab.construct(transport, &mockDriver, false);
+    CompletionQueue completionQueue((Homa::CompletionQueue::Callback()));
+    op->retained = true;
+    op->state.store(OpContext::State::COMPLETED);
+
+    {
+        // No completion queue.
+        SpinLock::Lock lock(op->mutex);
+        EXPECT_FALSE(op->processUpdates(lock));
+    }
+
+    op->completionQueue = &completionQueue;
+    op->state.store(OpContext::State::IN_PROGRESS);
+    InboundMessage inMessage;
+    inMessage.message.construct(&mockDriver, 0, 0);
+    op->inMessage = &inMessage;
+
+    {
+        // Not finished.
+        SpinLock::Lock lock(op->mutex);
+        EXPECT_FALSE(op->processUpdates(lock));
+    }
+
+    op->state.store(OpContext::State::COMPLETED);
+    {
+        SpinLock::Lock lock(op->mutex);
+        EXPECT_TRUE(op->processUpdates(lock));
+    }
+
+    op->state.store(OpContext::State::FAILED);
+    {
+        SpinLock::Lock lock(op->mutex);
+        EXPECT_TRUE(op->processUpdates(lock));
+    }
+
+    op->retained = false;
+    {
+        // Released by the application.
+        SpinLock::Lock lock(op->mutex);
+        EXPECT_FALSE(op->processUpdates(lock));
+    }
+    EXPECT_TRUE(op->destroy);
+}
+
+TEST_F(TransportTest, constructor)
+{
+    Transport defaultTransport(&mockDriver, 23);
+    EXPECT_EQ(4U, defaultTransport.receiver->overcommitmentDegree);
+
+    Transport customTransport(&mockDriver, 24, 8);
+    EXPECT_EQ(8U, customTransport.receiver->overcommitmentDegree);
+}
+
 TEST_F(TransportTest, allocOp)
 {
     char payload[1024];
     Homa::Mock::MockDriver::MockPacket packet(payload);
     Homa::Mock::MockDriver::MockAddress mockAddress;
 
-    EXPECT_EQ(0U, transport->opPool.outstandingObjects);
-    EXPECT_TRUE(transport->activeOps.empty());
+    EXPECT_EQ(0U, transport->opSlab.getNumLive());
 
     EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&packet));
     EXPECT_CALL(mockDriver, getLocalAddress).WillOnce(Return(&mockAddress));
@@ -417,8 +556,7 @@ TEST_F(TransportTest, allocOp)
     OpContext* context = transport->allocOp();
 
     Transport::Op* op = static_cast<Transport::Op*>(context);
-    EXPECT_EQ(1U, transport->opPool.outstandingObjects);
-    EXPECT_EQ(1U, transport->activeOps.count(op));
+    EXPECT_EQ(1U, transport->opSlab.getNumLive());
     EXPECT_EQ(sizeof(Protocol::Message::Header),
               op->outMessage.message.rawLength());
     EXPECT_TRUE(op->retained.load());
@@ -426,43 +564,43 @@ TEST_F(TransportTest, allocOp)
 
 TEST_F(TransportTest, receiveOp)
 {
-    char payload0[1024];
-    char payload1[1024];
-    Homa::Mock::MockDriver::MockPacket packet0(payload0);
-    Homa::Mock::MockDriver::MockPacket packet1(payload1);
-    Driver::Address::Raw rawAddress;
-    rawAddress.bytes[0] = 22;
-
     Transport::Op* serverOp =
-        transport->opPool.construct(transport, &mockDriver, true);
-
-    InboundMessage inMessage;
-    inMessage.message.construct(transport->driver,
-                                sizeof(Protocol::Packet::DataHeader), 0);
-    inMessage.message->setPacket(0, &packet0);
-    Protocol::Message::Header* header =
-        inMessage.message->defineHeader<Protocol::Message::Header>();
-    header->replyAddress = rawAddress;
-    serverOp->inMessage = &inMessage;
-
+        transport->opSlab.construct(transport, &mockDriver, true);
     transport->pendingServerOps.queue.push_back(serverOp);
-    EXPECT_EQ(OpContext::State::NOT_STARTED, serverOp->state.load());
     EXPECT_EQ(1U, transport->pendingServerOps.queue.size());
 
-    EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&packet1));
+    // The response was prepared when the Op was queued.
+    EXPECT_CALL(mockDriver, allocPacket).Times(0);
 
     OpContext* context = transport->receiveOp();
 
     Transport::Op* op = static_cast<Transport::Op*>(context);
     EXPECT_EQ(serverOp, op);
-    EXPECT_EQ(sizeof(Protocol::Message::Header),
-              op->outMessage.message.rawLength());
-    EXPECT_TRUE(transport->pendingServerOps.queue.empty());
-    EXPECT_EQ(rawAddress.bytes[0], op->outMessage.get()
-                                       ->getHeader<Protocol::Message::Header>()
-                                       ->replyAddress.bytes[0]);
     EXPECT_TRUE(op->retained.load());
-    EXPECT_EQ(0U, transport->pendingServerOps.queue.size());
+    EXPECT_TRUE(transport->pendingServerOps.queue.empty());
+}
+
+TEST_F(TransportTest, receiveOps)
+{
+    Transport::Op* serverOps[3];
+    for (int i = 0; i < 3; ++i) {
+        serverOps[i] = transport->opSlab.construct(transport, &mockDriver, true);
+        transport->pendingServerOps.queue.push_back(serverOps[i]);
+    }
+
+    OpContext* contexts[2];
+    EXPECT_EQ(2U, transport->receiveOps(contexts, 2));
+
+    EXPECT_EQ(serverOps[0], contexts[0]);
+    EXPECT_EQ(serverOps[1], contexts[1]);
+    EXPECT_TRUE(serverOps[0]->retained.load());
+    EXPECT_TRUE(serverOps[1]->retained.load());
+    EXPECT_FALSE(serverOps[2]->retained.load());
+    EXPECT_EQ(1U, transport->pendingServerOps.queue.size());
+
+    EXPECT_EQ(1U, transport->receiveOps(contexts, 2));
+    EXPECT_EQ(serverOps[2], contexts[0]);
+    EXPECT_EQ(0U, transport->receiveOps(contexts, 2));
 }
 
 TEST_F(TransportTest, receiveOp_empty)
@@ -479,20 +617,72 @@ TEST_F(TransportTest, receiveOp_empty)
 TEST_F(TransportTest, releaseOp)
 {
     Transport::Op* op =
-        transport->opPool.construct(transport, &mockDriver, false);
+        transport->opSlab.construct(transport, &mockDriver, false);
     op->retained.store(true);
-    EXPECT_EQ(0U, transport->updateHints.ops.count(op));
+    EXPECT_FALSE(op->hintQueued);
+
+    CompletionQueue completionQueue((Homa::CompletionQueue::Callback()));
+    op->completionQueue = &completionQueue;
 
     transport->releaseOp(op);
 
     EXPECT_FALSE(op->retained.load());
-    EXPECT_EQ(1U, transport->updateHints.ops.count(op));
+    EXPECT_TRUE(op->hintQueued);
+    EXPECT_EQ(nullptr, op->completionQueue);
+}
+
+TEST_F(TransportTest, releaseOp_hintPending)
+{
+    Transport::Op* op =
+        transport->opSlab.construct(transport, &mockDriver, false);
+    op->retained.store(true);
+    op->hintUpdate();
+
+    // The Op is not touched until its lock is free.
+    op->mutex.lock();
+    std::thread releaser([this, op] { transport->releaseOp(op); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    EXPECT_TRUE(op->retained.load());
+    op->mutex.unlock();
+    releaser.join();
+    EXPECT_FALSE(op->retained.load());
+
+    // The pending hint drops the Op, which can then be destroyed without
+    // leaving a stale hint behind.
+    transport->checkForUpdates();
+    transport->cleanupOps();
+
+    EXPECT_EQ(0U, transport->opSlab.getNumLive());
+    EXPECT_EQ(nullptr, transport->updateHints.pop());
+}
+
+TEST_F(TransportTest, detachOps)
+{
+    Transport::Op* op0 =
+        transport->opSlab.construct(transport, &mockDriver, false);
+    Transport::Op* op1 =
+        transport->opSlab.construct(transport, &mockDriver, false);
+    CompletionQueue completionQueue((Homa::CompletionQueue::Callback()));
+    CompletionQueue otherQueue((Homa::CompletionQueue::Callback()));
+    op0->completionQueue = &completionQueue;
+    op0->remoteOp = (RemoteOp*)22;
+    op1->completionQueue = &otherQueue;
+    op1->remoteOp = (RemoteOp*)23;
+    OpContext* contexts[] = {op0, op1};
+
+    transport->detachOps(2, contexts, &completionQueue);
+
+    EXPECT_EQ(nullptr, op0->completionQueue);
+    EXPECT_EQ(nullptr, op0->remoteOp);
+    // Only Ops sent with the given queue are detached.
+    EXPECT_EQ(&otherQueue, op1->completionQueue);
+    EXPECT_EQ((RemoteOp*)23, op1->remoteOp);
 }
 
 TEST_F(TransportTest, sendRequest_ServerOp)
 {
     Transport::Op* op =
-        transport->opPool.construct(transport, &mockDriver, true);
+        transport->opSlab.construct(transport, &mockDriver, true);
     InboundMessage message;
     Protocol::MessageId expectedId = {transport->transportId, 42, 3};
     op->inMessage = &message;
@@ -509,7 +699,7 @@ TEST_F(TransportTest, sendRequest_ServerOp)
 TEST_F(TransportTest, sendRequest_RemoteOp)
 {
     Transport::Op* op =
-        transport->opPool.construct(transport, &mockDriver, false);
+        transport->opSlab.construct(transport, &mockDriver, false);
 
     Protocol::OpId expectedOpId = {transport->transportId,
                                    transport->nextOpSequenceNumber};
@@ -526,9 +716,60 @@ TEST_F(TransportTest, sendRequest_RemoteOp)
                                 Protocol::MessageId::INITIAL_REQUEST_TAG)),
                             Eq(destination), Eq(op), Eq(true)));
 
-    transport->sendRequest(op, destination);
+    CompletionQueue completionQueue((Homa::CompletionQueue::Callback()));
+    RemoteOp* remoteOp = (RemoteOp*)42;
+
+    transport->sendRequest(op, destination, &completionQueue, remoteOp);
 
     EXPECT_EQ(OpContext::State::IN_PROGRESS, op->state.load());
+    EXPECT_EQ(&completionQueue, op->completionQueue);
+    EXPECT_EQ(remoteOp, op->remoteOp);
+}
+
+TEST_F(TransportTest, sendRequests)
+{
+    Transport::Op* ops[2];
+    OpContext* contexts[2];
+    for (int i = 0; i < 2; ++i) {
+        ops[i] = transport->opSlab.construct(transport, &mockDriver, false);
+        contexts[i] = ops[i];
+    }
+    Driver::Address* destinations[2] = {(Driver::Address*)22,
+                                        (Driver::Address*)23};
+    RemoteOp* remoteOps[2] = {(RemoteOp*)42, (RemoteOp*)43};
+    CompletionQueue completionQueue((Homa::CompletionQueue::Callback()));
+    uint64_t sequence = transport->nextOpSequenceNumber;
+
+    for (uint64_t i = 0; i < 2; ++i) {
+        EXPECT_CALL(*mockReceiver,
+                    registerOp(Eq(Protocol::MessageId(
+                                   {transport->transportId, sequence + i},
+                                   Protocol::MessageId::ULTIMATE_RESPONSE_TAG)),
+                               Eq(ops[i])));
+    }
+    EXPECT_CALL(*mockSender,
+                sendMessages(Eq(2U), _, Eq(destinations), _, Eq(true)))
+        .WillOnce([&](size_t, const Protocol::MessageId ids[],
+                      Driver::Address* const[], Transport::Op* const sent[],
+                      bool) {
+            for (uint64_t i = 0; i < 2; ++i) {
+                EXPECT_EQ(Protocol::MessageId(
+                              {transport->transportId, sequence + i},
+                              Protocol::MessageId::INITIAL_REQUEST_TAG),
+                          ids[i]);
+                EXPECT_EQ(ops[i], sent[i]);
+            }
+        });
+
+    transport->sendRequests(2, contexts, destinations, &completionQueue,
+                            remoteOps);
+
+    EXPECT_EQ(sequence + 2, transport->nextOpSequenceNumber);
+    for (int i = 0; i < 2; ++i) {
+        EXPECT_EQ(OpContext::State::IN_PROGRESS, ops[i]->state.load());
+        EXPECT_EQ(&completionQueue, ops[i]->completionQueue);
+        EXPECT_EQ(remoteOps[i], ops[i]->remoteOp);
+    }
 }
 
 TEST_F(TransportTest, sendReply)
@@ -537,7 +778,7 @@ TEST_F(TransportTest, sendReply)
     Homa::Mock::MockDriver::MockPacket packet(payload);
     Driver::Address* replyAddress = (Driver::Address*)22;
     Transport::Op* op =
-        transport->opPool.construct(transport, &mockDriver, true);
+        transport->opSlab.construct(transport, &mockDriver, true);
     Protocol::OpId expectedOpId = {42, 32};
     InboundMessage message;
     message.id = Protocol::MessageId(expectedOpId, 2);
@@ -562,6 +803,53 @@ TEST_F(TransportTest, sendReply)
     EXPECT_EQ(OpContext::State::IN_PROGRESS, op->state.load());
 }
 
+TEST_F(TransportTest, sendReplies)
+{
+    char payload[2][1024];
+    Homa::Mock::MockDriver::MockPacket packet0(payload[0]);
+    Homa::Mock::MockDriver::MockPacket packet1(payload[1]);
+    Homa::Mock::MockDriver::MockPacket* packets[2] = {&packet0, &packet1};
+    Driver::Address* replyAddresses[2] = {(Driver::Address*)22,
+                                          (Driver::Address*)23};
+    Transport::Op* ops[2];
+    OpContext* contexts[2];
+    InboundMessage messages[2];
+    for (int i = 0; i < 2; ++i) {
+        ops[i] = transport->opSlab.construct(transport, &mockDriver, true);
+        contexts[i] = ops[i];
+        messages[i].id = Protocol::MessageId({42, uint64_t(32 + i)}, 2);
+        messages[i].message.construct(transport->driver,
+                                      sizeof(Protocol::Packet::DataHeader), 0);
+        messages[i].message->setPacket(0, packets[i]);
+        Protocol::Message::Header* header =
+            messages[i].message->defineHeader<Protocol::Message::Header>();
+        ops[i]->inMessage = &messages[i];
+        EXPECT_CALL(mockDriver,
+                    getAddress(Matcher<Driver::Address::Raw const*>(
+                        Eq(&header->replyAddress))))
+            .WillOnce(Return(replyAddresses[i]));
+    }
+
+    EXPECT_CALL(*mockSender, sendMessages(Eq(2U), _, _, _, Eq(false)))
+        .WillOnce([&](size_t, const Protocol::MessageId ids[],
+                      Driver::Address* const destinations[],
+                      Transport::Op* const sent[], bool) {
+            for (int i = 0; i < 2; ++i) {
+                EXPECT_EQ(Protocol::MessageId(
+                              {42, uint64_t(32 + i)},
+                              Protocol::MessageId::ULTIMATE_RESPONSE_TAG),
+                          ids[i]);
+                EXPECT_EQ(replyAddresses[i], destinations[i]);
+                EXPECT_EQ(ops[i], sent[i]);
+            }
+        });
+
+    transport->sendReplies(2, contexts);
+
+    EXPECT_EQ(OpContext::State::IN_PROGRESS, ops[0]->state.load());
+    EXPECT_EQ(OpContext::State::IN_PROGRESS, ops[1]->state.load());
+}
+
 TEST_F(TransportTest, poll)
 {
     EXPECT_CALL(mockDriver, receivePackets).WillOnce(Return(0));
@@ -569,9 +857,111 @@ TEST_F(TransportTest, poll)
     EXPECT_CALL(*mockReceiver, poll);
     EXPECT_CALL(*mockReceiver, receiveMessage).WillOnce(Return(nullptr));
 
+    // Queued control packets are sent at the end of the poll.
+    char payload[1024];
+    Homa::Mock::MockDriver::MockPacket packet(payload, 1024);
+    EXPECT_CALL(mockDriver, allocPacket).WillOnce(Return(&packet));
+    transport->controlQueue.send<Protocol::Packet::BusyHeader>(
+        (Driver::Address*)22, Protocol::MessageId(42, 1, 1));
+    EXPECT_CALL(mockDriver, sendPackets(Pointee(&packet), Eq(1))).Times(1);
+
     transport->poll();
 }
 
+TEST_F(TransportTest, clearEvent)
+{
+    struct pollfd pfd = {transport->eventFd, POLLIN, 0};
+    transport->signalEvent();
+    EXPECT_EQ(1, ::poll(&pfd, 1, 0));
+
+    transport->clearEvent();
+
+    EXPECT_FALSE(transport->eventPending);
+    EXPECT_EQ(0, ::poll(&pfd, 1, 0));
+
+    // Clearing an unsignaled eventfd is harmless.
+    transport->clearEvent();
+    EXPECT_EQ(0, ::poll(&pfd, 1, 0));
+}
+
+TEST_F(TransportTest, waitForEvent)
+{
+    transport->signalEvent();
+    // Returns immediately since the eventfd is readable.
+    transport->waitForEvent(10000);
+    transport->clearEvent();
+    // Returns after the timeout.
+    transport->waitForEvent(0);
+}
+
+TEST_F(TransportTest, startPollingThreads)
+{
+    // Pin one thread to a CPU this thread is allowed to run on.
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    ASSERT_EQ(0, pthread_getaffinity_np(pthread_self(), sizeof(cpuset),
+                                        &cpuset));
+    int cpu = 0;
+    while (!CPU_ISSET(cpu, &cpuset)) {
+        ++cpu;
+    }
+
+    std::atomic<int> numPolls(0);
+    EXPECT_CALL(mockDriver, receivePackets)
+        .WillRepeatedly([&numPolls](uint32_t, Driver::Packet**) {
+            numPolls++;
+            return 0;
+        });
+
+    transport->startPollingThreads({-1, cpu});
+
+    EXPECT_EQ(2U, transport->pollingThreads.size());
+    cpu_set_t threadCpuset;
+    CPU_ZERO(&threadCpuset);
+    EXPECT_EQ(0, pthread_getaffinity_np(
+                     transport->pollingThreads.at(1).native_handle(),
+                     sizeof(threadCpuset), &threadCpuset));
+    EXPECT_EQ(1, CPU_COUNT(&threadCpuset));
+    EXPECT_TRUE(CPU_ISSET(cpu, &threadCpuset));
+    while (numPolls < 10) {
+        std::this_thread::yield();
+    }
+
+    // Restarting replaces the existing threads.
+    transport->startPollingThreads({-1});
+    EXPECT_EQ(1U, transport->pollingThreads.size());
+
+    transport->stopPollingThreads();
+
+    EXPECT_TRUE(transport->pollingThreads.empty());
+    EXPECT_FALSE(transport->stopPolling);
+}
+
+TEST_F(TransportTest, startPollingThreads_badCpu)
+{
+    EXPECT_THROW(transport->startPollingThreads({-1, CPU_SETSIZE - 1}),
+                 FatalError);
+    EXPECT_TRUE(transport->pollingThreads.empty());
+}
+
+TEST_F(TransportTest, signalEvent)
+{
+    struct pollfd pfd = {transport->eventFd, POLLIN, 0};
+    EXPECT_EQ(0, ::poll(&pfd, 1, 0));
+
+    transport->signalEvent();
+
+    EXPECT_TRUE(transport->eventPending);
+    EXPECT_EQ(1, ::poll(&pfd, 1, 0));
+
+    // Only the first signal writes to the eventfd.
+    transport->signalEvent();
+    uint64_t count = 0;
+    EXPECT_EQ(ssize_t(sizeof(count)),
+              read(transport->eventFd, &count, sizeof(count)));
+    EXPECT_EQ(1U, count);
+}
+
 TEST_F(TransportTest, processPackets)
 {
     char payload[7][1024];
@@ -645,8 +1035,7 @@ TEST_F(TransportTest, processInboundMessages_newRequest)
     InboundMessage message;
     message.id = id;
 
-    EXPECT_EQ(0U, transport->opPool.outstandingObjects);
-    EXPECT_TRUE(transport->activeOps.empty());
+    EXPECT_EQ(0U, transport->opSlab.getNumLive());
 
     EXPECT_CALL(*mockReceiver, receiveMessage)
         .WillOnce(Return(&message))
@@ -655,8 +1044,7 @@ TEST_F(TransportTest, processInboundMessages_newRequest)
 
     transport->processInboundMessages();
 
-    EXPECT_EQ(1U, transport->opPool.outstandingObjects);
-    EXPECT_FALSE(transport->activeOps.empty());
+    EXPECT_EQ(1U, transport->opSlab.getNumLive());
 }
 
 TEST_F(TransportTest, processInboundMessages_dropResponse)
@@ -675,48 +1063,140 @@ TEST_F(TransportTest, processInboundMessages_dropResponse)
 
 TEST_F(TransportTest, checkForUpdates)
 {
-    Transport::Op* staleOp =
-        transport->opPool.construct(transport, &mockDriver, false);
-    staleOp->hintUpdate();
+    Transport::Op* op[2];
+    for (int i = 0; i < 2; ++i) {
+        op[i] = transport->opSlab.construct(transport, &mockDriver, false);
+        op[i]->hintUpdate();
+        EXPECT_FALSE(op[i]->destroy);
+    }
+
+    transport->checkForUpdates();
+
+    for (int i = 0; i < 2; ++i) {
+        EXPECT_TRUE(op[i]->destroy);
+        EXPECT_FALSE(op[i]->hintQueued);
+    }
+    EXPECT_EQ(nullptr, transport->updateHints.pop());
+    EXPECT_EQ(2U, transport->unusedOps.queue.size());
+    EXPECT_EQ(op[0], transport->opSlab.get(transport->unusedOps.queue.front()));
+}
+
+TEST_F(TransportTest, checkForUpdates_completionQueue)
+{
+    CompletionQueue completionQueue((Homa::CompletionQueue::Callback()));
+    Transport::Op* op[2];
+    for (int i = 0; i < 2; ++i) {
+        op[i] = transport->opSlab.construct(transport, &mockDriver, false);
+        op[i]->retained = true;
+        op[i]->completionQueue = &completionQueue;
+        op[i]->remoteOp = (RemoteOp*)(uintptr_t)(i + 1);
+    }
+    op[0]->state.store(OpContext::State::FAILED);
+    op[1]->state.store(OpContext::State::NOT_STARTED);
+    op[1]->hintUpdate();
+    op[0]->hintUpdate();
+
+    transport->checkForUpdates();
+
+    RemoteOp* ops[4];
+    EXPECT_EQ(1U, completionQueue.pop(ops, 4));
+    EXPECT_EQ((RemoteOp*)1, ops[0]);
+    EXPECT_EQ(nullptr, op[0]->completionQueue);
+    EXPECT_EQ(&completionQueue, op[1]->completionQueue);
+
+    // Delivered only once.
+    op[0]->hintUpdate();
+    transport->checkForUpdates();
+    EXPECT_EQ(0U, completionQueue.pop(ops, 4));
+}
+
+TEST_F(TransportTest, checkForUpdates_bounded)
+{
     Transport::Op* op =
-        transport->opPool.construct(transport, &mockDriver, false);
+        transport->opSlab.construct(transport, &mockDriver, false);
+    uint32_t numDelivered = 0;
+    // Re-arm the Op from within its own processing so that there is always
+    // another hint to check.
+    CompletionQueue completionQueue([op, &completionQueue,
+                                     &numDelivered](RemoteOp*) {
+        ++numDelivered;
+        SpinLock::Lock lock_op(op->mutex);
+        op->completionQueue = &completionQueue;
+        op->hintUpdate();
+    });
+    op->retained = true;
+    op->state.store(OpContext::State::FAILED);
+    op->completionQueue = &completionQueue;
     op->hintUpdate();
-    transport->activeOps.insert(op);
 
-    EXPECT_FALSE(staleOp->destroy);
-    EXPECT_FALSE(op->destroy);
-    EXPECT_EQ(2U, transport->updateHints.ops.size());
-    EXPECT_EQ(2U, transport->updateHints.order.size());
-    EXPECT_EQ(1U, transport->activeOps.size());
+    transport->checkForUpdates();
+
+    EXPECT_EQ(uint32_t(Transport::MAX_HINTS_PER_CHECK), numDelivered);
+    EXPECT_TRUE(op->hintQueued);
+    EXPECT_TRUE(transport->eventPending);
 
+    // The rest is picked up by the next call.
     transport->checkForUpdates();
 
-    EXPECT_FALSE(staleOp->destroy);
-    EXPECT_TRUE(op->destroy);
-    EXPECT_EQ(0U, transport->updateHints.ops.size());
-    EXPECT_EQ(0U, transport->updateHints.order.size());
-    EXPECT_EQ(1U, transport->activeOps.size());
-    EXPECT_EQ(op, transport->unusedOps.queue.front());
+    EXPECT_EQ(2 * Transport::MAX_HINTS_PER_CHECK, numDelivered);
+    op->completionQueue = nullptr;
+}
+
+TEST_F(TransportTest, checkForUpdates_signalEvent)
+{
+    EXPECT_FALSE(transport->eventPending);
+
+    transport->checkForUpdates();
+
+    // Nothing was updated.
+    EXPECT_FALSE(transport->eventPending);
+
+    Transport::Op* op =
+        transport->opSlab.construct(transport, &mockDriver, false);
+    op->retained = true;
+    op->hintUpdate();
+
+    transport->checkForUpdates();
+
+    EXPECT_TRUE(transport->eventPending);
+}
+
+TEST_F(TransportTest, checkForUpdates_alreadyRunning)
+{
+    Transport::Op* op =
+        transport->opSlab.construct(transport, &mockDriver, false);
+    op->hintUpdate();
+    transport->checkingForUpdates.test_and_set();
+
+    transport->checkForUpdates();
+
+    EXPECT_FALSE(op->destroy);
+    EXPECT_TRUE(op->hintQueued);
+    EXPECT_EQ(op, transport->updateHints.pop());
 }
 
 TEST_F(TransportTest, cleanupOps)
 {
     Transport::Op* staleOp =
-        transport->opPool.construct(transport, &mockDriver);
+        transport->opSlab.construct(transport, &mockDriver);
     {
         SpinLock::Lock lock(staleOp->mutex);
         staleOp->drop(lock);
     }
-    Transport::Op* op = transport->opPool.construct(transport, &mockDriver);
+    Slab<Transport::Op>::Handle staleHandle =
+        Slab<Transport::Op>::getHandle(staleOp);
+    transport->opSlab.destroy(staleOp);
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
     {
         SpinLock::Lock lock(op->mutex);
         op->drop(lock);
     }
-    transport->activeOps.insert(op);
+    Slab<Transport::Op>::Handle handle = Slab<Transport::Op>::getHandle(op);
 
+    // The new Op reuses the stale Op's slot.
+    EXPECT_EQ(staleHandle.index, handle.index);
     EXPECT_EQ(2U, transport->unusedOps.queue.size());
-    EXPECT_EQ(0U, transport->activeOps.count(staleOp));
-    EXPECT_EQ(1U, transport->activeOps.count(op));
+    EXPECT_EQ(1U, transport->opSlab.getNumLive());
 
     EXPECT_CALL(*mockSender, dropMessage(Eq(op))).Times(1);
     EXPECT_CALL(*mockReceiver, dropOp(Eq(op))).Times(1);
@@ -724,8 +1204,30 @@ TEST_F(TransportTest, cleanupOps)
     transport->cleanupOps();
 
     EXPECT_EQ(0U, transport->unusedOps.queue.size());
-    EXPECT_EQ(0U, transport->activeOps.count(staleOp));
-    EXPECT_EQ(0U, transport->activeOps.count(op));
+    EXPECT_EQ(0U, transport->opSlab.getNumLive());
+    EXPECT_FALSE(transport->opSlab.isLive(handle));
+}
+
+TEST_F(TransportTest, cleanupOps_hintQueued)
+{
+    Transport::Op* op = transport->opSlab.construct(transport, &mockDriver);
+    {
+        SpinLock::Lock lock(op->mutex);
+        op->drop(lock);
+    }
+    op->hintUpdate();
+
+    transport->cleanupOps();
+
+    // Still linked into updateHints; not destroyed.
+    EXPECT_EQ(1U, transport->unusedOps.queue.size());
+    EXPECT_EQ(1U, transport->opSlab.getNumLive());
+
+    transport->checkForUpdates();
+    transport->cleanupOps();
+
+    EXPECT_EQ(0U, transport->unusedOps.queue.size());
+    EXPECT_EQ(0U, transport->opSlab.getNumLive());
 }
 
 }  // namespace
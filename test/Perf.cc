@@ -13,13 +13,18 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <algorithm>
 #include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <random>
 #include <sstream>
+#include <unordered_map>
 #include <vector>
 
 #include "Cycles.h"
+#include "FlatMap.h"
+#include "Protocol.h"
 #include "docopt.h"
 
 static const char USAGE[] = R"(Performance Nano-Benchmark
@@ -70,6 +75,85 @@ rdtscTest()
     return PerfUtils::Cycles::toSeconds(stop - start) / count;
 }
 
+/**
+ * Measure the average cost of looking up a MessageId that is present in a map
+ * holding the given number of entries.  Keys are looked up in random order so
+ * that large maps do not fit in cache.
+ */
+template <typename Map>
+double
+mapFindTest(uint64_t numEntries)
+{
+    Map map;
+    std::vector<Homa::Protocol::MessageId> ids;
+    for (uint64_t i = 0; i < numEntries; ++i) {
+        Homa::Protocol::MessageId id(0xBEEF0000 + (i % 16), i, i % 2);
+        ids.push_back(id);
+        map.insert({id, reinterpret_cast<void*>(i)});
+    }
+    std::shuffle(ids.begin(), ids.end(), std::mt19937(0));
+
+    int count = 1000000;
+    uint64_t total = 0;
+    uint64_t start = PerfUtils::Cycles::rdtscp();
+    for (int i = 0; i < count; i++) {
+        total += reinterpret_cast<uint64_t>(
+            map.find(ids[i % numEntries])->second);
+    }
+    uint64_t stop = PerfUtils::Cycles::rdtscp();
+    if (total == 0) {
+        std::cout << "unexpected sum" << std::endl;
+    }
+    return PerfUtils::Cycles::toSeconds(stop - start) / count;
+}
+
+typedef Homa::FlatMap<Homa::Protocol::MessageId, void*,
+                      Homa::Protocol::MessageId::Hasher>
+    MessageIdFlatMap;
+typedef std::unordered_map<Homa::Protocol::MessageId, void*,
+                           Homa::Protocol::MessageId::Hasher>
+    MessageIdUnorderedMap;
+
+TestInfo flatMapFind10kTestInfo = {
+    "flatMapFind10k", "FlatMap lookup, 10k MessageIds",
+    R"(Measure the cost of finding a MessageId in a FlatMap with 10,000
+entries.)"};
+double
+flatMapFind10kTest()
+{
+    return mapFindTest<MessageIdFlatMap>(10000);
+}
+
+TestInfo flatMapFind1MTestInfo = {
+    "flatMapFind1M", "FlatMap lookup, 1M MessageIds",
+    R"(Measure the cost of finding a MessageId in a FlatMap with 1,000,000
+entries.)"};
+double
+flatMapFind1MTest()
+{
+    return mapFindTest<MessageIdFlatMap>(1000000);
+}
+
+TestInfo unorderedMapFind10kTestInfo = {
+    "unorderedMapFind10k", "unordered_map lookup, 10k MessageIds",
+    R"(Measure the cost of finding a MessageId in a std::unordered_map with
+10,000 entries; baseline for flatMapFind10k.)"};
+double
+unorderedMapFind10kTest()
+{
+    return mapFindTest<MessageIdUnorderedMap>(10000);
+}
+
+TestInfo unorderedMapFind1MTestInfo = {
+    "unorderedMapFind1M", "unordered_map lookup, 1M MessageIds",
+    R"(Measure the cost of finding a MessageId in a std::unordered_map with
+1,000,000 entries; baseline for flatMapFind1M.)"};
+double
+unorderedMapFind1MTest()
+{
+    return mapFindTest<MessageIdUnorderedMap>(1000000);
+}
+
 // The following struct and table define each performance test in terms of
 // function that implements the test and collection of string information about
 // the test like the test's string name.
@@ -82,6 +166,10 @@ struct TestCase {
 };
 TestCase tests[] = {
     {rdtscTest, &rdtscTestInfo},
+    {flatMapFind10kTest, &flatMapFind10kTestInfo},
+    {flatMapFind1MTest, &flatMapFind1MTestInfo},
+    {unorderedMapFind10kTest, &unorderedMapFind10kTestInfo},
+    {unorderedMapFind1MTest, &unorderedMapFind1MTestInfo},
 };
 
 /**
@@ -45,6 +45,8 @@ static const char USAGE[] = R"(Homa System Test.
         --hops=<n>      Number of hops an op should make [default: 1]. 
         --servers=<n>   Number of virtual servers [default: 1].
         --size=<n>      Number of bytes to send as a payload [default: 10].
+        --poller        Drive the client from a background polling thread and
+                        block while waiting for responses.
 )";
 
 bool _PRINT_CLIENT_ = false;
@@ -75,6 +77,9 @@ struct Node {
 void
 serverMain(Node* server, std::vector<std::string> addresses)
 {
+    // Maximum number of requests handled per iteration.
+    const size_t BATCH_SIZE = 16;
+
     std::random_device rd;
     std::mt19937 gen(rd());
     std::uniform_int_distribution<> dis(0, addresses.size() - 1);
@@ -83,13 +88,13 @@ serverMain(Node* server, std::vector<std::string> addresses)
         if (server->run.load() == false) {
             break;
         }
-        Homa::ServerOp op = server->transport.receiveServerOp();
-        if (op) {
-            MessageHeader header;
-            op.request->get(0, &header, sizeof(MessageHeader));
-
-            char buf[header.length];
-            op.request->get(sizeof(MessageHeader), &buf, header.length);
+        Homa::ServerOp ops[BATCH_SIZE];
+        Homa::ServerOp replies[BATCH_SIZE];
+        size_t numReplies = 0;
+        size_t numOps = server->transport.receiveServerOps(ops, BATCH_SIZE);
+        for (size_t i = 0; i < numOps; ++i) {
+            Homa::ServerOp& op = ops[i];
+            MessageHeader header = *op.request->peek<MessageHeader>();
 
             if (_PRINT_SERVER_) {
                 std::cout << "  -> Server " << server->id
@@ -105,9 +110,25 @@ serverMain(Node* server, std::vector<std::string> addresses)
 
             header.hops--;
             op.response->append(&header, sizeof(MessageHeader));
-            op.response->append(buf, header.length);
+
+            // Forward the body straight out of the request's packets.
+            Homa::Message::Span spans[16];
+            uint32_t offset = sizeof(MessageHeader);
+            uint32_t end = offset + header.length;
+            while (offset < end) {
+                uint32_t numSpans =
+                    op.request->getSpans(offset, end - offset, spans, 16);
+                if (numSpans == 0) {
+                    break;
+                }
+                for (uint32_t j = 0; j < numSpans; ++j) {
+                    op.response->append(spans[j].data, spans[j].length);
+                    offset += spans[j].length;
+                }
+            }
             if (header.hops == 0) {
-                op.reply();
+                // Send all of this batch's replies together below.
+                replies[numReplies++] = std::move(op);
             } else {
                 std::string nextAddress = addresses[dis(gen)];
                 Homa::Driver::Address* nextServerAddress =
@@ -115,6 +136,7 @@ serverMain(Node* server, std::vector<std::string> addresses)
                 op.delegate(nextServerAddress);
             }
         }
+        server->transport.reply(replies, numReplies);
         server->transport.poll();
     }
 }
@@ -124,7 +146,8 @@ serverMain(Node* server, std::vector<std::string> addresses)
  *      Number of Op that failed.
  */
 int
-clientMain(int count, int hops, int size, std::vector<std::string> addresses)
+clientMain(int count, int hops, int size, std::vector<std::string> addresses,
+           bool usePoller)
 {
     std::random_device rd;
     std::mt19937 gen(rd());
@@ -135,6 +158,9 @@ clientMain(int count, int hops, int size, std::vector<std::string> addresses)
     int numFailed = 0;
 
     Node client(1);
+    if (usePoller) {
+        client.transport.startPollingThreads({-1});
+    }
     for (int i = 0; i < count; ++i) {
         uint64_t id = nextId++;
         char payload[size];
@@ -159,7 +185,11 @@ clientMain(int count, int hops, int size, std::vector<std::string> addresses)
         }
 
         op.send(client.driver.getAddress(&destAddress));
-        op.wait();
+        if (usePoller) {
+            op.wait(0);
+        } else {
+            op.wait();
+        }
 
         {
             MessageHeader header;
@@ -193,6 +223,7 @@ main(int argc, char* argv[])
     int numServers = args["--servers"].asLong();
     int numBytes = args["--size"].asLong();
     int verboseLevel = args["--verbose"].asLong();
+    bool usePoller = args["--poller"].asBool();
 
     // level of verboseness
     bool printSummary = false;
@@ -228,7 +259,7 @@ main(int argc, char* argv[])
         server->thread = std::move(std::thread(&serverMain, server, addresses));
     }
 
-    int numFails = clientMain(numTests, numHops, numBytes, addresses);
+    int numFails = clientMain(numTests, numHops, numBytes, addresses, usePoller);
 
     for (auto it = servers.begin(); it != servers.end(); ++it) {
         Node* server = *it;